@@ -57,11 +57,15 @@ typedef struct data_block_s
 #define IT_NONE 'N'
 #define IT_DIRECTORY 'D'
 #define IT_FILE 'F'
+// The inode table is initialized lazily (see oufs_format_disk()): an inode
+//  that was never written reads as zeroes, so type 0 is free like IT_NONE.
+//  oufs_read_inode_by_reference() reports it as IT_NONE
+#define IT_UNWRITTEN 0
 
 // Single inode
 typedef struct inode_s
 {
-  // IT_NONE, IT_DIRECTORY, IT_FILE
+  // IT_NONE (or IT_UNWRITTEN), IT_DIRECTORY, IT_FILE
   char type;
 
   // Number of directories references to this inode
@@ -87,6 +91,76 @@ typedef struct inode_block_s
 } INODE_BLOCK;
 
 
+/**********************************************************************/
+// Reverse map
+// For every block, the inode of the live file system that holds it and
+//  the index of the block in INODE.data[], so that the owner of a block is
+//  found without scanning the inode table.  Kept up to date by the paths
+//  that give blocks to inodes and take them away
+typedef struct owner_entry_s
+{
+  // Inode + 1, or one of the OWNER_ values
+  unsigned char holder;
+  // Index into INODE.data[]
+  unsigned char index;
+} OWNER_ENTRY;
+
+// No inode holds the block
+#define OWNER_NONE 0
+// Only a scan of the inode table can tell: the block is shared by several
+//  inodes (deduplication), or a snapshot kept it when its inode let go
+#define OWNER_UNKNOWN 0xff
+
+// Holder value of an inode
+#define OWNER_HOLDER(inode_reference) ((inode_reference) + 1)
+
+// Number of entries stored in each block of the map
+#define OWNERS_PER_BLOCK (BLOCK_SIZE / sizeof(OWNER_ENTRY))
+
+// Number of blocks the map takes
+#define OWNER_MAP_BLOCKS ((N_BLOCKS_IN_DISK + OWNERS_PER_BLOCK - 1) / OWNERS_PER_BLOCK)
+
+// Block of the reverse map: the entry of block b is owner[b % OWNERS_PER_BLOCK]
+//  of map block b / OWNERS_PER_BLOCK
+typedef struct owner_block_s
+{
+  OWNER_ENTRY owner[OWNERS_PER_BLOCK];
+} OWNER_BLOCK;
+
+_Static_assert(OWNER_HOLDER(N_INODES - 1) < OWNER_UNKNOWN, "every inode needs a holder value");
+
+/**********************************************************************/
+// Space usage
+// For every inode, the space taken by the tree below it (the inode itself
+//  included), so that the usage of a directory is read instead of added up.
+//  Files count once in every directory that links them.  The mutation paths
+//  add their changes to the entry of the inode and of each directory above it
+typedef struct usage_entry_s
+{
+  // Bytes of the files
+  unsigned int bytes;
+  // Data and directory blocks
+  unsigned short blocks;
+  // Inodes
+  unsigned short inodes;
+  // Directory that links the inode (for a file: the first one that did);
+  //  UNALLOCATED_INODE for the root directory
+  INODE_REFERENCE parent;
+} USAGE_ENTRY;
+
+// Number of entries stored in each block of the table
+#define USAGES_PER_BLOCK (BLOCK_SIZE / sizeof(USAGE_ENTRY))
+
+// Number of blocks the table takes
+#define USAGE_BLOCKS ((N_INODES + USAGES_PER_BLOCK - 1) / USAGES_PER_BLOCK)
+
+// Block of the usage table: the entry of inode i is usage[i % USAGES_PER_BLOCK]
+//  of table block i / USAGES_PER_BLOCK
+typedef struct usage_block_s
+{
+  USAGE_ENTRY usage[USAGES_PER_BLOCK];
+} USAGE_BLOCK;
+
 /**********************************************************************/
 // Block 0
 #define MASTER_BLOCK_REFERENCE 0
@@ -100,8 +174,77 @@ typedef struct master_block_s
   // 8 data blocks per byte: One block per bit: 1 = allocated, 0 = free
   // Block 0 (the master block) is byte 0, bit 0
   unsigned char block_allocated_flag[N_BLOCKS_IN_DISK >> 3];
+
+  // Block holding the snapshot table (0 = no snapshot exists)
+  BLOCK_REFERENCE snapshot_table_block;
+
+  // Block holding the shared block reference counts (0 = no block is shared)
+  BLOCK_REFERENCE refcount_block;
+
+  // Block holding the deduplication index (0 = deduplication is off)
+  BLOCK_REFERENCE dedup_block;
+
+  // Blocks holding the reverse map (0 = there is no reverse map)
+  BLOCK_REFERENCE owner_map_block[OWNER_MAP_BLOCKS];
+
+  // Blocks holding the usage table (0 = there is no usage table)
+  BLOCK_REFERENCE usage_block[USAGE_BLOCKS];
+
+  // 1 = the usage table fell behind (a file with several links changed) and
+  //  is rebuilt before it is used
+  unsigned char usage_stale;
 } MASTER_BLOCK;
 
+/**********************************************************************/
+// Shared blocks
+// A block that is allocated has one holder.  Every additional holder (a
+//  snapshot, for example) adds one extra reference; the block is only
+//  released in the master block once the extra references are gone.
+//  A shared block (extra > 0) is never modified in place: writers copy it first.
+typedef struct refcount_block_s
+{
+  unsigned char extra[N_BLOCKS_IN_DISK];
+} REFCOUNT_BLOCK;
+
+/**********************************************************************/
+// Deduplication index
+// A fingerprint of the contents of every file data block that has been
+//  written since deduplication was turned on: a digest folded to 1 ... 255;
+//  0 = not in the index.  A block whose fingerprint matches is compared in
+//  full before it is shared, as an extra reference
+typedef struct dedup_block_s
+{
+  unsigned char fingerprint[N_BLOCKS_IN_DISK];
+} DEDUP_BLOCK;
+
+/**********************************************************************/
+// Snapshots
+#define MAX_SNAPSHOTS 4
+
+// Single snapshot: a frozen copy of the inode table.  The data and directory
+//  blocks referenced by those inodes are shared with the live file system
+typedef struct snapshot_s
+{
+  // Name of the snapshot; empty if this entry is not used
+  char name[FILE_NAME_SIZE];
+
+  // Copy of each inode block.  UNALLOCATED_BLOCK if the inode block had no
+  //  allocated inodes
+  BLOCK_REFERENCE inode_block[N_INODE_BLOCKS];
+
+  // 8 data blocks per byte: 1 = the snapshot holds an extra reference to the block
+  unsigned char block_held_flag[N_BLOCKS_IN_DISK >> 3];
+
+  // Creation time (seconds since the epoch)
+  unsigned int created;
+} SNAPSHOT;
+
+// Snapshot table
+typedef struct snapshot_block_s
+{
+  SNAPSHOT snapshot[MAX_SNAPSHOTS];
+} SNAPSHOT_BLOCK;
+
 /**********************************************************************/
 // Single directory element
 typedef struct directory_entry_s
@@ -125,16 +268,29 @@ typedef struct directory_block_s
 
 /**********************************************************************/
 // All-encompassing structure for a disk block
-// The union says that all 4 of these elements occupy overlapping bytes in 
-//  memory (hence, a block will only be one of these 4 at any given time)
+// The union says that all of these elements occupy overlapping bytes in 
+//  memory (hence, a block will only be one of these at any given time)
 typedef union block_u
 {
   DATA_BLOCK data;
   MASTER_BLOCK master;
   INODE_BLOCK inodes;
   DIRECTORY_BLOCK directory;
+  REFCOUNT_BLOCK refcounts;
+  DEDUP_BLOCK dedup;
+  OWNER_BLOCK owners;
+  USAGE_BLOCK usages;
+  SNAPSHOT_BLOCK snapshots;
 } BLOCK;
 
+// Every block type must fit into a single disk block
+_Static_assert(sizeof(MASTER_BLOCK) <= BLOCK_SIZE, "MASTER_BLOCK does not fit into a block");
+_Static_assert(sizeof(REFCOUNT_BLOCK) <= BLOCK_SIZE, "REFCOUNT_BLOCK does not fit into a block");
+_Static_assert(sizeof(DEDUP_BLOCK) <= BLOCK_SIZE, "DEDUP_BLOCK does not fit into a block");
+_Static_assert(sizeof(OWNER_BLOCK) <= BLOCK_SIZE, "OWNER_BLOCK does not fit into a block");
+_Static_assert(sizeof(USAGE_BLOCK) <= BLOCK_SIZE, "USAGE_BLOCK does not fit into a block");
+_Static_assert(sizeof(SNAPSHOT_BLOCK) <= BLOCK_SIZE, "SNAPSHOT_BLOCK does not fit into a block");
+
 
 /**********************************************************************/
 
@@ -145,5 +301,23 @@ typedef struct oufile_s
   int offset;
 } OUFILE;
 
+/**********************************************************************/
+// Scan of the whole inode table (oufs_inode_scan_open(), oufs_inode_scan_next())
+
+// Largest number of inode blocks fetched with one read
+#define INODE_SCAN_BLOCKS 8
+
+typedef struct inode_scan_s
+{
+  // Inode bitmap of the master block when the scan started
+  unsigned char inode_allocated_flag[N_INODES >> 3];
+  // Inode blocks fetched by the last read: inode table blocks first ... first + n - 1
+  int first;
+  int n;
+  INODE_BLOCK blocks[INODE_SCAN_BLOCKS];
+  // Next inode to look at
+  int next;
+} INODE_SCAN;
+
 
 #endif
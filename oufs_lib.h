@@ -8,6 +8,8 @@ void oufs_get_environment(char *cwd, char *disk_name);  //ALIVE
 
 int oufs_format_disk(char  *virtual_disk_name);   //ALIVE
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);  //ALIVE
+int oufs_inode_scan_open(INODE_SCAN *scan);
+int oufs_inode_scan_next(INODE_SCAN *scan, INODE_REFERENCE *inode_reference, INODE *inode);
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);  //ALIVE
 int oufs_mkdir(char *cwd, char *path, int operation);  //ALIVE
 void oufs_rmdir(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *base_name);
@@ -22,6 +24,7 @@ INODE_REFERENCE oufs_look_for_inode_not_from_root(char *path, char *cwd, INODE_R
 int string_compare(const void *directory_entry_a, const void *directory_entry_b);   //ALIVE
 int oufs_find_open_bit(unsigned char value);    //ALIVE
 void list_directory_entries(INODE *inode, BLOCK *block, char *base_name);    //ALIVE
+void print_directory_entries(BLOCK *block);
 int create_new_inode_and_block(INODE_REFERENCE base_inode, BLOCK_REFERENCE base_block, char *base_name, int file_flag);    //ALIVE
 int check_for_entry(BLOCK *block, char *base_name, int flag);   //ALIVE
 int clip(char *str, int begin, int len);
@@ -32,5 +35,29 @@ INODE_REFERENCE get_specified_entry(BLOCK_REFERENCE base_block, INODE_REFERENCE
 OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
 int oufs_fwrite(OUFILE *fp, char * buf, int len);
 int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference);
+int oufs_copy(char *cwd, char *path, INODE_REFERENCE source_reference);
 void oufs_rmfile(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *base_name);
+
+int oufs_block_is_shared(BLOCK_REFERENCE block_reference);
+int oufs_release_block(BLOCK_REFERENCE block_reference);
+BLOCK_REFERENCE oufs_cow_inode_block(INODE_REFERENCE inode_reference, BLOCK_REFERENCE block_reference);
+int oufs_dedup_enable();
+BLOCK_REFERENCE oufs_dedup_inode_block(INODE_REFERENCE inode_reference, BLOCK_REFERENCE block_reference);
+void oufs_owner_set(BLOCK_REFERENCE block_reference, int holder, int index);
+int oufs_release_inode_block(BLOCK_REFERENCE block_reference);
+int oufs_owners_enable();
+int oufs_block_owner(BLOCK_REFERENCE block_reference, INODE_REFERENCE *inode_reference, int *index, int *scanned);
+int oufs_usage_enable();
+int oufs_usage_rebuild();
+int oufs_usage_table(USAGE_ENTRY *table);
+void oufs_usage_set_parent(INODE_REFERENCE inode_reference, INODE_REFERENCE parent);
+void oufs_usage_link(INODE_REFERENCE inode_reference, INODE_REFERENCE directory, int sign);
+int oufs_snapshot_create(char *name);
+int oufs_snapshot_delete(char *name);
+void oufs_snapshot_list();
+int oufs_snapshot_select(char *name);
+
+int oufs_txn_begin();
+int oufs_txn_commit();
+void oufs_txn_abort();
 #endif
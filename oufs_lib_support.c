@@ -1,11 +1,21 @@
 #include <stdlib.h>
 #include <libgen.h>
+#include <time.h>
 #include "oufs_lib.h"
 #include "oufs.h"
+#include "oufs_stats.h"
 
 #define debug 0
 #define MAX_BUFFER 1024
 
+//Inode blocks of the snapshot selected by oufs_snapshot_select(); inodes are read from here instead of the live inode table
+static BLOCK_REFERENCE snapshot_inode_block[N_INODE_BLOCKS];
+//Set when a snapshot is selected: the file system is then read-only
+static int snapshot_selected = 0;
+
+static void oufs_usage_inode_changed(INODE_REFERENCE inode_reference, INODE *old_inode, INODE *new_inode);
+static BLOCK_REFERENCE oufs_get_refcount_block();
+
 /**
  *  Compares a string directory_entry_a with the second string directory_entry_b. It is used as the function for qsort when outputting the directory entries in sorted order
  *
@@ -50,7 +60,35 @@ int clip(char *str, int begin, int length) {
 }
 
 /**
- *  Prints out the directories listed in the block parameter. First it sorts the entries using qsort, then lists out the entries with a / or no slash depending on if the entry is a directory or file in sorted order. The block is mutated during qsort, but not written back to the disk so that the sorted order isn't in the disk.
+ *  Prints out the entries of a directory block. First it sorts the entries using qsort, then lists out the entries with a / or no slash depending on if the entry is a directory or file in sorted order. The block is mutated during qsort, but not written back to the disk so that the sorted order isn't in the disk.
+ *
+ *  @param BLOCK block Used to go through the directory entries
+ */
+void print_directory_entries(BLOCK *block) {
+    //qsort the entries and print them out
+    qsort(block->directory.entry, 16, sizeof(DIRECTORY_ENTRY), string_compare);
+    
+    
+    //Loop through entries
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+        if(block->directory.entry[i].inode_reference != UNALLOCATED_INODE) {
+            printf("%s", block->directory.entry[i].name);
+            
+            //Checking to see if the inode of the entry is a directory or file
+            INODE_REFERENCE inode_ref = block->directory.entry[i].inode_reference;
+            INODE mock_inode;
+            oufs_read_inode_by_reference(inode_ref, &mock_inode);
+            if (mock_inode.type == IT_DIRECTORY) {
+                printf("/\n");
+            } else if (mock_inode.type == IT_FILE) {
+                printf("\n");
+            }
+        }
+    }
+}
+
+/**
+ *  Prints out the directories listed in the block parameter (see print_directory_entries()), and exits once a directory is listed.
  *
  *  @param INODE inode Used to check if an entry is a file or directory
  *  @param BLOCK block Used to go through the directory entries
@@ -59,26 +97,7 @@ int clip(char *str, int begin, int length) {
 void list_directory_entries(INODE *inode, BLOCK *block, char *base_name) {
     //Check if inode of basename is directory or file
     if (inode->type == IT_DIRECTORY) {
-        //qsort the entries and print them out
-        qsort(block->directory.entry, 16, sizeof(DIRECTORY_ENTRY), string_compare);
-        
-        
-        //Loop through entries
-        for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-            if(block->directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-                printf("%s", block->directory.entry[i].name);
-                
-                //Checking to see if the inode of the entry is a directory or file
-                INODE_REFERENCE inode_ref = block->directory.entry[i].inode_reference;
-                INODE mock_inode;
-                oufs_read_inode_by_reference(inode_ref, &mock_inode);
-                if (mock_inode.type == IT_DIRECTORY) {
-                    printf("/\n");
-                } else if (mock_inode.type == IT_FILE) {
-                    printf("\n");
-                }
-            }
-        }
+        print_directory_entries(block);
         exit(EXIT_SUCCESS);
     }
     
@@ -176,9 +195,13 @@ INODE_REFERENCE oufs_look_for_inode_not_from_root(char *path, char *cwd, INODE_R
     //Variables for tokenizing inputs of the cwd
     char *cwd_tokens[64];
     char **cwd_arg;
+    //Tokenize a copy: callers pass the same cwd to several operations
+    char cwd_copy[MAX_PATH_LENGTH];
+    strncpy(cwd_copy, cwd, MAX_PATH_LENGTH - 1);
+    cwd_copy[MAX_PATH_LENGTH - 1] = 0;
     //Tokenize input
     cwd_arg = cwd_tokens;
-    *cwd_arg++ = strtok(cwd, "/");
+    *cwd_arg++ = strtok(cwd_copy, "/");
     while ((*cwd_arg++ = strtok(NULL, "/")));
     
     BLOCK_REFERENCE base_block;
@@ -289,7 +312,7 @@ void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry)
 }
 
 /**
- *  Create a virtual disk with initial inode and directory set up
+ *  Create a virtual disk with initial inode and directory set up. The disk is erased rather than written: only the master block, the first inode block and the root directory block are written, and the rest of the inode table is initialized lazily: each inode is written in full when it is allocated, and until then it reads as zeroes. A free inode therefore has type IT_UNWRITTEN (0) if it was never written, or IT_NONE if it was freed; both mean free, and oufs_read_inode_by_reference() reports either one as IT_NONE
  *
  *  @param virtual_disk_name The name of the virtual disk
  */
@@ -299,27 +322,28 @@ int oufs_format_disk(char  *virtual_disk_name) {
         return -1;
     }
     
+    //Every block reads as zeroes from here on, and takes no space in a file
+    if (vdisk_disk_erase() != 0) {
+        fprintf(stderr, "ERROR: erasing vdisk\n");
+        return -1;
+    }
+    //The blocks below reach the disk together
+    vdisk_journal_begin();
+    
     BLOCK b;
     memset(b.data.data, 0, sizeof(b));
     
-    for (int i = 0; i < N_BLOCKS_IN_DISK; i++) {
-        if (vdisk_write_block(i, &b) != 0) {
-            fprintf(stderr, "ERROR: writing 0 to block\n");
-            return -1;
-        }
-    }
-    
     //Mark the blocks as allocated
     b.master.inode_allocated_flag[0] = 1;
     b.master.block_allocated_flag[0] = 0xff;
     b.master.block_allocated_flag[1] = 0x3;
     
-    for (int i = 0; i < N_BLOCKS_IN_DISK; i++) {
-        if (vdisk_write_block(i, &b) != 0) {
-            fprintf(stderr, "ERROR: writing 0 to block\n");
-            return -1;
-        }
+    if (vdisk_write_block(MASTER_BLOCK_REFERENCE, &b) != 0) {
+        fprintf(stderr, "ERROR: writing master block\n");
+        vdisk_journal_abort();
+        return -1;
     }
+    memset(b.data.data, 0, sizeof(b));
     
     //Initializing inode
     INODE inode;
@@ -338,6 +362,11 @@ int oufs_format_disk(char  *virtual_disk_name) {
     oufs_clean_directory_block(0, 0, &b);
     //Writing directories to disk
     vdisk_write_block(9, &b);
+    vdisk_journal_end();
+    
+    //Block classes for the statistics: the old contents are gone
+    oufs_stats_init(0);
+    oufs_stats_set_block_class(9, BC_DIRECTORY);
     
     //Return success
     return 0;
@@ -485,6 +514,9 @@ BLOCK_REFERENCE oufs_allocate_new_block()
     if(debug)
         fprintf(stderr, "Allocating block=%d\n", block_reference);
     
+    // Holds file data unless the caller says otherwise
+    oufs_stats_set_block_class(block_reference, BC_DATA);
+    
     // Done
     return(block_reference);
 }
@@ -563,16 +595,135 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
     BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
     int element = (i % INODES_PER_BLOCK);
     
+    // A selected snapshot has its own copy of the inode table
+    if(snapshot_selected) {
+        block = snapshot_inode_block[block - 1];
+        if(block == UNALLOCATED_BLOCK) {
+            // No allocated inodes in this block when the snapshot was taken
+            memset(inode, 0, sizeof(INODE));
+            inode->type = IT_NONE;
+            return(0);
+        }
+    }
+    
     BLOCK b;
     if(vdisk_read_block(block, &b) == 0) {
         // Successfully loaded the block: copy just this inode
         *inode = b.inodes.inode[element];
+        // Never written since the disk was formatted: a free inode
+        if(inode->type == IT_UNWRITTEN) {
+            inode->type = IT_NONE;
+        }
         return(0);
     }
     // Error case
     return(-1);
 }
 
+/**
+ *  Starts a scan of the whole inode table. The inode bitmap is taken from the master block now; inode blocks are fetched as the scan reaches them
+ *
+ *  @param INODE_SCAN *scan The scan to start
+ *  @return 0 on success, -1 on error
+ */
+int oufs_inode_scan_open(INODE_SCAN *scan) {
+    BLOCK master;
+    if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+        return -1;
+    }
+    memcpy(scan->inode_allocated_flag, master.master.inode_allocated_flag, sizeof(scan->inode_allocated_flag));
+    //A selected snapshot has its own inode table: every inode is looked at, and the type tells which are in use
+    if (snapshot_selected) {
+        memset(scan->inode_allocated_flag, 0xff, sizeof(scan->inode_allocated_flag));
+    }
+    scan->first = 0;
+    scan->n = 0;
+    scan->next = 0;
+    return 0;
+}
+
+/**
+ *  Fetches the inode blocks of a scan from the given one on, in as few reads as possible: consecutive blocks that hold allocated inodes are read together, up to INODE_SCAN_BLOCKS at a time
+ *
+ *  @param INODE_SCAN *scan The scan
+ *  @param int first First inode block to fetch (0 = the first block of the inode table)
+ *  @return 0 on success, -1 on error
+ */
+static int oufs_inode_scan_fetch(INODE_SCAN *scan, int first) {
+    int n = 0;
+    while (n < INODE_SCAN_BLOCKS && first + n < N_INODE_BLOCKS) {
+        //A block without allocated inodes ends the run
+        int used = 0;
+        for (int i = (first + n) * INODES_PER_BLOCK; i < (first + n + 1) * INODES_PER_BLOCK; ++i) {
+            used |= scan->inode_allocated_flag[i >> 3] & (1 << (i & 0x7));
+        }
+        if (!used && n > 0) {
+            break;
+        }
+        ++n;
+    }
+    
+    if (snapshot_selected) {
+        //The snapshot's inode blocks are wherever there was room for them
+        for (int k = 0; k < n; ++k) {
+            BLOCK block;
+            if (snapshot_inode_block[first + k] == UNALLOCATED_BLOCK) {
+                //No allocated inodes in this block when the snapshot was taken
+                memset(&block, 0, sizeof(block));
+            } else if (vdisk_read_block(snapshot_inode_block[first + k], &block) != 0) {
+                return -1;
+            }
+            scan->blocks[k] = block.inodes;
+        }
+    } else {
+        BLOCK blocks[INODE_SCAN_BLOCKS];
+        if (vdisk_read_blocks(first + 1, n, blocks) != 0) {
+            return -1;
+        }
+        for (int k = 0; k < n; ++k) {
+            scan->blocks[k] = blocks[k].inodes;
+        }
+    }
+    scan->first = first;
+    scan->n = n;
+    return 0;
+}
+
+/**
+ *  Moves a scan of the inode table on to the next allocated inode. The inode table is read in large sequential reads, and the inode bitmap skips the inodes that are not in use, so a scan of all metadata takes a few reads instead of one per directory entry
+ *
+ *  @param INODE_SCAN *scan The scan, from oufs_inode_scan_open()
+ *  @param INODE_REFERENCE *inode_reference Set to the inode
+ *  @param INODE *inode Set to its contents: type, size, n_references and blocks
+ *  @return 1 if an inode was found, 0 at the end of the table, -1 on error
+ */
+int oufs_inode_scan_next(INODE_SCAN *scan, INODE_REFERENCE *inode_reference, INODE *inode) {
+    while (scan->next < N_INODES) {
+        int i = scan->next++;
+        //Eight free inodes at a time
+        if ((i & 0x7) == 0 && scan->inode_allocated_flag[i >> 3] == 0) {
+            scan->next = i + 8;
+            continue;
+        }
+        if (!(scan->inode_allocated_flag[i >> 3] & (1 << (i & 0x7)))) {
+            continue;
+        }
+        int block = i / INODES_PER_BLOCK;
+        if (block < scan->first || block >= scan->first + scan->n) {
+            if (oufs_inode_scan_fetch(scan, block) != 0) {
+                return -1;
+            }
+        }
+        *inode = scan->blocks[block - scan->first].inode[i % INODES_PER_BLOCK];
+        if (inode->type != IT_FILE && inode->type != IT_DIRECTORY) {
+            continue;
+        }
+        *inode_reference = i;
+        return 1;
+    }
+    return 0;
+}
+
 /**
  *  Given an inode reference, write the inode to the virtual disk.
  *
@@ -587,16 +738,25 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
         printf("INODE_REFERENCE in write_inode_by_reference: %d\n", i);
     }
     
+    //Snapshots are read-only
+    if (snapshot_selected) {
+        fprintf(stderr, "ERROR: cannot modify a snapshot\n");
+        return (-1);
+    }
+    
     BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
     int element = (i % INODES_PER_BLOCK);
     
     BLOCK b;
     if (vdisk_read_block(block, &b) == 0) {
+        INODE old_inode = b.inodes.inode[element];
         //Put inode into element in block
         b.inodes.inode[element] = *inode;
         
         //Write block back to disk
         if (vdisk_write_block(block, &b) == 0) {
+            //Count the change in space in the directories above the inode
+            oufs_usage_inode_changed(i, &old_inode, inode);
             return (0);
         }
     }
@@ -609,7 +769,7 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
  *  @param BLOCK block The block to take an look through its entries
  *  @param char *base_name The name of the new entry to look through
  *  @param int flag If we are checking for the file in the list of entries
- *  @return True, false, 2 for Entry with same name if file, -2 for directory
+ *  @return 0 if there is no such entry; -1 if there is one (flag 0); 1 if it is a file, 2 if it is a directory (flag 1)
  */
 int check_for_entry(BLOCK *block, char *base_name, int flag) {
     //Check to see if basename is in the list of entries
@@ -635,9 +795,8 @@ int check_for_entry(BLOCK *block, char *base_name, int flag) {
                 }
                 return -1;
             }
-        } else {
-            break;
         }
+        //A removed entry leaves a hole: keep looking past it
     }
     return 0;
 }
@@ -680,6 +839,10 @@ INODE_REFERENCE get_specified_entry(BLOCK_REFERENCE base_block, INODE_REFERENCE
  *  @return nothing
  */
 void oufs_rmfile(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *base_name) {
+    STATS_SCOPE scope;
+    oufs_stats_enter(&scope, ST_RMFILE);
+    //Copy the parent block first if a snapshot still holds it
+    base_block = oufs_cow_inode_block(base_inode, base_block);
     //Read in parent block
     BLOCK parent_block;
     vdisk_read_block(base_block, &parent_block);
@@ -738,24 +901,8 @@ void oufs_rmfile(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *b
                 printf("Old block to reset: %d\n", old_block);
             }
             
-            //Read in old block to empty out
-            BLOCK empty_block;
-            vdisk_read_block(old_block, &empty_block);
-            //Reset raw data in block
-            memset(empty_block.data.data, 0, sizeof(empty_block));
-            //Write new empty block back
-            vdisk_write_block(old_block, &empty_block);
-            
-            //Deallocate inode and block
-            int old_block_index = old_block >> 3;
-            int old_block_bit = old_block & 0x7;
-            //Read in master block
-            BLOCK block;
-            vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-            //Deallocate block on master table
-            block.master.block_allocated_flag[old_block_index] &= ~(1 << old_block_bit);
-            //Write disk back to block
-            vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+            //Deallocate block on master table, unless a snapshot still holds it (a freed block is discarded)
+            oufs_release_inode_block(old_block);
         }
         //Creating new empty inode
         INODE empty_inode;
@@ -779,9 +926,12 @@ void oufs_rmfile(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *b
         //Write disk back to block
         vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
     } else {
+        //The file no longer counts in this directory
+        oufs_usage_link(inode_to_delete, base_inode, -1);
         deleting_inode.n_references -= 1;
         oufs_write_inode_by_reference(inode_to_delete, &deleting_inode);
     }
+    oufs_stats_leave(&scope);
 }
 
 /**
@@ -793,6 +943,10 @@ void oufs_rmfile(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *b
  *  @return Nothing
  */
 void oufs_rmdir(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *base_name) {
+    STATS_SCOPE scope;
+    oufs_stats_enter(&scope, ST_RMDIR);
+    //Copy the parent block first if a snapshot still holds it
+    base_block = oufs_cow_inode_block(base_inode, base_block);
     //Read in parent block
     BLOCK parent_block;
     vdisk_read_block(base_block, &parent_block);
@@ -834,6 +988,7 @@ void oufs_rmdir(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *ba
             
             if (delete_flag) {
                 fprintf(stderr, "ERROR: Entries exist in the directory to delete, cannot delete directory\n");
+                oufs_stats_leave(&scope);
                 return;
             } else {
                 //Clean the entry
@@ -878,21 +1033,10 @@ void oufs_rmdir(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *ba
     //Writing empty inode
     oufs_write_inode_by_reference(inode_to_delete, &empty_inode);
     
-    BLOCK empty_block;
-    vdisk_read_block(old_block, &empty_block);
-    DIRECTORY_ENTRY entry;
-    oufs_clean_directory_entry(&entry);
-    
-    // Copy empty directory entries across the entire directory list
-    for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-        empty_block.directory.entry[i] = entry;
-    }
-    //Write new empty block back
-    vdisk_write_block(old_block, &empty_block);
+    //Deallocate block on master table, unless a snapshot still holds it (a freed block is discarded)
+    oufs_release_inode_block(old_block);
 
-    //Deallocate inode and block
-    int old_block_index = old_block >> 3;
-    int old_block_bit = old_block & 0x7;
+    //Deallocate inode
     int old_inode_index = inode_to_delete >> 3;
     int old_inode_bit = inode_to_delete & 0x7;
     
@@ -902,10 +1046,10 @@ void oufs_rmdir(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *ba
     
     //Perform bitwise operations
     block.master.inode_allocated_flag[old_inode_index] &= ~(1 << old_inode_bit);
-    block.master.block_allocated_flag[old_block_index] &= ~(1 << old_block_bit);
     
     //Write disk back to block
     vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+    oufs_stats_leave(&scope);
 }
 
 /**
@@ -919,6 +1063,8 @@ void oufs_rmdir(BLOCK_REFERENCE base_block, INODE_REFERENCE base_inode, char *ba
  */
 int create_new_inode_and_block(INODE_REFERENCE base_inode, BLOCK_REFERENCE base_block, char *base_name, int file_flag) {
     BLOCK block;
+    //Copy the parent block first if a snapshot still holds it
+    base_block = oufs_cow_inode_block(base_inode, base_block);
     vdisk_read_block(base_block, &block);
     //Check for any open entries
     int open_entries = 1;
@@ -944,6 +1090,7 @@ int create_new_inode_and_block(INODE_REFERENCE base_inode, BLOCK_REFERENCE base_
     
     if (file_flag == 0) {
         block_reference = oufs_allocate_new_block();
+        oufs_stats_set_block_class(block_reference, BC_DIRECTORY);
     }
     
     if (debug) {
@@ -973,8 +1120,13 @@ int create_new_inode_and_block(INODE_REFERENCE base_inode, BLOCK_REFERENCE base_
     //References is the same for files and directories
     new_inode.n_references = 1;
     
+    //The new inode counts in the usage of the directories above it
+    oufs_usage_set_parent(inode_reference, base_inode);
     //Adding new inode
     oufs_write_inode_by_reference(inode_reference, &new_inode);
+    if (file_flag == 0) {
+        oufs_owner_set(block_reference, OWNER_HOLDER(inode_reference), 0);
+    }
     
     //Adding new directory entry
     vdisk_read_block(base_block, &block);
@@ -1013,7 +1165,7 @@ int create_new_inode_and_block(INODE_REFERENCE base_inode, BLOCK_REFERENCE base_
  *  @return 0 = success
  *         -1 = error occured
  */
-int oufs_mkdir(char *cwd, char *path, int operation) {
+static int oufs_mkdir_operation(char *cwd, char *path, int operation) {
     //Basename variable of path
     char base_name[128];
     char path_copy[128];
@@ -1087,6 +1239,8 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
                 if (flag == 0) {
                     //Create new directory
                     if (create_new_inode_and_block(base_inode, base_block, base_name, 0) == 0) {
+                        //Reload parent inode, its block may have been copied
+                        oufs_read_inode_by_reference(base_inode, &inode);
                         //Increment parent inode size
                         ++inode.size;
                         //Write inode parent inode back to the block
@@ -1117,6 +1271,8 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
                 if (flag == 0) {
                     //Create new file
                     if (create_new_inode_and_block(base_inode, base_block, base_name, 1) == 0) {
+                        //Reload parent inode, its block may have been copied
+                        oufs_read_inode_by_reference(base_inode, &inode);
                         //Increment parent inode size
                         ++inode.size;
                         //Write inode parent inode back to the block
@@ -1164,6 +1320,8 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
                 if (flag == 0) {
                     //Create new directory
                     if (create_new_inode_and_block(base_inode, base_block, base_name, 0) == 0) {
+                        //Reload parent inode, its block may have been copied
+                        oufs_read_inode_by_reference(base_inode, &inode);
                         //Increment parent inode size
                         ++inode.size;
                         //Write inode parent inode back to the block
@@ -1194,6 +1352,8 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
                 if (flag == 0) {
                     //Create new file
                     if (create_new_inode_and_block(base_inode, base_block, base_name, 1) == 0) {
+                        //Reload parent inode, its block may have been copied
+                        oufs_read_inode_by_reference(base_inode, &inode);
                         //Increment parent inode size
                         ++inode.size;
                         //Write inode parent inode back to the block
@@ -1211,7 +1371,7 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
             } else if (operation == 3) {
                 flag = check_for_entry(&block, base_name, 1);
                 
-                if (flag == 2) {
+                if (flag == 1) {
                     oufs_rmfile(base_block, base_inode, base_name);
                 } else {
                     fprintf(stderr, "ERROR: specified file does not exist\n");
@@ -1245,6 +1405,8 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
             if (flag == 0) {
                 //Create new directory
                 if (create_new_inode_and_block(base_inode, base_block, base_name, 0) == 0) {
+                    //Reload parent inode, its block may have been copied
+                    oufs_read_inode_by_reference(base_inode, &inode);
                     //Increment parent inode size
                     ++inode.size;
                     //Write inode parent inode back to the block
@@ -1275,6 +1437,8 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
             if (flag == 0) {
                 //Create new file
                 if (create_new_inode_and_block(base_inode, base_block, base_name, 1) == 0) {
+                    //Reload parent inode, its block may have been copied
+                    oufs_read_inode_by_reference(base_inode, &inode);
                     //Increment parent inode size
                     ++inode.size;
                     //Write inode parent inode back to the block
@@ -1292,7 +1456,7 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
         } else if (operation == 3) {
             flag = check_for_entry(&block, base_name, 1);
             
-            if (flag == 2) {
+            if (flag == 1) {
                 oufs_rmfile(base_block, base_inode, base_name);
             } else {
                 fprintf(stderr, "ERROR: specified file does not exist\n");
@@ -1302,6 +1466,25 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
     return (0);
 }
 
+/**
+ *  Runs one of the oufs_mkdir_operation() operations as a single journal transaction, so that all of the blocks it updates reach the disk together or not at all
+ *
+ *  @param cwd The current working directory of the environment
+ *  @param path The path to create the new directory in
+ *  @param operation 0 for mkdir, 1 for rmdir, 2 for touching file, 3 for removing files
+ *  @return 0 = success
+ *         -1 = error occured
+ */
+int oufs_mkdir(char *cwd, char *path, int operation) {
+    STATS_SCOPE scope;
+    oufs_stats_enter(&scope, ST_MKDIR + operation);
+    vdisk_journal_begin();
+    int ret = oufs_mkdir_operation(cwd, path, operation);
+    vdisk_journal_end();
+    oufs_stats_leave(&scope);
+    return ret;
+}
+
 /**
  *  Opens a file from cwd and path and gets the specifics of the file. Offset, inode reference, and mode is mutated in this function so that we know how to do specific operations on the file
  *
@@ -1310,7 +1493,7 @@ int oufs_mkdir(char *cwd, char *path, int operation) {
  *  @param char *mode Mode to perform operations of the file on
  *  @return OUFILE* contianing the file specs
  */
-OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
+static OUFILE* oufs_fopen_operation(char *cwd, char *path, char *mode) {
     //Basename variable of path
     char base_name[128];
     char path_copy[128];
@@ -1485,6 +1668,22 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
     return NULL;
 }
 
+/**
+ *  Opens a file from cwd and path and gets the specifics of the file (see oufs_fopen_operation)
+ *
+ *  @param char *cwd Path of cwd
+ *  @param char *path Path of the file to find
+ *  @param char *mode Mode to perform operations of the file on
+ *  @return OUFILE* contianing the file specs
+ */
+OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
+    STATS_SCOPE scope;
+    oufs_stats_enter(&scope, ST_FOPEN);
+    OUFILE *fp = oufs_fopen_operation(cwd, path, mode);
+    oufs_stats_leave(&scope);
+    return fp;
+}
+
 /**
  *  Writes the specified buffer into the raw data of the data block allocated to the file
  *
@@ -1496,6 +1695,8 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode) {
  *  @return Nothing
  */
 void regular_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_reference, int len, char * buf, int *offset) {
+    //Copy the block first if a snapshot still holds it
+    block_reference = oufs_cow_inode_block(inode_reference, block_reference);
     BLOCK block;
     vdisk_read_block(block_reference, &block);
     
@@ -1535,6 +1736,8 @@ void regular_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_refere
  *  @return Nothing
  */
 void bleed_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_reference, int len, char * buf, int data_block, int *offset) {
+    //Copy the block first if a snapshot still holds it
+    block_reference = oufs_cow_inode_block(inode_reference, block_reference);
     //Getting inode
     INODE inode;
     oufs_read_inode_by_reference(inode_reference, &inode);
@@ -1546,9 +1749,9 @@ void bleed_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_referenc
     //Creating new buffers to hold new strs from clip
     char top_off_buff[MAX_BUFFER];
     char remainder_buff[MAX_BUFFER];
-    //Copying buff to new chars to be mutated
-    memcpy(top_off_buff, buf, strlen(buf));
-    memcpy(remainder_buff, buf, strlen(buf));
+    //Copying buff to new chars to be mutated, terminator included: clip() works on strings
+    memcpy(top_off_buff, buf, strlen(buf) + 1);
+    memcpy(remainder_buff, buf, strlen(buf) + 1);
     
     //Cliping new strings
     clip(top_off_buff, size_top_off, boundary);
@@ -1567,6 +1770,8 @@ void bleed_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_referenc
         inode.size += len;
         //Write new block in inode
         oufs_write_inode_by_reference(inode_reference, &inode);
+        //Share the full block if another file holds the same contents
+        oufs_dedup_inode_block(inode_reference, block_reference);
     } else {
         
         clip(remainder_buff, 0, size_top_off);
@@ -1586,6 +1791,7 @@ void bleed_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_referenc
         memcpy(&block.data.data[*offset], top_off_buff, strlen(top_off_buff));
         //Write block back
         vdisk_write_block(block_reference, &block);
+        BLOCK_REFERENCE full_block = block_reference;
         
         //Writing rest of string to new block
         block_reference = oufs_allocate_new_block();
@@ -1595,10 +1801,9 @@ void bleed_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_referenc
         inode.size += len;
         //Write new block in inode
         oufs_write_inode_by_reference(inode_reference, &inode);
+        oufs_owner_set(block_reference, OWNER_HOLDER(inode_reference), data_block);
         
-        //Reading in new block
-        vdisk_read_block(block_reference, &block);
-        //Resetting block, so that the raw data is cleaned
+        //New block is written whole: clean it in memory instead of reading it
         memset(block.data.data, 0, sizeof(block));
         //Add remainder_buff to new block at block 1 in inode
         memcpy(&block.data.data[0], remainder_buff, strlen(remainder_buff));
@@ -1606,6 +1811,9 @@ void bleed_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_referenc
         *offset = len - size_top_off;
         //Write block back to disk
         vdisk_write_block(block_reference, &block);
+        
+        //Share the full block if another file holds the same contents; the new one is shared once it is filled
+        oufs_dedup_inode_block(inode_reference, full_block);
     }
 }
 
@@ -1618,6 +1826,10 @@ void bleed_write(BLOCK_REFERENCE block_reference, INODE_REFERENCE inode_referenc
  *  @return 0 on success, anything else is error
  */
 int oufs_fwrite(OUFILE *fp, char * buf, int len) {
+    STATS_SCOPE scope;
+    oufs_stats_enter(&scope, ST_FWRITE);
+    //All block updates of the write form one journal transaction
+    vdisk_journal_begin();
 
     //First grab inode
     INODE inode;
@@ -1631,14 +1843,11 @@ int oufs_fwrite(OUFILE *fp, char * buf, int len) {
         //Writing new info to inode
         inode.data[0] = block_reference;
         oufs_write_inode_by_reference(fp->inode_reference, &inode);
+        oufs_owner_set(block_reference, OWNER_HOLDER(fp->inode_reference), 0);
         
-        //Clean block
+        //Clean block: written whole, so there is nothing to read first
         BLOCK block;
-        //Read block at reference into block
-        vdisk_read_block(block_reference, &block);
-        //Reset data in the block
         memset(block.data.data, 0, sizeof(block));
-        //Write block back to disk
         vdisk_write_block(block_reference, &block);
     }
     
@@ -1651,17 +1860,14 @@ int oufs_fwrite(OUFILE *fp, char * buf, int len) {
             if (inode.data[i] == UNALLOCATED_INODE) {
                 inode.data[i] = block_reference;
                 oufs_write_inode_by_reference(fp->inode_reference, &inode);
+                oufs_owner_set(block_reference, OWNER_HOLDER(fp->inode_reference), i);
                 break;
             }
         }
         
-        //Clean block
+        //Clean block: written whole, so there is nothing to read first
         BLOCK block;
-        //Read block at reference into block
-        vdisk_read_block(block_reference, &block);
-        //Reset data in the block
         memset(block.data.data, 0, sizeof(block));
-        //Write block back to disk
         vdisk_write_block(block_reference, &block);
         //Reset offset
         fp->offset = 0;
@@ -1755,6 +1961,8 @@ int oufs_fwrite(OUFILE *fp, char * buf, int len) {
             regular_write(inode.data[13], fp->inode_reference, len, buf, &fp->offset);
         }
     }
+    vdisk_journal_end();
+    oufs_stats_leave(&scope);
     return 0;
 }
 
@@ -1766,7 +1974,7 @@ int oufs_fwrite(OUFILE *fp, char * buf, int len) {
  *  @param INODE_REFERENCE dest_reference Reference of destination file
  *  @return 0 on success, and -1 on error
  */
-int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
+static int oufs_link_operation(char *cwd, char *path, INODE_REFERENCE dest_reference) {
     //Basename variable of path
     char base_name[128];
     char path_copy[128];
@@ -1836,6 +2044,9 @@ int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
             
             //Entry does not exist
             if (flag == 0) {
+                //Copy the parent block first if a snapshot still holds it
+                base_block = oufs_cow_inode_block(base_inode, base_block);
+                oufs_read_inode_by_reference(base_inode, &inode);
                 //Increment parent inode size
                 ++inode.size;
                 //Write inode parent inode back to the block
@@ -1844,6 +2055,8 @@ int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
                 oufs_read_inode_by_reference(dest_reference, &inode);
                 ++inode.n_references;
                 oufs_write_inode_by_reference(dest_reference, &inode);
+                //The file counts in this directory now too
+                oufs_usage_link(dest_reference, base_inode, 1);
                 
                 //Looping through entries in block to check for empty entry
                 for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
@@ -1879,6 +2092,9 @@ int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
             int flag = check_for_entry(&block, base_name, 1);
             //If no entry for new directory
             if (flag == 0) {
+                //Copy the parent block first if a snapshot still holds it
+                base_block = oufs_cow_inode_block(base_inode, base_block);
+                oufs_read_inode_by_reference(base_inode, &inode);
                 //Increment parent inode size
                 ++inode.size;
                 //Write inode parent inode back to the block
@@ -1887,6 +2103,8 @@ int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
                 oufs_read_inode_by_reference(dest_reference, &inode);
                 ++inode.n_references;
                 oufs_write_inode_by_reference(dest_reference, &inode);
+                //The file counts in this directory now too
+                oufs_usage_link(dest_reference, base_inode, 1);
                 
                 //Looping through entries in block to check for empty entry
                 for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
@@ -1927,6 +2145,9 @@ int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
         
         //If no entry for new directory
         if (flag == 0) {
+            //Copy the parent block first if a snapshot still holds it
+            base_block = oufs_cow_inode_block(base_inode, base_block);
+            oufs_read_inode_by_reference(base_inode, &inode);
             //Increment parent inode size
             ++inode.size;
             //Write inode parent inode back to the block
@@ -1935,6 +2156,8 @@ int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
             oufs_read_inode_by_reference(dest_reference, &inode);
             ++inode.n_references;
             oufs_write_inode_by_reference(dest_reference, &inode);
+            //The file counts in this directory now too
+            oufs_usage_link(dest_reference, base_inode, 1);
             
             //Looping through entries in block to check for empty entry
             for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
@@ -1953,3 +2176,1066 @@ int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
     }
     return (0);
 }
+
+/**
+ *  Runs oufs_link_operation() as a single journal transaction
+ *
+ *  @param char *cwd The path of the CWD
+ *  @param char *path The path of the file to link
+ *  @param INODE_REFERENCE dest_reference Reference of destination file
+ *  @return 0 on success, and -1 on error
+ */
+int oufs_link(char *cwd, char *path, INODE_REFERENCE dest_reference) {
+    STATS_SCOPE scope;
+    oufs_stats_enter(&scope, ST_LINK);
+    vdisk_journal_begin();
+    int ret = oufs_link_operation(cwd, path, dest_reference);
+    vdisk_journal_end();
+    oufs_stats_leave(&scope);
+    return ret;
+}
+
+/**
+ *  Copies a file without copying its data. The copy is a new inode that holds the same blocks as the source, and every block gains an extra reference. Whichever file is written first later gets its own copy of the block from oufs_cow_inode_block(), so the two files stay independent. The cost does not depend on the size of the file
+ *
+ *  @param char *cwd The path of the CWD
+ *  @param char *path The path of the new file
+ *  @param INODE_REFERENCE source_reference Reference of the file to copy
+ *  @return 0 on success, and -1 on error
+ */
+int oufs_copy(char *cwd, char *path, INODE_REFERENCE source_reference) {
+    STATS_SCOPE scope;
+    oufs_stats_enter(&scope, ST_COPY);
+    vdisk_journal_begin();
+    
+    INODE source;
+    oufs_read_inode_by_reference(source_reference, &source);
+    if (source.type != IT_FILE) {
+        fprintf(stderr, "ERROR: only files can be copied\n");
+        vdisk_journal_abort();
+        oufs_stats_leave(&scope);
+        return (-1);
+    }
+    
+    //Create the new file empty, then look it up (both change the path they are given)
+    char path_copy[128];
+    strcpy(path_copy, path);
+    if (oufs_mkdir(cwd, path_copy, 2) != 0) {
+        vdisk_journal_abort();
+        oufs_stats_leave(&scope);
+        return (-1);
+    }
+    strcpy(path_copy, path);
+    OUFILE *fp = oufs_fopen(cwd, path_copy, "r");
+    INODE_REFERENCE copy_reference = fp->inode_reference;
+    free(fp);
+    //oufs_mkdir() succeeds even when no inode or entry was left for the file
+    if (copy_reference == UNALLOCATED_INODE) {
+        vdisk_journal_abort();
+        oufs_stats_leave(&scope);
+        return (-1);
+    }
+    
+    //The copy is one more holder of every block of the source
+    BLOCK_REFERENCE refcount_block = oufs_get_refcount_block();
+    if (refcount_block == UNALLOCATED_BLOCK) {
+        vdisk_journal_abort();
+        oufs_stats_leave(&scope);
+        return (-1);
+    }
+    BLOCK refcounts;
+    vdisk_read_block(refcount_block, &refcounts);
+    for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+        if (source.data[k] == UNALLOCATED_BLOCK || source.data[k] >= N_BLOCKS_IN_DISK) {
+            continue;
+        }
+        if (refcounts.refcounts.extra[source.data[k]] == UCHAR_MAX) {
+            fprintf(stderr, "ERROR: block %d has too many holders\n", source.data[k]);
+            vdisk_journal_abort();
+            oufs_stats_leave(&scope);
+            return (-1);
+        }
+        ++refcounts.refcounts.extra[source.data[k]];
+    }
+    vdisk_write_block(refcount_block, &refcounts);
+    
+    //Point the copy at the blocks of the source (which counts them in the usage of its directories)
+    INODE copy;
+    oufs_read_inode_by_reference(copy_reference, &copy);
+    copy.size = source.size;
+    for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+        copy.data[k] = source.data[k];
+    }
+    oufs_write_inode_by_reference(copy_reference, &copy);
+    //The blocks have two holders now, so the reverse map cannot name one
+    for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+        if (source.data[k] != UNALLOCATED_BLOCK) {
+            oufs_owner_set(source.data[k], OWNER_UNKNOWN, 0);
+        }
+    }
+    
+    int ret = vdisk_journal_end();
+    oufs_stats_leave(&scope);
+    return ret;
+}
+
+/**
+ *  Starts a transaction that groups several operations (oufs_mkdir operations, oufs_fwrite, oufs_link) into one unit. The operations see each other's changes, but nothing reaches the disk until oufs_txn_commit(). A block that is modified many times (the master block, an inode block, a directory block) is written only once, at commit
+ *
+ *  @return 0 on success
+ */
+int oufs_txn_begin() {
+    return vdisk_journal_begin();
+}
+
+/**
+ *  Commits the transaction started by oufs_txn_begin(). All of the blocks it modified are made durable together
+ *
+ *  @return 0 on success, anything else is error
+ */
+int oufs_txn_commit() {
+    if (vdisk_journal_end() != 0) {
+        return -1;
+    }
+    return vdisk_journal_commit();
+}
+
+/**
+ *  Abandons the transaction started by oufs_txn_begin(). None of the operations done since then reach the disk. A tool that exits while a transaction is open gets the same result
+ */
+void oufs_txn_abort() {
+    vdisk_journal_abort();
+}
+
+/**
+ *  Checks whether a block has more than one holder (for example, the live file system and a snapshot). A shared block must not be modified in place
+ *
+ *  @param BLOCK_REFERENCE block_reference Block to check
+ *  @return 1 if the block is shared, 0 otherwise
+ */
+int oufs_block_is_shared(BLOCK_REFERENCE block_reference) {
+    BLOCK block;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+    //No reference counts means that nothing is shared
+    if (block.master.refcount_block == 0) {
+        return 0;
+    }
+    vdisk_read_block(block.master.refcount_block, &block);
+    return block.refcounts.extra[block_reference] > 0;
+}
+
+/**
+ *  Drops one holder of a block. The block is only deallocated in the master block once its last holder is gone. A deallocated block is discarded: it reads as zeroes, and its space goes back to the host once the transaction reaches the disk
+ *
+ *  @param BLOCK_REFERENCE block_reference Block to release
+ *  @return 1 if the block is now free, 0 if it is still held
+ */
+int oufs_release_block(BLOCK_REFERENCE block_reference) {
+    BLOCK block;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+    
+    //Drop an extra reference if there is one
+    if (block.master.refcount_block != 0) {
+        BLOCK_REFERENCE refcount_block = block.master.refcount_block;
+        BLOCK refcounts;
+        vdisk_read_block(refcount_block, &refcounts);
+        if (refcounts.refcounts.extra[block_reference] > 0) {
+            --refcounts.refcounts.extra[block_reference];
+            vdisk_write_block(refcount_block, &refcounts);
+            return 0;
+        }
+    }
+    
+    //Last holder: deallocate block on master table
+    block.master.block_allocated_flag[block_reference >> 3] &= ~(1 << (block_reference & 0x7));
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+    vdisk_discard_block(block_reference);
+    
+    //A free block leaves the dedup index and the reverse map
+    if (block.master.dedup_block != 0) {
+        BLOCK index;
+        vdisk_read_block(block.master.dedup_block, &index);
+        if (index.dedup.fingerprint[block_reference] != 0) {
+            index.dedup.fingerprint[block_reference] = 0;
+            vdisk_write_block(block.master.dedup_block, &index);
+        }
+    }
+    oufs_owner_set(block_reference, OWNER_NONE, 0);
+    
+    if (debug) {
+        printf("Released block: %d\n", block_reference);
+    }
+    return 1;
+}
+
+/**
+ *  Copy-on-write: makes a block of an inode safe to modify. If the block is shared, its contents are copied to a newly allocated block, the inode is changed to point to the copy and the old block is released
+ *
+ *  @param INODE_REFERENCE inode_reference Inode that references the block
+ *  @param BLOCK_REFERENCE block_reference Block that is about to be modified
+ *  @return The block to modify (block_reference if it was not shared)
+ */
+BLOCK_REFERENCE oufs_cow_inode_block(INODE_REFERENCE inode_reference, BLOCK_REFERENCE block_reference) {
+    if (block_reference == UNALLOCATED_BLOCK || !oufs_block_is_shared(block_reference)) {
+        return block_reference;
+    }
+    
+    //Copy the contents into a new block
+    BLOCK block;
+    vdisk_read_block(block_reference, &block);
+    BLOCK_REFERENCE new_reference = oufs_allocate_new_block();
+    if (new_reference == UNALLOCATED_BLOCK) {
+        fprintf(stderr, "ERROR: no open blocks to copy a shared block\n");
+        return block_reference;
+    }
+    oufs_stats_set_block_class(new_reference, oufs_stats_get_block_class(block_reference));
+    vdisk_write_block(new_reference, &block);
+    
+    //Point the inode at the copy
+    INODE inode;
+    oufs_read_inode_by_reference(inode_reference, &inode);
+    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+        if (inode.data[i] == block_reference) {
+            inode.data[i] = new_reference;
+            oufs_owner_set(new_reference, OWNER_HOLDER(inode_reference), i);
+        }
+    }
+    oufs_write_inode_by_reference(inode_reference, &inode);
+    
+    //The old block stays with its other holders
+    oufs_release_inode_block(block_reference);
+    
+    if (debug) {
+        printf("Copied shared block %d to %d for inode %d\n", block_reference, new_reference, inode_reference);
+    }
+    return new_reference;
+}
+
+/**
+ *  Finds the block holding the shared block reference counts, and creates it if no block has been shared yet
+ *
+ *  @return The reference count block, UNALLOCATED_BLOCK if there is no open block for it
+ */
+static BLOCK_REFERENCE oufs_get_refcount_block() {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.refcount_block != 0) {
+        return master.master.refcount_block;
+    }
+    
+    BLOCK refcounts;
+    BLOCK_REFERENCE refcount_block = oufs_allocate_new_block();
+    if (refcount_block == UNALLOCATED_BLOCK) {
+        fprintf(stderr, "ERROR: no open blocks for the reference counts\n");
+        return UNALLOCATED_BLOCK;
+    }
+    oufs_stats_set_block_class(refcount_block, BC_MASTER);
+    memset(&refcounts, 0, sizeof(refcounts));
+    vdisk_write_block(refcount_block, &refcounts);
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    master.master.refcount_block = refcount_block;
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    return refcount_block;
+}
+
+/**
+ *  Fingerprint of the contents of a block for the dedup index (FNV-1a, folded to 1 ... 255)
+ *
+ *  @param BLOCK *block The block
+ *  @return The fingerprint
+ */
+static unsigned char oufs_block_fingerprint(BLOCK *block) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < BLOCK_SIZE; ++i) {
+        hash ^= block->data.data[i];
+        hash *= 16777619;
+    }
+    return hash % 255 + 1;
+}
+
+/**
+ *  Turns deduplication on: creates the dedup index and enters the data blocks of every file already on the disk. Files written from now on share their blocks with identical blocks of other files
+ *
+ *  @return 0 on success, -1 on error
+ */
+int oufs_dedup_enable() {
+    vdisk_journal_begin();
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.dedup_block != 0) {
+        return vdisk_journal_end();
+    }
+    
+    BLOCK_REFERENCE dedup_block = oufs_allocate_new_block();
+    if (dedup_block == UNALLOCATED_BLOCK) {
+        fprintf(stderr, "ERROR: no open blocks for the dedup index\n");
+        vdisk_journal_abort();
+        return -1;
+    }
+    oufs_stats_set_block_class(dedup_block, BC_MASTER);
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    master.master.dedup_block = dedup_block;
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    
+    //Index the blocks of the files that are already there
+    BLOCK index;
+    memset(&index, 0, sizeof(index));
+    for (int i = 0; i < N_INODES; ++i) {
+        if (!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 0x7)))) {
+            continue;
+        }
+        INODE inode;
+        oufs_read_inode_by_reference(i, &inode);
+        if (inode.type != IT_FILE) {
+            continue;
+        }
+        //Only full blocks, as on the write path
+        for (int k = 0; k < BLOCKS_PER_INODE && (k + 1) * BLOCK_SIZE <= inode.size; ++k) {
+            if (inode.data[k] != UNALLOCATED_BLOCK && inode.data[k] < N_BLOCKS_IN_DISK) {
+                BLOCK block;
+                vdisk_read_block(inode.data[k], &block);
+                index.dedup.fingerprint[inode.data[k]] = oufs_block_fingerprint(&block);
+            }
+        }
+    }
+    vdisk_write_block(dedup_block, &index);
+    return vdisk_journal_end();
+}
+
+/**
+ *  Deduplication on the write path: called once a block of a file has been filled (a block that is still being appended to would only be copied again by the next append). If another file already holds a block with the same contents, the file is pointed at that block, which gains an extra reference, and its own block is released. Otherwise the block is entered into the dedup index. Does nothing while deduplication is off
+ *
+ *  @param INODE_REFERENCE inode_reference Inode of the file that holds the block
+ *  @param BLOCK_REFERENCE block_reference Block that was just written
+ *  @return The block that the file holds now
+ */
+BLOCK_REFERENCE oufs_dedup_inode_block(INODE_REFERENCE inode_reference, BLOCK_REFERENCE block_reference) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.dedup_block == 0 || block_reference >= N_BLOCKS_IN_DISK) {
+        return block_reference;
+    }
+    BLOCK_REFERENCE dedup_block = master.master.dedup_block;
+    
+    BLOCK block;
+    vdisk_read_block(block_reference, &block);
+    unsigned char fingerprint = oufs_block_fingerprint(&block);
+    BLOCK index;
+    vdisk_read_block(dedup_block, &index);
+    INODE inode;
+    oufs_read_inode_by_reference(inode_reference, &inode);
+    
+    for (int candidate = ROOT_DIRECTORY_BLOCK + 1; candidate < N_BLOCKS_IN_DISK; ++candidate) {
+        if (candidate == block_reference || index.dedup.fingerprint[candidate] != fingerprint ||
+            !(master.master.block_allocated_flag[candidate >> 3] & (1 << (candidate & 0x7)))) {
+            continue;
+        }
+        //A file never holds the same block twice
+        int held = 0;
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            held |= inode.data[k] == candidate;
+        }
+        if (held) {
+            continue;
+        }
+        //The fingerprint only narrows the search down: compare the contents
+        BLOCK other;
+        vdisk_read_block(candidate, &other);
+        if (memcmp(&other, &block, sizeof(BLOCK)) != 0) {
+            continue;
+        }
+        
+        BLOCK_REFERENCE refcount_block = oufs_get_refcount_block();
+        if (refcount_block == UNALLOCATED_BLOCK) {
+            break;
+        }
+        BLOCK refcounts;
+        vdisk_read_block(refcount_block, &refcounts);
+        if (refcounts.refcounts.extra[candidate] == UCHAR_MAX) {
+            continue;
+        }
+        ++refcounts.refcounts.extra[candidate];
+        vdisk_write_block(refcount_block, &refcounts);
+        
+        //Point the file at the shared block, and let go of its own copy
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            if (inode.data[k] == block_reference) {
+                inode.data[k] = candidate;
+            }
+        }
+        oufs_write_inode_by_reference(inode_reference, &inode);
+        oufs_owner_set(candidate, OWNER_UNKNOWN, 0);
+        oufs_release_inode_block(block_reference);
+        
+        if (debug) {
+            printf("Deduplicated block %d of inode %d into block %d\n", block_reference, inode_reference, candidate);
+        }
+        return candidate;
+    }
+    
+    index.dedup.fingerprint[block_reference] = fingerprint;
+    vdisk_write_block(dedup_block, &index);
+    return block_reference;
+}
+
+/**
+ *  Records the owner of a block in the reverse map. Does nothing if the disk has no reverse map
+ *
+ *  @param BLOCK_REFERENCE block_reference The block
+ *  @param int holder OWNER_HOLDER() of the inode that holds it, OWNER_NONE or OWNER_UNKNOWN
+ *  @param int index Index of the block in INODE.data[]
+ */
+void oufs_owner_set(BLOCK_REFERENCE block_reference, int holder, int index) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.owner_map_block[0] == 0 || block_reference >= N_BLOCKS_IN_DISK) {
+        return;
+    }
+    BLOCK_REFERENCE map_block = master.master.owner_map_block[block_reference / OWNERS_PER_BLOCK];
+    BLOCK map;
+    vdisk_read_block(map_block, &map);
+    OWNER_ENTRY *entry = &map.owners.owner[block_reference % OWNERS_PER_BLOCK];
+    if (entry->holder == holder && entry->index == index) {
+        return;
+    }
+    entry->holder = holder;
+    entry->index = index;
+    vdisk_write_block(map_block, &map);
+}
+
+/**
+ *  Drops an inode's hold on a block (see oufs_release_block()). If the block stays with other holders, the reverse map no longer knows which of them owns it
+ *
+ *  @param BLOCK_REFERENCE block_reference Block to release
+ *  @return 1 if the block is now free, 0 if it is still held
+ */
+int oufs_release_inode_block(BLOCK_REFERENCE block_reference) {
+    if (oufs_release_block(block_reference)) {
+        return 1;
+    }
+    oufs_owner_set(block_reference, OWNER_UNKNOWN, 0);
+    return 0;
+}
+
+/**
+ *  Creates the reverse map and enters the blocks of every inode already on the disk. From then on, the owner of a block is found with one read instead of a scan of the inode table
+ *
+ *  @return 0 on success, -1 on error
+ */
+int oufs_owners_enable() {
+    vdisk_journal_begin();
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.owner_map_block[0] != 0) {
+        return vdisk_journal_end();
+    }
+    
+    BLOCK_REFERENCE map_block[OWNER_MAP_BLOCKS];
+    for (int m = 0; m < OWNER_MAP_BLOCKS; ++m) {
+        map_block[m] = oufs_allocate_new_block();
+        if (map_block[m] == UNALLOCATED_BLOCK) {
+            fprintf(stderr, "ERROR: no open blocks for the reverse map\n");
+            vdisk_journal_abort();
+            return -1;
+        }
+        oufs_stats_set_block_class(map_block[m], BC_MASTER);
+    }
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    memcpy(master.master.owner_map_block, map_block, sizeof(map_block));
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    
+    //Enter the blocks of the inodes that are already there
+    BLOCK map[OWNER_MAP_BLOCKS];
+    memset(map, 0, sizeof(map));
+    for (int i = 0; i < N_INODES; ++i) {
+        if (!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 0x7)))) {
+            continue;
+        }
+        INODE inode;
+        oufs_read_inode_by_reference(i, &inode);
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            if (inode.data[k] == UNALLOCATED_BLOCK || inode.data[k] >= N_BLOCKS_IN_DISK) {
+                continue;
+            }
+            OWNER_ENTRY *entry = &map[inode.data[k] / OWNERS_PER_BLOCK].owners.owner[inode.data[k] % OWNERS_PER_BLOCK];
+            entry->holder = entry->holder == OWNER_NONE ? OWNER_HOLDER(i) : OWNER_UNKNOWN;
+            entry->index = k;
+        }
+    }
+    for (int m = 0; m < OWNER_MAP_BLOCKS; ++m) {
+        vdisk_write_block(map_block[m], &map[m]);
+    }
+    return vdisk_journal_end();
+}
+
+/**
+ *  Finds the inode of the live file system that holds a block. With a reverse map this takes one read; without one, or when the map cannot tell, the inode table is scanned
+ *
+ *  @param BLOCK_REFERENCE block_reference The block
+ *  @param INODE_REFERENCE *inode_reference Set to the inode that holds the block
+ *  @param int *index Set to the index of the block in INODE.data[]
+ *  @param int *scanned Set to 1 if the inode table was scanned, 0 if the reverse map answered
+ *  @return 1 if an inode holds the block, 0 if none does
+ */
+int oufs_block_owner(BLOCK_REFERENCE block_reference, INODE_REFERENCE *inode_reference, int *index, int *scanned) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    *scanned = 0;
+    if (block_reference >= N_BLOCKS_IN_DISK) {
+        return 0;
+    }
+    if (master.master.owner_map_block[0] != 0) {
+        BLOCK map;
+        vdisk_read_block(master.master.owner_map_block[block_reference / OWNERS_PER_BLOCK], &map);
+        OWNER_ENTRY *entry = &map.owners.owner[block_reference % OWNERS_PER_BLOCK];
+        if (entry->holder == OWNER_NONE) {
+            return 0;
+        }
+        if (entry->holder != OWNER_UNKNOWN) {
+            *inode_reference = entry->holder - 1;
+            *index = entry->index;
+            return 1;
+        }
+    }
+    
+    //The first inode that holds the block
+    *scanned = 1;
+    for (int i = 0; i < N_INODES; ++i) {
+        if (!(master.master.inode_allocated_flag[i >> 3] & (1 << (i & 0x7)))) {
+            continue;
+        }
+        INODE inode;
+        oufs_read_inode_by_reference(i, &inode);
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            if (inode.data[k] == block_reference) {
+                *inode_reference = i;
+                *index = k;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ *  Space that an inode takes by itself: the bytes of a file, the blocks it holds and the inode. The parent is left alone
+ *
+ *  @param INODE *inode The inode
+ *  @param USAGE_ENTRY *usage Set to the space
+ */
+static void oufs_usage_own(INODE *inode, USAGE_ENTRY *usage) {
+    usage->bytes = 0;
+    usage->blocks = 0;
+    usage->inodes = 0;
+    if (inode->type != IT_FILE && inode->type != IT_DIRECTORY) {
+        return;
+    }
+    if (inode->type == IT_FILE) {
+        usage->bytes = inode->size;
+    }
+    for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+        usage->blocks += inode->data[k] != UNALLOCATED_BLOCK;
+    }
+    usage->inodes = 1;
+}
+
+/**
+ *  Marks the usage table as fallen behind, so that it is rebuilt before it is used next. Does nothing if the disk has no usage table
+ */
+static void oufs_usage_mark_stale() {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.usage_block[0] == 0 || master.master.usage_stale) {
+        return;
+    }
+    master.master.usage_stale = 1;
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+}
+
+/**
+ *  Adds a change in space to the usage of an inode and of every directory above it. Only the table blocks on the way are read. Does nothing if the disk has no usage table, or if the table has fallen behind anyway
+ *
+ *  @param INODE_REFERENCE inode_reference First inode to change
+ *  @param int bytes Change in bytes
+ *  @param int blocks Change in blocks
+ *  @param int inodes Change in inodes
+ */
+static void oufs_usage_add(INODE_REFERENCE inode_reference, int bytes, int blocks, int inodes) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.usage_block[0] == 0 || master.master.usage_stale) {
+        return;
+    }
+    
+    BLOCK table[USAGE_BLOCKS];
+    char loaded[USAGE_BLOCKS];
+    memset(loaded, 0, sizeof(loaded));
+    //The depth bounds the walk even if the parents form a loop
+    for (int depth = 0; inode_reference < N_INODES && depth < N_INODES; ++depth) {
+        int m = inode_reference / USAGES_PER_BLOCK;
+        if (!loaded[m]) {
+            vdisk_read_block(master.master.usage_block[m], &table[m]);
+            loaded[m] = 1;
+        }
+        USAGE_ENTRY *usage = &table[m].usages.usage[inode_reference % USAGES_PER_BLOCK];
+        usage->bytes += bytes;
+        usage->blocks += blocks;
+        usage->inodes += inodes;
+        inode_reference = usage->parent;
+    }
+    for (int m = 0; m < USAGE_BLOCKS; ++m) {
+        if (loaded[m]) {
+            vdisk_write_block(master.master.usage_block[m], &table[m]);
+        }
+    }
+}
+
+/**
+ *  Brings the usage table up to date after an inode was written. A file with several links counts in directories that the table cannot find from the inode, so a change to one marks the table as fallen behind instead
+ *
+ *  @param INODE_REFERENCE inode_reference The inode
+ *  @param INODE *old_inode The inode before the write
+ *  @param INODE *new_inode The inode after the write
+ */
+static void oufs_usage_inode_changed(INODE_REFERENCE inode_reference, INODE *old_inode, INODE *new_inode) {
+    USAGE_ENTRY before;
+    USAGE_ENTRY after;
+    oufs_usage_own(old_inode, &before);
+    oufs_usage_own(new_inode, &after);
+    if (before.bytes == after.bytes && before.blocks == after.blocks && before.inodes == after.inodes) {
+        return;
+    }
+    if ((old_inode->type == IT_FILE && old_inode->n_references > 1) ||
+        (new_inode->type == IT_FILE && new_inode->n_references > 1)) {
+        oufs_usage_mark_stale();
+        return;
+    }
+    oufs_usage_add(inode_reference, (int) after.bytes - (int) before.bytes, after.blocks - before.blocks,
+                   after.inodes - before.inodes);
+}
+
+/**
+ *  Starts the usage of a new inode at nothing, under the directory that links it. Called before the inode is first written, so that the write counts in that directory. Does nothing if the disk has no usage table
+ *
+ *  @param INODE_REFERENCE inode_reference The new inode
+ *  @param INODE_REFERENCE parent The directory that links it
+ */
+void oufs_usage_set_parent(INODE_REFERENCE inode_reference, INODE_REFERENCE parent) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.usage_block[0] == 0 || inode_reference >= N_INODES) {
+        return;
+    }
+    BLOCK_REFERENCE table_block = master.master.usage_block[inode_reference / USAGES_PER_BLOCK];
+    BLOCK table;
+    vdisk_read_block(table_block, &table);
+    USAGE_ENTRY *usage = &table.usages.usage[inode_reference % USAGES_PER_BLOCK];
+    memset(usage, 0, sizeof(USAGE_ENTRY));
+    usage->parent = parent;
+    vdisk_write_block(table_block, &table);
+}
+
+/**
+ *  Counts a file in one more directory, or in one less, after a link to it was added or removed. Removing the link that the table follows up from the file marks the table as fallen behind: the table cannot tell which directory links the file now
+ *
+ *  @param INODE_REFERENCE inode_reference The file
+ *  @param INODE_REFERENCE directory The directory that gained or lost the link
+ *  @param int sign 1 for a new link, -1 for a removed one
+ */
+void oufs_usage_link(INODE_REFERENCE inode_reference, INODE_REFERENCE directory, int sign) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.usage_block[0] == 0 || master.master.usage_stale || inode_reference >= N_INODES) {
+        return;
+    }
+    BLOCK table;
+    vdisk_read_block(master.master.usage_block[inode_reference / USAGES_PER_BLOCK], &table);
+    USAGE_ENTRY usage = table.usages.usage[inode_reference % USAGES_PER_BLOCK];
+    if (sign < 0 && usage.parent == directory) {
+        oufs_usage_mark_stale();
+        return;
+    }
+    oufs_usage_add(directory, sign * (int) usage.bytes, sign * usage.blocks, sign * usage.inodes);
+}
+
+/**
+ *  Adds up the usage of a directory from its entries, and of every directory below it
+ *
+ *  @param INODE_REFERENCE dir The directory
+ *  @param USAGE_ENTRY *table Usage of every inode, filled in; parents must be set to UNALLOCATED_INODE
+ *  @param char *seen Inodes that were counted already
+ */
+static void oufs_usage_walk(INODE_REFERENCE dir, USAGE_ENTRY *table, char *seen) {
+    INODE inode;
+    oufs_read_inode_by_reference(dir, &inode);
+    oufs_usage_own(&inode, &table[dir]);
+    seen[dir] = 1;
+    if (inode.type != IT_DIRECTORY || inode.data[0] >= N_BLOCKS_IN_DISK) {
+        return;
+    }
+    
+    BLOCK block;
+    vdisk_read_block(inode.data[0], &block);
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+        INODE_REFERENCE child = block.directory.entry[i].inode_reference;
+        if (child >= N_INODES || !strcmp(block.directory.entry[i].name, ".") ||
+            !strcmp(block.directory.entry[i].name, "..")) {
+            continue;
+        }
+        INODE child_inode;
+        oufs_read_inode_by_reference(child, &child_inode);
+        if (child_inode.type == IT_DIRECTORY) {
+            //A directory is only ever entered once, even if the tree is damaged
+            if (seen[child]) {
+                continue;
+            }
+            table[child].parent = dir;
+            oufs_usage_walk(child, table, seen);
+        } else if (!seen[child]) {
+            oufs_usage_own(&child_inode, &table[child]);
+            table[child].parent = dir;
+            seen[child] = 1;
+        }
+        table[dir].bytes += table[child].bytes;
+        table[dir].blocks += table[child].blocks;
+        table[dir].inodes += table[child].inodes;
+    }
+}
+
+/**
+ *  Rebuilds the usage table with a walk of the whole tree. Does nothing if the disk has no usage table
+ *
+ *  @return 0 on success, -1 on error
+ */
+int oufs_usage_rebuild() {
+    vdisk_journal_begin();
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.usage_block[0] == 0) {
+        return vdisk_journal_end();
+    }
+    
+    BLOCK table[USAGE_BLOCKS];
+    USAGE_ENTRY usage[USAGE_BLOCKS * USAGES_PER_BLOCK];
+    char seen[N_INODES];
+    memset(usage, 0, sizeof(usage));
+    memset(seen, 0, sizeof(seen));
+    for (int i = 0; i < USAGE_BLOCKS * USAGES_PER_BLOCK; ++i) {
+        usage[i].parent = UNALLOCATED_INODE;
+    }
+    oufs_usage_walk(0, usage, seen);
+    
+    memset(table, 0, sizeof(table));
+    for (int m = 0; m < USAGE_BLOCKS; ++m) {
+        memcpy(table[m].usages.usage, &usage[m * USAGES_PER_BLOCK], USAGES_PER_BLOCK * sizeof(USAGE_ENTRY));
+        vdisk_write_block(master.master.usage_block[m], &table[m]);
+    }
+    master.master.usage_stale = 0;
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    return vdisk_journal_end();
+}
+
+/**
+ *  Creates the usage table and fills it in from the tree that is already on the disk. From then on, the usage of any directory is read from the table instead of added up
+ *
+ *  @return 0 on success, -1 on error
+ */
+int oufs_usage_enable() {
+    vdisk_journal_begin();
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.usage_block[0] != 0) {
+        return vdisk_journal_end();
+    }
+    
+    BLOCK_REFERENCE table_block[USAGE_BLOCKS];
+    for (int m = 0; m < USAGE_BLOCKS; ++m) {
+        table_block[m] = oufs_allocate_new_block();
+        if (table_block[m] == UNALLOCATED_BLOCK) {
+            fprintf(stderr, "ERROR: no open blocks for the usage table\n");
+            vdisk_journal_abort();
+            return -1;
+        }
+        oufs_stats_set_block_class(table_block[m], BC_MASTER);
+    }
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    memcpy(master.master.usage_block, table_block, sizeof(table_block));
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    
+    if (oufs_usage_rebuild() != 0) {
+        vdisk_journal_abort();
+        return -1;
+    }
+    return vdisk_journal_end();
+}
+
+/**
+ *  Usage of every inode: bytes, blocks and inodes of the tree below it. Read from the usage table, which is rebuilt first if it fell behind. Without a usage table, or on a selected snapshot, the tree is walked instead
+ *
+ *  @param USAGE_ENTRY *table Filled in for each of the N_INODES inodes
+ *  @return 1 if the usage table answered, 0 if the tree was walked, -1 on error
+ */
+int oufs_usage_table(USAGE_ENTRY *table) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.usage_block[0] == 0 || snapshot_selected) {
+        char seen[N_INODES];
+        memset(table, 0, N_INODES * sizeof(USAGE_ENTRY));
+        memset(seen, 0, sizeof(seen));
+        for (int i = 0; i < N_INODES; ++i) {
+            table[i].parent = UNALLOCATED_INODE;
+        }
+        oufs_usage_walk(0, table, seen);
+        return 0;
+    }
+    if (master.master.usage_stale) {
+        if (oufs_usage_rebuild() != 0) {
+            return -1;
+        }
+    }
+    
+    for (int m = 0; m < USAGE_BLOCKS; ++m) {
+        BLOCK block;
+        vdisk_read_block(master.master.usage_block[m], &block);
+        int n = MIN(USAGES_PER_BLOCK, N_INODES - m * USAGES_PER_BLOCK);
+        memcpy(&table[m * USAGES_PER_BLOCK], block.usages.usage, n * sizeof(USAGE_ENTRY));
+    }
+    return 1;
+}
+
+/**
+ *  Takes a snapshot of the whole file system. The inode table is copied, and every block referenced by an allocated inode gains an extra reference so that later writes copy it instead of changing it. The cost does not depend on how much data the file system holds
+ *
+ *  @param char *name Name of the new snapshot
+ *  @return 0 on success, -1 on error
+ */
+int oufs_snapshot_create(char *name) {
+    if (strlen(name) >= FILE_NAME_SIZE) {
+        fprintf(stderr, "ERROR: snapshot name is too long\n");
+        return -1;
+    }
+    
+    vdisk_journal_begin();
+    
+    //Make sure that the snapshot table and the reference counts exist
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.snapshot_table_block == 0) {
+        BLOCK table;
+        BLOCK_REFERENCE table_block = oufs_allocate_new_block();
+        if (table_block == UNALLOCATED_BLOCK) {
+            fprintf(stderr, "ERROR: no open blocks for the snapshot table\n");
+            vdisk_journal_abort();
+            return -1;
+        }
+        oufs_stats_set_block_class(table_block, BC_MASTER);
+        memset(&table, 0, sizeof(table));
+        vdisk_write_block(table_block, &table);
+        vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+        master.master.snapshot_table_block = table_block;
+        vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    }
+    if (oufs_get_refcount_block() == UNALLOCATED_BLOCK) {
+        vdisk_journal_abort();
+        return -1;
+    }
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    
+    //Find a free entry in the snapshot table
+    BLOCK table;
+    vdisk_read_block(master.master.snapshot_table_block, &table);
+    SNAPSHOT *snapshot = NULL;
+    for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+        if (!strcmp(table.snapshots.snapshot[i].name, name)) {
+            fprintf(stderr, "ERROR: snapshot %s already exists\n", name);
+            vdisk_journal_abort();
+            return -1;
+        }
+        if (snapshot == NULL && table.snapshots.snapshot[i].name[0] == 0) {
+            snapshot = &table.snapshots.snapshot[i];
+        }
+    }
+    if (snapshot == NULL) {
+        fprintf(stderr, "ERROR: no room for another snapshot\n");
+        vdisk_journal_abort();
+        return -1;
+    }
+    memset(snapshot, 0, sizeof(SNAPSHOT));
+    strcpy(snapshot->name, name);
+    snapshot->created = (unsigned int) time(NULL);
+    
+    //Copy the inode table, and collect the blocks that its inodes reference
+    for (int i = 0; i < N_INODE_BLOCKS; ++i) {
+        BLOCK inodes;
+        vdisk_read_block(i + 1, &inodes);
+        int in_use = 0;
+        for (int j = 0; j < INODES_PER_BLOCK; ++j) {
+            int inode_reference = i * INODES_PER_BLOCK + j;
+            INODE *inode = &inodes.inodes.inode[j];
+            if (!(master.master.inode_allocated_flag[inode_reference >> 3] & (1 << (inode_reference & 0x7)))) {
+                continue;
+            }
+            in_use = 1;
+            for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+                if (inode->data[k] != UNALLOCATED_BLOCK && inode->data[k] < N_BLOCKS_IN_DISK) {
+                    snapshot->block_held_flag[inode->data[k] >> 3] |= 1 << (inode->data[k] & 0x7);
+                }
+            }
+        }
+        
+        snapshot->inode_block[i] = UNALLOCATED_BLOCK;
+        if (in_use) {
+            snapshot->inode_block[i] = oufs_allocate_new_block();
+            if (snapshot->inode_block[i] == UNALLOCATED_BLOCK) {
+                fprintf(stderr, "ERROR: no open blocks for the snapshot\n");
+                vdisk_journal_abort();
+                return -1;
+            }
+            oufs_stats_set_block_class(snapshot->inode_block[i], BC_INODE);
+            vdisk_write_block(snapshot->inode_block[i], &inodes);
+        }
+    }
+    
+    //The snapshot is an extra holder of every block it references
+    BLOCK refcounts;
+    vdisk_read_block(master.master.refcount_block, &refcounts);
+    for (int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+        if (snapshot->block_held_flag[i >> 3] & (1 << (i & 0x7))) {
+            if (refcounts.refcounts.extra[i] == UCHAR_MAX) {
+                fprintf(stderr, "ERROR: block %d has too many holders\n", i);
+                vdisk_journal_abort();
+                return -1;
+            }
+            ++refcounts.refcounts.extra[i];
+        }
+    }
+    vdisk_write_block(master.master.refcount_block, &refcounts);
+    vdisk_write_block(master.master.snapshot_table_block, &table);
+    
+    return vdisk_journal_end();
+}
+
+/**
+ *  Deletes a snapshot. Its copy of the inode table is freed, and the blocks that it was holding are released
+ *
+ *  @param char *name Name of the snapshot
+ *  @return 0 on success, -1 on error
+ */
+int oufs_snapshot_delete(char *name) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    BLOCK_REFERENCE table_block = master.master.snapshot_table_block;
+    if (table_block == 0) {
+        fprintf(stderr, "ERROR: snapshot %s does not exist\n", name);
+        return -1;
+    }
+    
+    BLOCK table;
+    vdisk_read_block(table_block, &table);
+    for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+        SNAPSHOT *snapshot = &table.snapshots.snapshot[i];
+        if (snapshot->name[0] == 0 || strcmp(snapshot->name, name)) {
+            continue;
+        }
+        
+        vdisk_journal_begin();
+        //Release the held blocks and the copy of the inode table
+        for (int j = 0; j < N_BLOCKS_IN_DISK; ++j) {
+            if (snapshot->block_held_flag[j >> 3] & (1 << (j & 0x7))) {
+                oufs_release_block(j);
+            }
+        }
+        for (int j = 0; j < N_INODE_BLOCKS; ++j) {
+            if (snapshot->inode_block[j] != UNALLOCATED_BLOCK) {
+                oufs_release_block(snapshot->inode_block[j]);
+            }
+        }
+        memset(snapshot, 0, sizeof(SNAPSHOT));
+        vdisk_write_block(table_block, &table);
+        
+        //Give back the snapshot table and the reference counts once nothing uses them
+        int in_use = 0;
+        for (int j = 0; j < MAX_SNAPSHOTS; ++j) {
+            in_use |= table.snapshots.snapshot[j].name[0] != 0;
+        }
+        vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+        if (!in_use) {
+            master.master.snapshot_table_block = 0;
+            vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+            oufs_release_block(table_block);
+            vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+        }
+        BLOCK_REFERENCE refcount_block = master.master.refcount_block;
+        BLOCK refcounts;
+        vdisk_read_block(refcount_block, &refcounts);
+        for (int j = 0; j < N_BLOCKS_IN_DISK; ++j) {
+            in_use |= refcounts.refcounts.extra[j] != 0;
+        }
+        if (!in_use) {
+            master.master.refcount_block = 0;
+            vdisk_write_block(MASTER_BLOCK_REFERENCE, &master);
+            oufs_release_block(refcount_block);
+        }
+        return vdisk_journal_end();
+    }
+    
+    fprintf(stderr, "ERROR: snapshot %s does not exist\n", name);
+    return -1;
+}
+
+/**
+ *  Prints one line per snapshot: name, creation time, inode blocks copied and data blocks held
+ */
+void oufs_snapshot_list() {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.snapshot_table_block == 0) {
+        return;
+    }
+    
+    BLOCK table;
+    vdisk_read_block(master.master.snapshot_table_block, &table);
+    for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+        SNAPSHOT *snapshot = &table.snapshots.snapshot[i];
+        if (snapshot->name[0] == 0) {
+            continue;
+        }
+        int inode_blocks = 0;
+        int held = 0;
+        for (int j = 0; j < N_INODE_BLOCKS; ++j) {
+            inode_blocks += snapshot->inode_block[j] != UNALLOCATED_BLOCK;
+        }
+        for (int j = 0; j < N_BLOCKS_IN_DISK; ++j) {
+            held += (snapshot->block_held_flag[j >> 3] >> (j & 0x7)) & 1;
+        }
+        time_t created = snapshot->created;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+        printf("%s %s inode_blocks=%d held_blocks=%d\n", snapshot->name, when, inode_blocks, held);
+    }
+}
+
+/**
+ *  Makes every following inode read come from a snapshot instead of the live file system. Writes are refused from then on
+ *
+ *  @param char *name Name of the snapshot
+ *  @return 0 on success, -1 if there is no such snapshot
+ */
+int oufs_snapshot_select(char *name) {
+    BLOCK master;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    if (master.master.snapshot_table_block != 0) {
+        BLOCK table;
+        vdisk_read_block(master.master.snapshot_table_block, &table);
+        for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+            SNAPSHOT *snapshot = &table.snapshots.snapshot[i];
+            if (snapshot->name[0] != 0 && !strcmp(snapshot->name, name)) {
+                memcpy(snapshot_inode_block, snapshot->inode_block, sizeof(snapshot_inode_block));
+                snapshot_selected = 1;
+                return 0;
+            }
+        }
+    }
+    fprintf(stderr, "ERROR: snapshot %s does not exist\n", name);
+    return -1;
+}
@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "oufs.h"
+#include "oufs_stats.h"
+
+/*
+ * Per-operation I/O and latency statistics.
+ *
+ * Turned on by the ZSTATS environment variable.  Every vdisk block read
+ * and write is counted by the class of the block (master, inode,
+ * directory, data), and every top-level oufs operation is timed.  Each
+ * counter keeps a histogram of its latencies.  The summary is written
+ * when the program exits.
+ *
+ * vdisk does not know what a block holds, so this module keeps a class
+ * for every block: it is loaded from the inode table when the disk is
+ * opened, and the oufs library updates it when it allocates blocks.
+ *
+ * The ZTRACE environment variable turns on the block trace: one binary
+ * record for every block access, both as requested from vdisk and as
+ * sent to the file, tagged with the operation in progress.  zblktrace
+ * analyzes it.
+ */
+
+// Trace records are collected here and written in large pieces
+#define TRACE_BUFFER_RECORDS 4096
+
+// One counter with its latency histogram
+typedef struct stat_s
+{
+    unsigned long count;
+    double total_us;
+    double max_us;
+    unsigned long bucket[STATS_BUCKETS];
+} STAT;
+
+static const char *class_name[N_BLOCK_CLASSES] = {"master", "inode", "directory", "data"};
+
+static const char *operation_name[N_OPERATION_STATS] = {
+    "oufs_mkdir(mkdir)", "oufs_mkdir(rmdir)", "oufs_mkdir(touch)", "oufs_mkdir(remove)",
+    "oufs_fopen", "oufs_fwrite", "oufs_link", "oufs_rmfile", "oufs_rmdir", "journal_commit",
+    "oufs_copy"
+};
+
+//Has the environment been checked?
+static int initialized = 0;
+//Are statistics being collected?
+static int enabled = 0;
+//Where the summary goes: NULL for stderr
+static char *output_name = NULL;
+
+//Block reads [0] and writes [1] by block class
+static STAT io_stat[2][N_BLOCK_CLASSES];
+static STAT operation_stat[N_OPERATION_STATS];
+
+//Class of every block
+static unsigned char block_class[N_BLOCKS_IN_DISK];
+
+//Operation in progress
+static int current_operation = ST_NONE;
+
+//Trace file (-1 when the trace is off) and the records not written yet
+static int trace_fd = -1;
+static TRACE_RECORD trace_buffer[TRACE_BUFFER_RECORDS];
+static int trace_buffered = 0;
+
+/**
+ *  Current time in microseconds
+ *
+ *  @return Monotonic time in microseconds
+ */
+double oufs_stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ *  Adds one latency to a counter
+ *
+ *  @param STAT *stat The counter
+ *  @param double start Time the event started (from oufs_stats_start())
+ */
+static void oufs_stats_add(STAT *stat, double start) {
+    double us = oufs_stats_now() - start;
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && us >= (double) (1UL << bucket)) {
+        ++bucket;
+    }
+    ++stat->count;
+    stat->total_us += us;
+    if (us > stat->max_us) {
+        stat->max_us = us;
+    }
+    ++stat->bucket[bucket];
+}
+
+/**
+ *  Upper bound of the bucket that holds a percentile of a counter's latencies
+ *
+ *  @param STAT *stat The counter
+ *  @param int percent Percentile (1-100)
+ *  @return Latency bound in microseconds
+ */
+static unsigned long oufs_stats_percentile(STAT *stat, int percent) {
+    unsigned long wanted = (stat->count * percent + 99) / 100;
+    unsigned long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; ++b) {
+        seen += stat->bucket[b];
+        if (seen >= wanted) {
+            return 1UL << b;
+        }
+    }
+    return 1UL << (STATS_BUCKETS - 1);
+}
+
+/**
+ *  Prints one counter of the summary
+ *
+ *  @param FILE *out Where to print
+ *  @param char *kind Kind of event
+ *  @param char *name Name of the event
+ *  @param STAT *stat The counter
+ */
+static void oufs_stats_print(FILE *out, const char *kind, const char *name, STAT *stat) {
+    if (stat->count == 0) {
+        return;
+    }
+    fprintf(out, "%-6s %-20s %8lu %12.1f %10.2f %8lu %8lu %10.1f  ", kind, name, stat->count, stat->total_us,
+            stat->total_us / stat->count, oufs_stats_percentile(stat, 50), oufs_stats_percentile(stat, 99),
+            stat->max_us);
+    for (int b = 0; b < STATS_BUCKETS; ++b) {
+        if (stat->bucket[b] != 0) {
+            fprintf(out, " <%lu:%lu", 1UL << b, stat->bucket[b]);
+        }
+    }
+    fprintf(out, "\n");
+}
+
+/**
+ *  Writes the buffered trace records to the trace file
+ */
+static void oufs_trace_flush() {
+    if (trace_fd < 0 || trace_buffered == 0) {
+        return;
+    }
+    ssize_t len = trace_buffered * sizeof(TRACE_RECORD);
+    if (write(trace_fd, trace_buffer, len) != len) {
+        fprintf(stderr, "ERROR: cannot write the block trace\n");
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    trace_buffered = 0;
+}
+
+/**
+ *  Writes the summary
+ */
+static void oufs_stats_report() {
+    FILE *out = stderr;
+    if (output_name != NULL) {
+        out = fopen(output_name, "a");
+        if (out == NULL) {
+            fprintf(stderr, "ERROR: cannot open statistics file %s\n", output_name);
+            return;
+        }
+    }
+
+    fprintf(out, "# zstats pid %d (latencies in microseconds; histogram buckets <bound:count)\n", (int) getpid());
+    fprintf(out, "%-6s %-20s %8s %12s %10s %8s %8s %10s   %s\n", "#kind", "name", "count", "total", "mean", "p50<",
+            "p99<", "max", "histogram");
+    for (int c = 0; c < N_BLOCK_CLASSES; ++c) {
+        oufs_stats_print(out, "read", class_name[c], &io_stat[0][c]);
+    }
+    for (int c = 0; c < N_BLOCK_CLASSES; ++c) {
+        oufs_stats_print(out, "write", class_name[c], &io_stat[1][c]);
+    }
+    for (int i = 0; i < N_OPERATION_STATS; ++i) {
+        oufs_stats_print(out, "op", operation_name[i], &operation_stat[i]);
+    }
+
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+/**
+ *  Finishes the statistics and the trace; registered with atexit()
+ */
+static void oufs_stats_exit() {
+    if (enabled) {
+        oufs_stats_report();
+    }
+    oufs_trace_flush();
+}
+
+/**
+ *  Sets up the statistics when a disk is opened (or formatted). The first call checks ZSTATS and ZTRACE; when statistics are on, every call loads the class of each block from the inode table
+ *
+ *  @param int existing_disk 0 if the disk holds no file system yet (nothing to load)
+ */
+void oufs_stats_init(int existing_disk) {
+    if (!initialized) {
+        initialized = 1;
+        char *str = getenv(STATS_ENVIRONMENT);
+        if (str != NULL) {
+            enabled = 1;
+            if (str[0] != 0 && strcmp(str, "-")) {
+                output_name = str;
+            }
+        }
+        str = getenv(TRACE_ENVIRONMENT);
+        if (str != NULL && str[0] != 0) {
+            trace_fd = open(str, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            if (trace_fd < 0) {
+                fprintf(stderr, "ERROR: cannot open trace file %s\n", str);
+            } else {
+                TRACE_HEADER header;
+                memset(&header, 0, sizeof(header));
+                header.magic = TRACE_MAGIC;
+                header.version = TRACE_VERSION;
+                header.block_size = BLOCK_SIZE;
+                header.n_blocks = N_BLOCKS_IN_DISK;
+                header.pid = getpid();
+                if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+                    close(trace_fd);
+                    trace_fd = -1;
+                }
+            }
+        }
+        if (enabled || trace_fd >= 0) {
+            atexit(oufs_stats_exit);
+        }
+    }
+    if (!enabled) {
+        return;
+    }
+
+    //Fixed layout
+    memset(block_class, BC_DATA, sizeof(block_class));
+    block_class[MASTER_BLOCK_REFERENCE] = BC_MASTER;
+    for (int i = 1; i <= N_INODE_BLOCKS; ++i) {
+        block_class[i] = BC_INODE;
+    }
+    if (!existing_disk) {
+        return;
+    }
+
+    //Directory blocks, from the inode table
+    BLOCK blocks[N_INODE_BLOCKS + 1];
+    if (vdisk_read_blocks(0, N_INODE_BLOCKS + 1, blocks) != 0) {
+        return;
+    }
+    MASTER_BLOCK *master = &blocks[MASTER_BLOCK_REFERENCE].master;
+    for (int i = 0; i < N_INODES; ++i) {
+        INODE *inode = &blocks[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK];
+        if (!(master->inode_allocated_flag[i >> 3] & (1 << (i & 0x7))) || inode->type != IT_DIRECTORY) {
+            continue;
+        }
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            if (inode->data[k] < N_BLOCKS_IN_DISK) {
+                block_class[inode->data[k]] = BC_DIRECTORY;
+            }
+        }
+    }
+
+    //Snapshot, dedup, owner and usage tables count as master blocks, snapshot copies of the inode table as inode blocks
+    if (master->refcount_block != 0 && master->refcount_block < N_BLOCKS_IN_DISK) {
+        block_class[master->refcount_block] = BC_MASTER;
+    }
+    if (master->dedup_block != 0 && master->dedup_block < N_BLOCKS_IN_DISK) {
+        block_class[master->dedup_block] = BC_MASTER;
+    }
+    for (int m = 0; m < OWNER_MAP_BLOCKS; ++m) {
+        if (master->owner_map_block[m] != 0 && master->owner_map_block[m] < N_BLOCKS_IN_DISK) {
+            block_class[master->owner_map_block[m]] = BC_MASTER;
+        }
+    }
+    for (int m = 0; m < USAGE_BLOCKS; ++m) {
+        if (master->usage_block[m] != 0 && master->usage_block[m] < N_BLOCKS_IN_DISK) {
+            block_class[master->usage_block[m]] = BC_MASTER;
+        }
+    }
+    if (master->snapshot_table_block != 0 && master->snapshot_table_block < N_BLOCKS_IN_DISK) {
+        BLOCK_REFERENCE table_block = master->snapshot_table_block;
+        block_class[table_block] = BC_MASTER;
+        if (vdisk_read_blocks(table_block, 1, blocks) != 0) {
+            return;
+        }
+        for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+            SNAPSHOT *snapshot = &blocks[0].snapshots.snapshot[i];
+            if (snapshot->name[0] == 0) {
+                continue;
+            }
+            for (int j = 0; j < N_INODE_BLOCKS; ++j) {
+                if (snapshot->inode_block[j] < N_BLOCKS_IN_DISK) {
+                    block_class[snapshot->inode_block[j]] = BC_INODE;
+                }
+            }
+        }
+    }
+}
+
+/**
+ *  Starts timing an event
+ *
+ *  @return Start time to pass to oufs_stats_io(); 0 when statistics are off
+ */
+double oufs_stats_start() {
+    if (!enabled) {
+        return 0;
+    }
+    return oufs_stats_now();
+}
+
+/**
+ *  Records a block read or write
+ *
+ *  @param int write 1 for a write, 0 for a read
+ *  @param BLOCK_REFERENCE block_ref The block
+ *  @param double start Time the I/O started (from oufs_stats_start())
+ */
+void oufs_stats_io(int write, BLOCK_REFERENCE block_ref, double start) {
+    oufs_trace(write ? TRACE_WRITE : TRACE_READ, block_ref, BLOCK_SIZE);
+    if (!enabled || block_ref >= N_BLOCKS_IN_DISK) {
+        return;
+    }
+    oufs_stats_add(&io_stat[write != 0][block_class[block_ref]], start);
+}
+
+/**
+ *  Starts a top-level operation: it is timed, and the I/O that it does is attributed to it in the trace
+ *
+ *  @param STATS_SCOPE *scope State of the operation, passed to oufs_stats_leave()
+ *  @param int operation One of the ST_ operations
+ */
+void oufs_stats_enter(STATS_SCOPE *scope, int operation) {
+    scope->operation = operation;
+    scope->outer = current_operation;
+    scope->start = oufs_stats_start();
+    current_operation = operation;
+}
+
+/**
+ *  Ends the operation started by oufs_stats_enter() and records it
+ *
+ *  @param STATS_SCOPE *scope State of the operation
+ */
+void oufs_stats_leave(STATS_SCOPE *scope) {
+    current_operation = scope->outer;
+    if (!enabled || scope->operation < 0 || scope->operation >= N_OPERATION_STATS) {
+        return;
+    }
+    oufs_stats_add(&operation_stat[scope->operation], scope->start);
+}
+
+/**
+ *  Name of an operation
+ *
+ *  @param int operation One of the ST_ operations
+ *  @return The name ("none" for ST_NONE or an unknown operation)
+ */
+const char *oufs_stats_operation_name(int operation) {
+    if (operation < 0 || operation >= N_OPERATION_STATS) {
+        return "none";
+    }
+    return operation_name[operation];
+}
+
+/**
+ *  Appends a record to the block trace
+ *
+ *  @param int kind One of the TRACE_ kinds
+ *  @param BLOCK_REFERENCE block_ref The block (a file block for device records)
+ *  @param unsigned int bytes Number of bytes transferred
+ */
+void oufs_trace(int kind, BLOCK_REFERENCE block_ref, unsigned int bytes) {
+    if (trace_fd < 0) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    TRACE_RECORD *record = &trace_buffer[trace_buffered++];
+    record->time_ns = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->block = block_ref;
+    record->kind = kind;
+    record->operation = current_operation;
+    record->bytes = bytes;
+    if (trace_buffered == TRACE_BUFFER_RECORDS) {
+        oufs_trace_flush();
+    }
+}
+
+/**
+ *  Records what a block holds from now on
+ *
+ *  @param BLOCK_REFERENCE block_ref The block
+ *  @param int new_class One of the BC_ classes
+ */
+void oufs_stats_set_block_class(BLOCK_REFERENCE block_ref, int new_class) {
+    if (enabled && block_ref < N_BLOCKS_IN_DISK) {
+        block_class[block_ref] = new_class;
+    }
+}
+
+/**
+ *  Looks up what a block holds
+ *
+ *  @param BLOCK_REFERENCE block_ref The block
+ *  @return One of the BC_ classes
+ */
+int oufs_stats_get_block_class(BLOCK_REFERENCE block_ref) {
+    if (block_ref >= N_BLOCKS_IN_DISK) {
+        return BC_DATA;
+    }
+    return block_class[block_ref];
+}
+
+/**
+ *  Starts timing one operation of a benchmark
+ *
+ *  @param OP_TIMER *timer Set to the time and the I/O counters now
+ */
+void oufs_timer_start(OP_TIMER *timer) {
+    vdisk_get_stats(&timer->io_before);
+    timer->start = oufs_stats_now();
+}
+
+/**
+ *  Stops timing the operation started by oufs_timer_start(), and adds the I/O it did to a total
+ *
+ *  @param OP_TIMER *timer The timer
+ *  @param VDISK_STATS *io_total Total that the block and device I/O of the operation is added to
+ *  @return Latency of the operation in microseconds
+ */
+double oufs_timer_stop(OP_TIMER *timer, VDISK_STATS *io_total) {
+    double us = oufs_stats_now() - timer->start;
+    VDISK_STATS io_after;
+    vdisk_get_stats(&io_after);
+    io_total->block_reads += io_after.block_reads - timer->io_before.block_reads;
+    io_total->block_writes += io_after.block_writes - timer->io_before.block_writes;
+    io_total->device_reads += io_after.device_reads - timer->io_before.device_reads;
+    io_total->device_writes += io_after.device_writes - timer->io_before.device_writes;
+    io_total->device_syncs += io_after.device_syncs - timer->io_before.device_syncs;
+    return us;
+}
+
+/**
+ *  Orders latency samples (doubles) for qsort
+ */
+int oufs_compare_samples(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,122 @@
+// Only evaluate these definitions once, even if included multiple times
+#ifndef OUFS_STATS_H
+#define OUFS_STATS_H
+
+#include "vdisk.h"
+
+// Environment variable that turns the statistics on.  Its value is the file
+//  that the summary is appended to at exit; empty or "-" means stderr
+#define STATS_ENVIRONMENT "ZSTATS"
+
+// Block classes
+#define BC_MASTER 0
+#define BC_INODE 1
+#define BC_DIRECTORY 2
+#define BC_DATA 3
+#define N_BLOCK_CLASSES 4
+
+// Timed operations.  The oufs_mkdir() operation codes (0 ... 3) map onto
+//  ST_MKDIR + operation
+#define ST_MKDIR 0
+#define ST_MKDIR_RMDIR 1
+#define ST_MKDIR_TOUCH 2
+#define ST_MKDIR_REMOVE 3
+#define ST_FOPEN 4
+#define ST_FWRITE 5
+#define ST_LINK 6
+#define ST_RMFILE 7
+#define ST_RMDIR 8
+#define ST_JOURNAL_COMMIT 9
+#define ST_COPY 10
+#define N_OPERATION_STATS 11
+// No operation in progress
+#define ST_NONE 255
+
+// An operation in progress: oufs_stats_enter() ... oufs_stats_leave()
+typedef struct stats_scope_s
+{
+  int operation;
+  // Operation that was in progress before this one
+  int outer;
+  double start;
+} STATS_SCOPE;
+
+// Histogram buckets: bucket b counts latencies below 2^b microseconds
+//  (the last bucket also counts everything slower)
+#define STATS_BUCKETS 24
+
+/**********************************************************************/
+// Block trace
+
+// Environment variable that turns the block trace on.  Its value is the file
+//  that the trace is appended to: a TRACE_HEADER for every program run,
+//  followed by its TRACE_RECORDs
+#define TRACE_ENVIRONMENT "ZTRACE"
+
+#define TRACE_MAGIC 0x5a545243
+#define TRACE_VERSION 1
+
+// Record kinds
+// Block read through vdisk_read_block() or vdisk_read_blocks()
+#define TRACE_READ 0
+// Block written through vdisk_write_block()
+#define TRACE_WRITE 1
+// Blocks read from / written to the file (the block is a file block: the
+//  journal region starts at N_BLOCKS_IN_DISK)
+#define TRACE_DEVICE_READ 2
+#define TRACE_DEVICE_WRITE 3
+// fsync() of the file
+#define TRACE_SYNC 4
+// Blocks whose space was given back (hole punched)
+#define TRACE_DISCARD 5
+#define N_TRACE_KINDS 6
+
+typedef struct trace_header_s
+{
+  unsigned int magic;
+  unsigned short version;
+  unsigned short block_size;
+  unsigned int n_blocks;
+  unsigned int pid;
+} TRACE_HEADER;
+
+typedef struct trace_record_s
+{
+  // CLOCK_MONOTONIC time
+  unsigned long long time_ns;
+  unsigned short block;
+  // TRACE_ kind
+  unsigned char kind;
+  // ST_ operation in progress (ST_NONE if none)
+  unsigned char operation;
+  unsigned int bytes;
+} TRACE_RECORD;
+
+_Static_assert(sizeof(TRACE_RECORD) == 16, "TRACE_RECORD must stay 16 bytes");
+
+/**********************************************************************/
+// Timing for the benchmark tools (zbench, zworkload)
+
+// One timed operation: oufs_timer_start() ... oufs_timer_stop()
+typedef struct op_timer_s
+{
+  VDISK_STATS io_before;
+  double start;
+} OP_TIMER;
+
+void oufs_stats_init(int existing_disk);
+double oufs_stats_start();
+void oufs_stats_io(int write, BLOCK_REFERENCE block_ref, double start);
+void oufs_stats_enter(STATS_SCOPE *scope, int operation);
+void oufs_stats_leave(STATS_SCOPE *scope);
+const char *oufs_stats_operation_name(int operation);
+void oufs_trace(int kind, BLOCK_REFERENCE block_ref, unsigned int bytes);
+void oufs_stats_set_block_class(BLOCK_REFERENCE block_ref, int new_class);
+int oufs_stats_get_block_class(BLOCK_REFERENCE block_ref);
+
+double oufs_stats_now();
+void oufs_timer_start(OP_TIMER *timer);
+double oufs_timer_stop(OP_TIMER *timer, VDISK_STATS *io_total);
+int oufs_compare_samples(const void *a, const void *b);
+
+#endif
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Writes that cross a block boundary add exactly the bytes written, also
+#  when an earlier crossing in the same run wrote a longer line
+. "$(dirname "$0")/lib.sh"
+
+"$Z"/zformat > /dev/null || fail "zformat"
+{
+    printf '%0200d\n' 0
+    printf '%0100d\n' 1
+    for i in $(seq 30); do
+        echo "line $i"
+    done
+} > expected
+"$Z"/zcreate f < expected
+for i in $(seq 40); do
+    echo "appended $i"
+done | tee -a expected | while read line; do
+    echo "$line" | "$Z"/zappend f
+done
+"$Z"/zmore f | cmp -s - expected || fail "zmore f differs from what was written"
+fsck_clean
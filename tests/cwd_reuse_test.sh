@@ -0,0 +1,12 @@
+#!/bin/sh
+# zcreate looks its file up twice with the same cwd: a nested cwd must
+#  lead to the same directory both times
+. "$(dirname "$0")/lib.sh"
+
+"$Z"/zformat > /dev/null || fail "zformat"
+"$Z"/zmkdir a && "$Z"/zmkdir a/b || fail "zmkdir"
+echo hello | ZPWD=/a/b "$Z"/zcreate f
+"$Z"/zfilez a/b | grep -q "^f$" || fail "f is not in /a/b"
+"$Z"/zfilez a | grep -q "^f$" && fail "f is in /a"
+[ "$(ZPWD=/a/b "$Z"/zmore f)" = hello ] || fail "zmore f"
+fsck_clean
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Entries after one that was removed can still be found: they can be read
+#  and truncated, and their names are not created a second time
+. "$(dirname "$0")/lib.sh"
+
+"$Z"/zformat > /dev/null || fail "zformat"
+echo one | "$Z"/zcreate f1
+echo two | "$Z"/zcreate f2
+"$Z"/zremove f1 || fail "zremove f1"
+[ "$("$Z"/zmore f2)" = two ] || fail "zmore f2"
+echo three | "$Z"/zcreate f2
+[ "$("$Z"/zfilez | grep -c "^f2$")" = 1 ] || fail "f2 was created twice"
+[ "$("$Z"/zmore f2)" = three ] || fail "zmore f2 after truncate"
+fsck_clean
@@ -0,0 +1,20 @@
+# Sourced by the tests: runs the test in a scratch directory with its own
+#  disk, and gives it the tools of the tree in $Z.  Each test formats the
+#  disk itself, and exits nonzero (through fail) on the first check that
+#  does not hold
+Z=$(cd "$(dirname "$0")/.." && pwd)
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+unset ZPWD ZCHECKSUM ZSTATS ZTRACE ZSLOW ZSTRIPE
+export ZDISK="$T/disk"
+
+fail() {
+    echo "FAIL: $(basename "$0"): $*" >&2
+    exit 1
+}
+
+# The disk has no problems that zfsck can find
+fsck_clean() {
+    "$Z"/zfsck > fsck.out 2>&1 || { cat fsck.out >&2; fail "zfsck found problems"; }
+}
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Files are removed from a nested cwd and through absolute paths, and a
+#  directory is not removed as a file
+. "$(dirname "$0")/lib.sh"
+
+"$Z"/zformat > /dev/null || fail "zformat"
+"$Z"/zmkdir a && "$Z"/zmkdir a/d || fail "zmkdir"
+echo hello | ZPWD=/a "$Z"/zcreate f
+echo hello | ZPWD=/a "$Z"/zcreate g
+ZPWD=/a "$Z"/zremove f || fail "zremove f from /a"
+"$Z"/zremove /a/g || fail "zremove /a/g"
+ZPWD=/a "$Z"/zremove d 2> /dev/null
+[ "$("$Z"/zfilez a | grep -c "^[fgd]/*$")" = 1 ] || fail "zfilez a: $("$Z"/zfilez a | tr '\n' ' ')"
+fsck_clean
@@ -0,0 +1,15 @@
+#!/bin/sh
+# zcp into a full directory fails, and leaves the blocks of the source
+#  with the holders they had
+. "$(dirname "$0")/lib.sh"
+
+"$Z"/zformat > /dev/null || fail "zformat"
+seq 100 | "$Z"/zcreate f
+# "." and ".." and 14 files fill the root directory
+for i in $(seq 13); do
+    "$Z"/zcp f c$i || fail "zcp f c$i"
+done
+"$Z"/zcp f extra 2> /dev/null && fail "zcp into a full directory succeeded"
+"$Z"/zfilez | grep -q "^extra$" && fail "extra was created"
+[ "$(seq 100)" = "$("$Z"/zmore f)" ] || fail "zmore f"
+fsck_clean
@@ -0,0 +1,11 @@
+#!/bin/sh
+# Truncating a file that a snapshot still holds leaves the reverse map
+#  consistent: the blocks the snapshot keeps lose their owner
+. "$(dirname "$0")/lib.sh"
+
+"$Z"/zformat -owners > /dev/null || fail "zformat"
+echo hello | "$Z"/zcreate f
+"$Z"/zsnap -create s1 || fail "zsnap"
+echo bye | "$Z"/zcreate f
+[ "$("$Z"/zmore f)" = bye ] || fail "zmore f after truncate"
+fsck_clean
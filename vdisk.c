@@ -1,45 +1,716 @@
+#include <stddef.h>
+#include <string.h>
 #include "vdisk.h"
+#include "oufs_stats.h"
 /*
  * Virtual disk implementation.
  *
- * The disk is implemented on top of a file.  Access provided by this
- * library is on a block-by-block basis
+ * The disk is implemented on top of a storage backend: a file, or memory
+ * (see vdisk_backend.c).  Access provided by this library is on a
+ * block-by-block basis
+ *
+ * Block writes are not applied to the file directly.  They are collected
+ * into transactions (vdisk_journal_begin() / vdisk_journal_end()), and
+ * many transactions are committed together as one group: the group is
+ * first written to a journal region that lives past the last block of the
+ * disk, made durable with a single fsync(), and only then copied to the
+ * home locations of the blocks, one write per run of consecutive blocks.  When the disk is closed,
+ * the home locations are synced and the newest group is recorded in the
+ * checksum table as checkpointed.  vdisk_disk_open() replays only the
+ * groups past the checkpoint: those that might not have reached their home
+ * locations.
+ *
+ * A freed block is discarded rather than overwritten with zeroes
+ * (vdisk_discard_block()).  The discard is part of the transaction like a
+ * write, is recorded in the journal without any data, and gives the
+ * space of the block back to the backend at checkpoint time; consecutive
+ * discarded blocks are given back with a single call.
+ *
+ * Blocks that are known to read as zeroes (never written since the disk
+ * was erased, discarded, or in a hole of the backend when the disk was
+ * opened) are tracked in a bitmap, and reads of them are answered
+ * without any device I/O.
+ *
+ * Every disk block has a CRC32C in a checksum table.  The checksums are
+ * computed for a whole group at checkpoint time and the table is written
+ * after the home locations; every block that is read from the device is
+ * checked against it (see CHECKSUM_ENVIRONMENT for what happens when it
+ * does not match).  Journal replay brings the checksums of the blocks it
+ * replays up to date, and a table that is missing or torn is rebuilt
+ * from the blocks when the disk is opened.
+ *
+ * Layout of the backend:
+ *   Blocks 0 ... N_BLOCKS_IN_DISK-1: the disk itself
+ *   Two journal slots, each JOURNAL_SLOT_BLOCKS long; consecutive groups
+ *   alternate between the slots
+ *   The checksum table, CHECKSUM_TABLE_BLOCKS long
  */
 
 // Debug flag
 #define debug 0
 
-// File descriptor for virtual disk.  Private to this file
+// Identifies a valid journal header
+#define JOURNAL_MAGIC 0x4a4e4c31
+
+// Marks a discarded block in the journal header; it has no contents in
+//  the journal
+#define JOURNAL_DISCARD 0x8000
+_Static_assert(N_BLOCKS_IN_DISK <= JOURNAL_DISCARD, "block references must leave JOURNAL_DISCARD free");
+
+// Values of txn_dirty[] and group_dirty[]
+#define BLOCK_WRITTEN 1
+#define BLOCK_DISCARDED 2
+
+// Journal header: which blocks the group holds, followed on disk by the
+//  contents of those blocks (in the same order, discarded blocks left out)
+typedef struct journal_header_s
+{
+  unsigned int magic;
+  // Group sequence number; slot = sequence % 2
+  unsigned int sequence;
+  // Number of blocks in the group, discarded blocks included
+  unsigned int n_blocks;
+  // Checksum over the header (with this field 0) and the block contents
+  unsigned int checksum;
+  BLOCK_REFERENCE block_ref[N_BLOCKS_IN_DISK];
+} JOURNAL_HEADER;
+
+// Number of disk blocks occupied by a journal header
+#define JOURNAL_HEADER_BLOCKS ((sizeof(JOURNAL_HEADER) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// A group never holds more than one copy of a block
+#define JOURNAL_SLOT_BLOCKS (JOURNAL_HEADER_BLOCKS + N_BLOCKS_IN_DISK)
+
+// First backend block of the given journal slot
+#define JOURNAL_SLOT_START(slot) (N_BLOCKS_IN_DISK + (slot) * JOURNAL_SLOT_BLOCKS)
+
+// Identifies a valid checksum table
+#define CHECKSUM_MAGIC 0x43524332
+
+// Checksum table: the CRC32C of the home location of every disk block
+typedef struct checksum_table_s
+{
+  unsigned int magic;
+  // CRC32C of the rest of the table, to detect a torn table
+  unsigned int checksum;
+  // Sequence number of the newest journal group whose home locations are
+  //  known to be durable; groups up to it are never replayed
+  unsigned int checkpointed;
+  unsigned int crc[N_BLOCKS_IN_DISK];
+} CHECKSUM_TABLE;
+
+// Bytes of the checksum table that its checksum covers
+#define CHECKSUM_COVERED (sizeof(CHECKSUM_TABLE) - offsetof(CHECKSUM_TABLE, checkpointed))
+
+// Number of disk blocks occupied by the checksum table
+#define CHECKSUM_TABLE_BLOCKS ((sizeof(CHECKSUM_TABLE) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// First backend block of the checksum table
+#define CHECKSUM_TABLE_START JOURNAL_SLOT_START(2)
+
+// Blocks in the whole layout
+#define LAYOUT_BLOCKS (CHECKSUM_TABLE_START + CHECKSUM_TABLE_BLOCKS)
+
+// Values of checksum_policy (see CHECKSUM_ENVIRONMENT)
+#define CHECKSUM_ERROR 0
+#define CHECKSUM_LOG 1
+#define CHECKSUM_REPAIR 2
+
+// The open backend (NULL if no disk is open).  Private to this file
 // Yes, global variables are generally a bad idea...
+static VDISK_BACKEND vdisk_instance;
+static VDISK_BACKEND *vdisk = NULL;
+
+// Blocks written (BLOCK_WRITTEN) or discarded (BLOCK_DISCARDED, the data
+//  is zeroes) by the currently open transaction
+static unsigned char txn_data[N_BLOCKS_IN_DISK][BLOCK_SIZE];
+static char txn_dirty[N_BLOCKS_IN_DISK];
+// Nesting depth of vdisk_journal_begin()
+static int txn_depth = 0;
+
+// Savepoints: for every nesting level above the first, the state of each
+//  block before the level first changed it, so that vdisk_journal_abort()
+//  can undo that level alone.  Levels from TXN_SAVEPOINTS - 1 on share the
+//  last savepoint
+#define TXN_SAVEPOINTS 8
+static unsigned char save_data[TXN_SAVEPOINTS][N_BLOCKS_IN_DISK][BLOCK_SIZE];
+static char save_dirty[TXN_SAVEPOINTS][N_BLOCKS_IN_DISK];
+static char saved[TXN_SAVEPOINTS][N_BLOCKS_IN_DISK];
+
+static void vdisk_journal_abort_all();
+
+// Blocks written by the closed transactions of the current group
+static unsigned char group_data[N_BLOCKS_IN_DISK][BLOCK_SIZE];
+static char group_dirty[N_BLOCKS_IN_DISK];
+// Number of closed transactions in the current group
+static int group_transactions = 0;
+
+// Sequence number of the next group commit
+static unsigned int journal_sequence = 1;
+
+// Disk blocks whose home location is known to read as zeroes
+static char known_zero[N_BLOCKS_IN_DISK];
+
+// Checksums of the home locations, and whether they changed since the
+//  table was last written
+static CHECKSUM_TABLE checksums;
+static int checksums_dirty = 0;
+
+// CRC32C of a block of zeroes
+static unsigned int zero_crc;
+
+// What to do with a block that does not match its checksum
+static int checksum_policy = CHECKSUM_ERROR;
+
+// Disk that CHECKSUM_REPAIR takes copies of blocks from (NULL for none),
+//  its backend once it is open, and where the blocks of the disk start in it
+static char *mirror_name = NULL;
+static VDISK_BACKEND mirror_instance;
+static VDISK_BACKEND *mirror = NULL;
+static int mirror_start = 0;
+
+// I/O counters
+static VDISK_STATS stats;
+
+// Has vdisk_atexit() been registered?
+static int atexit_registered = 0;
+
+/**
+ * Checksum used to detect torn or stale journal groups (FNV-1a)
+ *
+ * @param hash Running checksum (start with 2166136261)
+ * @param buf Bytes to fold into the checksum
+ * @param len Number of bytes
+ * @return The updated checksum
+ */
+static unsigned int vdisk_checksum(unsigned int hash, void *buf, int len)
+{
+  unsigned char *p = buf;
+  for(int i = 0; i < len; ++i) {
+    hash ^= p[i];
+    hash *= 16777619;
+  }
+  return(hash);
+}
+
+/**
+ * Read consecutive blocks of the backend, including the journal region
+ *
+ * @param start First backend block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_device_read(int start, int count, void *buf)
+{
+  int ret = vdisk->read(vdisk, start, count, buf);
+  if(ret != 0) {
+    return(ret);
+  }
+  stats.device_reads += count;
+  oufs_trace(TRACE_DEVICE_READ, start, count * BLOCK_SIZE);
+  return(0);
+}
+
+/**
+ * Write consecutive blocks of the backend, including the journal region
+ *
+ * @param start First backend block
+ * @param count Number of blocks
+ * @param buf Source (count * BLOCK_SIZE bytes)
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_device_write(int start, int count, void *buf)
+{
+  int ret = vdisk->write(vdisk, start, count, buf);
+  if(ret != 0) {
+    return(ret);
+  }
+  stats.device_writes += count;
+  oufs_trace(TRACE_DEVICE_WRITE, start, count * BLOCK_SIZE);
+  return(0);
+}
+
+/**
+ * Give back the space of consecutive blocks of the backend
+ *
+ * @param start First backend block
+ * @param count Number of blocks
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_device_discard(int start, int count)
+{
+  int ret = vdisk->discard(vdisk, start, count);
+  if(ret != 0) {
+    return(ret);
+  }
+  stats.device_discards += count;
+  oufs_trace(TRACE_DISCARD, start, count * BLOCK_SIZE);
+  return(0);
+}
+
+/**
+ * Number of blocks with contents in a journal group
+ *
+ * @param header Header of the group
+ * @return Blocks that are not discarded
+ */
+static unsigned int vdisk_journal_data_blocks(JOURNAL_HEADER *header)
+{
+  unsigned int n = 0;
+  for(unsigned int i = 0; i < header->n_blocks; ++i) {
+    n += !(header->block_ref[i] & JOURNAL_DISCARD);
+  }
+  return(n);
+}
+
+/**
+ * Load one journal slot and check that it holds a complete group
+ *
+ * @param slot Journal slot (0 or 1)
+ * @param header Filled in with the slot's header
+ * @param data Filled in with the slot's block contents
+ * @return 1 if the slot holds a valid group; 0 otherwise
+ */
+static int vdisk_journal_load_slot(int slot, JOURNAL_HEADER *header,
+                                   unsigned char data[][BLOCK_SIZE])
+{
+  unsigned char raw[JOURNAL_HEADER_BLOCKS * BLOCK_SIZE];
+
+  if(vdisk_device_read(JOURNAL_SLOT_START(slot), JOURNAL_HEADER_BLOCKS, raw) != 0) {
+    // Journal region was never written
+    return(0);
+  }
+  memcpy(header, raw, sizeof(JOURNAL_HEADER));
+  if(header->magic != JOURNAL_MAGIC || header->n_blocks > N_BLOCKS_IN_DISK) {
+    return(0);
+  }
+  unsigned int n_data = vdisk_journal_data_blocks(header);
+  if(n_data > 0 &&
+     vdisk_device_read(JOURNAL_SLOT_START(slot) + JOURNAL_HEADER_BLOCKS,
+                     n_data, data) != 0) {
+    return(0);
+  }
+
+  // A torn write leaves a checksum mismatch
+  unsigned int stored = header->checksum;
+  header->checksum = 0;
+  unsigned int hash = vdisk_checksum(2166136261u, header, sizeof(JOURNAL_HEADER));
+  hash = vdisk_checksum(hash, data, n_data * BLOCK_SIZE);
+  header->checksum = stored;
+  return(hash == stored);
+}
+
+/**
+ * Record the checksum of the home location of a block
+ *
+ * @param block_ref The block
+ * @param crc Its new CRC32C
+ */
+static void vdisk_checksum_set(BLOCK_REFERENCE block_ref, unsigned int crc)
+{
+  if(checksums.crc[block_ref] != crc) {
+    checksums.crc[block_ref] = crc;
+    checksums_dirty = 1;
+  }
+}
+
+/**
+ * Load the checksum table
+ *
+ * @return 1 if the backend holds a valid table; 0 otherwise
+ */
+static int vdisk_checksums_load()
+{
+  unsigned char raw[CHECKSUM_TABLE_BLOCKS * BLOCK_SIZE];
+
+  if(vdisk_device_read(CHECKSUM_TABLE_START, CHECKSUM_TABLE_BLOCKS, raw) != 0) {
+    // Never written
+    return(0);
+  }
+  memcpy(&checksums, raw, sizeof(checksums));
+  return(checksums.magic == CHECKSUM_MAGIC &&
+         checksums.checksum == vdisk_crc32c(0, &checksums.checkpointed, CHECKSUM_COVERED));
+}
+
+/**
+ * Compute the checksum of every disk block from its home location, with
+ * one read of the whole disk
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_checksums_rebuild()
+{
+  static unsigned char disk[N_BLOCKS_IN_DISK][BLOCK_SIZE];
+
+  // Blocks past the end of the backend read as zeroes once it is erased
+  long n = vdisk->size(vdisk);
+  n = n < N_BLOCKS_IN_DISK ? n : N_BLOCKS_IN_DISK;
+  memset(disk, 0, sizeof(disk));
+  if(n > 0 && vdisk_device_read(0, n, disk) != 0) {
+    return(-4);
+  }
+  for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+    vdisk_checksum_set(i, known_zero[i] ? zero_crc : vdisk_crc32c(0, disk[i], BLOCK_SIZE));
+  }
+  checksums_dirty = 1;
+  return(0);
+}
+
+/**
+ * Write the checksum table, if it changed
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_checksums_write()
+{
+  unsigned char raw[CHECKSUM_TABLE_BLOCKS * BLOCK_SIZE];
+
+  if(!checksums_dirty) {
+    return(0);
+  }
+  checksums.magic = CHECKSUM_MAGIC;
+  checksums.checksum = vdisk_crc32c(0, &checksums.checkpointed, CHECKSUM_COVERED);
+  memset(raw, 0, sizeof(raw));
+  memcpy(raw, &checksums, sizeof(checksums));
+  if(vdisk_device_write(CHECKSUM_TABLE_START, CHECKSUM_TABLE_BLOCKS, raw) != 0) {
+    return(-4);
+  }
+  checksums_dirty = 0;
+  return(0);
+}
+
+/**
+ * Rewrite the home location of a block from a copy that matches its
+ * checksum: the same block of the mirror disk, or else another copy kept
+ * by the backend (which rewrites every copy), or else the newest copy of
+ * the block in the journal
+ *
+ * @param block_ref The block
+ * @param block Filled in with the repaired contents
+ * @return 0 on success; <0 if there is no such copy
+ */
+static int vdisk_checksum_repair(BLOCK_REFERENCE block_ref, void *block)
+{
+  static JOURNAL_HEADER header[2];
+  static unsigned char data[2][N_BLOCKS_IN_DISK][BLOCK_SIZE];
+  static const unsigned char zeroes[BLOCK_SIZE];
+  unsigned char other[BLOCK_SIZE];
+  int valid[2];
+
+  if(mirror == NULL && mirror_name != NULL) {
+    char *path;
+    mirror_instance = *vdisk_backend_lookup(mirror_name, &path);
+    if(mirror_instance.open(&mirror_instance, path, LAYOUT_BLOCKS) == 0) {
+      mirror = &mirror_instance;
+      // A member of a mirrored disk keeps the blocks after its header
+      mirror_start = vdisk_backend_mirror_start(mirror, LAYOUT_BLOCKS);
+    }else {
+      fprintf(stderr, "vdisk: cannot open mirror %s\n", mirror_name);
+      mirror_name = NULL;
+    }
+  }
+  if(mirror != NULL && mirror->read(mirror, mirror_start + block_ref, 1, other) == 0 &&
+     vdisk_crc32c(0, other, BLOCK_SIZE) == checksums.crc[block_ref] &&
+     vdisk_device_write(block_ref, 1, other) == 0) {
+    memcpy(block, other, BLOCK_SIZE);
+    return(0);
+  }
+
+  // The copy that was read is among them, and does not match
+  for(int copy = 0; vdisk->read_copy != NULL; ++copy) {
+    int ret = vdisk->read_copy(vdisk, copy, block_ref, 1, other);
+    if(ret > 0) {
+      break;
+    }
+    if(ret == 0 && vdisk_crc32c(0, other, BLOCK_SIZE) == checksums.crc[block_ref] &&
+       vdisk_device_write(block_ref, 1, other) == 0) {
+      memcpy(block, other, BLOCK_SIZE);
+      return(0);
+    }
+  }
+
+  for(int slot = 0; slot < 2; ++slot) {
+    valid[slot] = vdisk_journal_load_slot(slot, &header[slot], data[slot]);
+  }
+  // Newest group first
+  int order[2] = {0, 1};
+  if(valid[0] && valid[1] && header[0].sequence < header[1].sequence) {
+    order[0] = 1;
+    order[1] = 0;
+  }
+  for(int k = 0; k < 2; ++k) {
+    int slot = order[k];
+    if(!valid[slot]) {
+      continue;
+    }
+    const unsigned char *copy = NULL;
+    unsigned int d = 0;
+    for(unsigned int i = 0; i < header[slot].n_blocks; ++i) {
+      int discard = header[slot].block_ref[i] & JOURNAL_DISCARD;
+      if((header[slot].block_ref[i] & ~JOURNAL_DISCARD) == block_ref) {
+        copy = discard ? zeroes : data[slot][d];
+      }
+      d += !discard;
+    }
+    if(copy != NULL && vdisk_crc32c(0, copy, BLOCK_SIZE) == checksums.crc[block_ref] &&
+       vdisk_device_write(block_ref, 1, (void *) copy) == 0) {
+      memcpy(block, copy, BLOCK_SIZE);
+      return(0);
+    }
+  }
+  return(-6);
+}
+
+/**
+ * Check a block read from its home location against its checksum, and
+ * apply checksum_policy if it does not match
+ *
+ * @param block_ref The block
+ * @param block Its contents; repaired in place
+ * @return 0 if the contents can be used; <0 otherwise
+ */
+static int vdisk_checksum_verify(BLOCK_REFERENCE block_ref, void *block)
+{
+  if(vdisk_crc32c(0, block, BLOCK_SIZE) == checksums.crc[block_ref]) {
+    return(0);
+  }
+  ++stats.checksum_errors;
+  fprintf(stderr, "vdisk: block %d does not match its checksum\n", block_ref);
+  if(checksum_policy == CHECKSUM_LOG) {
+    return(0);
+  }
+  if(checksum_policy == CHECKSUM_REPAIR && vdisk_checksum_repair(block_ref, block) == 0) {
+    ++stats.checksum_repairs;
+    fprintf(stderr, "vdisk: block %d repaired\n", block_ref);
+    return(0);
+  }
+  return(-6);
+}
+
+/**
+ * Bring the home locations of the blocks up to date with the journal.
+ * Only groups newer than the checkpoint are replayed, the older slot
+ * first; its blocks that the newer group holds as well are left to the
+ * newer group.  Blocks that already hold the journaled contents are not
+ * rewritten, so an image that is up to date is only read.  Once blocks
+ * were replayed and synced, the checkpoint moves past the replayed groups.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_journal_replay()
+{
+  static JOURNAL_HEADER header[2];
+  static unsigned char data[2][N_BLOCKS_IN_DISK][BLOCK_SIZE];
+  int valid[2];
+
+  for(int slot = 0; slot < 2; ++slot) {
+    valid[slot] = vdisk_journal_load_slot(slot, &header[slot], data[slot]);
+  }
+  int newer = valid[1] && (!valid[0] || header[1].sequence > header[0].sequence);
+  int older = !newer;
+
+  // Sequence numbers are never reused, whether or not a slot survived
+  if(checksums.checkpointed >= journal_sequence) {
+    journal_sequence = checksums.checkpointed + 1;
+  }
+  for(int slot = 0; slot < 2; ++slot) {
+    if(valid[slot] && header[slot].sequence >= journal_sequence) {
+      journal_sequence = header[slot].sequence + 1;
+    }
+  }
+
+  // Blocks of the older group that the newer group supersedes
+  char superseded[N_BLOCKS_IN_DISK];
+  memset(superseded, 0, sizeof(superseded));
+  if(valid[newer]) {
+    for(unsigned int i = 0; i < header[newer].n_blocks; ++i) {
+      BLOCK_REFERENCE ref = header[newer].block_ref[i] & ~JOURNAL_DISCARD;
+      if(ref < N_BLOCKS_IN_DISK) {
+        superseded[ref] = 1;
+      }
+    }
+  }
+
+  int replayed = 0;
+  unsigned int newest = checksums.checkpointed;
+  int order[2] = {older, newer};
+  for(int k = 0; k < 2; ++k) {
+    int slot = order[k];
+    if(!valid[slot] || header[slot].sequence <= checksums.checkpointed) {
+      continue;
+    }
+    newest = header[slot].sequence;
+    static const unsigned char zeroes[BLOCK_SIZE];
+    static unsigned char home[N_BLOCKS_IN_DISK][BLOCK_SIZE];
+    unsigned int d = 0;
+    // Home locations of a run of consecutive blocks are read together
+    int run_start = 0;
+    int run_end = 0;
+    int have_home = 0;
+    for(unsigned int i = 0; i < header[slot].n_blocks; ++i) {
+      BLOCK_REFERENCE ref = header[slot].block_ref[i] & ~JOURNAL_DISCARD;
+      int discard = header[slot].block_ref[i] & JOURNAL_DISCARD;
+      const unsigned char *contents = discard ? zeroes : data[slot][d++];
+      if(ref >= N_BLOCKS_IN_DISK || (slot == older && valid[newer] && superseded[ref])) {
+        continue;
+      }
+      vdisk_checksum_set(ref, discard ? zero_crc : vdisk_crc32c(0, contents, BLOCK_SIZE));
+      if(ref >= run_end) {
+        run_start = ref;
+        run_end = ref + 1;
+        for(unsigned int j = i + 1; j < header[slot].n_blocks &&
+              (header[slot].block_ref[j] & ~JOURNAL_DISCARD) == run_end && run_end < N_BLOCKS_IN_DISK; ++j) {
+          ++run_end;
+        }
+        have_home = vdisk_device_read(run_start, run_end - run_start, home) == 0;
+      }
+      if(have_home && memcmp(home[ref - run_start], contents, BLOCK_SIZE) == 0) {
+        continue;
+      }
+      if(debug)
+        fprintf(stderr, "##Replaying block %d (group %u)\n", ref, header[slot].sequence);
+      if((discard ? vdisk_device_discard(ref, 1) : vdisk_device_write(ref, 1, (void *) contents)) != 0) {
+        fprintf(stderr, "vdisk_disk_open(): journal replay failed\n");
+        return(-5);
+      }
+      replayed = 1;
+    }
+  }
+
+  if(replayed) {
+    ++stats.device_syncs;
+    oufs_trace(TRACE_SYNC, 0, 0);
+    if(vdisk->flush(vdisk) != 0) {
+      fprintf(stderr, "vdisk_disk_open(): journal replay sync failed\n");
+      return(-5);
+    }
+    // The table is written by vdisk_disk_open(); if it is lost, the groups
+    //  are replayed again, which rewrites nothing
+    checksums.checkpointed = newest;
+    checksums_dirty = 1;
+  }
+  return(0);
+}
+
+/**
+ * Checkpoint: once every committed group has reached its home locations,
+ * sync them and record the newest group in the checksum table, so that
+ * the journal is not replayed over them when the disk is opened next.
+ * Does nothing if no group was committed since the last checkpoint
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_journal_checkpoint()
+{
+  if(journal_sequence - 1 <= checksums.checkpointed) {
+    return(0);
+  }
+  ++stats.device_syncs;
+  oufs_trace(TRACE_SYNC, 0, 0);
+  if(vdisk->flush(vdisk) != 0) {
+    return(-5);
+  }
+  checksums.checkpointed = journal_sequence - 1;
+  checksums_dirty = 1;
+  if(vdisk_checksums_write() != 0) {
+    return(-4);
+  }
+  ++stats.device_syncs;
+  oufs_trace(TRACE_SYNC, 0, 0);
+  return(vdisk->flush(vdisk) == 0 ? 0 : -5);
+}
 
-int vdisk_fd = 0;
+/**
+ * Make sure that pending groups reach the disk, and that the backend is
+ * closed, when a tool exits without closing it.  A transaction that is
+ * still open is an incomplete operation, so it is dropped.
+ */
+static void vdisk_atexit()
+{
+  if(vdisk != NULL) {
+    vdisk_disk_close();
+  }
+}
 
 /**
  * Open the virtual disk
  *
- * @param virtual_disk_name Name of the file containing the virtual disk
+ * @param virtual_disk_name Name of the file containing the virtual disk,
+ *  optionally prefixed with the scheme of another backend ("ram:")
  * @return 0 on success; < 0 on error
  *
  */
 int vdisk_disk_open(char *virtual_disk_name)
 {
-  if(vdisk_fd != 0) {
+  if(vdisk != NULL) {
     fprintf(stderr, "A disk is already opened\n");
     return(-1);
   };
 
-  // Open file
-  int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
-		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
-  // Check code
-  if(fd <= 0) {
+  // Open the backend
+  char *path;
+  vdisk_instance = *vdisk_backend_lookup(virtual_disk_name, &path);
+  if(vdisk_instance.open(&vdisk_instance, path, LAYOUT_BLOCKS) != 0) {
     fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
     return(-1);
   };
 
-  // Remember the fd in the global variable
-  vdisk_fd = fd;
+  // Remember the backend in the global variable
+  vdisk = &vdisk_instance;
+
+  char *policy = getenv(CHECKSUM_ENVIRONMENT);
+  if(policy == NULL || *policy == 0 || strcmp(policy, "error") == 0) {
+    checksum_policy = CHECKSUM_ERROR;
+  }else if(strcmp(policy, "log") == 0) {
+    checksum_policy = CHECKSUM_LOG;
+  }else if(strncmp(policy, "repair", 6) == 0 && (policy[6] == 0 || policy[6] == ':')) {
+    checksum_policy = CHECKSUM_REPAIR;
+    mirror_name = policy[6] == ':' ? &policy[7] : NULL;
+  }else {
+    fprintf(stderr, "vdisk_disk_open(): bad %s (%s)\n", CHECKSUM_ENVIRONMENT, policy);
+    vdisk->close(vdisk);
+    vdisk = NULL;
+    return(-1);
+  }
+
+  // Finish any group that was interrupted before it reached the disk,
+  //  together with the checksums of its blocks
+  static const unsigned char zeroes[BLOCK_SIZE];
+  zero_crc = vdisk_crc32c(0, zeroes, BLOCK_SIZE);
+  checksums_dirty = 0;
+  int have_checksums = vdisk_checksums_load();
+  if(!have_checksums) {
+    checksums.checkpointed = 0;
+  }
+  if(vdisk_journal_replay() != 0) {
+    vdisk->close(vdisk);
+    vdisk = NULL;
+    return(-1);
+  }
+
+  // Holes of the backend read as zeroes
+  memset(known_zero, 0, sizeof(known_zero));
+  if(vdisk->zeroes(vdisk, 0, N_BLOCKS_IN_DISK, known_zero) != 0) {
+    memset(known_zero, 0, sizeof(known_zero));
+  }
+
+  // A disk without a valid table trusts the blocks as they are.  The table
+  //  needs no sync: replay brings it up to date again after a crash
+  if((!have_checksums && vdisk_checksums_rebuild() != 0) || vdisk_checksums_write() != 0) {
+    fprintf(stderr, "vdisk_disk_open(): checksum table update failed\n");
+    vdisk->close(vdisk);
+    vdisk = NULL;
+    return(-1);
+  }
+
+  // Statistics are reported after the final group commit (atexit() order)
+  oufs_stats_init(vdisk->size(vdisk) >= N_BLOCKS_IN_DISK);
+
+  if(!atexit_registered) {
+    atexit(vdisk_atexit);
+    atexit_registered = 1;
+  }
   return(0);
 };
 
@@ -51,16 +722,62 @@ int vdisk_disk_open(char *virtual_disk_name)
 int vdisk_disk_close()
 {
   // Must be initialized to clos it
-  if(vdisk_fd == 0) {
+  if(vdisk == NULL) {
     fprintf(stderr, "vdisk_disk_close(): disk not initialized\n");
     exit(-1);
   };
 
-  // Close the file
-  close(vdisk_fd);
+  // Flush the pending group, and retire the journal
+  vdisk_journal_abort_all();
+  int ret = vdisk_journal_commit();
+  if(ret == 0) {
+    ret = vdisk_journal_checkpoint();
+  }
+
+  // Close the backend
+  if(vdisk->close(vdisk) != 0 && ret == 0) {
+    ret = -4;
+  }
+  if(mirror != NULL) {
+    mirror->close(mirror);
+    mirror = NULL;
+  }
 
   // Mark as closed
-  vdisk_fd = 0;
+  vdisk = NULL;
+  return(ret);
+}
+
+/**
+ * Erase the whole disk: every block reads as zeroes afterwards.  The
+ * backend is cut to nothing and extended to the disk blocks again, so
+ * that no block is written (a file becomes sparse).  Open and pending
+ * transactions are discarded, and so is the journal
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_disk_erase()
+{
+  if(vdisk == NULL) {
+    fprintf(stderr, "vdisk_disk_erase(): disk not initialized\n");
+    exit(-1);
+  };
+
+  vdisk_journal_abort_all();
+  memset(group_dirty, 0, sizeof(group_dirty));
+  group_transactions = 0;
+
+  if(vdisk->truncate(vdisk, 0) != 0 || vdisk->truncate(vdisk, N_BLOCKS_IN_DISK) != 0) {
+    fprintf(stderr, "vdisk_disk_erase(): truncate failed\n");
+    return(-4);
+  }
+  memset(known_zero, 1, sizeof(known_zero));
+  for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+    checksums.crc[i] = zero_crc;
+  }
+  // The journal went with the rest of the backend
+  checksums.checkpointed = journal_sequence - 1;
+  checksums_dirty = 1;
   return(0);
 }
 
@@ -78,7 +795,7 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
     fprintf(stderr, "##Reading block %d\n", block_ref);
 
   // Make sure that the disk is initialized
-  if(vdisk_fd == 0) {
+  if(vdisk == NULL) {
     fprintf(stderr, "vdisk_read_block(): disk not initialized\n");
     exit(-1);
   };
@@ -89,25 +806,136 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
     return(-2);
   }
 
-  // Lsek to the correct point in the file
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_read_block(): seek failed\n");
-    return(-3);
+  ++stats.block_reads;
+  double start = oufs_stats_start();
+
+  // The newest copy of the block may not have reached the disk yet
+  if(txn_dirty[block_ref]) {
+    memcpy(block, txn_data[block_ref], BLOCK_SIZE);
+    oufs_stats_io(0, block_ref, start);
+    return(0);
+  }
+  if(group_dirty[block_ref]) {
+    memcpy(block, group_data[block_ref], BLOCK_SIZE);
+    oufs_stats_io(0, block_ref, start);
+    return(0);
+  }
+  if(known_zero[block_ref]) {
+    memset(block, 0, BLOCK_SIZE);
+    ++stats.zero_reads;
+    oufs_stats_io(0, block_ref, start);
+    return(0);
   }
 
   // Read the block
-  if(read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+  int ret = vdisk_device_read(block_ref, 1, block);
+  if(ret != 0) {
     fprintf(stderr, "vdisk_read_block(): read failed\n");
+    return(ret);
+  }
+  ret = vdisk_checksum_verify(block_ref, block);
+  if(ret != 0) {
+    fprintf(stderr, "vdisk_read_block(): block %d is corrupt\n", block_ref);
+    return(ret);
+  }
+  oufs_stats_io(0, block_ref, start);
+
+  // Success
+  return(0);
+}
+
+/**
+ *  Read consecutive disk blocks with a single I/O
+ *
+ * @param block_ref Index of the first block that is to be loaded
+ * @param count Number of blocks
+ * @param blocks Buffer of count * BLOCK_SIZE bytes that the blocks will be placed into
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_read_blocks(BLOCK_REFERENCE block_ref, int count, void *blocks)
+{
+  if(debug)
+    fprintf(stderr, "##Reading blocks %d-%d\n", block_ref, block_ref + count - 1);
+
+  // Make sure that the disk is initialized
+  if(vdisk == NULL) {
+    fprintf(stderr, "vdisk_read_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  // Make sure that we have a valid block request
+  if(count < 0 || block_ref + count > N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_read_blocks(): bad block range(%d, %d)\n", block_ref, count);
+    return(-2);
+  }
+
+  // Every block counts as a read, as in vdisk_read_block()
+  stats.block_reads += count;
+  double start = oufs_stats_start();
+
+  // No I/O if every block is known to be zeroes
+  int all_zero = 1;
+  for(int i = 0; i < count && all_zero; ++i) {
+    all_zero = known_zero[block_ref + i];
+  }
+  if(all_zero) {
+    memset(blocks, 0, (size_t) count * BLOCK_SIZE);
+    stats.zero_reads += count;
+  }else if(vdisk_device_read(block_ref, count, blocks) != 0) {
+    fprintf(stderr, "vdisk_read_blocks(): read failed\n");
     return(-4);
   }
 
+  // Blocks that have not reached the disk yet; the others are checked
+  //  against their checksums.  Each block that can be used is recorded
+  //  with an equal share of the time of the I/O
+  double share = start != 0 ? (oufs_stats_now() - start) / (count > 0 ? count : 1) : 0;
+  unsigned char *p = blocks;
+  int ret = 0;
+  for(int i = 0; i < count; ++i) {
+    if(txn_dirty[block_ref + i]) {
+      memcpy(p + i * BLOCK_SIZE, txn_data[block_ref + i], BLOCK_SIZE);
+    }else if(group_dirty[block_ref + i]) {
+      memcpy(p + i * BLOCK_SIZE, group_data[block_ref + i], BLOCK_SIZE);
+    }else if(!all_zero && vdisk_checksum_verify(block_ref + i, p + i * BLOCK_SIZE) != 0) {
+      fprintf(stderr, "vdisk_read_blocks(): block %d is corrupt\n", block_ref + i);
+      ret = -6;
+      continue;
+    }
+    oufs_stats_io(0, block_ref + i, start != 0 ? oufs_stats_now() - share : 0);
+  }
+  if(ret != 0) {
+    return(ret);
+  }
+
   // Success
   return(0);
 }
 
+/**
+ * Remember the state of a block in the savepoint of the open transaction
+ * before the transaction changes it, unless it was remembered already
+ *
+ * @param block_ref The block
+ */
+static void vdisk_journal_save(BLOCK_REFERENCE block_ref)
+{
+  int level = txn_depth < TXN_SAVEPOINTS ? txn_depth : TXN_SAVEPOINTS - 1;
+  if(level < 2 || saved[level][block_ref]) {
+    return;
+  }
+  saved[level][block_ref] = 1;
+  save_dirty[level][block_ref] = txn_dirty[block_ref];
+  memcpy(save_data[level][block_ref], txn_data[block_ref], BLOCK_SIZE);
+}
+
 /**
  *  Write a disk block to the virtual disk
  *
+ *  The block becomes part of the open transaction.  Outside of a
+ *  transaction, the write forms a transaction by itself.
+ *
  * @param block_ref Index to the block to be written
  * @param block Memory in which the block is currently stored
  *
@@ -118,7 +946,7 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
     fprintf(stderr, "##Writing block %d\n", block_ref);
 
   // File open?
-  if(vdisk_fd == 0) {
+  if(vdisk == NULL) {
     fprintf(stderr, "vdisk_write_block(): disk not initialized\n");
     exit(-1);
   };
@@ -129,18 +957,281 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
     return(-2);
   }
 
-  // Move to the beginning of the block
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_write_block(): seek failed\n");
-    return(-3);
+  ++stats.block_writes;
+  double start = oufs_stats_start();
+
+  vdisk_journal_save(block_ref);
+  vdisk_journal_begin();
+  memcpy(txn_data[block_ref], block, BLOCK_SIZE);
+  txn_dirty[block_ref] = BLOCK_WRITTEN;
+  int ret = vdisk_journal_end();
+  oufs_stats_io(1, block_ref, start);
+  return(ret);
+}
+
+/**
+ *  Discard a disk block: it has been freed, and its contents no longer
+ *  matter.  The block reads as zeroes from now on, and its space is
+ *  given back to the backend when the transaction reaches the disk.
+ *
+ *  The discard becomes part of the open transaction.  Outside of a
+ *  transaction, it forms a transaction by itself.
+ *
+ * @param block_ref Index of the block to be discarded
+ * @return 0 on success; <0 on error
+ */
+int vdisk_discard_block(BLOCK_REFERENCE block_ref)
+{
+  if(vdisk == NULL) {
+    fprintf(stderr, "vdisk_discard_block(): disk not initialized\n");
+    exit(-1);
+  };
+  if(block_ref >= N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_discard_block(): bad block_ref(%d)\n", block_ref);
+    return(-2);
   }
 
-  // Read the block
-  if(write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_write_block(): read failed\n");
+  vdisk_journal_save(block_ref);
+  vdisk_journal_begin();
+  memset(txn_data[block_ref], 0, BLOCK_SIZE);
+  txn_dirty[block_ref] = BLOCK_DISCARDED;
+  return(vdisk_journal_end());
+}
+
+/**
+ *  Check the contents of a block against the checksum of its home
+ *  location, without reading it
+ *
+ * @param block_ref Index of the block
+ * @param block Contents of the block
+ * @return 1 if they match; 0 otherwise
+ */
+int vdisk_checksum_matches(BLOCK_REFERENCE block_ref, void *block)
+{
+  if(block_ref >= N_BLOCKS_IN_DISK) {
+    return(0);
+  }
+  return(vdisk_crc32c(0, block, BLOCK_SIZE) == checksums.crc[block_ref]);
+}
+
+/**
+ *  Copy the I/O counters
+ *
+ * @param out Filled in with the counters
+ */
+void vdisk_get_stats(VDISK_STATS *out)
+{
+  *out = stats;
+}
+
+/**
+ *  Start a transaction.  Transactions nest: only the outermost
+ *  vdisk_journal_end() closes it.
+ *
+ * @return 0 on success
+ */
+int vdisk_journal_begin()
+{
+  ++txn_depth;
+  return(0);
+}
+
+/**
+ *  Close the current transaction.  The closed transaction joins the
+ *  current group, which is committed once it holds
+ *  JOURNAL_GROUP_TRANSACTIONS transactions.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_journal_end()
+{
+  if(txn_depth == 0) {
+    fprintf(stderr, "vdisk_journal_end(): no open transaction\n");
+    return(-1);
+  }
+  // The enclosing transaction takes over the savepoint
+  if(txn_depth > 2 && txn_depth < TXN_SAVEPOINTS) {
+    for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+      if(saved[txn_depth][i] && !saved[txn_depth - 1][i]) {
+        saved[txn_depth - 1][i] = 1;
+        save_dirty[txn_depth - 1][i] = save_dirty[txn_depth][i];
+        memcpy(save_data[txn_depth - 1][i], save_data[txn_depth][i], BLOCK_SIZE);
+      }
+    }
+  }
+  if(txn_depth < TXN_SAVEPOINTS) {
+    memset(saved[txn_depth], 0, sizeof(saved[txn_depth]));
+  }
+  if(--txn_depth > 0) {
+    return(0);
+  }
+
+  // Move the transaction into the group
+  int written = 0;
+  for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+    if(txn_dirty[i]) {
+      memcpy(group_data[i], txn_data[i], BLOCK_SIZE);
+      group_dirty[i] = txn_dirty[i];
+      txn_dirty[i] = 0;
+      written = 1;
+    }
+  }
+  if(!written) {
+    return(0);
+  }
+
+  if(++group_transactions >= JOURNAL_GROUP_TRANSACTIONS) {
+    return(vdisk_journal_commit());
+  }
+  return(0);
+}
+
+/**
+ *  Drop every open transaction, with all of the blocks they wrote
+ */
+static void vdisk_journal_abort_all()
+{
+  memset(txn_dirty, 0, sizeof(txn_dirty));
+  memset(saved, 0, sizeof(saved));
+  txn_depth = 0;
+}
+
+/**
+ *  Discard every block written by the innermost open transaction and
+ *  close it.  The transactions that enclose it stay open, with their own
+ *  changes
+ */
+void vdisk_journal_abort()
+{
+  if(txn_depth == 0) {
+    return;
+  }
+  if(txn_depth >= TXN_SAVEPOINTS) {
+    fprintf(stderr, "vdisk_journal_abort(): transactions nested too deeply, dropping all of them\n");
+    vdisk_journal_abort_all();
+    return;
+  }
+  if(txn_depth == 1) {
+    memset(txn_dirty, 0, sizeof(txn_dirty));
+  }else {
+    for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+      if(saved[txn_depth][i]) {
+        txn_dirty[i] = save_dirty[txn_depth][i];
+        memcpy(txn_data[i], save_data[txn_depth][i], BLOCK_SIZE);
+        saved[txn_depth][i] = 0;
+      }
+    }
+  }
+  --txn_depth;
+}
+
+/**
+ *  Group commit: make every closed transaction durable with one journal
+ *  write and a single fsync(), then apply the blocks to their home
+ *  locations.  The home writes need no sync of their own: the fsync() of
+ *  the next group covers them before their journal slot is reused.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_journal_commit()
+{
+  static unsigned char slot[JOURNAL_SLOT_BLOCKS][BLOCK_SIZE];
+
+  if(group_transactions == 0) {
+    return(0);
+  }
+  STATS_SCOPE scope;
+  oufs_stats_enter(&scope, ST_JOURNAL_COMMIT);
+
+  // Assemble the group: header followed by the contents of the written blocks
+  JOURNAL_HEADER header;
+  memset(&header, 0, sizeof(header));
+  unsigned char (*data)[BLOCK_SIZE] = &slot[JOURNAL_HEADER_BLOCKS];
+  unsigned int n_data = 0;
+  for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+    if(group_dirty[i] == BLOCK_DISCARDED) {
+      header.block_ref[header.n_blocks++] = i | JOURNAL_DISCARD;
+    }else if(group_dirty[i]) {
+      header.block_ref[header.n_blocks++] = i;
+      memcpy(data[n_data++], group_data[i], BLOCK_SIZE);
+    }
+  }
+  header.magic = JOURNAL_MAGIC;
+  header.sequence = journal_sequence;
+  unsigned int hash = vdisk_checksum(2166136261u, &header, sizeof(header));
+  header.checksum = vdisk_checksum(hash, data, n_data * BLOCK_SIZE);
+  memset(slot, 0, JOURNAL_HEADER_BLOCKS * BLOCK_SIZE);
+  memcpy(slot, &header, sizeof(header));
+
+  if(debug)
+    fprintf(stderr, "##Committing group %u: %d transactions, %u blocks\n",
+            journal_sequence, group_transactions, header.n_blocks);
+
+  // Commit point
+  if(vdisk_device_write(JOURNAL_SLOT_START(journal_sequence % 2),
+                      JOURNAL_HEADER_BLOCKS + n_data, slot) != 0) {
+    fprintf(stderr, "vdisk_journal_commit(): journal write failed\n");
+    oufs_stats_leave(&scope);
+    return(-4);
+  }
+  ++stats.device_syncs;
+  oufs_trace(TRACE_SYNC, 0, 0);
+  if(vdisk->flush(vdisk) != 0) {
+    fprintf(stderr, "vdisk_journal_commit(): sync failed\n");
+    oufs_stats_leave(&scope);
+    return(-5);
+  }
+  ++journal_sequence;
+
+  // Checkpoint: the block references are in increasing order, so that
+  //  consecutive discarded blocks form one range, and consecutive written
+  //  blocks (which are consecutive in the journal as well) one write
+  unsigned int d = 0;
+  for(unsigned int i = 0; i < header.n_blocks; ++i) {
+    int ret;
+    if(header.block_ref[i] & JOURNAL_DISCARD) {
+      int start = header.block_ref[i] & ~JOURNAL_DISCARD;
+      int count = 1;
+      while(i + 1 < header.n_blocks && header.block_ref[i + 1] == (JOURNAL_DISCARD | (start + count))) {
+        ++count;
+        ++i;
+      }
+      ret = vdisk_device_discard(start, count);
+      if(ret == 0) {
+        memset(&known_zero[start], 1, count);
+      }
+      for(int j = 0; j < count; ++j) {
+        vdisk_checksum_set(start + j, zero_crc);
+      }
+    }else {
+      int start = header.block_ref[i];
+      int count = 1;
+      while(i + 1 < header.n_blocks && header.block_ref[i + 1] == start + count) {
+        ++count;
+        ++i;
+      }
+      for(int j = 0; j < count; ++j) {
+        known_zero[start + j] = 0;
+        vdisk_checksum_set(start + j, vdisk_crc32c(0, data[d + j], BLOCK_SIZE));
+      }
+      ret = vdisk_device_write(start, count, data[d]);
+      d += count;
+    }
+    if(ret != 0) {
+      fprintf(stderr, "vdisk_journal_commit(): write failed\n");
+      oufs_stats_leave(&scope);
+      return(-4);
+    }
+  }
+  // The next group's sync covers the table, like the home locations
+  if(vdisk_checksums_write() != 0) {
+    fprintf(stderr, "vdisk_journal_commit(): checksum table write failed\n");
+    oufs_stats_leave(&scope);
     return(-4);
   }
 
-  // Success
+  memset(group_dirty, 0, sizeof(group_dirty));
+  group_transactions = 0;
+  oufs_stats_leave(&scope);
   return(0);
 }
@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,12 +13,143 @@ typedef unsigned short BLOCK_REFERENCE;
 // Size of block in bytes
 #define BLOCK_SIZE 256 
 
-// Total number of blocks on the virtual disk
+// Total number of blocks on the virtual disk (a multiple of 8).  Can be
+//  overridden at build time for experiments with other geometries
+#ifndef N_BLOCKS_IN_DISK
 #define N_BLOCKS_IN_DISK 128
+#endif
+
+// Number of transactions collected before the journal forces a group commit
+#define JOURNAL_GROUP_TRANSACTIONS 32
+
+// Running I/O counters, since the program started
+typedef struct vdisk_stats_s
+{
+  // Calls to vdisk_read_block() / vdisk_write_block()
+  unsigned long block_reads;
+  unsigned long block_writes;
+  // Blocks actually transferred to or from the file (journal included)
+  unsigned long device_reads;
+  unsigned long device_writes;
+  // fsync() calls
+  unsigned long device_syncs;
+  // Blocks whose space was given back to the backend
+  unsigned long device_discards;
+  // Block reads answered with zeroes, without any device I/O, because the
+  //  block was known to read as zeroes
+  unsigned long zero_reads;
+  // Blocks read from the device that did not match their checksum, and
+  //  those of them that were repaired
+  unsigned long checksum_errors;
+  unsigned long checksum_repairs;
+} VDISK_STATS;
+
+// What a read does with a block that does not match its checksum:
+//  ZCHECKSUM=error (the default) fails the read; log reports the block on
+//  stderr and returns it as it is; repair rewrites the block from a copy
+//  that matches, and fails the read if there is none.  repair:name takes
+//  the copy from the same block of the disk name (any backend), and
+//  otherwise from the other copy of a mirror: disk, or from the newest
+//  copy of the block in the journal.  The disk name may be a member of a
+//  mirrored disk
+#define CHECKSUM_ENVIRONMENT "ZCHECKSUM"
+
+// Storage behind the virtual disk.  The layout (disk blocks followed by the
+//  journal) is moved through it in whole blocks; see vdisk_backend.c
+typedef struct vdisk_backend_s VDISK_BACKEND;
+struct vdisk_backend_s
+{
+  // Prefix of the disk name that selects the backend ("" for the default)
+  const char *scheme;
+  // Opens the storage; n_blocks is the size of the whole layout
+  int (*open)(VDISK_BACKEND *backend, char *name, int n_blocks);
+  int (*close)(VDISK_BACKEND *backend);
+  // Transfer count consecutive blocks.  Reading blocks that were never
+  //  written fails
+  int (*read)(VDISK_BACKEND *backend, int start, int count, void *buf);
+  int (*write)(VDISK_BACKEND *backend, int start, int count, void *buf);
+  // Gives the space of count consecutive blocks back; they read as zeroes
+  int (*discard)(VDISK_BACKEND *backend, int start, int count);
+  // Makes the writes so far durable
+  int (*flush)(VDISK_BACKEND *backend);
+  // Sets the number of blocks stored.  Blocks added read as zeroes, and
+  //  take no space where the storage allows
+  int (*truncate)(VDISK_BACKEND *backend, int n_blocks);
+  // Number of blocks stored
+  long (*size)(VDISK_BACKEND *backend);
+  // Sets map[i] for the blocks start + i that are known to read as zeroes
+  //  without reading them (holes); others are left alone
+  int (*zeroes)(VDISK_BACKEND *backend, int start, int count, char *map);
+  // Transfers count consecutive blocks from one copy (0, 1, ...) of a
+  //  backend that keeps several, whichever copy read would use; returns 1
+  //  past the last copy.  NULL for backends that keep one copy
+  int (*read_copy)(VDISK_BACKEND *backend, int copy, int start, int count, void *buf);
+  // Private to the backend while it is open
+  void *state;
+};
+
+VDISK_BACKEND *vdisk_backend_lookup(char *name, char **path);
+int vdisk_backend_mirror_start(VDISK_BACKEND *backend, int n_blocks);
+
+// Settings of the slow: backend, as comma separated key=value pairs:
+//  read, write: microseconds per block; flush: microseconds per flush;
+//  bandwidth: bytes per second (k, m, g suffixes; 0 is unlimited);
+//  seek: microseconds for an access that does not continue the previous
+//  one; track: nanoseconds per block of distance from the previous access;
+//  fail_read, fail_write, fail_flush: the n-th call and every later one fails
+#define SLOW_ENVIRONMENT "ZSLOW"
+
+// Defaults of the slow: backend (microseconds)
+#define SLOW_READ_US 50
+#define SLOW_WRITE_US 50
+#define SLOW_FLUSH_US 500
+#define SLOW_SEEK_US 100
+
+// The lz: backend stores every block compressed, packed into slots of
+//  LZ_SLOT_SIZE bytes of the blocks of the wrapped backend.  A block that
+//  does not compress into fewer than LZ_SLOTS slots is stored as it is, and
+//  a block of zeroes takes no space
+#define LZ_SLOT_SIZE 32
+#define LZ_SLOTS (BLOCK_SIZE / LZ_SLOT_SIZE)
+_Static_assert(LZ_SLOTS <= 8, "the slots of a block must fit into a byte mask");
+
+// The stripe: backend spreads the blocks over its members in chunks of
+//  ZSTRIPE blocks (STRIPE_CHUNK_BLOCKS if unset).  The chunk size of a
+//  disk is fixed when it is first opened; it is recorded in every member
+#define STRIPE_ENVIRONMENT "ZSTRIPE"
+#define STRIPE_CHUNK_BLOCKS 1
+#define STRIPE_MAX_MEMBERS 16
+
+// The mirror: backend copies every change of the primary to the secondary
+//  in the background.  Regions of MIRROR_REGION_BLOCKS blocks that may
+//  differ between the two are marked in a bitmap on the primary, so that a
+//  secondary that fell behind only gets the regions that changed.  At most
+//  MIRROR_QUEUE_BLOCKS written blocks wait for the secondary; changes past
+//  that are copied from the primary later
+#define MIRROR_REGION_BLOCKS 8
+#define MIRROR_QUEUE_BLOCKS 1024
+
+int vdisk_lz_compress(const unsigned char *in, int len, unsigned char *out, int max);
+int vdisk_lz_decompress(const unsigned char *in, int len, unsigned char *out, int out_len);
+
+unsigned int vdisk_crc32c(unsigned int crc, const void *buf, size_t len);
+unsigned int vdisk_crc32c_portable(unsigned int crc, const void *buf, size_t len);
+const char *vdisk_crc32c_method();
 
 int vdisk_disk_open(char *virtual_disk_name);
 int vdisk_disk_close();
+int vdisk_disk_erase();
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks(BLOCK_REFERENCE block_ref, int count, void *blocks);
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_discard_block(BLOCK_REFERENCE block_ref);
+int vdisk_checksum_matches(BLOCK_REFERENCE block_ref, void *block);
+
+void vdisk_get_stats(VDISK_STATS *stats);
+
+int vdisk_journal_begin();
+int vdisk_journal_end();
+void vdisk_journal_abort();
+int vdisk_journal_commit();
 
 #endif
@@ -0,0 +1,2645 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "vdisk.h"
+/*
+ * Storage backends of the virtual disk.
+ *
+ * vdisk.c lays the disk and its journal out as a sequence of blocks and
+ * moves them through a backend.  A backend is selected by a scheme
+ * prefix of the disk name:
+ *
+ *   name      a file (the default)
+ *   ram:name  anonymous memory, loaded from the file at open and saved
+ *             back to it at close; "ram:" alone is a throwaway disk that
+ *             lives until the program exits
+ *   slow:name the disk "name" (any backend), with the latency, bandwidth,
+ *             seek cost and faults of slower media added (see ZSLOW in
+ *             vdisk.h)
+ *   lz:name   the disk "name" (any backend), holding every block
+ *             compressed (see vdisk_lz.c), several to a block
+ *   stripe:name,name,...
+ *             the disks "name" (any backend each), with the blocks
+ *             striped across them in chunks (RAID-0); the members are
+ *             accessed in parallel by one thread each
+ *   mirror:primary,secondary
+ *             the disk "primary", with every change copied to the disk
+ *             "secondary" (any backends) in the background (RAID-1)
+ */
+
+// Open file backend
+typedef struct file_state_s
+{
+  int fd;
+} FILE_STATE;
+
+// Open RAM backend
+typedef struct ram_state_s
+{
+  unsigned char *memory;
+  // Size of the mapping, in blocks
+  int capacity;
+  // Blocks that hold data: loaded from the image or written since.  The
+  //  memory past the extent is zero
+  int extent;
+  // Image file that is loaded and saved ("" for none)
+  char *image;
+} RAM_STATE;
+
+// The throwaway RAM disk: kept when it is closed, so that it can be opened
+//  again by the same program
+static RAM_STATE *ram_anonymous = NULL;
+
+// Model of slower media
+typedef struct slow_model_s
+{
+  // Microseconds per block read / written, and per flush
+  double read_us;
+  double write_us;
+  double flush_us;
+  // Bytes per second (0 for unlimited)
+  double bandwidth;
+  // Microseconds for an access that does not start where the previous one
+  //  ended, plus nanoseconds per block of distance
+  double seek_us;
+  double track_ns;
+  // The n-th read / write / flush and every later one fails (0 for never)
+  long fail_read;
+  long fail_write;
+  long fail_flush;
+} SLOW_MODEL;
+
+// Open slow backend
+typedef struct slow_state_s
+{
+  // The wrapped backend
+  VDISK_BACKEND inner;
+  SLOW_MODEL model;
+  // Block after the previous access
+  int position;
+  // Calls so far
+  long reads;
+  long writes;
+  long flushes;
+} SLOW_STATE;
+
+// Identifies a valid map of the lz: backend
+#define LZ_MAGIC 0x4c5a4d31
+
+// Where the lz: backend keeps one block
+typedef struct lz_entry_s
+{
+  // Block of the data area, and first slot in it
+  unsigned short physical;
+  unsigned char slot;
+  // Number of slots: 0 for a block of zeroes, LZ_SLOTS for a block stored
+  //  as it is
+  unsigned char slots;
+} LZ_ENTRY;
+
+// Map of the lz: backend, followed by an LZ_ENTRY for every block.  The
+//  wrapped backend holds two copies of the map, followed by the data area
+typedef struct lz_map_s
+{
+  unsigned int magic;
+  // Copy = sequence % 2; the valid copy with the higher sequence is current
+  unsigned int sequence;
+  unsigned int n_blocks;
+  // Blocks below the extent have been written: reading past it fails
+  unsigned int extent;
+  // Checksum over the map (with this field 0) and the entries
+  unsigned int checksum;
+} LZ_MAP;
+
+// Open lz: backend
+typedef struct lz_state_s
+{
+  // The wrapped backend
+  VDISK_BACKEND inner;
+  int n_blocks;
+  // Blocks of the wrapped backend taken by one copy of the map
+  int map_blocks;
+  // Blocks in the data area
+  int n_physical;
+  // The current map and its entries; changed since it was last written?
+  LZ_MAP *map;
+  LZ_ENTRY *entry;
+  int map_dirty;
+  // Slot masks of the data blocks: slots used by the current map, and by
+  //  the map on the wrapped backend.  Slots used by either are never
+  //  overwritten, so that a crash always finds the blocks of its map
+  unsigned char *live;
+  unsigned char *durable;
+  // Data block that new blocks are packed into (-1 for none)
+  int fill_block;
+  int fill_dirty;
+  unsigned char fill[BLOCK_SIZE];
+  // Data block that was read last (-1 for none)
+  int cache_block;
+  unsigned char cache[BLOCK_SIZE];
+} LZ_STATE;
+
+// First block of the data area in the wrapped backend
+#define LZ_DATA_START(state) (2 * (state)->map_blocks)
+
+// Identifies the header of a member of a striped disk
+#define STRIPE_MAGIC 0x53545231
+
+// Header in the first block of every member of a striped disk; the chunks
+//  follow it
+typedef struct stripe_header_s
+{
+  unsigned int magic;
+  unsigned int n_members;
+  // Position of this member in the disk name
+  unsigned int member;
+  // Blocks per chunk
+  unsigned int chunk;
+  // Blocks in the layout of the striped disk
+  unsigned int n_blocks;
+} STRIPE_HEADER;
+
+// Operations that a member carries out for a request
+#define STRIPE_READ 0
+#define STRIPE_WRITE 1
+#define STRIPE_DISCARD 2
+#define STRIPE_FLUSH 3
+
+// One member of an open striped disk
+typedef struct stripe_member_s
+{
+  VDISK_BACKEND backend;
+  struct stripe_state_s *stripe;
+  pthread_t thread;
+  // The member's part of the current request: one range of its blocks
+  //  (after the header).  pieces is the number of chunks or parts of
+  //  chunks that it is made of, and offset the block of the request that
+  //  the first of them starts at
+  int op;
+  int start;
+  int count;
+  int pieces;
+  int offset;
+  unsigned char *buf;
+  int ret;
+  // Set while the member's thread owes the result
+  int pending;
+  // Blocks of a request that take more than one piece, gathered
+  unsigned char *bounce;
+} STRIPE_MEMBER;
+
+// Open striped backend
+typedef struct stripe_state_s
+{
+  // Copy of the disk name, which the member names point into
+  char *names;
+  int n_members;
+  int chunk;
+  STRIPE_MEMBER member[STRIPE_MAX_MEMBERS];
+  // Hands requests to the member threads: work is signalled when there
+  //  are pending members, finished when the last one is done
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  int outstanding;
+  int quit;
+} STRIPE_STATE;
+
+// Identifies the header of a member of a mirrored disk
+#define MIRROR_MAGIC 0x4d495231
+
+// Header in the first block of both members of a mirrored disk.  The
+//  second block of the primary holds the dirty region bitmap, and the
+//  blocks of the disk follow (in both members)
+typedef struct mirror_header_s
+{
+  unsigned int magic;
+  // Tells the members of one mirrored disk from those of others
+  unsigned int id;
+  // Blocks in the layout of the mirrored disk
+  unsigned int n_blocks;
+} MIRROR_HEADER;
+
+// Blocks of both members that come before the blocks of the disk
+#define MIRROR_DATA_START 2
+
+// Changes queued for the secondary
+#define MIRROR_WRITE 0
+#define MIRROR_DISCARD 1
+#define MIRROR_TRUNCATE 2
+
+// A change queued for the secondary
+typedef struct mirror_item_s
+{
+  struct mirror_item_s *next;
+  // MIRROR_ operation, blocks of the disk (count is the new size for
+  //  MIRROR_TRUNCATE), and the blocks written
+  int op;
+  int start;
+  int count;
+  unsigned char *data;
+  // Regions that the change holds dirty
+  int first_region;
+  int last_region;
+} MIRROR_ITEM;
+
+// Open mirrored backend
+typedef struct mirror_state_s
+{
+  // Copy of the disk name, which the member names point into
+  char *names;
+  char *secondary_name;
+  VDISK_BACKEND primary;
+  VDISK_BACKEND secondary;
+  // Each member is used by the caller and by the mirror thread
+  pthread_mutex_t primary_lock;
+  pthread_mutex_t secondary_lock;
+  unsigned int id;
+  int n_regions;
+  // The rest is protected by lock.  The secondary is open and in use: a
+  //  secondary that fails is left alone until the disk is opened again
+  int have_secondary;
+  // Regions that may differ between the members, as recorded in the
+  //  primary.  A region stays dirty while changes that it holds are
+  //  pending (on their way to the primary, or queued), and while it is
+  //  stale (has to be copied whole: it missed the queue, or the secondary
+  //  was behind when the disk was opened)
+  unsigned char dirty[BLOCK_SIZE];
+  int *pending;
+  char *stale;
+  // Regions that were copied since the secondary was last flushed
+  int unflushed;
+  // The ordered queue of changes for the secondary
+  MIRROR_ITEM *head;
+  MIRROR_ITEM *tail;
+  int queued_blocks;
+  // Signalled when there is work for the mirror thread, and when it has
+  //  caught up (idle)
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t caught_up;
+  int idle;
+  int quit;
+  pthread_t thread;
+  // Member that serves the next read of clean regions
+  int next_read;
+} MIRROR_STATE;
+
+// Delays above this many microseconds sleep until close to the deadline,
+//  then spin: sleeping alone overshoots short delays
+#define SLOW_SPIN_US 1000
+
+/**********************************************************************/
+// File backend
+
+/**
+ * Open or create the file
+ *
+ * @param backend The backend
+ * @param name File name
+ * @param n_blocks Number of blocks in the layout (unused)
+ * @return 0 on success; <0 on error
+ */
+static int file_open(VDISK_BACKEND *backend, char *name, int n_blocks)
+{
+  int fd = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd <= 0) {
+    return(-1);
+  }
+  FILE_STATE *state = malloc(sizeof(FILE_STATE));
+  state->fd = fd;
+  backend->state = state;
+  return(0);
+}
+
+/**
+ * Close the file
+ *
+ * @param backend The backend
+ * @return 0 on success
+ */
+static int file_close(VDISK_BACKEND *backend)
+{
+  FILE_STATE *state = backend->state;
+  close(state->fd);
+  free(state);
+  backend->state = NULL;
+  return(0);
+}
+
+/**
+ * Read consecutive blocks of the file
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -3 if the seek failed, -4 on a failed or short read
+ */
+static int file_read(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  FILE_STATE *state = backend->state;
+  if(lseek(state->fd, (off_t) start * BLOCK_SIZE, SEEK_SET) < 0) {
+    return(-3);
+  }
+  if(read(state->fd, buf, count * BLOCK_SIZE) != count * BLOCK_SIZE) {
+    return(-4);
+  }
+  return(0);
+}
+
+/**
+ * Write consecutive blocks of the file
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Source (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -3 if the seek failed, -4 on a failed or short write
+ */
+static int file_write(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  FILE_STATE *state = backend->state;
+  if(lseek(state->fd, (off_t) start * BLOCK_SIZE, SEEK_SET) < 0) {
+    return(-3);
+  }
+  if(write(state->fd, buf, count * BLOCK_SIZE) != count * BLOCK_SIZE) {
+    return(-4);
+  }
+  return(0);
+}
+
+/**
+ * Punch a hole over consecutive blocks of the file.  Where the file
+ * system cannot punch holes, the blocks are overwritten with zeroes
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @return 0 on success; <0 on error
+ */
+static int file_discard(VDISK_BACKEND *backend, int start, int count)
+{
+  FILE_STATE *state = backend->state;
+  if(fallocate(state->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+               (off_t) start * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) == 0) {
+    return(0);
+  }
+  if(errno != EOPNOTSUPP && errno != ENOSYS) {
+    return(-4);
+  }
+  static const unsigned char zeroes[BLOCK_SIZE];
+  for(int i = 0; i < count; ++i) {
+    if(file_write(backend, start + i, 1, (void *) zeroes) != 0) {
+      return(-4);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Make the writes durable
+ *
+ * @param backend The backend
+ * @return 0 on success; <0 on error
+ */
+static int file_flush(VDISK_BACKEND *backend)
+{
+  FILE_STATE *state = backend->state;
+  return(fsync(state->fd) == 0 ? 0 : -5);
+}
+
+/**
+ * Cut or extend the file.  An extended file is sparse
+ *
+ * @param backend The backend
+ * @param n_blocks New size in blocks
+ * @return 0 on success; <0 on error
+ */
+static int file_truncate(VDISK_BACKEND *backend, int n_blocks)
+{
+  FILE_STATE *state = backend->state;
+  return(ftruncate(state->fd, (off_t) n_blocks * BLOCK_SIZE) == 0 ? 0 : -4);
+}
+
+/**
+ * Number of whole blocks in the file
+ *
+ * @param backend The backend
+ * @return Size in blocks
+ */
+static long file_size(VDISK_BACKEND *backend)
+{
+  FILE_STATE *state = backend->state;
+  struct stat st;
+  if(fstat(state->fd, &st) != 0) {
+    return(0);
+  }
+  return(st.st_size / BLOCK_SIZE);
+}
+
+/**
+ * Find the blocks that lie in holes of the file.  Blocks past the end of
+ * the file are not holes: reading them fails
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param map map[i] is set for every block start + i in a hole
+ * @return 0 on success; -4 if the file cannot be examined
+ */
+static int file_zeroes(VDISK_BACKEND *backend, int start, int count, char *map)
+{
+  FILE_STATE *state = backend->state;
+  struct stat st;
+  if(fstat(state->fd, &st) != 0) {
+    return(-4);
+  }
+  off_t end = (off_t) (start + count) * BLOCK_SIZE;
+  if(end > st.st_size) {
+    end = st.st_size;
+  }
+
+  // File systems without holes report the whole file as data
+  off_t hole = (off_t) start * BLOCK_SIZE;
+  while(hole < end) {
+    hole = lseek(state->fd, hole, SEEK_HOLE);
+    if(hole < 0 || hole >= end) {
+      break;
+    }
+    off_t data = lseek(state->fd, hole, SEEK_DATA);
+    if(data < 0 || data > end) {
+      // The hole runs to the end of the file
+      data = end;
+    }
+    if(data <= hole) {
+      break;
+    }
+    for(off_t b = (hole + BLOCK_SIZE - 1) / BLOCK_SIZE; (b + 1) * BLOCK_SIZE <= data; ++b) {
+      map[b - start] = 1;
+    }
+    hole = data;
+  }
+  return(0);
+}
+
+static VDISK_BACKEND file_backend = {
+  "", file_open, file_close, file_read, file_write, file_discard, file_flush, file_truncate, file_size,
+  file_zeroes, NULL, NULL
+};
+
+/**********************************************************************/
+// RAM backend
+
+/**
+ * Map anonymous memory for the whole layout and load the image into it
+ *
+ * @param backend The backend
+ * @param name Image file ("" for none).  A missing image is a new disk
+ * @param n_blocks Number of blocks in the layout
+ * @return 0 on success; <0 on error
+ */
+static int ram_open(VDISK_BACKEND *backend, char *name, int n_blocks)
+{
+  if(name[0] == 0 && ram_anonymous != NULL) {
+    backend->state = ram_anonymous;
+    return(0);
+  }
+  RAM_STATE *state = malloc(sizeof(RAM_STATE));
+  state->memory = mmap(NULL, (size_t) n_blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(state->memory == MAP_FAILED) {
+    free(state);
+    return(-1);
+  }
+  state->capacity = n_blocks;
+  state->extent = 0;
+  state->image = strdup(name);
+
+  if(name[0] != 0) {
+    int fd = open(name, O_RDONLY);
+    if(fd < 0 && errno != ENOENT) {
+      munmap(state->memory, (size_t) n_blocks * BLOCK_SIZE);
+      free(state->image);
+      free(state);
+      return(-1);
+    }
+    if(fd >= 0) {
+      ssize_t n = read(fd, state->memory, (size_t) n_blocks * BLOCK_SIZE);
+      close(fd);
+      state->extent = n > 0 ? n / BLOCK_SIZE : 0;
+    }
+  }else {
+    ram_anonymous = state;
+  }
+  backend->state = state;
+  return(0);
+}
+
+/**
+ * Save the blocks to the image and release the memory.  The throwaway
+ * disk is kept as it is
+ *
+ * @param backend The backend
+ * @return 0 on success; <0 if the image could not be saved
+ */
+static int ram_close(VDISK_BACKEND *backend)
+{
+  RAM_STATE *state = backend->state;
+  backend->state = NULL;
+  if(state == ram_anonymous) {
+    return(0);
+  }
+  int ret = 0;
+  if(state->image[0] != 0) {
+    int fd = open(state->image, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    size_t len = (size_t) state->extent * BLOCK_SIZE;
+    if(fd < 0 || write(fd, state->memory, len) != (ssize_t) len) {
+      fprintf(stderr, "vdisk: cannot save RAM disk to %s\n", state->image);
+      ret = -4;
+    }
+    if(fd >= 0) {
+      close(fd);
+    }
+  }
+  munmap(state->memory, (size_t) state->capacity * BLOCK_SIZE);
+  free(state->image);
+  free(state);
+  return(ret);
+}
+
+/**
+ * Read consecutive blocks.  Blocks past the extent have never been
+ * written, like blocks past the end of a file
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -4 if the blocks do not exist
+ */
+static int ram_read(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  RAM_STATE *state = backend->state;
+  if(start < 0 || start + count > state->extent) {
+    return(-4);
+  }
+  memcpy(buf, state->memory + (size_t) start * BLOCK_SIZE, (size_t) count * BLOCK_SIZE);
+  return(0);
+}
+
+/**
+ * Write consecutive blocks
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Source (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -4 if the blocks are outside of the layout
+ */
+static int ram_write(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  RAM_STATE *state = backend->state;
+  if(start < 0 || start + count > state->capacity) {
+    return(-4);
+  }
+  memcpy(state->memory + (size_t) start * BLOCK_SIZE, buf, (size_t) count * BLOCK_SIZE);
+  if(start + count > state->extent) {
+    state->extent = start + count;
+  }
+  return(0);
+}
+
+/**
+ * Zero consecutive blocks
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @return 0 on success; -4 if the blocks are outside of the layout
+ */
+static int ram_discard(VDISK_BACKEND *backend, int start, int count)
+{
+  RAM_STATE *state = backend->state;
+  if(start < 0 || start + count > state->capacity) {
+    return(-4);
+  }
+  memset(state->memory + (size_t) start * BLOCK_SIZE, 0, (size_t) count * BLOCK_SIZE);
+  return(0);
+}
+
+/**
+ * Nothing to make durable: the image is only written at close
+ *
+ * @param backend The backend
+ * @return 0
+ */
+static int ram_flush(VDISK_BACKEND *backend)
+{
+  return(0);
+}
+
+/**
+ * Cut or extend the disk.  Memory that is cut is zeroed again, so that it
+ * reads as zeroes if the disk is extended later
+ *
+ * @param backend The backend
+ * @param n_blocks New size in blocks
+ * @return 0 on success; -4 if the size is outside of the layout
+ */
+static int ram_truncate(VDISK_BACKEND *backend, int n_blocks)
+{
+  RAM_STATE *state = backend->state;
+  if(n_blocks < 0 || n_blocks > state->capacity) {
+    return(-4);
+  }
+  if(n_blocks < state->extent) {
+    memset(state->memory + (size_t) n_blocks * BLOCK_SIZE, 0, (size_t) (state->extent - n_blocks) * BLOCK_SIZE);
+  }
+  state->extent = n_blocks;
+  return(0);
+}
+
+/**
+ * Number of blocks that hold data
+ *
+ * @param backend The backend
+ * @return Size in blocks
+ */
+static long ram_size(VDISK_BACKEND *backend)
+{
+  RAM_STATE *state = backend->state;
+  return(state->extent);
+}
+
+/**
+ * Find the blocks that hold only zeroes.  Looking at memory costs no I/O
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param map map[i] is set for every block start + i that is zero
+ * @return 0
+ */
+static int ram_zeroes(VDISK_BACKEND *backend, int start, int count, char *map)
+{
+  RAM_STATE *state = backend->state;
+  static const unsigned char zeroes[BLOCK_SIZE];
+  for(int i = 0; i < count && start + i < state->extent; ++i) {
+    if(memcmp(state->memory + (size_t) (start + i) * BLOCK_SIZE, zeroes, BLOCK_SIZE) == 0) {
+      map[i] = 1;
+    }
+  }
+  return(0);
+}
+
+static VDISK_BACKEND ram_backend = {
+  "ram:", ram_open, ram_close, ram_read, ram_write, ram_discard, ram_flush, ram_truncate, ram_size,
+  ram_zeroes, NULL, NULL
+};
+
+/**********************************************************************/
+// Slow backend
+
+/**
+ * Current time in microseconds
+ *
+ * @return Monotonic time in microseconds
+ */
+static double slow_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/**
+ * Wait for the given time
+ *
+ * @param us Microseconds
+ */
+static void slow_wait(double us)
+{
+  if(us <= 0) {
+    return;
+  }
+  double deadline = slow_now_us() + us;
+  if(us > SLOW_SPIN_US) {
+    double sleep_us = us - SLOW_SPIN_US;
+    struct timespec ts = {(time_t) (sleep_us / 1e6), (long) ((sleep_us - (time_t) (sleep_us / 1e6) * 1e6) * 1e3)};
+    nanosleep(&ts, NULL);
+  }
+  while(slow_now_us() < deadline);
+}
+
+/**
+ * Read the model from ZSLOW: comma separated key=value settings
+ *
+ * @param model Filled in with the model
+ * @return 0 on success; -1 if ZSLOW is malformed
+ */
+static int slow_parse(SLOW_MODEL *model)
+{
+  SLOW_MODEL defaults = {SLOW_READ_US, SLOW_WRITE_US, SLOW_FLUSH_US, 0, SLOW_SEEK_US, 0, 0, 0, 0};
+  *model = defaults;
+  char *config = getenv(SLOW_ENVIRONMENT);
+  if(config == NULL) {
+    return(0);
+  }
+
+  char copy[strlen(config) + 1];
+  strcpy(copy, config);
+  for(char *setting = strtok(copy, ","); setting != NULL; setting = strtok(NULL, ",")) {
+    char *equals = strchr(setting, '=');
+    if(equals == NULL) {
+      fprintf(stderr, "vdisk: %s: %s has no value\n", SLOW_ENVIRONMENT, setting);
+      return(-1);
+    }
+    *equals = 0;
+    char *end;
+    double value = strtod(equals + 1, &end);
+    // Bandwidth takes a k, m or g suffix
+    if(*end == 'k' || *end == 'K') {
+      value *= 1e3;
+      ++end;
+    }else if(*end == 'm' || *end == 'M') {
+      value *= 1e6;
+      ++end;
+    }else if(*end == 'g' || *end == 'G') {
+      value *= 1e9;
+      ++end;
+    }
+    if(end == equals + 1 || *end != 0 || value < 0) {
+      fprintf(stderr, "vdisk: %s: bad value for %s\n", SLOW_ENVIRONMENT, setting);
+      return(-1);
+    }
+
+    if(!strcmp(setting, "read")) {
+      model->read_us = value;
+    }else if(!strcmp(setting, "write")) {
+      model->write_us = value;
+    }else if(!strcmp(setting, "flush")) {
+      model->flush_us = value;
+    }else if(!strcmp(setting, "bandwidth")) {
+      model->bandwidth = value;
+    }else if(!strcmp(setting, "seek")) {
+      model->seek_us = value;
+    }else if(!strcmp(setting, "track")) {
+      model->track_ns = value;
+    }else if(!strcmp(setting, "fail_read")) {
+      model->fail_read = value;
+    }else if(!strcmp(setting, "fail_write")) {
+      model->fail_write = value;
+    }else if(!strcmp(setting, "fail_flush")) {
+      model->fail_flush = value;
+    }else {
+      fprintf(stderr, "vdisk: %s: unknown setting %s\n", SLOW_ENVIRONMENT, setting);
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Open the wrapped backend
+ *
+ * @param backend The backend
+ * @param name Name of the wrapped disk, with its own scheme prefix
+ * @param n_blocks Number of blocks in the layout
+ * @return 0 on success; <0 on error
+ */
+static int slow_open(VDISK_BACKEND *backend, char *name, int n_blocks)
+{
+  SLOW_STATE *state = malloc(sizeof(SLOW_STATE));
+  char *path;
+  state->inner = *vdisk_backend_lookup(name, &path);
+  if(slow_parse(&state->model) != 0 || state->inner.open(&state->inner, path, n_blocks) != 0) {
+    free(state);
+    return(-1);
+  }
+  state->position = 0;
+  state->reads = 0;
+  state->writes = 0;
+  state->flushes = 0;
+  backend->state = state;
+  return(0);
+}
+
+/**
+ * Close the wrapped backend
+ *
+ * @param backend The backend
+ * @return What the wrapped backend returned
+ */
+static int slow_close(VDISK_BACKEND *backend)
+{
+  SLOW_STATE *state = backend->state;
+  int ret = state->inner.close(&state->inner);
+  free(state);
+  backend->state = NULL;
+  return(ret);
+}
+
+/**
+ * Time that an access takes on the modelled media
+ *
+ * @param state The open backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param block_us Microseconds per block
+ * @return Microseconds
+ */
+static double slow_access_us(SLOW_STATE *state, int start, int count, double block_us)
+{
+  double us = block_us * count;
+  if(state->model.bandwidth > 0) {
+    us += 1e6 * count * BLOCK_SIZE / state->model.bandwidth;
+  }
+  if(start != state->position) {
+    int distance = start > state->position ? start - state->position : state->position - start;
+    us += state->model.seek_us + state->model.track_ns * distance / 1e3;
+  }
+  state->position = start + count;
+  return(us);
+}
+
+/**
+ * Read consecutive blocks, taking the time of the modelled media
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -4 for an injected fault; else what the wrapped backend returned
+ */
+static int slow_read(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  SLOW_STATE *state = backend->state;
+  if(state->model.fail_read > 0 && ++state->reads >= state->model.fail_read) {
+    return(-4);
+  }
+  slow_wait(slow_access_us(state, start, count, state->model.read_us));
+  return(state->inner.read(&state->inner, start, count, buf));
+}
+
+/**
+ * Write consecutive blocks, taking the time of the modelled media
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Source (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -4 for an injected fault; else what the wrapped backend returned
+ */
+static int slow_write(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  SLOW_STATE *state = backend->state;
+  if(state->model.fail_write > 0 && ++state->writes >= state->model.fail_write) {
+    return(-4);
+  }
+  slow_wait(slow_access_us(state, start, count, state->model.write_us));
+  return(state->inner.write(&state->inner, start, count, buf));
+}
+
+/**
+ * Discard consecutive blocks.  No data moves, so it takes no modelled
+ * time, and it does not move the head
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @return What the wrapped backend returned
+ */
+static int slow_discard(VDISK_BACKEND *backend, int start, int count)
+{
+  SLOW_STATE *state = backend->state;
+  return(state->inner.discard(&state->inner, start, count));
+}
+
+/**
+ * Make the writes durable, taking the time of the modelled media
+ *
+ * @param backend The backend
+ * @return 0 on success; -5 for an injected fault; else what the wrapped backend returned
+ */
+static int slow_flush(VDISK_BACKEND *backend)
+{
+  SLOW_STATE *state = backend->state;
+  if(state->model.fail_flush > 0 && ++state->flushes >= state->model.fail_flush) {
+    return(-5);
+  }
+  slow_wait(state->model.flush_us);
+  return(state->inner.flush(&state->inner));
+}
+
+/**
+ * Cut or extend the wrapped backend.  This changes no data, so it takes
+ * no modelled time
+ *
+ * @param backend The backend
+ * @param n_blocks New size in blocks
+ * @return What the wrapped backend returned
+ */
+static int slow_truncate(VDISK_BACKEND *backend, int n_blocks)
+{
+  SLOW_STATE *state = backend->state;
+  return(state->inner.truncate(&state->inner, n_blocks));
+}
+
+/**
+ * Number of blocks stored by the wrapped backend
+ *
+ * @param backend The backend
+ * @return Size in blocks
+ */
+static long slow_size(VDISK_BACKEND *backend)
+{
+  SLOW_STATE *state = backend->state;
+  return(state->inner.size(&state->inner));
+}
+
+/**
+ * Find the blocks of the wrapped backend that read as zeroes.  This reads
+ * no data, so it takes no modelled time
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param map map[i] is set for every block start + i that reads as zeroes
+ * @return What the wrapped backend returned
+ */
+static int slow_zeroes(VDISK_BACKEND *backend, int start, int count, char *map)
+{
+  SLOW_STATE *state = backend->state;
+  return(state->inner.zeroes(&state->inner, start, count, map));
+}
+
+/**
+ * Read consecutive blocks from one copy of the wrapped backend, taking the
+ * time of the modelled media.  A wrapped backend that keeps one copy has
+ * copy 0 only
+ *
+ * @param backend The backend
+ * @param copy The copy
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; 1 past the last copy; -4 for an injected fault; else what the wrapped backend returned
+ */
+static int slow_read_copy(VDISK_BACKEND *backend, int copy, int start, int count, void *buf)
+{
+  SLOW_STATE *state = backend->state;
+  if(state->inner.read_copy == NULL) {
+    return(copy == 0 ? slow_read(backend, start, count, buf) : 1);
+  }
+  if(state->model.fail_read > 0 && ++state->reads >= state->model.fail_read) {
+    return(-4);
+  }
+  slow_wait(slow_access_us(state, start, count, state->model.read_us));
+  return(state->inner.read_copy(&state->inner, copy, start, count, buf));
+}
+
+static VDISK_BACKEND slow_backend = {
+  "slow:", slow_open, slow_close, slow_read, slow_write, slow_discard, slow_flush, slow_truncate, slow_size,
+  slow_zeroes, slow_read_copy, NULL
+};
+
+/**********************************************************************/
+// Compressing backend
+
+/**
+ * Mask of consecutive slots
+ *
+ * @param slot First slot
+ * @param slots Number of slots
+ * @return Bit i set for every slot i
+ */
+static int lz_mask(int slot, int slots)
+{
+  return(((1 << slots) - 1) << slot);
+}
+
+/**
+ * Find room in a data block
+ *
+ * @param used Slots in use
+ * @param slots Number of consecutive slots needed
+ * @return The first of slots free slots; -1 if there are none
+ */
+static int lz_free_run(int used, int slots)
+{
+  for(int slot = 0; slot + slots <= LZ_SLOTS; ++slot) {
+    if((used & lz_mask(slot, slots)) == 0) {
+      return(slot);
+    }
+  }
+  return(-1);
+}
+
+/**
+ * Checksum of a map copy (FNV-1a), with its checksum field taken as 0
+ *
+ * @param state The open backend
+ * @param map The map, with its entries
+ * @return The checksum
+ */
+static unsigned int lz_checksum(LZ_STATE *state, LZ_MAP *map)
+{
+  unsigned int stored = map->checksum;
+  map->checksum = 0;
+  unsigned int hash = 2166136261u;
+  unsigned char *p = (unsigned char *) map;
+  for(int i = 0; i < state->map_blocks * BLOCK_SIZE; ++i) {
+    hash ^= p[i];
+    hash *= 16777619;
+  }
+  map->checksum = stored;
+  return(hash);
+}
+
+/**
+ * Load one copy of the map
+ *
+ * @param state The open backend
+ * @param copy 0 or 1
+ * @param map Filled in with the copy (map_blocks blocks)
+ * @return 1 if the copy is a valid map of this geometry; 0 otherwise
+ */
+static int lz_load_map(LZ_STATE *state, int copy, LZ_MAP *map)
+{
+  if(state->inner.read(&state->inner, copy * state->map_blocks, state->map_blocks, map) != 0) {
+    return(0);
+  }
+  return(map->magic == LZ_MAGIC && map->n_blocks == (unsigned int) state->n_blocks &&
+         map->extent <= map->n_blocks && lz_checksum(state, map) == map->checksum);
+}
+
+/**
+ * Write the block being filled, if it changed
+ *
+ * @param state The open backend
+ * @return 0 on success; <0 on error
+ */
+static int lz_put_fill(LZ_STATE *state)
+{
+  if(!state->fill_dirty) {
+    return(0);
+  }
+  state->fill_dirty = 0;
+  return(state->inner.write(&state->inner, LZ_DATA_START(state) + state->fill_block, 1, state->fill));
+}
+
+/**
+ * Pack compressed data into the slots of a data block.  The block being
+ * filled is used while it has room; after that, the first data block with
+ * room is, and is read first if other slots of it are in use
+ *
+ * @param state The open backend
+ * @param data The data (slots * LZ_SLOT_SIZE bytes)
+ * @param slots Number of slots
+ * @param entry Filled in with the place of the data
+ * @return 0 on success; <0 if the data area is full or cannot be read
+ */
+static int lz_place(LZ_STATE *state, unsigned char *data, int slots, LZ_ENTRY *entry)
+{
+  int slot = -1;
+  if(state->fill_block >= 0) {
+    slot = lz_free_run(state->live[state->fill_block] | state->durable[state->fill_block], slots);
+  }
+  if(slot < 0) {
+    int p;
+    for(p = 0; p < state->n_physical; ++p) {
+      slot = lz_free_run(state->live[p] | state->durable[p], slots);
+      if(slot >= 0) {
+        break;
+      }
+    }
+    if(p == state->n_physical || lz_put_fill(state) != 0) {
+      return(-4);
+    }
+    // The block that was filled is likely to be read again soon
+    if(state->fill_block >= 0) {
+      memcpy(state->cache, state->fill, BLOCK_SIZE);
+      state->cache_block = state->fill_block;
+    }
+    if((state->live[p] | state->durable[p]) == 0) {
+      memset(state->fill, 0, BLOCK_SIZE);
+    }else if(state->cache_block == p) {
+      memcpy(state->fill, state->cache, BLOCK_SIZE);
+    }else if(state->inner.read(&state->inner, LZ_DATA_START(state) + p, 1, state->fill) != 0) {
+      state->fill_block = -1;
+      return(-4);
+    }
+    if(state->cache_block == p) {
+      state->cache_block = -1;
+    }
+    state->fill_block = p;
+  }
+
+  memcpy(&state->fill[slot * LZ_SLOT_SIZE], data, slots * LZ_SLOT_SIZE);
+  state->live[state->fill_block] |= lz_mask(slot, slots);
+  state->fill_dirty = 1;
+  entry->physical = state->fill_block;
+  entry->slot = slot;
+  entry->slots = slots;
+  return(0);
+}
+
+/**
+ * Forget where a block is stored: it reads as zeroes
+ *
+ * @param state The open backend
+ * @param block The block
+ */
+static void lz_release(LZ_STATE *state, int block)
+{
+  LZ_ENTRY *entry = &state->entry[block];
+  if(entry->slots > 0) {
+    state->live[entry->physical] &= ~lz_mask(entry->slot, entry->slots);
+    entry->slots = 0;
+  }
+  state->map_dirty = 1;
+}
+
+/**
+ * Open the wrapped backend and load the map.  An empty wrapped backend
+ * is a new disk
+ *
+ * @param backend The backend
+ * @param name Name of the wrapped disk, with its own scheme prefix
+ * @param n_blocks Number of blocks in the layout
+ * @return 0 on success; <0 on error
+ */
+static int lz_open(VDISK_BACKEND *backend, char *name, int n_blocks)
+{
+  LZ_STATE *state = calloc(1, sizeof(LZ_STATE));
+  char *path;
+  state->inner = *vdisk_backend_lookup(name, &path);
+  state->n_blocks = n_blocks;
+  state->map_blocks = (sizeof(LZ_MAP) + n_blocks * sizeof(LZ_ENTRY) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  // Each block is stored once by each of the two maps
+  state->n_physical = 2 * n_blocks;
+  if(state->inner.open(&state->inner, path, LZ_DATA_START(state) + state->n_physical) != 0) {
+    free(state);
+    return(-1);
+  }
+
+  // Current copy of the map
+  LZ_MAP *copy[2];
+  int valid[2];
+  for(int i = 0; i < 2; ++i) {
+    copy[i] = calloc(state->map_blocks, BLOCK_SIZE);
+    valid[i] = lz_load_map(state, i, copy[i]);
+  }
+  int current = valid[1] && (!valid[0] || copy[1]->sequence > copy[0]->sequence);
+  state->map = copy[current];
+  free(copy[!current]);
+  state->entry = (LZ_ENTRY *) (state->map + 1);
+  if(!valid[current]) {
+    if(state->inner.size(&state->inner) > 0) {
+      fprintf(stderr, "vdisk: %s is not an lz: disk\n", name);
+      state->inner.close(&state->inner);
+      free(state->map);
+      free(state);
+      return(-1);
+    }
+    memset(state->map, 0, state->map_blocks * BLOCK_SIZE);
+    state->map->magic = LZ_MAGIC;
+    state->map->n_blocks = n_blocks;
+  }
+
+  state->live = calloc(state->n_physical, 1);
+  state->durable = calloc(state->n_physical, 1);
+  for(int i = 0; i < n_blocks; ++i) {
+    LZ_ENTRY *entry = &state->entry[i];
+    if(entry->slots > 0) {
+      state->live[entry->physical] |= lz_mask(entry->slot, entry->slots);
+    }
+  }
+  memcpy(state->durable, state->live, state->n_physical);
+  state->fill_block = -1;
+  state->cache_block = -1;
+  backend->state = state;
+  return(0);
+}
+
+/**
+ * Make the data blocks durable, then the map that points to them.  Data
+ * blocks that the new map no longer uses are given back afterwards
+ *
+ * @param backend The backend
+ * @return 0 on success; -4 on a failed write; -5 on a failed flush
+ */
+static int lz_flush(VDISK_BACKEND *backend)
+{
+  LZ_STATE *state = backend->state;
+  if(lz_put_fill(state) != 0) {
+    return(-4);
+  }
+  if(!state->map_dirty) {
+    return(state->inner.flush(&state->inner) == 0 ? 0 : -5);
+  }
+  if(state->inner.flush(&state->inner) != 0) {
+    return(-5);
+  }
+
+  LZ_MAP *map = state->map;
+  ++map->sequence;
+  map->checksum = lz_checksum(state, map);
+  if(state->inner.write(&state->inner, (map->sequence % 2) * state->map_blocks, state->map_blocks, map) != 0) {
+    return(-4);
+  }
+  if(state->inner.flush(&state->inner) != 0) {
+    return(-5);
+  }
+  state->map_dirty = 0;
+
+  for(int p = 0; p < state->n_physical; ++p) {
+    if(state->durable[p] == 0 || state->live[p] != 0) {
+      continue;
+    }
+    int count = 1;
+    while(p + count < state->n_physical && state->durable[p + count] != 0 && state->live[p + count] == 0) {
+      ++count;
+    }
+    if(state->inner.discard(&state->inner, LZ_DATA_START(state) + p, count) != 0) {
+      return(-4);
+    }
+    p += count - 1;
+  }
+  memcpy(state->durable, state->live, state->n_physical);
+  return(0);
+}
+
+/**
+ * Write the map if it changed and close the wrapped backend
+ *
+ * @param backend The backend
+ * @return 0 on success; <0 on error
+ */
+static int lz_close(VDISK_BACKEND *backend)
+{
+  LZ_STATE *state = backend->state;
+  int ret = lz_flush(backend);
+  if(state->inner.close(&state->inner) != 0 && ret == 0) {
+    ret = -4;
+  }
+  free(state->map);
+  free(state->live);
+  free(state->durable);
+  free(state);
+  backend->state = NULL;
+  return(ret);
+}
+
+/**
+ * Read and decompress consecutive blocks.  Blocks packed into the same
+ * data block cost one read of the wrapped backend
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -4 if the blocks do not exist, cannot be read or are corrupt
+ */
+static int lz_read(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  LZ_STATE *state = backend->state;
+  if(start < 0 || start + count > (int) state->map->extent) {
+    return(-4);
+  }
+  for(int i = 0; i < count; ++i) {
+    LZ_ENTRY *entry = &state->entry[start + i];
+    unsigned char *out = (unsigned char *) buf + (size_t) i * BLOCK_SIZE;
+    if(entry->slots == 0) {
+      memset(out, 0, BLOCK_SIZE);
+      continue;
+    }
+    unsigned char *data = state->fill;
+    if(entry->physical != state->fill_block) {
+      if(entry->physical != state->cache_block) {
+        state->cache_block = -1;
+        if(state->inner.read(&state->inner, LZ_DATA_START(state) + entry->physical, 1, state->cache) != 0) {
+          return(-4);
+        }
+        state->cache_block = entry->physical;
+      }
+      data = state->cache;
+    }
+    if(entry->slots == LZ_SLOTS) {
+      memcpy(out, data, BLOCK_SIZE);
+    }else if(vdisk_lz_decompress(&data[entry->slot * LZ_SLOT_SIZE], entry->slots * LZ_SLOT_SIZE,
+                                 out, BLOCK_SIZE) != 0) {
+      return(-4);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Compress consecutive blocks and pack them into the data area
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Source (count * BLOCK_SIZE bytes)
+ * @return 0 on success; -4 if the blocks are outside of the layout, the
+ *  data area is full or the wrapped backend failed
+ */
+static int lz_write(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  LZ_STATE *state = backend->state;
+  if(start < 0 || start + count > state->n_blocks) {
+    return(-4);
+  }
+  static const unsigned char zeroes[BLOCK_SIZE];
+  for(int i = 0; i < count; ++i) {
+    unsigned char *block = (unsigned char *) buf + (size_t) i * BLOCK_SIZE;
+    lz_release(state, start + i);
+    if(memcmp(block, zeroes, BLOCK_SIZE) == 0) {
+      continue;
+    }
+    unsigned char packed[BLOCK_SIZE];
+    int n = vdisk_lz_compress(block, BLOCK_SIZE, packed, (LZ_SLOTS - 1) * LZ_SLOT_SIZE);
+    int slots = LZ_SLOTS;
+    if(n < 0) {
+      memcpy(packed, block, BLOCK_SIZE);
+    }else {
+      slots = (n + LZ_SLOT_SIZE - 1) / LZ_SLOT_SIZE;
+      memset(&packed[n], 0, slots * LZ_SLOT_SIZE - n);
+    }
+    if(lz_place(state, packed, slots, &state->entry[start + i]) != 0) {
+      return(-4);
+    }
+  }
+  if(start + count > (int) state->map->extent) {
+    state->map->extent = start + count;
+  }
+  return(lz_put_fill(state));
+}
+
+/**
+ * Forget consecutive blocks: they read as zeroes, and their slots are
+ * given back once the map reaches the wrapped backend
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @return 0 on success; -4 if the blocks are outside of the layout
+ */
+static int lz_discard(VDISK_BACKEND *backend, int start, int count)
+{
+  LZ_STATE *state = backend->state;
+  if(start < 0 || start + count > state->n_blocks) {
+    return(-4);
+  }
+  for(int i = 0; i < count; ++i) {
+    lz_release(state, start + i);
+  }
+  return(0);
+}
+
+/**
+ * Cut or extend the disk.  Blocks that are cut read as zeroes if the disk
+ * is extended later
+ *
+ * @param backend The backend
+ * @param n_blocks New size in blocks
+ * @return 0 on success; -4 if the size is outside of the layout
+ */
+static int lz_truncate(VDISK_BACKEND *backend, int n_blocks)
+{
+  LZ_STATE *state = backend->state;
+  if(n_blocks < 0 || n_blocks > state->n_blocks) {
+    return(-4);
+  }
+  for(int i = n_blocks; i < (int) state->map->extent; ++i) {
+    lz_release(state, i);
+  }
+  state->map->extent = n_blocks;
+  state->map_dirty = 1;
+  return(0);
+}
+
+/**
+ * Number of blocks written
+ *
+ * @param backend The backend
+ * @return Size in blocks
+ */
+static long lz_size(VDISK_BACKEND *backend)
+{
+  LZ_STATE *state = backend->state;
+  return(state->map->extent);
+}
+
+/**
+ * Find the blocks of zeroes: the map knows them without any I/O
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param map map[i] is set for every block start + i of zeroes
+ * @return 0
+ */
+static int lz_zeroes(VDISK_BACKEND *backend, int start, int count, char *map)
+{
+  LZ_STATE *state = backend->state;
+  for(int i = 0; i < count && start + i < (int) state->map->extent; ++i) {
+    if(state->entry[start + i].slots == 0) {
+      map[i] = 1;
+    }
+  }
+  return(0);
+}
+
+static VDISK_BACKEND lz_backend = {
+  "lz:", lz_open, lz_close, lz_read, lz_write, lz_discard, lz_flush, lz_truncate, lz_size,
+  lz_zeroes, NULL, NULL
+};
+
+/**********************************************************************/
+// Striped backend
+
+/**
+ * Number of blocks of a member that hold blocks of the first n blocks of
+ * the striped disk
+ *
+ * @param state The open backend
+ * @param m The member
+ * @param n Blocks of the striped disk
+ * @return Blocks of the member, not counting its header
+ */
+static int stripe_member_blocks(STRIPE_STATE *state, int m, int n)
+{
+  int row = state->chunk * state->n_members;
+  int rest = n % row - m * state->chunk;
+  return(n / row * state->chunk + (rest < 0 ? 0 : rest < state->chunk ? rest : state->chunk));
+}
+
+/**
+ * Split a range of blocks of the striped disk into the range of each
+ * member.  Consecutive chunks of a member are consecutive on the member,
+ * so that each member gets a single range
+ *
+ * @param state The open backend
+ * @param op STRIPE_ operation for the members
+ * @param start First block
+ * @param count Number of blocks
+ */
+static void stripe_split(STRIPE_STATE *state, int op, int start, int count)
+{
+  for(int m = 0; m < state->n_members; ++m) {
+    state->member[m].op = op;
+    state->member[m].count = 0;
+    state->member[m].pieces = 0;
+  }
+  for(int b = start; b < start + count; ) {
+    int chunk = b / state->chunk;
+    int within = b % state->chunk;
+    int run = state->chunk - within < start + count - b ? state->chunk - within : start + count - b;
+    STRIPE_MEMBER *member = &state->member[chunk % state->n_members];
+    if(member->pieces++ == 0) {
+      member->start = chunk / state->n_members * state->chunk + within;
+      member->offset = b - start;
+    }
+    member->count += run;
+    b += run;
+  }
+}
+
+/**
+ * Copy between a request and the gathered blocks of the members that
+ * take more than one piece of it
+ *
+ * @param state The open backend
+ * @param start First block of the request
+ * @param count Number of blocks
+ * @param buf The blocks of the request
+ * @param to_members 1 to gather the request into the members; 0 to
+ *  scatter the members into the request
+ */
+static void stripe_copy(STRIPE_STATE *state, int start, int count, unsigned char *buf, int to_members)
+{
+  int done[STRIPE_MAX_MEMBERS] = {0};
+  for(int b = start; b < start + count; ) {
+    int chunk = b / state->chunk;
+    int within = b % state->chunk;
+    int run = state->chunk - within < start + count - b ? state->chunk - within : start + count - b;
+    int m = chunk % state->n_members;
+    if(state->member[m].pieces > 1) {
+      unsigned char *gathered = state->member[m].bounce + (size_t) done[m] * BLOCK_SIZE;
+      unsigned char *request = buf + (size_t) (b - start) * BLOCK_SIZE;
+      memcpy(to_members ? gathered : request, to_members ? request : gathered, (size_t) run * BLOCK_SIZE);
+    }
+    done[m] += run;
+    b += run;
+  }
+}
+
+/**
+ * Carry out the part of a request that falls to one member
+ *
+ * @param member The member
+ * @return What its backend returned
+ */
+static int stripe_member_run(STRIPE_MEMBER *member)
+{
+  VDISK_BACKEND *backend = &member->backend;
+  switch(member->op) {
+  case STRIPE_READ:
+    return(backend->read(backend, 1 + member->start, member->count, member->buf));
+  case STRIPE_WRITE:
+    return(backend->write(backend, 1 + member->start, member->count, member->buf));
+  case STRIPE_DISCARD:
+    return(backend->discard(backend, 1 + member->start, member->count));
+  default:
+    return(backend->flush(backend));
+  }
+}
+
+/**
+ * Thread of a member: carries out its part of every request
+ *
+ * @param arg The member
+ * @return NULL
+ */
+static void *stripe_member_thread(void *arg)
+{
+  STRIPE_MEMBER *member = arg;
+  STRIPE_STATE *state = member->stripe;
+  pthread_mutex_lock(&state->lock);
+  for(;;) {
+    while(!member->pending && !state->quit) {
+      pthread_cond_wait(&state->work, &state->lock);
+    }
+    if(state->quit) {
+      break;
+    }
+    pthread_mutex_unlock(&state->lock);
+    int ret = stripe_member_run(member);
+    pthread_mutex_lock(&state->lock);
+    member->ret = ret;
+    member->pending = 0;
+    if(--state->outstanding == 0) {
+      pthread_cond_signal(&state->finished);
+    }
+  }
+  pthread_mutex_unlock(&state->lock);
+  return(NULL);
+}
+
+/**
+ * Carry out a request on every member that has a part in it (count > 0,
+ * or a flush), in parallel.  The calling thread takes the first part
+ * itself, so that a request for a single member costs no thread switch
+ *
+ * @param state The open backend
+ * @return 0 on success; else what the first member that failed returned
+ */
+static int stripe_run(STRIPE_STATE *state)
+{
+  STRIPE_MEMBER *own = NULL;
+  pthread_mutex_lock(&state->lock);
+  for(int m = 0; m < state->n_members; ++m) {
+    STRIPE_MEMBER *member = &state->member[m];
+    member->ret = 0;
+    if(member->count == 0 && member->op != STRIPE_FLUSH) {
+      continue;
+    }
+    if(own == NULL) {
+      own = member;
+    }else {
+      member->pending = 1;
+      ++state->outstanding;
+    }
+  }
+  if(state->outstanding > 0) {
+    pthread_cond_broadcast(&state->work);
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  if(own != NULL) {
+    own->ret = stripe_member_run(own);
+  }
+
+  pthread_mutex_lock(&state->lock);
+  while(state->outstanding > 0) {
+    pthread_cond_wait(&state->finished, &state->lock);
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  for(int m = 0; m < state->n_members; ++m) {
+    if(state->member[m].ret != 0) {
+      return(state->member[m].ret);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Stop the member threads and close the members
+ *
+ * @param state The open backend
+ * @param n_threads Number of member threads that were started
+ * @param n_open Number of members that were opened
+ * @return 0 on success; <0 if a member failed to close
+ */
+static int stripe_shutdown(STRIPE_STATE *state, int n_threads, int n_open)
+{
+  pthread_mutex_lock(&state->lock);
+  state->quit = 1;
+  pthread_cond_broadcast(&state->work);
+  pthread_mutex_unlock(&state->lock);
+  int ret = 0;
+  for(int m = 0; m < n_threads; ++m) {
+    pthread_join(state->member[m].thread, NULL);
+  }
+  for(int m = 0; m < n_open; ++m) {
+    if(state->member[m].backend.close(&state->member[m].backend) != 0) {
+      ret = -4;
+    }
+    free(state->member[m].bounce);
+  }
+  pthread_mutex_destroy(&state->lock);
+  pthread_cond_destroy(&state->work);
+  pthread_cond_destroy(&state->finished);
+  free(state->names);
+  free(state);
+  return(ret);
+}
+
+/**
+ * Open the members, check or write their headers, and start a thread for
+ * each.  A member is new if it is empty; then every member has to be.
+ * New disks take their chunk size from ZSTRIPE
+ *
+ * @param backend The backend
+ * @param name Comma separated names of the members, each with its own
+ *  scheme prefix
+ * @param n_blocks Number of blocks in the layout
+ * @return 0 on success; <0 on error
+ */
+static int stripe_open(VDISK_BACKEND *backend, char *name, int n_blocks)
+{
+  STRIPE_STATE *state = calloc(1, sizeof(STRIPE_STATE));
+  state->names = strdup(name);
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->work, NULL);
+  pthread_cond_init(&state->finished, NULL);
+
+  char *member_name[STRIPE_MAX_MEMBERS];
+  for(char *next = strtok(state->names, ","); next != NULL; next = strtok(NULL, ",")) {
+    if(state->n_members == STRIPE_MAX_MEMBERS) {
+      fprintf(stderr, "vdisk: stripe: more than %d members\n", STRIPE_MAX_MEMBERS);
+      stripe_shutdown(state, 0, 0);
+      return(-1);
+    }
+    for(int m = 0; m < state->n_members; ++m) {
+      if(!strcmp(member_name[m], next)) {
+        fprintf(stderr, "vdisk: stripe: %s is listed twice\n", next);
+        stripe_shutdown(state, 0, 0);
+        return(-1);
+      }
+    }
+    member_name[state->n_members++] = next;
+  }
+  if(state->n_members == 0) {
+    fprintf(stderr, "vdisk: stripe: no members\n");
+    stripe_shutdown(state, 0, 0);
+    return(-1);
+  }
+  char *chunk = getenv(STRIPE_ENVIRONMENT);
+  state->chunk = chunk != NULL && atoi(chunk) > 0 ? atoi(chunk) : STRIPE_CHUNK_BLOCKS;
+
+  // Members that already belong to a striped disk fix its chunk size
+  unsigned char raw[BLOCK_SIZE];
+  STRIPE_HEADER *header = (STRIPE_HEADER *) raw;
+  int n_new = 0;
+  for(int m = 0; m < state->n_members; ++m) {
+    STRIPE_MEMBER *member = &state->member[m];
+    char *path;
+    member->backend = *vdisk_backend_lookup(member_name[m], &path);
+    member->stripe = state;
+    // Its share of the layout depends on the chunk size, which is not known yet
+    if(member->backend.open(&member->backend, path, 1 + n_blocks) != 0) {
+      fprintf(stderr, "vdisk: stripe: cannot open %s\n", member_name[m]);
+      stripe_shutdown(state, 0, m);
+      return(-1);
+    }
+    if(member->backend.size(&member->backend) == 0) {
+      ++n_new;
+      continue;
+    }
+    if(member->backend.read(&member->backend, 0, 1, raw) != 0 || header->magic != STRIPE_MAGIC ||
+       header->n_members != (unsigned int) state->n_members || header->member != (unsigned int) m ||
+       header->n_blocks != (unsigned int) n_blocks || header->chunk == 0) {
+      fprintf(stderr, "vdisk: stripe: %s is not member %d of this disk\n", member_name[m], m);
+      stripe_shutdown(state, 0, m + 1);
+      return(-1);
+    }
+    state->chunk = header->chunk;
+  }
+  if(n_new > 0 && n_new < state->n_members) {
+    fprintf(stderr, "vdisk: stripe: some members are empty, others are not\n");
+    stripe_shutdown(state, 0, state->n_members);
+    return(-1);
+  }
+
+  for(int m = 0; m < state->n_members; ++m) {
+    STRIPE_MEMBER *member = &state->member[m];
+    if(n_new > 0) {
+      memset(raw, 0, sizeof(raw));
+      header->magic = STRIPE_MAGIC;
+      header->n_members = state->n_members;
+      header->member = m;
+      header->chunk = state->chunk;
+      header->n_blocks = n_blocks;
+      if(member->backend.write(&member->backend, 0, 1, raw) != 0) {
+        fprintf(stderr, "vdisk: stripe: cannot write the header of %s\n", member_name[m]);
+        stripe_shutdown(state, m, state->n_members);
+        return(-1);
+      }
+    }
+    // A request takes at most one range of a member: whole chunks, and
+    //  parts of two more
+    member->bounce = malloc(((size_t) stripe_member_blocks(state, m, n_blocks) + 2 * state->chunk) * BLOCK_SIZE);
+    if(pthread_create(&member->thread, NULL, stripe_member_thread, member) != 0) {
+      free(member->bounce);
+      member->bounce = NULL;
+      stripe_shutdown(state, m, state->n_members);
+      return(-1);
+    }
+  }
+  backend->state = state;
+  return(0);
+}
+
+/**
+ * Stop the member threads and close the members
+ *
+ * @param backend The backend
+ * @return 0 on success; <0 if a member failed to close
+ */
+static int stripe_close(VDISK_BACKEND *backend)
+{
+  STRIPE_STATE *state = backend->state;
+  backend->state = NULL;
+  return(stripe_shutdown(state, state->n_members, state->n_members));
+}
+
+/**
+ * Read consecutive blocks: one read of each member, in parallel
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; else what the first member that failed returned
+ */
+static int stripe_read(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  STRIPE_STATE *state = backend->state;
+  stripe_split(state, STRIPE_READ, start, count);
+  for(int m = 0; m < state->n_members; ++m) {
+    STRIPE_MEMBER *member = &state->member[m];
+    member->buf = member->pieces > 1 ? member->bounce : (unsigned char *) buf + (size_t) member->offset * BLOCK_SIZE;
+  }
+  int ret = stripe_run(state);
+  if(ret == 0) {
+    stripe_copy(state, start, count, buf, 0);
+  }
+  return(ret);
+}
+
+/**
+ * Write consecutive blocks: one write to each member, in parallel
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Source (count * BLOCK_SIZE bytes)
+ * @return 0 on success; else what the first member that failed returned
+ */
+static int stripe_write(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  STRIPE_STATE *state = backend->state;
+  stripe_split(state, STRIPE_WRITE, start, count);
+  for(int m = 0; m < state->n_members; ++m) {
+    STRIPE_MEMBER *member = &state->member[m];
+    member->buf = member->pieces > 1 ? member->bounce : (unsigned char *) buf + (size_t) member->offset * BLOCK_SIZE;
+  }
+  stripe_copy(state, start, count, buf, 1);
+  return(stripe_run(state));
+}
+
+/**
+ * Give back the space of consecutive blocks, on each member in parallel
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @return 0 on success; else what the first member that failed returned
+ */
+static int stripe_discard(VDISK_BACKEND *backend, int start, int count)
+{
+  STRIPE_STATE *state = backend->state;
+  stripe_split(state, STRIPE_DISCARD, start, count);
+  return(stripe_run(state));
+}
+
+/**
+ * Flush every member, in parallel
+ *
+ * @param backend The backend
+ * @return 0 on success; else what the first member that failed returned
+ */
+static int stripe_flush(VDISK_BACKEND *backend)
+{
+  STRIPE_STATE *state = backend->state;
+  stripe_split(state, STRIPE_FLUSH, 0, 0);
+  return(stripe_run(state));
+}
+
+/**
+ * Cut or extend every member to its share of the blocks
+ *
+ * @param backend The backend
+ * @param n_blocks New size in blocks
+ * @return 0 on success; else what the first member that failed returned
+ */
+static int stripe_truncate(VDISK_BACKEND *backend, int n_blocks)
+{
+  STRIPE_STATE *state = backend->state;
+  for(int m = 0; m < state->n_members; ++m) {
+    VDISK_BACKEND *member = &state->member[m].backend;
+    int ret = member->truncate(member, 1 + stripe_member_blocks(state, m, n_blocks));
+    if(ret != 0) {
+      return(ret);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Number of blocks stored: every block up to the last one that a member
+ * holds
+ *
+ * @param backend The backend
+ * @return Size in blocks
+ */
+static long stripe_size(VDISK_BACKEND *backend)
+{
+  STRIPE_STATE *state = backend->state;
+  long size = 0;
+  for(int m = 0; m < state->n_members; ++m) {
+    long blocks = state->member[m].backend.size(&state->member[m].backend) - 1;
+    if(blocks > 0) {
+      long last = blocks - 1;
+      long end = (last / state->chunk * state->n_members + m) * state->chunk + last % state->chunk + 1;
+      size = end > size ? end : size;
+    }
+  }
+  return(size);
+}
+
+/**
+ * Find the blocks that read as zeroes, asking each member about its range
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param map map[i] is set for every block start + i that reads as zeroes
+ * @return 0 on success; else what the first member that failed returned
+ */
+static int stripe_zeroes(VDISK_BACKEND *backend, int start, int count, char *map)
+{
+  STRIPE_STATE *state = backend->state;
+  stripe_split(state, STRIPE_READ, start, count);
+  for(int m = 0; m < state->n_members; ++m) {
+    STRIPE_MEMBER *member = &state->member[m];
+    // The bounce buffer holds a byte for every block of the range
+    memset(member->bounce, 0, member->count);
+    if(member->count > 0) {
+      int ret = member->backend.zeroes(&member->backend, 1 + member->start, member->count, (char *) member->bounce);
+      if(ret != 0) {
+        return(ret);
+      }
+    }
+  }
+  int done[STRIPE_MAX_MEMBERS] = {0};
+  for(int i = 0; i < count; ++i) {
+    int m = (start + i) / state->chunk % state->n_members;
+    map[i] |= state->member[m].bounce[done[m]++];
+  }
+  return(0);
+}
+
+static VDISK_BACKEND stripe_backend = {
+  "stripe:", stripe_open, stripe_close, stripe_read, stripe_write, stripe_discard, stripe_flush,
+  stripe_truncate, stripe_size, stripe_zeroes, NULL, NULL
+};
+
+/**********************************************************************/
+// Mirrored backend
+
+/**
+ * Write the dirty region bitmap to the primary
+ *
+ * @param state The open backend
+ * @param sync Also make it durable before any write that follows
+ * @return 0 on success; else what the primary returned
+ */
+static int mirror_write_bitmap(MIRROR_STATE *state, int sync)
+{
+  unsigned char raw[BLOCK_SIZE];
+  // Writers take the primary first, so that the newest bitmap is written last
+  pthread_mutex_lock(&state->primary_lock);
+  pthread_mutex_lock(&state->lock);
+  memcpy(raw, state->dirty, BLOCK_SIZE);
+  pthread_mutex_unlock(&state->lock);
+  int ret = state->primary.write(&state->primary, 1, 1, raw);
+  if(ret == 0 && sync) {
+    ret = state->primary.flush(&state->primary);
+  }
+  pthread_mutex_unlock(&state->primary_lock);
+  return(ret);
+}
+
+/**
+ * Hold the regions of a change dirty until it reaches the secondary.  A
+ * region that was clean becomes dirty in the primary before the change
+ * is written, so that a crash cannot leave a change on the primary alone
+ * without its region marked.  Called with lock held
+ *
+ * @param state The open backend
+ * @param first First region
+ * @param last Last region
+ * @return 1 if a region became dirty; 0 otherwise
+ */
+static int mirror_hold(MIRROR_STATE *state, int first, int last)
+{
+  int newly = 0;
+  for(int r = first; r <= last && r < state->n_regions; ++r) {
+    if(!(state->dirty[r >> 3] & (1 << (r & 7)))) {
+      state->dirty[r >> 3] |= 1 << (r & 7);
+      newly = 1;
+    }
+    ++state->pending[r];
+  }
+  return(newly);
+}
+
+/**
+ * Let go of the regions of a change.  Called with lock held
+ *
+ * @param state The open backend
+ * @param first First region
+ * @param last Last region
+ * @param failed The change did not reach the secondary: copy the regions whole
+ */
+static void mirror_release(MIRROR_STATE *state, int first, int last, int failed)
+{
+  for(int r = first; r <= last && r < state->n_regions; ++r) {
+    --state->pending[r];
+    if(failed) {
+      state->stale[r] = 1;
+    }
+  }
+}
+
+/**
+ * Carry out a change on the secondary
+ *
+ * @param state The open backend
+ * @param item The change
+ * @return What the secondary returned
+ */
+static int mirror_apply(MIRROR_STATE *state, MIRROR_ITEM *item)
+{
+  VDISK_BACKEND *secondary = &state->secondary;
+  pthread_mutex_lock(&state->secondary_lock);
+  int ret;
+  switch(item->op) {
+  case MIRROR_WRITE:
+    ret = secondary->write(secondary, MIRROR_DATA_START + item->start, item->count, item->data);
+    break;
+  case MIRROR_DISCARD:
+    ret = secondary->discard(secondary, MIRROR_DATA_START + item->start, item->count);
+    break;
+  default:
+    ret = secondary->truncate(secondary, MIRROR_DATA_START + item->count);
+    break;
+  }
+  pthread_mutex_unlock(&state->secondary_lock);
+  return(ret);
+}
+
+/**
+ * Copy one region whole from the primary to the secondary
+ *
+ * @param state The open backend
+ * @param r The region
+ * @return 0 on success; <0 on error
+ */
+static int mirror_copy_region(MIRROR_STATE *state, int r)
+{
+  unsigned char data[MIRROR_REGION_BLOCKS * BLOCK_SIZE];
+  pthread_mutex_lock(&state->primary_lock);
+  long size = state->primary.size(&state->primary) - MIRROR_DATA_START;
+  int start = r * MIRROR_REGION_BLOCKS;
+  int count = size - start < MIRROR_REGION_BLOCKS ? size - start : MIRROR_REGION_BLOCKS;
+  int ret = count <= 0 ? 0 : state->primary.read(&state->primary, MIRROR_DATA_START + start, count, data);
+  pthread_mutex_unlock(&state->primary_lock);
+  if(ret != 0 || count <= 0) {
+    return(ret);
+  }
+  MIRROR_ITEM item = {NULL, MIRROR_WRITE, start, count, data, r, r};
+  return(mirror_apply(state, &item));
+}
+
+/**
+ * The mirror thread: applies the queued changes to the secondary in
+ * order, copies stale regions, and once it has caught up, flushes the
+ * secondary and marks the regions that it holds clean again
+ *
+ * @param arg The open backend
+ * @return NULL
+ */
+static void *mirror_thread(void *arg)
+{
+  MIRROR_STATE *state = arg;
+  pthread_mutex_lock(&state->lock);
+  for(;;) {
+    if(!state->have_secondary) {
+      // Drop the queue; the regions stay dirty for the next open
+      while(state->head != NULL) {
+        MIRROR_ITEM *item = state->head;
+        state->head = item->next;
+        state->queued_blocks -= item->op == MIRROR_WRITE ? item->count : 0;
+        mirror_release(state, item->first_region, item->last_region, 1);
+        free(item->data);
+        free(item);
+      }
+      state->tail = NULL;
+    }else if(state->head != NULL) {
+      MIRROR_ITEM *item = state->head;
+      state->head = item->next;
+      if(state->head == NULL) {
+        state->tail = NULL;
+      }
+      state->queued_blocks -= item->op == MIRROR_WRITE ? item->count : 0;
+      pthread_mutex_unlock(&state->lock);
+      int ret = mirror_apply(state, item);
+      pthread_mutex_lock(&state->lock);
+      if(ret != 0) {
+        fprintf(stderr, "vdisk: mirror: %s failed; running without it\n", state->secondary_name);
+        state->have_secondary = 0;
+      }
+      mirror_release(state, item->first_region, item->last_region, ret != 0);
+      state->unflushed = 1;
+      free(item->data);
+      free(item);
+      continue;
+    }
+
+    int r;
+    for(r = 0; state->have_secondary && r < state->n_regions && !state->stale[r]; ++r);
+    if(state->have_secondary && r < state->n_regions) {
+      state->stale[r] = 0;
+      ++state->pending[r];
+      pthread_mutex_unlock(&state->lock);
+      int ret = mirror_copy_region(state, r);
+      pthread_mutex_lock(&state->lock);
+      if(ret != 0) {
+        fprintf(stderr, "vdisk: mirror: %s failed; running without it\n", state->secondary_name);
+        state->have_secondary = 0;
+      }
+      mirror_release(state, r, r, ret != 0);
+      state->unflushed = 1;
+      continue;
+    }
+
+    if(state->have_secondary && state->unflushed) {
+      // Changes queued from now on keep their regions pending
+      state->unflushed = 0;
+      pthread_mutex_unlock(&state->lock);
+      pthread_mutex_lock(&state->secondary_lock);
+      int ret = state->secondary.flush(&state->secondary);
+      pthread_mutex_unlock(&state->secondary_lock);
+      pthread_mutex_lock(&state->lock);
+      if(ret != 0) {
+        fprintf(stderr, "vdisk: mirror: %s failed; running without it\n", state->secondary_name);
+        state->have_secondary = 0;
+        continue;
+      }
+      int cleaned = 0;
+      for(r = 0; r < state->n_regions; ++r) {
+        if(state->pending[r] == 0 && !state->stale[r] && (state->dirty[r >> 3] & (1 << (r & 7)))) {
+          state->dirty[r >> 3] &= ~(1 << (r & 7));
+          cleaned = 1;
+        }
+      }
+      if(cleaned) {
+        // Clean regions need no sync: marked dirty, they only cost a copy
+        pthread_mutex_unlock(&state->lock);
+        mirror_write_bitmap(state, 0);
+        pthread_mutex_lock(&state->lock);
+      }
+      continue;
+    }
+
+    if(state->quit) {
+      break;
+    }
+    state->idle = 1;
+    pthread_cond_broadcast(&state->caught_up);
+    pthread_cond_wait(&state->work, &state->lock);
+  }
+  pthread_mutex_unlock(&state->lock);
+  return(NULL);
+}
+
+/**
+ * Hold the regions of a change on the primary, and mark them dirty in the
+ * primary first if they were clean
+ *
+ * @param state The open backend
+ * @param start First block of the change
+ * @param end Block after the change
+ * @param item Filled in with the regions
+ * @return 0 on success; <0 if the bitmap could not be written
+ */
+static int mirror_begin(MIRROR_STATE *state, int start, int end, MIRROR_ITEM *item)
+{
+  item->first_region = start / MIRROR_REGION_BLOCKS;
+  item->last_region = end > start ? (end - 1) / MIRROR_REGION_BLOCKS : item->first_region;
+  pthread_mutex_lock(&state->lock);
+  int newly = mirror_hold(state, item->first_region, item->last_region);
+  pthread_mutex_unlock(&state->lock);
+  if(newly && mirror_write_bitmap(state, 1) != 0) {
+    pthread_mutex_lock(&state->lock);
+    mirror_release(state, item->first_region, item->last_region, 0);
+    pthread_mutex_unlock(&state->lock);
+    return(-4);
+  }
+  return(0);
+}
+
+/**
+ * Queue a change that reached the primary for the secondary.  When the
+ * queue is full, or there is no secondary, the change is not queued and
+ * its regions are copied whole later instead
+ *
+ * @param state The open backend
+ * @param item The change, with its regions held
+ * @param ret What the primary returned for the change
+ * @param buf Blocks written by the change (NULL for others)
+ * @return ret
+ */
+static int mirror_queue(MIRROR_STATE *state, MIRROR_ITEM *item, int ret, void *buf)
+{
+  pthread_mutex_lock(&state->lock);
+  int blocks = buf != NULL ? item->count : 0;
+  if(ret != 0 || !state->have_secondary || state->queued_blocks + blocks > MIRROR_QUEUE_BLOCKS) {
+    mirror_release(state, item->first_region, item->last_region, ret == 0);
+  }else {
+    MIRROR_ITEM *queued = malloc(sizeof(MIRROR_ITEM));
+    *queued = *item;
+    queued->next = NULL;
+    queued->data = NULL;
+    if(buf != NULL) {
+      queued->data = malloc((size_t) blocks * BLOCK_SIZE);
+      memcpy(queued->data, buf, (size_t) blocks * BLOCK_SIZE);
+    }
+    if(state->tail != NULL) {
+      state->tail->next = queued;
+    }else {
+      state->head = queued;
+    }
+    state->tail = queued;
+    state->queued_blocks += blocks;
+  }
+  state->idle = 0;
+  pthread_cond_signal(&state->work);
+  pthread_mutex_unlock(&state->lock);
+  return(ret);
+}
+
+/**
+ * Wait until the mirror thread has caught up, stop it, and close the members
+ *
+ * @param state The open backend
+ * @return 0 on success; <0 if a member failed to close
+ */
+static int mirror_shutdown(MIRROR_STATE *state)
+{
+  pthread_mutex_lock(&state->lock);
+  while(!state->idle) {
+    pthread_cond_wait(&state->caught_up, &state->lock);
+  }
+  state->quit = 1;
+  pthread_cond_signal(&state->work);
+  pthread_mutex_unlock(&state->lock);
+  pthread_join(state->thread, NULL);
+
+  int ret = 0;
+  if(state->have_secondary && state->secondary.close(&state->secondary) != 0) {
+    ret = -4;
+  }
+  if(state->primary.flush(&state->primary) != 0 || state->primary.close(&state->primary) != 0) {
+    ret = -4;
+  }
+  pthread_mutex_destroy(&state->lock);
+  pthread_mutex_destroy(&state->primary_lock);
+  pthread_mutex_destroy(&state->secondary_lock);
+  pthread_cond_destroy(&state->work);
+  pthread_cond_destroy(&state->caught_up);
+  free(state->pending);
+  free(state->stale);
+  free(state->names);
+  free(state);
+  return(ret);
+}
+
+/**
+ * Open both members.  A new (empty) primary gets a header; a new
+ * secondary gets a copy of every region, one that fell behind gets a copy
+ * of the dirty regions.  Without a secondary, the disk runs on the
+ * primary alone and keeps track of the regions that change
+ *
+ * @param backend The backend
+ * @param name The names of the primary and the secondary, separated by a
+ *  comma, each with its own scheme prefix
+ * @param n_blocks Number of blocks in the layout
+ * @return 0 on success; <0 on error
+ */
+static int mirror_open(VDISK_BACKEND *backend, char *name, int n_blocks)
+{
+  char *comma = strchr(name, ',');
+  int n_regions = (n_blocks + MIRROR_REGION_BLOCKS - 1) / MIRROR_REGION_BLOCKS;
+  if(comma == NULL || n_regions > BLOCK_SIZE * 8) {
+    fprintf(stderr, "vdisk: mirror: %s\n", comma == NULL ? "needs primary,secondary" : "too many regions");
+    return(-1);
+  }
+  MIRROR_STATE *state = calloc(1, sizeof(MIRROR_STATE));
+  state->names = strdup(name);
+  state->names[comma - name] = 0;
+  state->secondary_name = &state->names[comma - name + 1];
+  state->n_regions = n_regions;
+  state->pending = calloc(n_regions, sizeof(int));
+  state->stale = calloc(n_regions, 1);
+
+  // The primary
+  unsigned char raw[BLOCK_SIZE];
+  MIRROR_HEADER *header = (MIRROR_HEADER *) raw;
+  char *path;
+  state->primary = *vdisk_backend_lookup(state->names, &path);
+  if(state->primary.open(&state->primary, path, MIRROR_DATA_START + n_blocks) != 0) {
+    fprintf(stderr, "vdisk: mirror: cannot open %s\n", state->names);
+    free(state->pending);
+    free(state->stale);
+    free(state->names);
+    free(state);
+    return(-1);
+  }
+  int new_primary = state->primary.size(&state->primary) == 0;
+  if(new_primary) {
+    memset(raw, 0, sizeof(raw));
+    header->magic = MIRROR_MAGIC;
+    header->id = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+    header->n_blocks = n_blocks;
+    if(state->primary.write(&state->primary, 0, 1, raw) != 0 ||
+       state->primary.write(&state->primary, 1, 1, state->dirty) != 0) {
+      fprintf(stderr, "vdisk: mirror: cannot write the header of %s\n", state->names);
+      state->primary.close(&state->primary);
+      free(state->pending);
+      free(state->stale);
+      free(state->names);
+      free(state);
+      return(-1);
+    }
+  }else if(state->primary.read(&state->primary, 0, 1, raw) != 0 || header->magic != MIRROR_MAGIC ||
+           header->n_blocks != (unsigned int) n_blocks ||
+           state->primary.read(&state->primary, 1, 1, state->dirty) != 0) {
+    fprintf(stderr, "vdisk: mirror: %s is not the primary of a mirrored disk\n", state->names);
+    state->primary.close(&state->primary);
+    free(state->pending);
+    free(state->stale);
+    free(state->names);
+    free(state);
+    return(-1);
+  }
+  state->id = header->id;
+
+  // The secondary: stale where the primary says the members differ
+  unsigned char secondary_raw[BLOCK_SIZE];
+  MIRROR_HEADER *secondary_header = (MIRROR_HEADER *) secondary_raw;
+  state->secondary = *vdisk_backend_lookup(state->secondary_name, &path);
+  if(state->secondary.open(&state->secondary, path, MIRROR_DATA_START + n_blocks) != 0) {
+    fprintf(stderr, "vdisk: mirror: cannot open %s; running without it\n", state->secondary_name);
+  }else if(state->secondary.size(&state->secondary) == 0) {
+    // Both members start empty, or the secondary gets everything.  The
+    //  regions are marked in the primary, durably, before the header makes
+    //  the secondary a member: a crash in between must not leave an empty
+    //  secondary that matches a clean bitmap
+    for(int r = 0; !new_primary && r < n_regions; ++r) {
+      state->dirty[r >> 3] |= 1 << (r & 7);
+    }
+    if(!new_primary && (state->primary.write(&state->primary, 1, 1, state->dirty) != 0 ||
+                        state->primary.flush(&state->primary) != 0)) {
+      fprintf(stderr, "vdisk: mirror: cannot write the bitmap of %s; running without %s\n",
+              state->names, state->secondary_name);
+      state->secondary.close(&state->secondary);
+    }else if(state->secondary.write(&state->secondary, 0, 1, raw) == 0) {
+      state->have_secondary = 1;
+      memset(state->stale, !new_primary, n_regions);
+    }else {
+      fprintf(stderr, "vdisk: mirror: cannot write %s; running without it\n", state->secondary_name);
+      state->secondary.close(&state->secondary);
+    }
+  }else if(state->secondary.read(&state->secondary, 0, 1, secondary_raw) == 0 &&
+           memcmp(secondary_header, header, sizeof(MIRROR_HEADER)) == 0) {
+    state->have_secondary = 1;
+    for(int r = 0; r < n_regions; ++r) {
+      state->stale[r] = (state->dirty[r >> 3] >> (r & 7)) & 1;
+    }
+  }else {
+    fprintf(stderr, "vdisk: mirror: %s is not a mirror of %s; running without it\n",
+            state->secondary_name, state->names);
+    state->secondary.close(&state->secondary);
+  }
+  // Stale regions are already dirty in the primary
+  int n_stale = 0;
+  for(int r = 0; r < n_regions; ++r) {
+    n_stale += state->stale[r];
+  }
+  if(n_stale > 0) {
+    fprintf(stderr, "vdisk: mirror: copying %d of %d regions to %s\n", n_stale, n_regions, state->secondary_name);
+  }
+
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_mutex_init(&state->primary_lock, NULL);
+  pthread_mutex_init(&state->secondary_lock, NULL);
+  pthread_cond_init(&state->work, NULL);
+  pthread_cond_init(&state->caught_up, NULL);
+  pthread_create(&state->thread, NULL, mirror_thread, state);
+  backend->state = state;
+  return(0);
+}
+
+/**
+ * Wait until the secondary has caught up, and close both members
+ *
+ * @param backend The backend
+ * @return 0 on success; <0 if a member failed to close
+ */
+static int mirror_close(VDISK_BACKEND *backend)
+{
+  MIRROR_STATE *state = backend->state;
+  backend->state = NULL;
+  return(mirror_shutdown(state));
+}
+
+/**
+ * Read consecutive blocks.  Blocks whose regions are clean are the same
+ * on both members, so such reads alternate between them; a failed read
+ * of the secondary is tried on the primary
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; else what the primary returned
+ */
+static int mirror_read(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  MIRROR_STATE *state = backend->state;
+  int use_secondary = 0;
+  pthread_mutex_lock(&state->lock);
+  if(state->have_secondary) {
+    use_secondary = state->next_read++ & 1;
+    for(int r = start / MIRROR_REGION_BLOCKS; use_secondary && r <= (start + count - 1) / MIRROR_REGION_BLOCKS; ++r) {
+      use_secondary = !((state->dirty[r >> 3] >> (r & 7)) & 1);
+    }
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  if(use_secondary) {
+    pthread_mutex_lock(&state->secondary_lock);
+    int ret = state->secondary.read(&state->secondary, MIRROR_DATA_START + start, count, buf);
+    pthread_mutex_unlock(&state->secondary_lock);
+    if(ret == 0) {
+      return(0);
+    }
+  }
+  pthread_mutex_lock(&state->primary_lock);
+  int ret = state->primary.read(&state->primary, MIRROR_DATA_START + start, count, buf);
+  pthread_mutex_unlock(&state->primary_lock);
+  return(ret);
+}
+
+/**
+ * Write consecutive blocks to the primary, and queue them for the secondary
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Source (count * BLOCK_SIZE bytes)
+ * @return 0 on success; else what the primary returned
+ */
+static int mirror_write(VDISK_BACKEND *backend, int start, int count, void *buf)
+{
+  MIRROR_STATE *state = backend->state;
+  MIRROR_ITEM item = {NULL, MIRROR_WRITE, start, count, NULL, 0, 0};
+  if(mirror_begin(state, start, start + count, &item) != 0) {
+    return(-4);
+  }
+  pthread_mutex_lock(&state->primary_lock);
+  int ret = state->primary.write(&state->primary, MIRROR_DATA_START + start, count, buf);
+  pthread_mutex_unlock(&state->primary_lock);
+  return(mirror_queue(state, &item, ret, buf));
+}
+
+/**
+ * Discard consecutive blocks on the primary, and queue the discard for
+ * the secondary
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @return 0 on success; else what the primary returned
+ */
+static int mirror_discard(VDISK_BACKEND *backend, int start, int count)
+{
+  MIRROR_STATE *state = backend->state;
+  MIRROR_ITEM item = {NULL, MIRROR_DISCARD, start, count, NULL, 0, 0};
+  if(mirror_begin(state, start, start + count, &item) != 0) {
+    return(-4);
+  }
+  pthread_mutex_lock(&state->primary_lock);
+  int ret = state->primary.discard(&state->primary, MIRROR_DATA_START + start, count);
+  pthread_mutex_unlock(&state->primary_lock);
+  return(mirror_queue(state, &item, ret, NULL));
+}
+
+/**
+ * Make the writes to the primary durable.  The secondary is flushed by
+ * the mirror thread, in the background
+ *
+ * @param backend The backend
+ * @return What the primary returned
+ */
+static int mirror_flush(VDISK_BACKEND *backend)
+{
+  MIRROR_STATE *state = backend->state;
+  pthread_mutex_lock(&state->primary_lock);
+  int ret = state->primary.flush(&state->primary);
+  pthread_mutex_unlock(&state->primary_lock);
+  return(ret);
+}
+
+/**
+ * Cut or extend the primary, and queue the same for the secondary
+ *
+ * @param backend The backend
+ * @param n_blocks New size in blocks
+ * @return 0 on success; else what the primary returned
+ */
+static int mirror_truncate(VDISK_BACKEND *backend, int n_blocks)
+{
+  MIRROR_STATE *state = backend->state;
+  pthread_mutex_lock(&state->primary_lock);
+  long size = state->primary.size(&state->primary) - MIRROR_DATA_START;
+  pthread_mutex_unlock(&state->primary_lock);
+  // Every block from the smaller size on changes
+  MIRROR_ITEM item = {NULL, MIRROR_TRUNCATE, 0, n_blocks, NULL, 0, 0};
+  if(mirror_begin(state, size < n_blocks ? size : n_blocks, state->n_regions * MIRROR_REGION_BLOCKS, &item) != 0) {
+    return(-4);
+  }
+  pthread_mutex_lock(&state->primary_lock);
+  int ret = state->primary.truncate(&state->primary, MIRROR_DATA_START + n_blocks);
+  pthread_mutex_unlock(&state->primary_lock);
+  return(mirror_queue(state, &item, ret, NULL));
+}
+
+/**
+ * Number of blocks stored by the primary
+ *
+ * @param backend The backend
+ * @return Size in blocks
+ */
+static long mirror_size(VDISK_BACKEND *backend)
+{
+  MIRROR_STATE *state = backend->state;
+  pthread_mutex_lock(&state->primary_lock);
+  long size = state->primary.size(&state->primary) - MIRROR_DATA_START;
+  pthread_mutex_unlock(&state->primary_lock);
+  return(size > 0 ? size : 0);
+}
+
+/**
+ * Find the blocks of the primary that read as zeroes
+ *
+ * @param backend The backend
+ * @param start First block
+ * @param count Number of blocks
+ * @param map map[i] is set for every block start + i that reads as zeroes
+ * @return What the primary returned
+ */
+static int mirror_zeroes(VDISK_BACKEND *backend, int start, int count, char *map)
+{
+  MIRROR_STATE *state = backend->state;
+  pthread_mutex_lock(&state->primary_lock);
+  int ret = state->primary.zeroes(&state->primary, MIRROR_DATA_START + start, count, map);
+  pthread_mutex_unlock(&state->primary_lock);
+  return(ret);
+}
+
+/**
+ * Read consecutive blocks from one member: copy 0 is the primary, copy 1
+ * the secondary.  Blocks of dirty regions are read from the secondary as
+ * they are, which may be out of date
+ *
+ * @param backend The backend
+ * @param copy The copy
+ * @param start First block
+ * @param count Number of blocks
+ * @param buf Destination (count * BLOCK_SIZE bytes)
+ * @return 0 on success; 1 past the last copy, and for a secondary that is
+ *  not in use; else what the member returned
+ */
+static int mirror_read_copy(VDISK_BACKEND *backend, int copy, int start, int count, void *buf)
+{
+  MIRROR_STATE *state = backend->state;
+  if(copy == 0) {
+    pthread_mutex_lock(&state->primary_lock);
+    int ret = state->primary.read(&state->primary, MIRROR_DATA_START + start, count, buf);
+    pthread_mutex_unlock(&state->primary_lock);
+    return(ret);
+  }
+  pthread_mutex_lock(&state->lock);
+  int have_secondary = state->have_secondary;
+  pthread_mutex_unlock(&state->lock);
+  if(copy != 1 || !have_secondary) {
+    return(1);
+  }
+  pthread_mutex_lock(&state->secondary_lock);
+  int ret = state->secondary.read(&state->secondary, MIRROR_DATA_START + start, count, buf);
+  pthread_mutex_unlock(&state->secondary_lock);
+  return(ret);
+}
+
+static VDISK_BACKEND mirror_backend = {
+  "mirror:", mirror_open, mirror_close, mirror_read, mirror_write, mirror_discard, mirror_flush,
+  mirror_truncate, mirror_size, mirror_zeroes, mirror_read_copy, NULL
+};
+
+/**********************************************************************/
+
+// Backends selected by a scheme prefix
+static VDISK_BACKEND *backends[] = {&ram_backend, &slow_backend, &lz_backend, &stripe_backend, &mirror_backend,
+                                    NULL};
+
+/**
+ * Tell whether an open backend holds a member of a mirrored disk, which
+ * keeps the blocks of the disk after a header
+ *
+ * @param backend The open backend
+ * @param n_blocks Number of blocks in the layout of the disk
+ * @return Blocks before the blocks of the disk: MIRROR_DATA_START for a
+ *  member of a mirrored disk with this layout; else 0
+ */
+int vdisk_backend_mirror_start(VDISK_BACKEND *backend, int n_blocks)
+{
+  unsigned char raw[BLOCK_SIZE];
+  MIRROR_HEADER *header = (MIRROR_HEADER *) raw;
+  if(backend->read(backend, 0, 1, raw) != 0 || header->magic != MIRROR_MAGIC ||
+     header->n_blocks != (unsigned int) n_blocks) {
+    return(0);
+  }
+  return(MIRROR_DATA_START);
+}
+
+/**
+ * Find the backend for a disk name
+ *
+ * @param name Disk name, with an optional scheme prefix
+ * @param path Filled in with the name without the prefix
+ * @return Template of the backend; copy it before opening
+ */
+VDISK_BACKEND *vdisk_backend_lookup(char *name, char **path)
+{
+  for(int i = 0; backends[i] != NULL; ++i) {
+    size_t len = strlen(backends[i]->scheme);
+    if(!strncmp(name, backends[i]->scheme, len)) {
+      *path = name + len;
+      return(backends[i]);
+    }
+  }
+  *path = name;
+  return(&file_backend);
+}
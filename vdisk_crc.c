@@ -0,0 +1,138 @@
+#include <string.h>
+#include "vdisk.h"
+/*
+ * CRC32C (Castagnoli), used for the block checksums of vdisk.c.
+ *
+ * On x86-64 processors with SSE4.2 the crc32 instruction computes it 8
+ * bytes at a time.  Elsewhere, a portable version looks up 8 tables, one
+ * per byte of each 8-byte word (slicing by 8).  Both give the same result.
+ */
+
+// The CRC32C polynomial, bit-reversed
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+// crc_table[k][b]: CRC of byte b followed by k zero bytes
+static unsigned int crc_table[8][256];
+
+// 0: not set up yet; 1: portable version; 2: SSE4.2
+static int crc_method = 0;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC_HAVE_SSE42 1
+
+/**
+ * CRC32C with the SSE4.2 crc32 instruction
+ *
+ * @param crc Running CRC, inverted
+ * @param p Bytes to fold into the CRC
+ * @param len Number of bytes
+ * @return The updated CRC, inverted
+ */
+__attribute__((target("sse4.2")))
+static unsigned int vdisk_crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+  // x86 loads words from any address
+  typedef unsigned long long __attribute__((may_alias, aligned(1))) WORD;
+  unsigned long long c = crc;
+  for(; len >= 8; len -= 8, p += 8) {
+    c = _mm_crc32_u64(c, *(const WORD *) p);
+  }
+  crc = c;
+  for(; len > 0; --len) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return(crc);
+}
+#endif
+
+/**
+ * Build the tables, and pick the fastest version this processor runs
+ */
+static void vdisk_crc32c_setup()
+{
+  for(int b = 0; b < 256; ++b) {
+    unsigned int c = b;
+    for(int k = 0; k < 8; ++k) {
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLYNOMIAL : c >> 1;
+    }
+    crc_table[0][b] = c;
+  }
+  for(int b = 0; b < 256; ++b) {
+    for(int k = 1; k < 8; ++k) {
+      crc_table[k][b] = (crc_table[k - 1][b] >> 8) ^ crc_table[0][crc_table[k - 1][b] & 0xff];
+    }
+  }
+  crc_method = 1;
+#ifdef CRC_HAVE_SSE42
+  if(__builtin_cpu_supports("sse4.2")) {
+    crc_method = 2;
+  }
+#endif
+}
+
+/**
+ * CRC32C without any special instruction
+ *
+ * @param crc CRC of the bytes before buf (0 to start)
+ * @param buf Bytes to fold into the CRC
+ * @param len Number of bytes
+ * @return CRC of the bytes so far
+ */
+unsigned int vdisk_crc32c_portable(unsigned int crc, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  if(crc_method == 0) {
+    vdisk_crc32c_setup();
+  }
+  crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for(; len >= 8; len -= 8, p += 8) {
+    unsigned long long word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+      crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+      crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+      crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+  }
+#endif
+  for(; len > 0; --len) {
+    crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+  }
+  return(~crc);
+}
+
+/**
+ * CRC32C of a buffer, with the crc32 instruction where there is one
+ *
+ * @param crc CRC of the bytes before buf (0 to start)
+ * @param buf Bytes to fold into the CRC
+ * @param len Number of bytes
+ * @return CRC of the bytes so far
+ */
+unsigned int vdisk_crc32c(unsigned int crc, const void *buf, size_t len)
+{
+  if(crc_method == 0) {
+    vdisk_crc32c_setup();
+  }
+#ifdef CRC_HAVE_SSE42
+  if(crc_method == 2) {
+    return(~vdisk_crc32c_sse42(~crc, buf, len));
+  }
+#endif
+  return(vdisk_crc32c_portable(crc, buf, len));
+}
+
+/**
+ * Which version vdisk_crc32c() uses
+ *
+ * @return "sse4.2" or "portable"
+ */
+const char *vdisk_crc32c_method()
+{
+  if(crc_method == 0) {
+    vdisk_crc32c_setup();
+  }
+  return(crc_method == 2 ? "sse4.2" : "portable");
+}
@@ -0,0 +1,218 @@
+#include <string.h>
+#include "vdisk.h"
+/*
+ * Block compression used by the lz: backend (see vdisk_backend.c).
+ *
+ * A small LZ77 codec in the style of LZ4, sized for disk blocks: the
+ * compressed data is a sequence of
+ *
+ *   token      high 4 bits: number of literals; low 4 bits: match length
+ *              minus LZ_MIN_MATCH.  15 means that bytes follow which are
+ *              added to the count, up to and including the first one that
+ *              is not 255
+ *   literals   copied to the output as they are
+ *   distance   one byte: the match starts this many bytes back in the
+ *              output (1 ... LZ_WINDOW)
+ *
+ * The last sequence stops after its literals, or after its match, once the
+ * output is complete.  The window is short, but it covers a whole block.
+ */
+
+// Shortest match worth a token and a distance
+#define LZ_MIN_MATCH 3
+
+// Farthest distance a match can reach back
+#define LZ_WINDOW 255
+
+// Size of the table of recently seen positions, by hash of LZ_MIN_MATCH bytes
+#define LZ_HASH_BITS 8
+
+/**
+ * Hash of the LZ_MIN_MATCH bytes at p
+ *
+ * @param p Input position
+ * @return Index into the table of recent positions
+ */
+static unsigned int vdisk_lz_hash(const unsigned char *p)
+{
+  unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/**
+ * Append a length that did not fit into its 4 bits of the token
+ *
+ * @param out Output buffer
+ * @param op Output position, advanced
+ * @param max Size of the output buffer
+ * @param n Length minus 15
+ * @return 0 on success; -1 if the output is full
+ */
+static int vdisk_lz_put_length(unsigned char *out, int *op, int max, int n)
+{
+  for(;;) {
+    if(*op >= max) {
+      return(-1);
+    }
+    if(n < 255) {
+      out[(*op)++] = n;
+      return(0);
+    }
+    out[(*op)++] = 255;
+    n -= 255;
+  }
+}
+
+/**
+ * Append one sequence: literals, then an optional match
+ *
+ * @param out Output buffer
+ * @param op Output position, advanced
+ * @param max Size of the output buffer
+ * @param literals The literals
+ * @param n_literals Number of literals
+ * @param distance Distance of the match (ignored without a match)
+ * @param match Length of the match; 0 for none
+ * @return 0 on success; -1 if the output is full
+ */
+static int vdisk_lz_put_sequence(unsigned char *out, int *op, int max, const unsigned char *literals,
+                                 int n_literals, int distance, int match)
+{
+  int match_code = match ? match - LZ_MIN_MATCH : 0;
+  if(*op >= max) {
+    return(-1);
+  }
+  out[(*op)++] = ((n_literals < 15 ? n_literals : 15) << 4) | (match_code < 15 ? match_code : 15);
+  if(n_literals >= 15 && vdisk_lz_put_length(out, op, max, n_literals - 15) != 0) {
+    return(-1);
+  }
+  if(*op + n_literals > max) {
+    return(-1);
+  }
+  memcpy(&out[*op], literals, n_literals);
+  *op += n_literals;
+  if(match == 0) {
+    return(0);
+  }
+  if(*op >= max) {
+    return(-1);
+  }
+  out[(*op)++] = distance;
+  if(match_code >= 15 && vdisk_lz_put_length(out, op, max, match_code - 15) != 0) {
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ * Compress a buffer
+ *
+ * @param in Data to compress
+ * @param len Number of bytes
+ * @param out Compressed data
+ * @param max Size of out
+ * @return Number of compressed bytes; -1 if they do not fit into max bytes
+ */
+int vdisk_lz_compress(const unsigned char *in, int len, unsigned char *out, int max)
+{
+  short recent[1 << LZ_HASH_BITS];
+  memset(recent, 0xff, sizeof(recent));
+
+  int op = 0;
+  int anchor = 0;
+  int i = 0;
+  while(i + LZ_MIN_MATCH <= len) {
+    unsigned int h = vdisk_lz_hash(&in[i]);
+    int candidate = recent[h];
+    recent[h] = i;
+    if(candidate < 0 || i - candidate > LZ_WINDOW || memcmp(&in[candidate], &in[i], LZ_MIN_MATCH) != 0) {
+      ++i;
+      continue;
+    }
+    // The match may run into the bytes it produces
+    int match = LZ_MIN_MATCH;
+    while(i + match < len && in[candidate + match] == in[i + match]) {
+      ++match;
+    }
+    if(vdisk_lz_put_sequence(out, &op, max, &in[anchor], i - anchor, i - candidate, match) != 0) {
+      return(-1);
+    }
+    // Remember the positions inside the match, for the matches that follow
+    for(int j = i + 1; j < i + match && j + LZ_MIN_MATCH <= len; ++j) {
+      recent[vdisk_lz_hash(&in[j])] = j;
+    }
+    i += match;
+    anchor = i;
+  }
+  if(anchor < len && vdisk_lz_put_sequence(out, &op, max, &in[anchor], len - anchor, 0, 0) != 0) {
+    return(-1);
+  }
+  return(op);
+}
+
+/**
+ * Decompress a buffer.  Bytes that follow the last sequence are ignored,
+ * so that the compressed data can be padded
+ *
+ * @param in Compressed data
+ * @param len Number of compressed bytes
+ * @param out Decompressed data
+ * @param out_len Number of bytes that the data decompresses to
+ * @return 0 on success; -1 if the compressed data is corrupt
+ */
+int vdisk_lz_decompress(const unsigned char *in, int len, unsigned char *out, int out_len)
+{
+  int ip = 0;
+  int op = 0;
+  while(op < out_len) {
+    if(ip >= len) {
+      return(-1);
+    }
+    int token = in[ip++];
+
+    int n_literals = token >> 4;
+    if(n_literals == 15) {
+      int b;
+      do {
+        if(ip >= len) {
+          return(-1);
+        }
+        b = in[ip++];
+        n_literals += b;
+      } while(b == 255);
+    }
+    if(ip + n_literals > len || op + n_literals > out_len) {
+      return(-1);
+    }
+    memcpy(&out[op], &in[ip], n_literals);
+    ip += n_literals;
+    op += n_literals;
+    if(op == out_len) {
+      break;
+    }
+
+    if(ip >= len) {
+      return(-1);
+    }
+    int distance = in[ip++];
+    int match = (token & 15) + LZ_MIN_MATCH;
+    if((token & 15) == 15) {
+      int b;
+      do {
+        if(ip >= len) {
+          return(-1);
+        }
+        b = in[ip++];
+        match += b;
+      } while(b == 255);
+    }
+    if(distance == 0 || distance > op || op + match > out_len) {
+      return(-1);
+    }
+    // Byte by byte: the match may overlap its own output
+    for(int j = 0; j < match; ++j, ++op) {
+      out[op] = out[op - distance];
+    }
+  }
+  return(0);
+}
@@ -16,6 +16,8 @@ int main(int argc, char** argv) {
     if(argc == 2) {
         // Open the virtual disk
         vdisk_disk_open(disk_name);
+        //Create or extend the whole file as one transaction
+        oufs_txn_begin();
         
         //Main inode to write
         INODE inode;
@@ -32,26 +34,6 @@ int main(int argc, char** argv) {
             //Gets the file specs of the newly created file
             file_specs = *oufs_fopen(cwd, argv[1], "w");
             
-            //Reading in inode
-            oufs_read_inode_by_reference(file_specs.inode_reference, &inode);
-
-            //Checking data blocks of inode, they need to be truncated
-            for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-                if (inode.data[i] == UNALLOCATED_INODE) {
-                    continue;
-                } else {
-                    BLOCK_REFERENCE block_reference = inode.data[i];
-                    //Get block from block reference in inode
-                    BLOCK block;
-                    //Read block at reference into block
-                    vdisk_read_block(block_reference, &block);
-                    //Reset data in the block
-                    memset(block.data.data, 0, sizeof(block));
-                    //Write block back to disk
-                    vdisk_write_block(block_reference, &block);
-                }
-            }
-            
             //Get input from STDIN
             while (!feof(stdin)) {
                 if (fgets(buf, MAX_BUFFER, stdin)) {
@@ -91,6 +73,10 @@ int main(int argc, char** argv) {
                 }
             }
         }
+        
+        // Clean up
+        oufs_txn_commit();
+        vdisk_disk_close();
     } else {
         // Wrong number of parameters
         fprintf(stderr, "Usage: zcreate <filename>\n");
@@ -0,0 +1,650 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oufs_lib.h"
+#include "oufs_stats.h"
+
+// Default number of timed operations per benchmark
+#define DEFAULT_OPS 1000
+
+// Default scratch image; it is formatted again before every benchmark
+#define DEFAULT_IMAGE "vdisk_bench"
+
+// Files written by the fwrite benchmarks are started over once they would
+//  grow past this size
+#define FILE_LIMIT (7 * BLOCK_SIZE)
+
+// Entries created in the root directory for the lookup and listing benchmarks
+#define ROOT_ENTRIES 8
+
+// Depth of the directory chain used by the lookup benchmark
+#define LOOKUP_DEPTH 4
+
+// Blocks read per op by the vectored read benchmark
+#define READ_RUN_BLOCKS 16
+
+// Blocks of generated text that the codec benchmark compresses, and blocks
+//  compressed per timed op
+#define LZ_TEXT_BLOCKS 64
+#define LZ_REPEAT 64
+
+// Blocks checksummed per timed op by the CRC32C benchmark
+#define CRC_REPEAT 1024
+
+// Options
+static int n_ops = DEFAULT_OPS;
+static int json = 0;
+static char *image = DEFAULT_IMAGE;
+
+// Latency of each timed operation (microseconds)
+static double *samples;
+static int n_samples;
+// I/O done by the timed operations only
+static VDISK_STATS io_total;
+
+// The operation being timed
+static OP_TIMER timer;
+
+// Number of benchmarks reported so far
+static int n_reported = 0;
+
+// Results of the lz: codec benchmark
+static double lz_ratio;
+static double lz_stored_ratio;
+static double lz_compress_mb_per_sec;
+static double lz_decompress_mb_per_sec;
+
+// Results of the CRC32C benchmark: the version vdisk uses, and the
+//  portable one
+static double crc_mb_per_sec;
+static double crc_portable_mb_per_sec;
+
+// Results of the dedup benchmark: blocks that ROOT_ENTRIES copies of a file
+//  need, and take
+static int dedup_logical_blocks;
+static int dedup_physical_blocks;
+
+/**
+ *  Starts timing one operation
+ */
+static void op_start()
+{
+    oufs_timer_start(&timer);
+}
+
+/**
+ *  Stops timing the operation started by op_start() and records it
+ */
+static void op_stop()
+{
+    samples[n_samples++] = oufs_timer_stop(&timer, &io_total);
+}
+
+/**
+ *  Formats a fresh image and opens it, with nothing left in the journal
+ */
+static void fresh_image()
+{
+    unlink(image);
+    if (oufs_format_disk(image) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    vdisk_disk_close();
+    if (vdisk_disk_open(image) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    n_samples = 0;
+    memset(&io_total, 0, sizeof(io_total));
+}
+
+/**
+ *  Prints the results of the benchmark that was just run and closes the image
+ *
+ *  @param name Name of the benchmark
+ */
+static void report(const char *name)
+{
+    vdisk_disk_close();
+
+    double total = 0;
+    for (int i = 0; i < n_samples; ++i) {
+        total += samples[i];
+    }
+    qsort(samples, n_samples, sizeof(double), oufs_compare_samples);
+    double p50 = samples[n_samples / 2];
+    double p99 = samples[(n_samples * 99) / 100];
+    double ops_per_sec = total > 0 ? n_samples / (total / 1e6) : 0;
+    double n = n_samples;
+
+    if (json) {
+        printf("%s\n  {\"name\": \"%s\", \"ops\": %d, \"ops_per_sec\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+               "\"block_reads_per_op\": %.2f, \"block_writes_per_op\": %.2f, \"device_reads_per_op\": %.2f, "
+               "\"device_writes_per_op\": %.2f, \"syncs_per_op\": %.3f}",
+               n_reported == 0 ? "" : ",", name, n_samples, ops_per_sec, p50, p99,
+               io_total.block_reads / n, io_total.block_writes / n, io_total.device_reads / n,
+               io_total.device_writes / n, io_total.device_syncs / n);
+    } else {
+        printf("%-30s %8d %12.0f %10.2f %10.2f %8.2f %8.2f %8.2f %8.2f %8.3f\n",
+               name, n_samples, ops_per_sec, p50, p99,
+               io_total.block_reads / n, io_total.block_writes / n, io_total.device_reads / n,
+               io_total.device_writes / n, io_total.device_syncs / n);
+    }
+    ++n_reported;
+}
+
+/**
+ *  Root directory block of the open image
+ *
+ *  @return Block reference of the root directory
+ */
+static BLOCK_REFERENCE root_block()
+{
+    INODE inode;
+    oufs_read_inode_by_reference(0, &inode);
+    return inode.data[0];
+}
+
+/**
+ *  Runs one oufs_mkdir() operation on a copy of the path (the path is tokenized in place)
+ *
+ *  @param path Path relative to the root directory
+ *  @param operation oufs_mkdir() operation code
+ */
+static void make_entry(const char *path, int operation)
+{
+    char cwd[] = "/";
+    char path_copy[MAX_PATH_LENGTH];
+    strcpy(path_copy, path);
+    if (oufs_mkdir(cwd, path_copy, operation) != 0) {
+        fprintf(stderr, "zbench: cannot create %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ *  Opens a file in the root directory for writing
+ *
+ *  @param name File name
+ *  @return The file; the caller frees it
+ */
+static OUFILE *open_file(const char *name)
+{
+    char cwd[] = "/";
+    char path_copy[MAX_PATH_LENGTH];
+    strcpy(path_copy, name);
+    return oufs_fopen(cwd, path_copy, "w");
+}
+
+/**
+ *  vdisk_read_block() across the whole disk
+ */
+static void bench_read_block()
+{
+    fresh_image();
+    BLOCK block;
+    for (int i = 0; i < n_ops; ++i) {
+        op_start();
+        vdisk_read_block(i % N_BLOCKS_IN_DISK, &block);
+        op_stop();
+    }
+    report("vdisk_read_block");
+}
+
+/**
+ *  vdisk_read_blocks() of READ_RUN_BLOCKS consecutive blocks across the
+ *  whole disk, every block written beforehand so that each run is read
+ *  from the device.  On a stripe: disk the runs are spread over the members
+ */
+static void bench_read_blocks()
+{
+    fresh_image();
+    static BLOCK blocks[READ_RUN_BLOCKS];
+    memset(blocks, 0xa5, sizeof(blocks));
+    vdisk_journal_begin();
+    for (int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+        vdisk_write_block(b, &blocks[0]);
+    }
+    vdisk_journal_end();
+    vdisk_journal_commit();
+    for (int i = 0; i < n_ops; ++i) {
+        op_start();
+        vdisk_read_blocks(i * READ_RUN_BLOCKS % (N_BLOCKS_IN_DISK - READ_RUN_BLOCKS + 1), READ_RUN_BLOCKS, blocks);
+        op_stop();
+    }
+    report("vdisk_read_blocks_16");
+}
+
+/**
+ *  vdisk_write_block() across the data blocks
+ */
+static void bench_write_block()
+{
+    fresh_image();
+    BLOCK block;
+    memset(&block, 0xa5, sizeof(block));
+    int n_data = N_BLOCKS_IN_DISK - ROOT_DIRECTORY_BLOCK - 1;
+    for (int i = 0; i < n_ops; ++i) {
+        op_start();
+        vdisk_write_block(ROOT_DIRECTORY_BLOCK + 1 + i % n_data, &block);
+        op_stop();
+    }
+    report("vdisk_write_block");
+}
+
+/**
+ *  oufs_allocate_new_block() with half of the blocks in use
+ */
+static void bench_allocate_block()
+{
+    fresh_image();
+    while (oufs_allocate_new_block() < N_BLOCKS_IN_DISK / 2);
+    for (int i = 0; i < n_ops; ++i) {
+        op_start();
+        BLOCK_REFERENCE block_reference = oufs_allocate_new_block();
+        op_stop();
+        oufs_release_block(block_reference);
+    }
+    report("oufs_allocate_new_block");
+}
+
+/**
+ *  oufs_allocate_new_inode() with half of the inodes in use
+ */
+static void bench_allocate_inode()
+{
+    fresh_image();
+    while (oufs_allocate_new_inode() < N_INODES / 2);
+    for (int i = 0; i < n_ops; ++i) {
+        op_start();
+        INODE_REFERENCE inode_reference = oufs_allocate_new_inode();
+        op_stop();
+
+        BLOCK block;
+        vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+        block.master.inode_allocated_flag[inode_reference >> 3] &= ~(1 << (inode_reference & 0x7));
+        vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+    }
+    report("oufs_allocate_new_inode");
+}
+
+/**
+ *  oufs_look_for_inode_from_root() down a chain of LOOKUP_DEPTH directories
+ */
+static void bench_lookup()
+{
+    fresh_image();
+    char path[MAX_PATH_LENGTH];
+    for (int i = 0; i < ROOT_ENTRIES; ++i) {
+        sprintf(path, "f%d", i);
+        make_entry(path, 2);
+    }
+    path[0] = 0;
+    for (int i = 0; i < LOOKUP_DEPTH; ++i) {
+        sprintf(path + strlen(path), i == 0 ? "d%d" : "/d%d", i);
+        make_entry(path, 0);
+    }
+    char base_name[FILE_NAME_SIZE];
+    sprintf(base_name, "d%d", LOOKUP_DEPTH - 1);
+
+    for (int i = 0; i < n_ops; ++i) {
+        char path_copy[MAX_PATH_LENGTH];
+        strcpy(path_copy, path);
+        op_start();
+        oufs_look_for_inode_from_root(path_copy, 0, base_name, 0);
+        op_stop();
+    }
+    report("oufs_look_for_inode_from_root");
+}
+
+/**
+ *  oufs_fwrite() of len bytes at a time, appending to one file
+ *
+ *  @param name Name of the benchmark
+ *  @param len Bytes per write
+ */
+static void bench_fwrite(const char *name, int len)
+{
+    fresh_image();
+    // oufs_fwrite() copies text: the buffer must be terminated
+    char buf[BLOCK_SIZE + 1];
+    memset(buf, 'x', len);
+    buf[len - 1] = '\n';
+    buf[len] = 0;
+
+    make_entry("f", 2);
+    OUFILE *fp = open_file("f");
+    int size = 0;
+    for (int i = 0; i < n_ops; ++i) {
+        // Start over with an empty file
+        if (size + len > FILE_LIMIT) {
+            free(fp);
+            make_entry("f", 3);
+            make_entry("f", 2);
+            fp = open_file("f");
+            size = 0;
+        }
+        op_start();
+        oufs_fwrite(fp, buf, len);
+        op_stop();
+        size += len;
+    }
+    free(fp);
+    report(name);
+}
+
+/**
+ *  The listing of zfilez (print_directory_entries(), which
+ *  list_directory_entries() runs before it exits) of a root directory
+ *  holding ROOT_ENTRIES files.  The listing itself goes to /dev/null
+ */
+static void bench_list()
+{
+    fresh_image();
+    char path[MAX_PATH_LENGTH];
+    for (int i = 0; i < ROOT_ENTRIES; ++i) {
+        sprintf(path, "f%d", i);
+        make_entry(path, 2);
+    }
+    INODE inode;
+    oufs_read_inode_by_reference(0, &inode);
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n_ops; ++i) {
+        BLOCK block;
+        vdisk_read_block(inode.data[0], &block);
+        op_start();
+        print_directory_entries(&block);
+        fflush(stdout);
+        op_stop();
+    }
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    clearerr(stdout);
+    report("list_directory_entries");
+}
+
+/**
+ *  oufs_rmfile() of a one-line file
+ */
+static void bench_rmfile()
+{
+    fresh_image();
+    char buf[] = "a line of text that fills a few dozen bytes\n";
+    for (int i = 0; i < n_ops; ++i) {
+        make_entry("r", 2);
+        OUFILE *fp = open_file("r");
+        oufs_fwrite(fp, buf, strlen(buf));
+        free(fp);
+        BLOCK_REFERENCE base_block = root_block();
+
+        op_start();
+        oufs_rmfile(base_block, 0, "r");
+        op_stop();
+    }
+    report("oufs_rmfile");
+}
+
+/**
+ *  Fills a buffer with lines of text made of common words
+ *
+ *  @param text The buffer
+ *  @param len Its size
+ */
+static void make_text(char *text, int len)
+{
+    static const char *words[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on",
+        "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they",
+        "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if", "more",
+        "when", "will", "would", "who", "so", "no", "block", "file", "disk", "directory", "inode", "write"
+    };
+    int n_words = sizeof(words) / sizeof(words[0]);
+    unsigned int seed = 12345;
+    int line = 0;
+    int i = 0;
+    while (i < len) {
+        seed = seed * 1103515245 + 12345;
+        const char *word = words[(seed >> 16) % n_words];
+        for (int j = 0; word[j] != 0 && i < len; ++j, ++line) {
+            text[i++] = word[j];
+        }
+        if (i < len) {
+            text[i++] = line > 60 ? '\n' : ' ';
+            line = line > 60 ? 0 : line + 1;
+        }
+    }
+}
+
+/**
+ *  The lz: block codec on text: compression ratio, and compression and
+ *  decompression speed
+ */
+static void bench_lz()
+{
+    static unsigned char text[LZ_TEXT_BLOCKS][BLOCK_SIZE];
+    unsigned char packed[BLOCK_SIZE];
+    unsigned char out[BLOCK_SIZE];
+    make_text((char *) text, sizeof(text));
+
+    // Bytes after compression, and as stored: in whole slots, or raw
+    long compressed = 0;
+    long stored = 0;
+    for (int b = 0; b < LZ_TEXT_BLOCKS; ++b) {
+        int n = vdisk_lz_compress(text[b], BLOCK_SIZE, packed, (LZ_SLOTS - 1) * LZ_SLOT_SIZE);
+        compressed += n < 0 ? BLOCK_SIZE : n;
+        stored += n < 0 ? BLOCK_SIZE : (n + LZ_SLOT_SIZE - 1) / LZ_SLOT_SIZE * LZ_SLOT_SIZE;
+        if (n >= 0 && (vdisk_lz_decompress(packed, n, out, BLOCK_SIZE) != 0 || memcmp(out, text[b], BLOCK_SIZE))) {
+            fprintf(stderr, "zbench: lz codec does not reproduce block %d\n", b);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long n_blocks = (long) n_ops * LZ_REPEAT;
+    double start = oufs_stats_now();
+    for (long i = 0; i < n_blocks; ++i) {
+        vdisk_lz_compress(text[i % LZ_TEXT_BLOCKS], BLOCK_SIZE, packed, BLOCK_SIZE);
+    }
+    double compress_us = oufs_stats_now() - start;
+
+    static unsigned char packed_text[LZ_TEXT_BLOCKS][BLOCK_SIZE];
+    int packed_len[LZ_TEXT_BLOCKS];
+    for (int b = 0; b < LZ_TEXT_BLOCKS; ++b) {
+        packed_len[b] = vdisk_lz_compress(text[b], BLOCK_SIZE, packed_text[b], BLOCK_SIZE);
+    }
+    start = oufs_stats_now();
+    for (long i = 0; i < n_blocks; ++i) {
+        vdisk_lz_decompress(packed_text[i % LZ_TEXT_BLOCKS], packed_len[i % LZ_TEXT_BLOCKS], out, BLOCK_SIZE);
+    }
+    double decompress_us = oufs_stats_now() - start;
+
+    double raw = (double) LZ_TEXT_BLOCKS * BLOCK_SIZE;
+    double mb = (double) n_blocks * BLOCK_SIZE / 1e6;
+    lz_ratio = raw / compressed;
+    lz_stored_ratio = raw / stored;
+    lz_compress_mb_per_sec = mb / (compress_us / 1e6);
+    lz_decompress_mb_per_sec = mb / (decompress_us / 1e6);
+}
+
+/**
+ *  Block checksums: CRC32C of blocks of text, with the version that vdisk
+ *  uses and with the portable one.  Compare the time per block with the
+ *  p50 of vdisk_read_block for the cost of verifying reads
+ */
+static void bench_crc()
+{
+    static unsigned char text[LZ_TEXT_BLOCKS][BLOCK_SIZE];
+    make_text((char *) text, sizeof(text));
+
+    long n_blocks = (long) n_ops * CRC_REPEAT;
+    unsigned int sum = 0;
+    double start = oufs_stats_now();
+    for (long i = 0; i < n_blocks; ++i) {
+        sum ^= vdisk_crc32c(0, text[i % LZ_TEXT_BLOCKS], BLOCK_SIZE);
+    }
+    double crc_us = oufs_stats_now() - start;
+
+    start = oufs_stats_now();
+    for (long i = 0; i < n_blocks; ++i) {
+        sum ^= vdisk_crc32c_portable(0, text[i % LZ_TEXT_BLOCKS], BLOCK_SIZE);
+    }
+    double portable_us = oufs_stats_now() - start;
+    if (sum != 0) {
+        // Every block is checksummed an even number of times
+        fprintf(stderr, "zbench: the CRC32C versions disagree\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double mb = (double) n_blocks * BLOCK_SIZE / 1e6;
+    crc_mb_per_sec = mb / (crc_us / 1e6);
+    crc_portable_mb_per_sec = mb / (portable_us / 1e6);
+}
+
+/**
+ *  Number of blocks marked allocated in the open image
+ *
+ *  @return Allocated blocks
+ */
+static int blocks_in_use()
+{
+    BLOCK block;
+    vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+    int n = 0;
+    for (int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+        n += (block.master.block_allocated_flag[b >> 3] >> (b & 0x7)) & 1;
+    }
+    return n;
+}
+
+/**
+ *  oufs_fwrite() of whole blocks with deduplication on: ROOT_ENTRIES files
+ *  receive the same text, so every file after the first shares the blocks
+ *  of the first.  Compare with oufs_fwrite_block for the cost on the write
+ *  path; the space taken by the first set of copies is reported at the end
+ */
+static void bench_fwrite_dedup()
+{
+    static char text[FILE_LIMIT / BLOCK_SIZE][BLOCK_SIZE];
+    make_text((char *) text, sizeof(text));
+    int blocks_per_file = FILE_LIMIT / BLOCK_SIZE;
+
+    fresh_image();
+    if (oufs_dedup_enable() != 0) {
+        exit(EXIT_FAILURE);
+    }
+    int base = blocks_in_use();
+    dedup_physical_blocks = 0;
+
+    OUFILE *fp = NULL;
+    char name[FILE_NAME_SIZE];
+    // oufs_fwrite() copies text: the buffer must be terminated
+    char buf[BLOCK_SIZE + 1];
+    buf[BLOCK_SIZE] = 0;
+    for (int i = 0; i < n_ops; ++i) {
+        int file = (i / blocks_per_file) % ROOT_ENTRIES;
+        int block = i % blocks_per_file;
+        if (block == 0) {
+            // All copies written: start over with no files
+            if (file == 0 && i > 0) {
+                if (dedup_physical_blocks == 0) {
+                    dedup_physical_blocks = blocks_in_use() - base;
+                }
+                for (int f = 0; f < ROOT_ENTRIES; ++f) {
+                    sprintf(name, "f%d", f);
+                    make_entry(name, 3);
+                }
+            }
+            free(fp);
+            sprintf(name, "f%d", file);
+            make_entry(name, 2);
+            fp = open_file(name);
+        }
+        memcpy(buf, text[block], BLOCK_SIZE);
+        op_start();
+        oufs_fwrite(fp, buf, BLOCK_SIZE);
+        op_stop();
+    }
+    free(fp);
+    if (dedup_physical_blocks == 0) {
+        dedup_physical_blocks = blocks_in_use() - base;
+    }
+    dedup_logical_blocks = MIN(n_ops, ROOT_ENTRIES * blocks_per_file);
+    report("oufs_fwrite_block_dedup");
+}
+
+/**
+ *  Times each layer of the storage stack on freshly formatted images
+ *
+ *  Usage: zbench [-n ops] [-json] [-d image]
+ */
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            n_ops = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-json")) {
+            json = 1;
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            image = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: zbench [-n ops] [-json] [-d image]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (n_ops <= 0) {
+        fprintf(stderr, "zbench: ops must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    samples = malloc(n_ops * sizeof(double));
+
+    if (json) {
+        printf("{\"block_size\": %d, \"blocks\": %d, \"inodes\": %d, \"ops\": %d, \"benchmarks\": [",
+               BLOCK_SIZE, N_BLOCKS_IN_DISK, (int) N_INODES, n_ops);
+    } else {
+        printf("# block_size %d blocks %d inodes %d\n", BLOCK_SIZE, N_BLOCKS_IN_DISK, (int) N_INODES);
+        printf("%-30s %8s %12s %10s %10s %8s %8s %8s %8s %8s\n", "benchmark", "ops", "ops/s", "p50_us",
+               "p99_us", "rd/op", "wr/op", "devrd/op", "devwr/op", "sync/op");
+    }
+
+    bench_read_block();
+    bench_read_blocks();
+    bench_write_block();
+    bench_allocate_block();
+    bench_allocate_inode();
+    bench_lookup();
+    bench_fwrite("oufs_fwrite_line", 32);
+    bench_fwrite("oufs_fwrite_block", BLOCK_SIZE);
+    bench_list();
+    bench_rmfile();
+    bench_fwrite_dedup();
+    bench_lz();
+    bench_crc();
+
+    if (json) {
+        printf("\n], \"crc32c\": {\"method\": \"%s\", \"mb_per_sec\": %.1f, \"portable_mb_per_sec\": %.1f}, ",
+               vdisk_crc32c_method(), crc_mb_per_sec, crc_portable_mb_per_sec);
+        printf("\"dedup\": {\"logical_blocks\": %d, \"physical_blocks\": %d, \"ratio\": %.2f}, "
+               "\"lz\": {\"ratio\": %.2f, \"stored_ratio\": %.2f, \"compress_mb_per_sec\": %.1f, "
+               "\"decompress_mb_per_sec\": %.1f}}\n", dedup_logical_blocks, dedup_physical_blocks,
+               (double) dedup_logical_blocks / dedup_physical_blocks, lz_ratio, lz_stored_ratio,
+               lz_compress_mb_per_sec, lz_decompress_mb_per_sec);
+    } else {
+        printf("# dedup: %d copies of the same text take %d blocks instead of %d (ratio %.2f)\n",
+               ROOT_ENTRIES, dedup_physical_blocks, dedup_logical_blocks,
+               (double) dedup_logical_blocks / dedup_physical_blocks);
+        printf("# lz codec on text: ratio %.2f (%.2f as stored in %d-byte slots), compress %.1f MB/s, "
+               "decompress %.1f MB/s\n", lz_ratio, lz_stored_ratio, LZ_SLOT_SIZE,
+               lz_compress_mb_per_sec, lz_decompress_mb_per_sec);
+        printf("# crc32c block checksums (%s): %.1f MB/s, %.3f us per block; portable %.1f MB/s\n",
+               vdisk_crc32c_method(), crc_mb_per_sec, BLOCK_SIZE / crc_mb_per_sec, crc_portable_mb_per_sec);
+    }
+
+    unlink(image);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "oufs_stats.h"
+
+// Default number of hottest blocks listed
+#define DEFAULT_TOP 10
+
+// Largest disk that the analyzer handles (blocks of the disk itself)
+#define MAX_TRACE_BLOCKS 65536
+
+// Heat map: blocks per row, and the characters used for increasing access counts
+#define HEAT_ROW 32
+#define HEAT_SCALE " .:-=+*#%@"
+
+static const char *kind_name[N_TRACE_KINDS] = {"read", "write", "device_read", "device_write", "sync", "discard"};
+
+// Totals by kind
+static unsigned long kind_records[N_TRACE_KINDS];
+static unsigned long long kind_bytes[N_TRACE_KINDS];
+
+// Device writes that went past the disk: the journal and the checksum table
+static unsigned long long journal_bytes;
+
+// Logical reads and writes by operation (ST_NONE is counted last)
+static unsigned long operation_reads[N_OPERATION_STATS + 1];
+static unsigned long operation_writes[N_OPERATION_STATS + 1];
+static unsigned long long operation_device_bytes[N_OPERATION_STATS + 1];
+
+// Logical reads and writes by block
+static unsigned long *block_reads;
+static unsigned long *block_writes;
+
+// Reads of a block that the same run had already read or written
+static unsigned long rereads;
+
+// Accesses that continue where the previous access of the same kind ended
+static unsigned long sequential[N_TRACE_KINDS];
+
+// LRU stack distances of logical accesses: hits[d] accesses found at depth d
+static unsigned long *lru_hits;
+static unsigned long lru_accesses;
+
+// Geometry of the first run, and number of runs
+static unsigned int n_blocks = 0;
+static int n_runs = 0;
+static double span_seconds = 0;
+
+/**
+ *  Index for the per-operation counters
+ *
+ *  @param operation Operation from a trace record
+ *  @return Index into operation_reads[] etc.
+ */
+static int operation_index(int operation)
+{
+    return operation < N_OPERATION_STATS ? operation : N_OPERATION_STATS;
+}
+
+/**
+ *  Analyzes the records of one program run
+ *
+ *  @param records The records
+ *  @param n Number of records
+ */
+static void analyze_run(TRACE_RECORD *records, long n)
+{
+    // Blocks touched so far in this run, and the LRU stack of logical accesses
+    static char touched[MAX_TRACE_BLOCKS];
+    static unsigned short stack[MAX_TRACE_BLOCKS];
+    int depth = 0;
+    long next_block[N_TRACE_KINDS];
+
+    memset(touched, 0, n_blocks);
+    for (int k = 0; k < N_TRACE_KINDS; ++k) {
+        next_block[k] = -1;
+    }
+    if (n > 0) {
+        span_seconds += (records[n - 1].time_ns - records[0].time_ns) / 1e9;
+    }
+
+    for (long i = 0; i < n; ++i) {
+        TRACE_RECORD *r = &records[i];
+        if (r->kind >= N_TRACE_KINDS) {
+            continue;
+        }
+        ++kind_records[r->kind];
+        kind_bytes[r->kind] += r->bytes;
+
+        long blocks = (r->bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (r->kind != TRACE_SYNC) {
+            if (r->block == next_block[r->kind]) {
+                ++sequential[r->kind];
+            }
+            next_block[r->kind] = r->block + blocks;
+        }
+
+        int op = operation_index(r->operation);
+        if (r->kind == TRACE_DEVICE_WRITE) {
+            operation_device_bytes[op] += r->bytes;
+            if (r->block >= n_blocks) {
+                journal_bytes += r->bytes;
+            }
+        }
+        if ((r->kind != TRACE_READ && r->kind != TRACE_WRITE) || r->block >= n_blocks) {
+            continue;
+        }
+
+        if (r->kind == TRACE_READ) {
+            ++block_reads[r->block];
+            ++operation_reads[op];
+            if (touched[r->block]) {
+                ++rereads;
+            }
+        } else {
+            ++block_writes[r->block];
+            ++operation_writes[op];
+        }
+        touched[r->block] = 1;
+
+        // Move the block to the top of the LRU stack
+        int d;
+        for (d = 0; d < depth && stack[d] != r->block; ++d);
+        if (r->kind == TRACE_READ) {
+            ++lru_accesses;
+            if (d < depth) {
+                ++lru_hits[d];
+            }
+        }
+        if (d == depth) {
+            ++depth;
+        }
+        memmove(&stack[1], &stack[0], d * sizeof(stack[0]));
+        stack[0] = r->block;
+    }
+}
+
+/**
+ *  Prints the access counts of every block as a grid of characters
+ *
+ *  @param title Title of the map
+ *  @param counts Access count of each block
+ */
+static void print_heat_map(const char *title, unsigned long *counts)
+{
+    unsigned long max = 0;
+    for (unsigned int b = 0; b < n_blocks; ++b) {
+        if (counts[b] > max) {
+            max = counts[b];
+        }
+    }
+    int levels = strlen(HEAT_SCALE) - 1;
+    printf("\n%s heat map (%d blocks per row, '%s' = 0 ... %lu accesses):\n", title, HEAT_ROW, HEAT_SCALE, max);
+    for (unsigned int b = 0; b < n_blocks; ++b) {
+        if (b % HEAT_ROW == 0) {
+            printf("%6u |", b);
+        }
+        int level = 0;
+        if (counts[b] > 0) {
+            level = max > 1 ? 1 + (int) ((counts[b] - 1) * (levels - 1) / (max - 1)) : levels;
+        }
+        putchar(HEAT_SCALE[level]);
+        if (b % HEAT_ROW == HEAT_ROW - 1 || b == n_blocks - 1) {
+            printf("|\n");
+        }
+    }
+}
+
+/**
+ *  Prints the blocks with the most logical accesses
+ *
+ *  @param top Number of blocks to print
+ */
+static void print_hottest(int top)
+{
+    static char listed[MAX_TRACE_BLOCKS];
+    printf("\nhottest blocks:\n%8s %10s %10s\n", "block", "reads", "writes");
+    for (int t = 0; t < top; ++t) {
+        long best = -1;
+        for (unsigned int b = 0; b < n_blocks; ++b) {
+            if (!listed[b] && (block_reads[b] + block_writes[b]) > 0 &&
+                (best < 0 || block_reads[b] + block_writes[b] > block_reads[best] + block_writes[best])) {
+                best = b;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        listed[best] = 1;
+        printf("%8ld %10lu %10lu\n", best, block_reads[best], block_writes[best]);
+    }
+}
+
+/**
+ *  Analyzes a block trace written by the vdisk layer (ZTRACE)
+ *
+ *  Usage: zblktrace [-top n] [tracefile]
+ *  The trace file defaults to $ZTRACE
+ */
+int main(int argc, char** argv) {
+    int top = DEFAULT_TOP;
+    char *name = getenv(TRACE_ENVIRONMENT);
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-top") && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            name = argv[i];
+        } else {
+            name = NULL;
+            break;
+        }
+    }
+    if (name == NULL) {
+        fprintf(stderr, "Usage: zblktrace [-top n] [tracefile]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Load the whole trace
+    FILE *fp = fopen(name, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "zblktrace: cannot open %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    long n_entries = size / sizeof(TRACE_RECORD);
+    TRACE_RECORD *entries = malloc(n_entries * sizeof(TRACE_RECORD) + 1);
+    if (entries == NULL || (long) fread(entries, sizeof(TRACE_RECORD), n_entries, fp) != n_entries) {
+        fprintf(stderr, "zblktrace: cannot read %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+
+    // Every run starts with a header
+    _Static_assert(sizeof(TRACE_HEADER) == sizeof(TRACE_RECORD), "a header takes the place of one record");
+    long run_start = -1;
+    for (long i = 0; i <= n_entries; ++i) {
+        TRACE_HEADER *header = (TRACE_HEADER *) &entries[i];
+        int is_header = i < n_entries && header->magic == TRACE_MAGIC && header->version == TRACE_VERSION &&
+            header->block_size == BLOCK_SIZE;
+        if (i < n_entries && !is_header && run_start < 0) {
+            fprintf(stderr, "zblktrace: %s is not a block trace\n", name);
+            exit(EXIT_FAILURE);
+        }
+        if (!is_header && i < n_entries) {
+            continue;
+        }
+        if (run_start >= 0) {
+            analyze_run(&entries[run_start], i - run_start);
+        }
+        if (i == n_entries) {
+            break;
+        }
+        if (n_blocks == 0) {
+            n_blocks = header->n_blocks;
+            if (n_blocks == 0 || n_blocks > MAX_TRACE_BLOCKS) {
+                fprintf(stderr, "zblktrace: bad geometry (%u blocks)\n", n_blocks);
+                exit(EXIT_FAILURE);
+            }
+            block_reads = calloc(n_blocks, sizeof(unsigned long));
+            block_writes = calloc(n_blocks, sizeof(unsigned long));
+            lru_hits = calloc(n_blocks, sizeof(unsigned long));
+        } else if (header->n_blocks != n_blocks) {
+            fprintf(stderr, "zblktrace: runs with different geometries\n");
+            exit(EXIT_FAILURE);
+        }
+        ++n_runs;
+        run_start = i + 1;
+    }
+
+    printf("trace %s: %d runs, %ld records, %.6f s traced, %u blocks of %d bytes\n", name, n_runs,
+           n_entries - n_runs, span_seconds, n_blocks, BLOCK_SIZE);
+
+    printf("\n%-14s %10s %12s %12s\n", "kind", "records", "bytes", "sequential");
+    for (int k = 0; k < N_TRACE_KINDS; ++k) {
+        printf("%-14s %10lu %12llu", kind_name[k], kind_records[k], kind_bytes[k]);
+        if (k != TRACE_SYNC && kind_records[k] > 0) {
+            printf(" %11.1f%%", 100.0 * sequential[k] / kind_records[k]);
+        }
+        printf("\n");
+    }
+
+    printf("\nre-read ratio: %.1f%% of reads hit a block the same run had already accessed\n",
+           kind_records[TRACE_READ] ? 100.0 * rereads / kind_records[TRACE_READ] : 0.0);
+    if (kind_bytes[TRACE_WRITE] > 0) {
+        printf("write amplification: %.2f (%llu bytes written to the file for %llu bytes written to vdisk; "
+               "journal %llu, home %llu)\n",
+               (double) kind_bytes[TRACE_DEVICE_WRITE] / kind_bytes[TRACE_WRITE], kind_bytes[TRACE_DEVICE_WRITE],
+               kind_bytes[TRACE_WRITE], journal_bytes, kind_bytes[TRACE_DEVICE_WRITE] - journal_bytes);
+    }
+
+    printf("\n%-20s %10s %10s %14s\n", "operation", "reads", "writes", "device_bytes");
+    for (int op = 0; op <= N_OPERATION_STATS; ++op) {
+        if (operation_reads[op] + operation_writes[op] + operation_device_bytes[op] == 0) {
+            continue;
+        }
+        printf("%-20s %10lu %10lu %14llu\n", oufs_stats_operation_name(op == N_OPERATION_STATS ? ST_NONE : op),
+               operation_reads[op], operation_writes[op], operation_device_bytes[op]);
+    }
+
+    print_heat_map("read", block_reads);
+    print_heat_map("write", block_writes);
+    print_hottest(top);
+
+    // A cache of c blocks serves every read found at LRU depth < c
+    printf("\nLRU cache model (read hit ratio by cache size, cold at the start of each run):\n");
+    unsigned long hits = 0;
+    unsigned int next_size = 1;
+    for (unsigned int d = 0; d < n_blocks; ++d) {
+        hits += lru_hits[d];
+        if (d + 1 == next_size || d + 1 == n_blocks) {
+            printf("%8u blocks %6.1f%%\n", d + 1, lru_accesses ? 100.0 * hits / lru_accesses : 0.0);
+            next_size *= 2;
+        }
+    }
+
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/**
+ *  Copies a file.  The copy shares the data blocks of the source, so only
+ *  an inode and a directory entry are written, whatever the size of the
+ *  file.  A block is copied when either file is written later.
+ *
+ *  Usage: zcp <source> <newfile>
+ */
+int main(int argc, char** argv) {
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name);
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: zcp <source> <newfile>\n");
+        exit(EXIT_FAILURE);
+    }
+    if (vdisk_disk_open(disk_name) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // oufs_fopen() changes the path it is given
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s", argv[1]);
+    OUFILE *source = oufs_fopen(cwd, path, "r");
+    INODE_REFERENCE source_reference = source->inode_reference;
+    free(source);
+    if (source_reference == UNALLOCATED_INODE) {
+        fprintf(stderr, "zcp: %s does not exist\n", argv[1]);
+        vdisk_disk_close();
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(path, sizeof(path), "%s", argv[2]);
+    OUFILE *existing = oufs_fopen(cwd, path, "r");
+    INODE_REFERENCE existing_reference = existing->inode_reference;
+    free(existing);
+    if (existing_reference != UNALLOCATED_INODE) {
+        fprintf(stderr, "zcp: %s already exists\n", argv[2]);
+        vdisk_disk_close();
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(path, sizeof(path), "%s", argv[2]);
+    int ret = oufs_copy(cwd, path, source_reference);
+    if (vdisk_disk_close() != 0) {
+        ret = -1;
+    }
+    return(ret == 0 ? 0 : EXIT_FAILURE);
+}
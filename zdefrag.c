@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/**
+ *  Defragmenter.
+ *
+ *  The first free block goes to whoever asks for it next, so a file that
+ *  grows by many small appends ends up with its blocks spread between the
+ *  blocks of other files and directories.  zdefrag loads the whole disk,
+ *  walks the directory tree depth first and gives out new locations in
+ *  that order: each directory's block, followed by the blocks of its files
+ *  (each file in one run of consecutive blocks where there is room for
+ *  one), followed by its subdirectories.  The blocks are moved in the
+ *  loaded image, the inodes, the master block, the dedup index and the
+ *  reverse map are updated to match, and everything that changed reaches the disk in one
+ *  transaction, so a crash leaves either the old layout or the new one.
+ *
+ *  Blocks that are shared (snapshots, deduplication) or that hold file
+ *  system metadata are left where they are, since not every reference to
+ *  them is in a live inode.
+ */
+
+// The whole disk, before and after
+static BLOCK image[N_BLOCKS_IN_DISK];
+static BLOCK moved[N_BLOCKS_IN_DISK];
+
+// Inode i as stored in the loaded image
+#define INODE_AT(i) (&image[(i) / INODES_PER_BLOCK + 1].inodes.inode[(i) % INODES_PER_BLOCK])
+
+// Bit helpers for allocation tables
+#define BIT_IS_SET(table, i) (((table)[(i) >> 3] >> ((i) & 0x7)) & 1)
+#define SET_BIT(table, i) ((table)[(i) >> 3] |= (1 << ((i) & 0x7)))
+#define CLEAR_BIT(table, i) ((table)[(i) >> 3] &= ~(1 << ((i) & 0x7)))
+
+// Blocks that stay where they are
+static char pinned[N_BLOCKS_IN_DISK];
+
+// New location of every block that is in use (UNALLOCATED_BLOCK: not placed yet)
+static BLOCK_REFERENCE new_location[N_BLOCKS_IN_DISK];
+
+// Locations that have been given out (pinned blocks included)
+static char taken[N_BLOCKS_IN_DISK];
+
+// Inodes already placed (a file with several links is placed once)
+static char placed[N_INODES];
+
+// Fragmentation of the file system
+typedef struct layout_score_s
+{
+  int n_files;
+  // Files whose blocks form one run
+  int contiguous;
+  // Runs of consecutive blocks over all files
+  int extents;
+  // Blocks over all files
+  int blocks;
+  // Sum and number of distances between a directory's block and the
+  //  first block of each of its files
+  long distance;
+  int n_distances;
+} LAYOUT_SCORE;
+
+/**
+ *  Checks whether a block reference can point to a data or directory block
+ *
+ *  @param block_reference The reference to check
+ *  @return 1 if valid, 0 otherwise
+ */
+static int valid_data_block(BLOCK_REFERENCE block_reference)
+{
+  return block_reference > N_INODE_BLOCKS && block_reference < N_BLOCKS_IN_DISK;
+}
+
+/**
+ *  Number of blocks of an inode: its data[] entries up to the first
+ *  unallocated one
+ *
+ *  @param inode The inode
+ *  @return Number of blocks
+ */
+static int inode_blocks(INODE *inode)
+{
+  int n = 0;
+  while(n < BLOCKS_PER_INODE && valid_data_block(inode->data[n])) {
+    ++n;
+  }
+  return(n);
+}
+
+/**
+ *  Measures the fragmentation of every file reachable from a directory
+ *
+ *  @param blocks The image to measure
+ *  @param dir The directory
+ *  @param seen Inodes already measured
+ *  @param score Added to
+ */
+static void score_directory(BLOCK *blocks, INODE_REFERENCE dir, char *seen, LAYOUT_SCORE *score)
+{
+  INODE *inode = &blocks[dir / INODES_PER_BLOCK + 1].inodes.inode[dir % INODES_PER_BLOCK];
+  BLOCK_REFERENCE dir_block = inode->data[0];
+  seen[dir] = 1;
+  if(!valid_data_block(dir_block)) {
+    return;
+  }
+  DIRECTORY_BLOCK *directory = &blocks[dir_block].directory;
+  for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+    INODE_REFERENCE child = directory->entry[e].inode_reference;
+    if(child >= N_INODES || seen[child] ||
+       !strcmp(directory->entry[e].name, ".") || !strcmp(directory->entry[e].name, "..")) {
+      continue;
+    }
+    INODE *child_inode = &blocks[child / INODES_PER_BLOCK + 1].inodes.inode[child % INODES_PER_BLOCK];
+    if(child_inode->type == IT_DIRECTORY) {
+      score_directory(blocks, child, seen, score);
+      continue;
+    }
+    seen[child] = 1;
+    int n = inode_blocks(child_inode);
+    if(child_inode->type != IT_FILE || n == 0) {
+      continue;
+    }
+    int runs = 1;
+    for(int k = 1; k < n; ++k) {
+      runs += child_inode->data[k] != child_inode->data[k - 1] + 1;
+    }
+    ++score->n_files;
+    score->contiguous += runs == 1;
+    score->extents += runs;
+    score->blocks += n;
+    score->distance += child_inode->data[0] > dir_block ? child_inode->data[0] - dir_block :
+      dir_block - child_inode->data[0];
+    ++score->n_distances;
+  }
+}
+
+/**
+ *  Prints the fragmentation of a layout.  The score is the share of
+ *  block-to-block steps within files that do not continue a run: 0 when
+ *  every file is one run, 1 when no two blocks of a file are adjacent
+ *
+ *  @param label Which layout this is
+ *  @param blocks The image
+ */
+static void print_score(const char *label, BLOCK *blocks)
+{
+  char seen[N_INODES];
+  LAYOUT_SCORE score;
+  memset(seen, 0, sizeof(seen));
+  memset(&score, 0, sizeof(score));
+  score_directory(blocks, 0, seen, &score);
+
+  int steps = score.blocks - score.n_files;
+  printf("zdefrag: %s: fragmentation %.2f (%d extents in %d files, %d contiguous), "
+         "directory to file distance %.1f blocks\n", label,
+         steps > 0 ? (double) (score.extents - score.n_files) / steps : 0.0, score.extents, score.n_files,
+         score.contiguous, score.n_distances ? (double) score.distance / score.n_distances : 0.0);
+}
+
+/**
+ *  Finds the new location for a run of blocks: the first n consecutive
+ *  free locations if there are any, otherwise the first free location
+ *
+ *  @param n Number of blocks in the run
+ *  @return First location of the run, or UNALLOCATED_BLOCK if the disk is full
+ */
+static BLOCK_REFERENCE find_room(int n)
+{
+  int first_free = -1;
+  for(int b = N_INODE_BLOCKS + 1; b < N_BLOCKS_IN_DISK; ++b) {
+    if(taken[b]) {
+      continue;
+    }
+    if(first_free < 0) {
+      first_free = b;
+    }
+    int len = 0;
+    while(len < n && b + len < N_BLOCKS_IN_DISK && !taken[b + len]) {
+      ++len;
+    }
+    if(len == n) {
+      return(b);
+    }
+    b += len;
+  }
+  return(first_free < 0 ? UNALLOCATED_BLOCK : first_free);
+}
+
+/**
+ *  Gives new locations to the blocks of an inode, as one run if possible
+ *
+ *  @param inode The inode
+ */
+static void place_inode(INODE *inode)
+{
+  int n = inode_blocks(inode);
+  for(int k = 0; k < n; ) {
+    BLOCK_REFERENCE b = inode->data[k];
+    if(pinned[b] || new_location[b] != UNALLOCATED_BLOCK) {
+      ++k;
+      continue;
+    }
+    // The rest of the file, up to its next pinned block
+    int run = 1;
+    while(k + run < n && !pinned[inode->data[k + run]] && new_location[inode->data[k + run]] == UNALLOCATED_BLOCK) {
+      ++run;
+    }
+    BLOCK_REFERENCE start = find_room(run);
+    int len = 0;
+    while(len < run && start + len < N_BLOCKS_IN_DISK && !taken[start + len]) {
+      new_location[inode->data[k + len]] = start + len;
+      taken[start + len] = 1;
+      ++len;
+    }
+    if(len == 0) {
+      break;
+    }
+    k += len;
+  }
+}
+
+/**
+ *  Gives new locations to a directory's block, then to its files, then to
+ *  its subdirectories
+ *
+ *  @param dir The directory
+ */
+static void place_directory(INODE_REFERENCE dir)
+{
+  INODE *inode = INODE_AT(dir);
+  placed[dir] = 1;
+  place_inode(inode);
+  if(!valid_data_block(inode->data[0])) {
+    return;
+  }
+  DIRECTORY_BLOCK *directory = &image[inode->data[0]].directory;
+  for(int pass = 0; pass < 2; ++pass) {
+    for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+      INODE_REFERENCE child = directory->entry[e].inode_reference;
+      if(child >= N_INODES || placed[child] ||
+         !strcmp(directory->entry[e].name, ".") || !strcmp(directory->entry[e].name, "..")) {
+        continue;
+      }
+      INODE *child_inode = INODE_AT(child);
+      if(pass == 0 && child_inode->type == IT_FILE) {
+        placed[child] = 1;
+        place_inode(child_inode);
+      }else if(pass == 1 && child_inode->type == IT_DIRECTORY) {
+        place_directory(child);
+      }
+    }
+  }
+}
+
+/**
+ *  Usage: zdefrag [-n]
+ *  With -n, only the fragmentation is reported; nothing is moved
+ *
+ *  @param argc The number of parameters from the command line
+ *  @param argv The array containing the parameters from the command line
+ *  @return 0 on success, anything else is error
+ */
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  int dry_run = 0;
+  if(argc == 2 && strncmp(argv[1], "-n", 3) == 0) {
+    dry_run = 1;
+  }else if(argc != 1) {
+    fprintf(stderr, "Usage: zdefrag [-n]\n");
+    return(-1);
+  }
+
+  if(vdisk_disk_open(disk_name) != 0) {
+    return(-1);
+  }
+  if(vdisk_read_blocks(0, N_BLOCKS_IN_DISK, image) != 0) {
+    fprintf(stderr, "zdefrag: cannot read the disk\n");
+    return(-1);
+  }
+  print_score("before", image);
+  if(dry_run) {
+    vdisk_disk_close();
+    return(0);
+  }
+
+  // Metadata and shared blocks stay put
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  for(int b = 0; b <= N_INODE_BLOCKS; ++b) {
+    pinned[b] = 1;
+  }
+  BLOCK_REFERENCE metadata[3] = {master->snapshot_table_block, master->refcount_block, master->dedup_block};
+  for(int m = 0; m < 3; ++m) {
+    if(valid_data_block(metadata[m])) {
+      pinned[metadata[m]] = 1;
+    }
+  }
+  for(int m = 0; m < OWNER_MAP_BLOCKS && master->owner_map_block[0] != 0; ++m) {
+    if(valid_data_block(master->owner_map_block[m])) {
+      pinned[master->owner_map_block[m]] = 1;
+    }
+  }
+  for(int m = 0; m < USAGE_BLOCKS && master->usage_block[0] != 0; ++m) {
+    if(valid_data_block(master->usage_block[m])) {
+      pinned[master->usage_block[m]] = 1;
+    }
+  }
+  if(valid_data_block(master->refcount_block)) {
+    REFCOUNT_BLOCK *refcounts = &image[master->refcount_block].refcounts;
+    for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      pinned[b] |= refcounts->extra[b] > 0;
+    }
+  }
+  if(valid_data_block(master->snapshot_table_block)) {
+    SNAPSHOT_BLOCK *table = &image[master->snapshot_table_block].snapshots;
+    for(int s = 0; s < MAX_SNAPSHOTS; ++s) {
+      if(table->snapshot[s].name[0] == 0) {
+        continue;
+      }
+      for(int j = 0; j < N_INODE_BLOCKS; ++j) {
+        if(valid_data_block(table->snapshot[s].inode_block[j])) {
+          pinned[table->snapshot[s].inode_block[j]] = 1;
+        }
+      }
+      for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+        pinned[b] |= BIT_IS_SET(table->snapshot[s].block_held_flag, b);
+      }
+    }
+  }
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    new_location[b] = UNALLOCATED_BLOCK;
+    if(pinned[b] && BIT_IS_SET(master->block_allocated_flag, b)) {
+      taken[b] = 1;
+      new_location[b] = b;
+    }
+  }
+
+  // Blocks that no live inode reaches (only ever pinned ones) stay put too
+  place_directory(0);
+  for(int b = N_INODE_BLOCKS + 1; b < N_BLOCKS_IN_DISK; ++b) {
+    if(BIT_IS_SET(master->block_allocated_flag, b) && new_location[b] == UNALLOCATED_BLOCK) {
+      fprintf(stderr, "zdefrag: block %d is allocated but not reachable; run zfsck first\n", b);
+      vdisk_disk_close();
+      return(-1);
+    }
+  }
+
+  // Move the blocks, and every reference to them
+  int n_moved = 0;
+  memcpy(moved, image, sizeof(image));
+  MASTER_BLOCK *new_master = &moved[MASTER_BLOCK_REFERENCE].master;
+  DEDUP_BLOCK *index = valid_data_block(master->dedup_block) ? &image[master->dedup_block].dedup : NULL;
+  DEDUP_BLOCK *new_index = index != NULL ? &moved[master->dedup_block].dedup : NULL;
+  BLOCK_REFERENCE *map_block = master->owner_map_block[0] != 0 ? master->owner_map_block : NULL;
+  for(int b = N_INODE_BLOCKS + 1; b < N_BLOCKS_IN_DISK; ++b) {
+    if(new_location[b] == UNALLOCATED_BLOCK || new_location[b] == b) {
+      continue;
+    }
+    ++n_moved;
+    SET_BIT(new_master->block_allocated_flag, new_location[b]);
+    memcpy(&moved[new_location[b]], &image[b], BLOCK_SIZE);
+    if(index != NULL) {
+      new_index->fingerprint[new_location[b]] = index->fingerprint[b];
+    }
+    if(map_block != NULL) {
+      BLOCK_REFERENCE to = new_location[b];
+      moved[map_block[to / OWNERS_PER_BLOCK]].owners.owner[to % OWNERS_PER_BLOCK] =
+        image[map_block[b / OWNERS_PER_BLOCK]].owners.owner[b % OWNERS_PER_BLOCK];
+    }
+  }
+  // Locations that were given to no block are free now
+  for(int b = N_INODE_BLOCKS + 1; b < N_BLOCKS_IN_DISK; ++b) {
+    if(!taken[b] && BIT_IS_SET(new_master->block_allocated_flag, b)) {
+      CLEAR_BIT(new_master->block_allocated_flag, b);
+      memset(&moved[b], 0, BLOCK_SIZE);
+      if(index != NULL) {
+        new_index->fingerprint[b] = 0;
+      }
+      if(map_block != NULL) {
+        memset(&moved[map_block[b / OWNERS_PER_BLOCK]].owners.owner[b % OWNERS_PER_BLOCK], 0, sizeof(OWNER_ENTRY));
+      }
+    }
+  }
+  for(int i = 0; i < N_INODES; ++i) {
+    INODE *inode = &moved[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK];
+    if(!placed[i]) {
+      continue;
+    }
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+      if(valid_data_block(inode->data[k])) {
+        inode->data[k] = new_location[inode->data[k]];
+      }
+    }
+  }
+
+  // All at once: the journal holds every block of the disk
+  if(n_moved > 0) {
+    vdisk_journal_begin();
+    for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      if(memcmp(&moved[b], &image[b], BLOCK_SIZE) == 0) {
+        continue;
+      }
+      if(!BIT_IS_SET(new_master->block_allocated_flag, b)) {
+        vdisk_discard_block(b);
+      }else {
+        vdisk_write_block(b, &moved[b]);
+      }
+    }
+    if(vdisk_journal_end() != 0 || vdisk_journal_commit() != 0) {
+      fprintf(stderr, "zdefrag: cannot write the new layout\n");
+      vdisk_disk_close();
+      return(-1);
+    }
+  }
+  print_score("after", moved);
+  printf("zdefrag: %d blocks moved\n", n_moved);
+
+  vdisk_disk_close();
+  return(0);
+}
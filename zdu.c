@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+// Usage of every inode, from oufs_usage_table()
+static USAGE_ENTRY usage[N_INODES];
+
+/**
+ *  Finds the inode that a path names, one directory block at a time
+ *
+ *  @param cwd Current working directory
+ *  @param path Path to look up, absolute or relative to cwd
+ *  @return The inode, UNALLOCATED_INODE if there is none
+ */
+static INODE_REFERENCE look_up(const char *cwd, const char *path)
+{
+    char full_path[2 * MAX_PATH_LENGTH + 2];
+    if (path[0] == '/') {
+        snprintf(full_path, sizeof(full_path), "%s", path);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s/%s", cwd, path);
+    }
+
+    INODE_REFERENCE inode_reference = 0;
+    for (char *name = strtok(full_path, "/"); name != NULL; name = strtok(NULL, "/")) {
+        INODE inode;
+        oufs_read_inode_by_reference(inode_reference, &inode);
+        if (inode.type != IT_DIRECTORY) {
+            return UNALLOCATED_INODE;
+        }
+        BLOCK block;
+        vdisk_read_block(inode.data[0], &block);
+        INODE_REFERENCE next = UNALLOCATED_INODE;
+        for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+            if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE &&
+                !strncmp(block.directory.entry[i].name, name, FILE_NAME_SIZE - 1)) {
+                next = block.directory.entry[i].inode_reference;
+                break;
+            }
+        }
+        if (next >= N_INODES) {
+            return UNALLOCATED_INODE;
+        }
+        inode_reference = next;
+    }
+    return inode_reference;
+}
+
+/**
+ *  Prints the usage of one inode
+ *
+ *  @param inode_reference The inode
+ *  @param path Path to print with it
+ */
+static void print_usage(INODE_REFERENCE inode_reference, const char *path)
+{
+    USAGE_ENTRY *u = &usage[inode_reference];
+    printf("%10u %6u %6u  %s\n", u->bytes, u->blocks, u->inodes, path);
+}
+
+/**
+ *  Prints the usage of every directory below a directory, and then of the
+ *  directory itself.  Only directory blocks and the inodes of their entries
+ *  are read: the sizes come from the usage table
+ *
+ *  @param dir The directory
+ *  @param path Its path
+ *  @param depth Directories above it, which bounds the walk
+ */
+static void print_tree(INODE_REFERENCE dir, const char *path, int depth)
+{
+    INODE inode;
+    oufs_read_inode_by_reference(dir, &inode);
+    if (inode.type == IT_DIRECTORY && depth < N_INODES) {
+        BLOCK block;
+        vdisk_read_block(inode.data[0], &block);
+        for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+            DIRECTORY_ENTRY *entry = &block.directory.entry[i];
+            if (entry->inode_reference >= N_INODES || !strcmp(entry->name, ".") || !strcmp(entry->name, "..")) {
+                continue;
+            }
+            INODE child;
+            oufs_read_inode_by_reference(entry->inode_reference, &child);
+            if (child.type != IT_DIRECTORY) {
+                continue;
+            }
+            char child_path[MAX_PATH_LENGTH + FILE_NAME_SIZE + 2];
+            snprintf(child_path, sizeof(child_path), "%s%s%.*s", path, strcmp(path, "/") ? "/" : "",
+                     (int) FILE_NAME_SIZE, entry->name);
+            print_tree(entry->inode_reference, child_path, depth + 1);
+        }
+    }
+    print_usage(dir, path);
+}
+
+/**
+ *  Prints the space taken by a file or directory tree: bytes of the files,
+ *  blocks and inodes.  A file counts in every directory that links it.
+ *
+ *  On a disk formatted with zformat -usage the numbers are read from the
+ *  usage table, without walking the tree; elsewhere, the tree is walked.
+ *
+ *  Usage: zdu [-r] [path]
+ *  -r also prints every directory below the path
+ */
+int main(int argc, char** argv) {
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name);
+
+    int recursive = 0;
+    char *path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-r")) {
+            recursive = 1;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: zdu [-r] [path]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (path == NULL) {
+        path = cwd;
+    }
+
+    if (vdisk_disk_open(disk_name) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    //Read from a snapshot instead of the live file system
+    char *snapshot_name = getenv("ZSNAP");
+    if (snapshot_name != NULL && oufs_snapshot_select(snapshot_name) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    INODE_REFERENCE inode_reference = look_up(cwd, path);
+    if (inode_reference == UNALLOCATED_INODE) {
+        fprintf(stderr, "zdu: %s not found\n", path);
+        vdisk_disk_close();
+        exit(EXIT_FAILURE);
+    }
+    if (oufs_usage_table(usage) < 0) {
+        vdisk_disk_close();
+        exit(EXIT_FAILURE);
+    }
+
+    if (recursive) {
+        print_tree(inode_reference, path, 0);
+    } else {
+        print_usage(inode_reference, path);
+    }
+    vdisk_disk_close();
+    return 0;
+}
@@ -25,6 +25,12 @@ int main(int argc, char** argv) {
     oufs_get_environment(cwd, disk_name);
     // Open the virtual disk
     vdisk_disk_open(disk_name);
+    
+    //Read from a snapshot instead of the live file system
+    char *snapshot_name = getenv("ZSNAP");
+    if (snapshot_name != NULL && oufs_snapshot_select(snapshot_name) != 0) {
+        exit(EXIT_FAILURE);
+    }
      
     //If zfilez contains a parameter
     if (argc == 2) {
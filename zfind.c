@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+// Longest run of directory blocks fetched with one read
+#define DIRECTORY_RUN 16
+
+// Room for a path: every directory level takes a name and a '/'
+#define FIND_PATH_LENGTH (N_INODES * FILE_NAME_SIZE + 2)
+
+// One test on a number: n, +n (more than n) or -n (less than n)
+typedef struct number_test_s
+{
+    int active;
+    int sign;
+    unsigned int value;
+} NUMBER_TEST;
+
+// Tests given on the command line
+static char type_test = 0;
+static NUMBER_TEST size_test;
+static NUMBER_TEST links_test;
+
+// Every inode in use, from one scan of the inode table
+static INODE inodes[N_INODES];
+static char in_use[N_INODES];
+
+// Directory block of every directory, from one pass over the directory blocks
+static DIRECTORY_BLOCK directories[N_INODES];
+static char loaded[N_INODES];
+
+// Directory that links each directory, and the name it has there
+static INODE_REFERENCE parent_of[N_INODES];
+static char name_of[N_INODES][FILE_NAME_SIZE + 1];
+
+// One path that passed the tests
+typedef struct found_s
+{
+    char *path;
+    INODE_REFERENCE inode_reference;
+} FOUND;
+
+// Paths found, printed in order at the end
+static FOUND *found;
+static int n_found = 0;
+
+/**
+ *  Parses the argument of -size or -links
+ *
+ *  @param arg n, +n or -n
+ *  @param test Set to the test
+ */
+static void parse_number_test(const char *arg, NUMBER_TEST *test)
+{
+    test->active = 1;
+    test->sign = arg[0] == '+' ? 1 : arg[0] == '-' ? -1 : 0;
+    test->value = strtoul(test->sign ? arg + 1 : arg, NULL, 10);
+}
+
+/**
+ *  Applies a test on a number
+ *
+ *  @param test The test
+ *  @param value The number
+ *  @return 1 if the number passes
+ */
+static int number_matches(NUMBER_TEST *test, unsigned int value)
+{
+    if (!test->active) {
+        return 1;
+    }
+    if (test->sign > 0) {
+        return value > test->value;
+    }
+    if (test->sign < 0) {
+        return value < test->value;
+    }
+    return value == test->value;
+}
+
+/**
+ *  Applies the tests of the command line to an inode
+ *
+ *  @param inode_reference The inode
+ *  @return 1 if it passes all of them
+ */
+static int inode_matches(INODE_REFERENCE inode_reference)
+{
+    INODE *inode = &inodes[inode_reference];
+    if (type_test == 'f' && inode->type != IT_FILE) {
+        return 0;
+    }
+    if (type_test == 'd' && inode->type != IT_DIRECTORY) {
+        return 0;
+    }
+    return number_matches(&size_test, inode->size) && number_matches(&links_test, inode->n_references);
+}
+
+/**
+ *  Compares two paths that were found, for qsort()
+ */
+static int path_compare(const void *a, const void *b)
+{
+    return strcmp(((const FOUND *) a)->path, ((const FOUND *) b)->path);
+}
+
+/**
+ *  Reads the directory block of every directory.  The blocks are sorted,
+ *  and blocks that follow each other on the disk are read together
+ */
+static void load_directories()
+{
+    BLOCK_REFERENCE block_of[N_INODES];
+    INODE_REFERENCE order[N_INODES];
+    int n = 0;
+    for (int i = 0; i < N_INODES; ++i) {
+        if (in_use[i] && inodes[i].type == IT_DIRECTORY && inodes[i].data[0] > N_INODE_BLOCKS &&
+            inodes[i].data[0] < N_BLOCKS_IN_DISK) {
+            block_of[i] = inodes[i].data[0];
+            order[n++] = i;
+        }
+    }
+    // Insertion sort by block: there are few directories
+    for (int j = 1; j < n; ++j) {
+        INODE_REFERENCE d = order[j];
+        int k = j;
+        for (; k > 0 && block_of[order[k - 1]] > block_of[d]; --k) {
+            order[k] = order[k - 1];
+        }
+        order[k] = d;
+    }
+
+    BLOCK run[DIRECTORY_RUN];
+    for (int j = 0; j < n;) {
+        int length = 1;
+        while (j + length < n && length < DIRECTORY_RUN &&
+               block_of[order[j + length]] == block_of[order[j]] + length) {
+            ++length;
+        }
+        if (vdisk_read_blocks(block_of[order[j]], length, run) == 0) {
+            for (int k = 0; k < length; ++k) {
+                directories[order[j + k]] = run[k].directory;
+                loaded[order[j + k]] = 1;
+            }
+        }
+        j += length;
+    }
+}
+
+/**
+ *  Builds the path of a directory from the names found in the directory pass
+ *
+ *  @param dir The directory
+ *  @param path Set to its path
+ *  @return 0 on success, -1 if the directory cannot be reached from the root
+ */
+static int directory_path(INODE_REFERENCE dir, char *path)
+{
+    INODE_REFERENCE chain[N_INODES];
+    int depth = 0;
+    for (; dir != 0; dir = parent_of[dir]) {
+        if (dir >= N_INODES || depth == N_INODES) {
+            return -1;
+        }
+        chain[depth++] = dir;
+    }
+    path[0] = 0;
+    while (depth > 0) {
+        strcat(path, "/");
+        strcat(path, name_of[chain[--depth]]);
+    }
+    if (path[0] == 0) {
+        strcpy(path, "/");
+    }
+    return 0;
+}
+
+/**
+ *  Turns a path into an absolute one without ".", ".." or repeated '/'
+ *
+ *  @param cwd Current working directory
+ *  @param path Path, absolute or relative to cwd
+ *  @param result Set to the absolute path
+ */
+static void normalize_path(const char *cwd, const char *path, char *result)
+{
+    char full_path[2 * MAX_PATH_LENGTH + 2];
+    snprintf(full_path, sizeof(full_path), "%s/%s", path[0] == '/' ? "" : cwd, path);
+    result[0] = 0;
+    for (char *name = strtok(full_path, "/"); name != NULL; name = strtok(NULL, "/")) {
+        if (!strcmp(name, ".")) {
+            continue;
+        }
+        if (!strcmp(name, "..")) {
+            char *slash = strrchr(result, '/');
+            if (slash != NULL) {
+                *slash = 0;
+            }
+            continue;
+        }
+        strcat(result, "/");
+        strncat(result, name, FILE_NAME_SIZE - 1);
+    }
+    if (result[0] == 0) {
+        strcpy(result, "/");
+    }
+}
+
+/**
+ *  Records a path that passed the tests, if it is under the start path
+ *
+ *  @param start Start path
+ *  @param path The path
+ *  @param inode_reference Its inode
+ */
+static void add_found(const char *start, const char *path, INODE_REFERENCE inode_reference)
+{
+    size_t n = strlen(start);
+    if (strcmp(start, "/") && (strncmp(path, start, n) || (path[n] != 0 && path[n] != '/'))) {
+        return;
+    }
+    found[n_found].path = strdup(path);
+    found[n_found].inode_reference = inode_reference;
+    ++n_found;
+}
+
+/**
+ *  Finds files and directories by type, size and number of links.
+ *
+ *  The inode table is scanned with oufs_inode_scan_next(), which reads it
+ *  in large sequential reads, and the directory blocks are read once, in
+ *  disk order, to give the inodes that passed their paths.  A file with
+ *  several links is printed once for each of them.
+ *
+ *  Usage: zfind [path] [-type f|d] [-size [+|-]n] [-links [+|-]n] [-l]
+ *  -size compares the size of the inode: bytes for a file, entries for a
+ *  directory.  +n means more than n, -n less than n.  -l prints the inode,
+ *  type, size and number of links before each path
+ */
+int main(int argc, char** argv) {
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name);
+
+    char *path = NULL;
+    int long_format = 0;
+    int usage = 0;
+    for (int i = 1; i < argc && !usage; ++i) {
+        if (!strcmp(argv[i], "-type") && i + 1 < argc && argv[i + 1][0] != 0 && strchr("fd", argv[i + 1][0])) {
+            type_test = argv[++i][0];
+        } else if (!strcmp(argv[i], "-size") && i + 1 < argc) {
+            parse_number_test(argv[++i], &size_test);
+        } else if (!strcmp(argv[i], "-links") && i + 1 < argc) {
+            parse_number_test(argv[++i], &links_test);
+        } else if (!strcmp(argv[i], "-l")) {
+            long_format = 1;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage) {
+        fprintf(stderr, "Usage: zfind [path] [-type f|d] [-size [+|-]n] [-links [+|-]n] [-l]\n");
+        exit(EXIT_FAILURE);
+    }
+    char start[FIND_PATH_LENGTH];
+    normalize_path(cwd, path != NULL ? path : ".", start);
+
+    if (vdisk_disk_open(disk_name) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    //Read from a snapshot instead of the live file system
+    char *snapshot_name = getenv("ZSNAP");
+    if (snapshot_name != NULL && oufs_snapshot_select(snapshot_name) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Every inode in use
+    INODE_SCAN scan;
+    INODE_REFERENCE inode_reference;
+    INODE inode;
+    int result;
+    if (oufs_inode_scan_open(&scan) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    while ((result = oufs_inode_scan_next(&scan, &inode_reference, &inode)) == 1) {
+        inodes[inode_reference] = inode;
+        in_use[inode_reference] = 1;
+    }
+    if (result < 0) {
+        fprintf(stderr, "zfind: cannot read the inode table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Names of the directories
+    load_directories();
+    for (int d = 0; d < N_INODES; ++d) {
+        parent_of[d] = UNALLOCATED_INODE;
+    }
+    for (int d = 0; d < N_INODES; ++d) {
+        for (int e = 0; loaded[d] && e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+            DIRECTORY_ENTRY *entry = &directories[d].entry[e];
+            INODE_REFERENCE child = entry->inode_reference;
+            if (child >= N_INODES || !in_use[child] || inodes[child].type != IT_DIRECTORY ||
+                !strcmp(entry->name, ".") || !strcmp(entry->name, "..") || child == 0) {
+                continue;
+            }
+            parent_of[child] = d;
+            snprintf(name_of[child], sizeof(name_of[child]), "%.*s", (int) FILE_NAME_SIZE, entry->name);
+        }
+    }
+
+    // The entries that pass, under the start path
+    found = malloc((N_INODES * DIRECTORY_ENTRIES_PER_BLOCK + 1) * sizeof(FOUND));
+    if (in_use[0] && inode_matches(0)) {
+        add_found(start, "/", 0);
+    }
+    for (int d = 0; d < N_INODES; ++d) {
+        char dir_path[FIND_PATH_LENGTH];
+        if (!loaded[d] || directory_path(d, dir_path) != 0) {
+            continue;
+        }
+        for (int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+            DIRECTORY_ENTRY *entry = &directories[d].entry[e];
+            INODE_REFERENCE child = entry->inode_reference;
+            if (child >= N_INODES || !in_use[child] || !strcmp(entry->name, ".") || !strcmp(entry->name, "..") ||
+                !inode_matches(child)) {
+                continue;
+            }
+            char child_path[FIND_PATH_LENGTH + FILE_NAME_SIZE + 1];
+            snprintf(child_path, sizeof(child_path), "%s%s%.*s", dir_path, d == 0 ? "" : "/",
+                     (int) FILE_NAME_SIZE, entry->name);
+            add_found(start, child_path, child);
+        }
+    }
+
+    qsort(found, n_found, sizeof(FOUND), path_compare);
+    for (int i = 0; i < n_found; ++i) {
+        if (long_format) {
+            INODE *found_inode = &inodes[found[i].inode_reference];
+            printf("%5d %c %6u %3d  ", found[i].inode_reference, found_inode->type, found_inode->size,
+                   found_inode->n_references);
+        }
+        printf("%s\n", found[i].path);
+        free(found[i].path);
+    }
+    free(found);
+    vdisk_disk_close();
+    return 0;
+}
@@ -7,8 +7,35 @@ int main(int argc, char** argv) {
     char disk_name[MAX_PATH_LENGTH];
     oufs_get_environment(cwd, disk_name);
     
+    // -dedup: files share the blocks whose contents are identical
+    // -owners: keep a reverse map from blocks to the inodes that hold them
+    // -usage: keep the space taken by every directory tree (see zdu)
+    int dedup = 0;
+    int owners = 0;
+    int usage = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-dedup")) {
+            dedup = 1;
+        } else if (!strcmp(argv[i], "-owners")) {
+            owners = 1;
+        } else if (!strcmp(argv[i], "-usage")) {
+            usage = 1;
+        } else {
+            fprintf(stderr, "Usage: zformat [-dedup] [-owners] [-usage]\n");
+            return(-1);
+        }
+    }
+    
     oufs_format_disk(disk_name);
+    if (dedup && oufs_dedup_enable() != 0) {
+        return(-1);
+    }
+    if (owners && oufs_owners_enable() != 0) {
+        return(-1);
+    }
+    if (usage && oufs_usage_enable() != 0) {
+        return(-1);
+    }
     
     return(0);
 }
-
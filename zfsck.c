@@ -0,0 +1,801 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+/**
+ *  File system checker.
+ *
+ *  The whole disk is loaded with one sequential read.  The directory tree is
+ *  then walked in memory (split across threads for large geometries) to
+ *  find every reachable inode and count the directory entries that refer to
+ *  it.  From that, the inode and block allocation tables are rebuilt and
+ *  compared with MASTER_BLOCK, together with n_references, inode sizes,
+ *  "." / ".." entries, the shared block reference counts, the reverse
+ *  map from blocks to the inodes that hold them and the usage table.  Blocks that
+ *  do not match their checksums are reported as well.
+ *
+ *  With -r, the problems that were found are repaired in one transaction.
+ */
+
+#define debug 0
+
+// Geometries with at least this many inodes walk the tree with one thread per CPU
+#define FSCK_PARALLEL_INODES 4096
+
+// Maximum number of walker threads
+#define FSCK_MAX_THREADS 64
+
+// The whole disk
+static BLOCK image[N_BLOCKS_IN_DISK];
+
+// Inode i as stored in the loaded image
+#define INODE_AT(i) (&image[(i) / INODES_PER_BLOCK + 1].inodes.inode[(i) % INODES_PER_BLOCK])
+
+// Bit helpers for allocation tables
+#define BIT_IS_SET(table, i) (((table)[(i) >> 3] >> ((i) & 0x7)) & 1)
+#define SET_BIT(table, i) ((table)[(i) >> 3] |= (1 << ((i) & 0x7)))
+
+// Results of the tree walk
+static char reachable[N_INODES];
+static INODE_REFERENCE parent_of[N_INODES];
+static unsigned int entry_count[N_INODES];
+
+// Number of blocks each block is held by (inodes and snapshots)
+static unsigned int holders[N_BLOCKS_IN_DISK];
+// Blocks that hold file system metadata (snapshot table, reference counts,
+//  dedup index, snapshot inode tables)
+static char metadata_block[N_BLOCKS_IN_DISK];
+
+// Blocks held by files, and the number of references to them from files
+static char file_block[N_BLOCKS_IN_DISK];
+static int file_references = 0;
+
+// Problems found so far
+static int problems = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Work handed to one walker thread
+typedef struct walker_s
+{
+  pthread_t thread;
+  // Directories to walk
+  INODE_REFERENCE stack[N_INODES];
+  int depth;
+  // Entries found by this walker, merged into entry_count afterwards
+  unsigned int entry_count[N_INODES];
+} WALKER;
+
+static WALKER walkers[FSCK_MAX_THREADS];
+
+/**
+ *  Prints a problem; safe to call from walker threads
+ *
+ *  @param format printf() style format
+ */
+static void report(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  pthread_mutex_lock(&report_lock);
+  vprintf(format, args);
+  ++problems;
+  pthread_mutex_unlock(&report_lock);
+  va_end(args);
+}
+
+/**
+ *  Checks whether a block reference can point to a data or directory block
+ *
+ *  @param block_reference The reference to check
+ *  @return 1 if valid, 0 otherwise
+ */
+static int valid_data_block(BLOCK_REFERENCE block_reference)
+{
+  return block_reference > N_INODE_BLOCKS && block_reference < N_BLOCKS_IN_DISK;
+}
+
+/**
+ *  Reports names that appear more than once in a directory.  Lookups only
+ *  ever find the first of them, so this is reported but not repaired.
+ *
+ *  @param dir Inode of the directory
+ *  @param directory Contents of the directory
+ */
+static void check_names(INODE_REFERENCE dir, DIRECTORY_BLOCK *directory)
+{
+  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+    if(directory->entry[i].inode_reference == UNALLOCATED_INODE) {
+      continue;
+    }
+    for(int j = 0; j < i; ++j) {
+      if(directory->entry[j].inode_reference != UNALLOCATED_INODE &&
+         !strncmp(directory->entry[j].name, directory->entry[i].name, FILE_NAME_SIZE)) {
+        report("Directory inode %d: name \"%.*s\" appears more than once\n",
+               dir, (int) FILE_NAME_SIZE, directory->entry[i].name);
+        break;
+      }
+    }
+  }
+}
+
+/**
+ *  Walks the directories on a walker's stack, and every directory below them
+ *
+ *  @param arg The WALKER
+ *  @return NULL
+ */
+static void *walk(void *arg)
+{
+  WALKER *w = arg;
+
+  while(w->depth > 0) {
+    INODE_REFERENCE dir = w->stack[--w->depth];
+    BLOCK_REFERENCE block_reference = INODE_AT(dir)->data[0];
+    if(!valid_data_block(block_reference)) {
+      report("Directory inode %d: bad directory block %d\n", dir, block_reference);
+      continue;
+    }
+
+    DIRECTORY_BLOCK *directory = &image[block_reference].directory;
+    check_names(dir, directory);
+    for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+      DIRECTORY_ENTRY *entry = &directory->entry[i];
+      if(entry->inode_reference == UNALLOCATED_INODE ||
+         !strcmp(entry->name, ".") || !strcmp(entry->name, "..")) {
+        continue;
+      }
+      INODE_REFERENCE child = entry->inode_reference;
+      if(child >= N_INODES) {
+        report("Directory inode %d: entry \"%s\" refers to bad inode %d\n", dir, entry->name, child);
+        continue;
+      }
+      ++w->entry_count[child];
+
+      INODE *inode = INODE_AT(child);
+      if(inode->type == IT_DIRECTORY) {
+        // Claim the directory; a second claim means it is linked twice
+        if(__atomic_exchange_n(&reachable[child], 1, __ATOMIC_ACQ_REL) == 0) {
+          parent_of[child] = dir;
+          w->stack[w->depth++] = child;
+        } else {
+          report("Directory inode %d: entry \"%s\" links directory inode %d a second time\n",
+                 dir, entry->name, child);
+        }
+      } else if(inode->type == IT_FILE) {
+        __atomic_store_n(&reachable[child], 1, __ATOMIC_RELEASE);
+      } else {
+        report("Directory inode %d: entry \"%s\" refers to unused inode %d\n", dir, entry->name, child);
+      }
+    }
+  }
+  return(NULL);
+}
+
+/**
+ *  Finds every reachable inode, starting at the root.  With more than one
+ *  thread, the root is read here and its subdirectories are dealt out to
+ *  the walkers.
+ *
+ *  @param n_threads Number of walker threads
+ */
+static void walk_tree(int n_threads)
+{
+  // Nothing refers to the root but its own "." and ".."
+  reachable[0] = 1;
+  parent_of[0] = 0;
+  entry_count[0] = 1;
+
+  if(n_threads == 1) {
+    walkers[0].stack[walkers[0].depth++] = 0;
+  } else {
+    BLOCK_REFERENCE block_reference = INODE_AT(0)->data[0];
+    if(!valid_data_block(block_reference)) {
+      report("Directory inode 0: bad directory block %d\n", block_reference);
+      return;
+    }
+    int next = 0;
+    DIRECTORY_BLOCK *directory = &image[block_reference].directory;
+    check_names(0, directory);
+    for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+      DIRECTORY_ENTRY *entry = &directory->entry[i];
+      INODE_REFERENCE child = entry->inode_reference;
+      if(child == UNALLOCATED_INODE || !strcmp(entry->name, ".") || !strcmp(entry->name, "..")) {
+        continue;
+      }
+      if(child >= N_INODES) {
+        report("Directory inode 0: entry \"%s\" refers to bad inode %d\n", entry->name, child);
+        continue;
+      }
+      ++entry_count[child];
+      if(INODE_AT(child)->type == IT_DIRECTORY && !reachable[child]) {
+        reachable[child] = 1;
+        parent_of[child] = 0;
+        WALKER *w = &walkers[next++ % n_threads];
+        w->stack[w->depth++] = child;
+      } else if(INODE_AT(child)->type == IT_FILE) {
+        reachable[child] = 1;
+      } else {
+        report("Directory inode 0: entry \"%s\" refers to unused inode %d\n", entry->name, child);
+      }
+    }
+  }
+
+  for(int t = 1; t < n_threads; ++t) {
+    pthread_create(&walkers[t].thread, NULL, walk, &walkers[t]);
+  }
+  walk(&walkers[0]);
+  for(int t = 1; t < n_threads; ++t) {
+    pthread_join(walkers[t].thread, NULL);
+  }
+
+  for(int t = 0; t < n_threads; ++t) {
+    for(int i = 0; i < N_INODES; ++i) {
+      entry_count[i] += walkers[t].entry_count[i];
+    }
+  }
+}
+
+/**
+ *  Checks every inode against the results of the tree walk, and counts the
+ *  holders of every block.  Fixes are applied to the loaded image.
+ *
+ *  @param dirty Set for each block of the image that was changed
+ */
+static void check_inodes(char *dirty)
+{
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+
+  for(int i = 0; i < N_INODES; ++i) {
+    INODE *inode = INODE_AT(i);
+    BLOCK_REFERENCE inode_block = i / INODES_PER_BLOCK + 1;
+    int allocated = BIT_IS_SET(master->inode_allocated_flag, i);
+
+    if(!reachable[i]) {
+      if(allocated) {
+        report("Inode %d: allocated but not in any directory\n", i);
+        inode->type = IT_NONE;
+        inode->n_references = 0;
+        dirty[inode_block] = 1;
+      }
+      continue;
+    }
+    if(!allocated) {
+      report("Inode %d: in use but marked free\n", i);
+    }
+
+    // Count the blocks held by this inode
+    int n_blocks = 0;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+      BLOCK_REFERENCE b = inode->data[k];
+      if(b == UNALLOCATED_BLOCK) {
+        continue;
+      }
+      if(!valid_data_block(b)) {
+        report("Inode %d: bad block reference %d\n", i, b);
+        inode->data[k] = UNALLOCATED_BLOCK;
+        dirty[inode_block] = 1;
+        continue;
+      }
+      int duplicate = 0;
+      for(int j = 0; j < k; ++j) {
+        duplicate |= inode->data[j] == b;
+      }
+      if(duplicate) {
+        report("Inode %d: block %d referenced twice\n", i, b);
+        inode->data[k] = UNALLOCATED_BLOCK;
+        dirty[inode_block] = 1;
+        continue;
+      }
+      ++holders[b];
+      ++n_blocks;
+      if(inode->type == IT_FILE) {
+        file_block[b] = 1;
+        ++file_references;
+      }
+    }
+
+    if(inode->type == IT_DIRECTORY) {
+      if(inode->n_references != 1) {
+        report("Directory inode %d: n_references is %d, should be 1\n", i, inode->n_references);
+        inode->n_references = 1;
+        dirty[inode_block] = 1;
+      }
+      BLOCK_REFERENCE b = inode->data[0];
+      if(!valid_data_block(b)) {
+        continue;
+      }
+
+      // "." and ".."
+      DIRECTORY_BLOCK *directory = &image[b].directory;
+      INODE_REFERENCE expected[2] = {i, parent_of[i]};
+      const char *names[2] = {".", ".."};
+      for(int e = 0; e < 2; ++e) {
+        if(strcmp(directory->entry[e].name, names[e]) ||
+           directory->entry[e].inode_reference != expected[e]) {
+          report("Directory inode %d: \"%s\" should refer to inode %d\n", i, names[e], expected[e]);
+          memset(directory->entry[e].name, 0, FILE_NAME_SIZE);
+          strcpy(directory->entry[e].name, names[e]);
+          directory->entry[e].inode_reference = expected[e];
+          dirty[b] = 1;
+        }
+      }
+
+      // Size is the number of entries
+      unsigned int n_entries = 0;
+      for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+        n_entries += directory->entry[e].inode_reference != UNALLOCATED_INODE;
+      }
+      if(inode->size != n_entries) {
+        report("Directory inode %d: size is %u, has %u entries\n", i, inode->size, n_entries);
+        inode->size = n_entries;
+        dirty[inode_block] = 1;
+      }
+    } else {
+      if(inode->n_references != entry_count[i]) {
+        report("File inode %d: n_references is %d, %u directory entries refer to it\n",
+               i, inode->n_references, entry_count[i]);
+        inode->n_references = entry_count[i];
+        dirty[inode_block] = 1;
+      }
+
+      // A file needs one block per started BLOCK_SIZE bytes
+      int expected_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      if(n_blocks < expected_blocks) {
+        report("File inode %d: size is %u but only %d blocks are allocated\n", i, inode->size, n_blocks);
+        inode->size = n_blocks * BLOCK_SIZE;
+        dirty[inode_block] = 1;
+      } else if(n_blocks > expected_blocks) {
+        report("File inode %d: size is %u but %d blocks are allocated\n", i, inode->size, n_blocks);
+        inode->size = n_blocks * BLOCK_SIZE;
+        dirty[inode_block] = 1;
+      }
+    }
+  }
+}
+
+/**
+ *  Counts the blocks held by snapshots and the metadata blocks named by
+ *  the master block
+ *
+ *  @param dirty Set for each block of the image that was changed
+ */
+static void check_snapshots(char *dirty)
+{
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+
+  if(master->refcount_block != 0) {
+    if(valid_data_block(master->refcount_block)) {
+      metadata_block[master->refcount_block] = 1;
+    } else {
+      report("Master block: bad reference count block %d\n", master->refcount_block);
+    }
+  }
+  for(int m = 0; m < OWNER_MAP_BLOCKS && master->owner_map_block[0] != 0; ++m) {
+    if(valid_data_block(master->owner_map_block[m])) {
+      metadata_block[master->owner_map_block[m]] = 1;
+    } else {
+      report("Master block: bad reverse map block %d\n", master->owner_map_block[m]);
+      memset(master->owner_map_block, 0, sizeof(master->owner_map_block));
+      dirty[MASTER_BLOCK_REFERENCE] = 1;
+      break;
+    }
+  }
+  for(int m = 0; m < USAGE_BLOCKS && master->usage_block[0] != 0; ++m) {
+    if(valid_data_block(master->usage_block[m])) {
+      metadata_block[master->usage_block[m]] = 1;
+    } else {
+      report("Master block: bad usage table block %d\n", master->usage_block[m]);
+      memset(master->usage_block, 0, sizeof(master->usage_block));
+      dirty[MASTER_BLOCK_REFERENCE] = 1;
+      break;
+    }
+  }
+  if(master->dedup_block != 0) {
+    if(valid_data_block(master->dedup_block)) {
+      metadata_block[master->dedup_block] = 1;
+    } else {
+      report("Master block: bad dedup index block %d\n", master->dedup_block);
+      master->dedup_block = 0;
+      dirty[MASTER_BLOCK_REFERENCE] = 1;
+    }
+  }
+  if(master->snapshot_table_block == 0) {
+    return;
+  }
+  if(!valid_data_block(master->snapshot_table_block)) {
+    report("Master block: bad snapshot table block %d\n", master->snapshot_table_block);
+    return;
+  }
+  metadata_block[master->snapshot_table_block] = 1;
+
+  SNAPSHOT_BLOCK *table = &image[master->snapshot_table_block].snapshots;
+  for(int i = 0; i < MAX_SNAPSHOTS; ++i) {
+    SNAPSHOT *snapshot = &table->snapshot[i];
+    if(snapshot->name[0] == 0) {
+      continue;
+    }
+    for(int j = 0; j < N_INODE_BLOCKS; ++j) {
+      if(snapshot->inode_block[j] == UNALLOCATED_BLOCK) {
+        continue;
+      }
+      if(valid_data_block(snapshot->inode_block[j])) {
+        metadata_block[snapshot->inode_block[j]] = 1;
+      } else {
+        report("Snapshot %s: bad inode block %d\n", snapshot->name, snapshot->inode_block[j]);
+      }
+    }
+    for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      if(BIT_IS_SET(snapshot->block_held_flag, b)) {
+        ++holders[b];
+      }
+    }
+  }
+}
+
+/**
+ *  Rebuilds both allocation tables and the shared block reference counts,
+ *  and compares them with what is on disk
+ *
+ *  @param dirty Set for each block of the image that was changed
+ */
+static void check_tables(char *dirty)
+{
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  MASTER_BLOCK rebuilt;
+  memset(&rebuilt, 0, sizeof(rebuilt));
+
+  for(int i = 0; i < N_INODES; ++i) {
+    if(reachable[i]) {
+      SET_BIT(rebuilt.inode_allocated_flag, i);
+    }
+  }
+
+  int shared = 0;
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    if(metadata_block[b] && holders[b] > 0) {
+      report("Block %d: metadata block is also used for data\n", b);
+    }
+    int in_use = b <= N_INODE_BLOCKS || metadata_block[b] || holders[b] > 0;
+    if(in_use) {
+      SET_BIT(rebuilt.block_allocated_flag, b);
+    }
+    if(in_use && !BIT_IS_SET(master->block_allocated_flag, b)) {
+      report("Block %d: in use but marked free\n", b);
+    } else if(!in_use && BIT_IS_SET(master->block_allocated_flag, b)) {
+      report("Block %d: marked allocated but not in use\n", b);
+    }
+    shared |= holders[b] > 1;
+  }
+
+  if(memcmp(rebuilt.inode_allocated_flag, master->inode_allocated_flag, sizeof(rebuilt.inode_allocated_flag)) ||
+     memcmp(rebuilt.block_allocated_flag, master->block_allocated_flag, sizeof(rebuilt.block_allocated_flag))) {
+    memcpy(master->inode_allocated_flag, rebuilt.inode_allocated_flag, sizeof(rebuilt.inode_allocated_flag));
+    memcpy(master->block_allocated_flag, rebuilt.block_allocated_flag, sizeof(rebuilt.block_allocated_flag));
+    dirty[MASTER_BLOCK_REFERENCE] = 1;
+  }
+
+  // Extra references: every holder beyond the first
+  BLOCK_REFERENCE refcount_block = master->refcount_block;
+  if(refcount_block == 0 || !valid_data_block(refcount_block)) {
+    if(!shared) {
+      return;
+    }
+    report("Master block: blocks are shared but there are no reference counts\n");
+    // Take the first free block for them
+    for(refcount_block = N_INODE_BLOCKS + 1; refcount_block < N_BLOCKS_IN_DISK; ++refcount_block) {
+      if(!BIT_IS_SET(master->block_allocated_flag, refcount_block)) {
+        break;
+      }
+    }
+    if(refcount_block == N_BLOCKS_IN_DISK) {
+      fprintf(stderr, "zfsck: no free block for the reference counts\n");
+      return;
+    }
+    memset(&image[refcount_block], 0, BLOCK_SIZE);
+    SET_BIT(master->block_allocated_flag, refcount_block);
+    master->refcount_block = refcount_block;
+    dirty[MASTER_BLOCK_REFERENCE] = 1;
+  }
+
+  REFCOUNT_BLOCK *refcounts = &image[refcount_block].refcounts;
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    unsigned int expected = holders[b] > 1 ? holders[b] - 1 : 0;
+    if(refcounts->extra[b] != expected) {
+      report("Block %d: %d extra references recorded, %u expected\n", b, refcounts->extra[b], expected);
+      refcounts->extra[b] = expected;
+      dirty[refcount_block] = 1;
+    }
+  }
+}
+
+/**
+ *  Checks every block against its checksum.  A repair cannot bring back
+ *  the lost contents: the block is rewritten as it was read (and as the
+ *  other checks left it), so that it can be read again
+ *
+ *  @param dirty Set for each block of the image that was changed
+ */
+static void check_checksums(char *dirty)
+{
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    if(!vdisk_checksum_matches(b, &image[b])) {
+      report("Block %d: does not match its checksum\n", b);
+      dirty[b] = 1;
+    }
+  }
+}
+
+/**
+ *  Checks that the dedup index only holds blocks that are in use (by a file
+ *  or a snapshot).  A stale entry would only cost a comparison, but it is
+ *  removed all the same
+ *
+ *  @param dirty Set for each block of the image that was changed
+ */
+static void check_dedup(char *dirty)
+{
+  BLOCK_REFERENCE dedup_block = image[MASTER_BLOCK_REFERENCE].master.dedup_block;
+  if(dedup_block == 0) {
+    return;
+  }
+  DEDUP_BLOCK *index = &image[dedup_block].dedup;
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    if(index->fingerprint[b] != 0 && (holders[b] == 0 || metadata_block[b])) {
+      report("Block %d: in the dedup index but not in use\n", b);
+      index->fingerprint[b] = 0;
+      dirty[dedup_block] = 1;
+    }
+  }
+}
+
+/**
+ *  Checks the reverse map against the inodes: an entry must name an inode
+ *  that holds the block at that index, and a block that an inode holds
+ *  must have an entry (OWNER_UNKNOWN will do: it only costs a scan)
+ *
+ *  @param dirty Set for each block of the image that was changed
+ */
+static void check_owners(char *dirty)
+{
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  if(master->owner_map_block[0] == 0) {
+    return;
+  }
+
+  // What the map should say
+  OWNER_ENTRY expected[N_BLOCKS_IN_DISK];
+  memset(expected, 0, sizeof(expected));
+  for(int i = 0; i < N_INODES; ++i) {
+    if(!reachable[i]) {
+      continue;
+    }
+    INODE *inode = INODE_AT(i);
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+      BLOCK_REFERENCE b = inode->data[k];
+      if(valid_data_block(b)) {
+        expected[b].holder = expected[b].holder == OWNER_NONE ? OWNER_HOLDER(i) : OWNER_UNKNOWN;
+        expected[b].index = k;
+      }
+    }
+  }
+
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    BLOCK_REFERENCE map_block = master->owner_map_block[b / OWNERS_PER_BLOCK];
+    OWNER_ENTRY *entry = &image[map_block].owners.owner[b % OWNERS_PER_BLOCK];
+    int ok;
+    if(entry->holder == OWNER_UNKNOWN) {
+      ok = expected[b].holder != OWNER_NONE || holders[b] > 0;
+    } else if(entry->holder == OWNER_NONE) {
+      ok = expected[b].holder == OWNER_NONE;
+    } else {
+      INODE_REFERENCE owner = entry->holder - 1;
+      ok = owner < N_INODES && reachable[owner] && entry->index < BLOCKS_PER_INODE &&
+        INODE_AT(owner)->data[entry->index] == b;
+    }
+    if(!ok) {
+      report("Block %d: reverse map entry (%d, %d) does not match its holders\n", b, entry->holder, entry->index);
+      if(expected[b].holder == OWNER_NONE && holders[b] > 0) {
+        // Held by snapshots only
+        expected[b].holder = OWNER_UNKNOWN;
+      }
+      *entry = expected[b];
+      dirty[map_block] = 1;
+    }
+  }
+}
+
+/**
+ *  Adds up the space taken by a directory tree, the way oufs_usage_rebuild()
+ *  does: a file counts in every directory that links it
+ *
+ *  @param dir The directory
+ *  @param expected Usage of every inode, filled in
+ *  @param seen Inodes that were counted already
+ *  @param linked_by Set to the first directory found to link each inode
+ */
+static void add_up_usage(INODE_REFERENCE dir, USAGE_ENTRY *expected, char *seen, INODE_REFERENCE *linked_by)
+{
+  seen[dir] = 1;
+  BLOCK_REFERENCE block_reference = INODE_AT(dir)->data[0];
+  if(!valid_data_block(block_reference)) {
+    return;
+  }
+  DIRECTORY_BLOCK *directory = &image[block_reference].directory;
+  for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+    INODE_REFERENCE child = directory->entry[e].inode_reference;
+    if(child >= N_INODES || !reachable[child] ||
+       !strcmp(directory->entry[e].name, ".") || !strcmp(directory->entry[e].name, "..")) {
+      continue;
+    }
+    int is_directory = INODE_AT(child)->type == IT_DIRECTORY;
+    if(is_directory && seen[child]) {
+      continue;
+    }
+    if(!seen[child]) {
+      linked_by[child] = dir;
+    }
+    if(is_directory) {
+      add_up_usage(child, expected, seen, linked_by);
+    }
+    seen[child] = 1;
+    expected[dir].bytes += expected[child].bytes;
+    expected[dir].blocks += expected[child].blocks;
+    expected[dir].inodes += expected[child].inodes;
+  }
+}
+
+/**
+ *  Checks the usage table against the tree: every inode must record the
+ *  bytes, blocks and inodes below it, and the directory that links it.  A
+ *  table that is marked as fallen behind is rebuilt before it is used, so
+ *  it is not checked
+ *
+ *  @param dirty Set for each block of the image that was changed
+ */
+static void check_usage(char *dirty)
+{
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  if(master->usage_block[0] == 0 || master->usage_stale) {
+    return;
+  }
+
+  // What the table should say: first the space of each inode by itself
+  static USAGE_ENTRY expected[N_INODES];
+  static char seen[N_INODES];
+  static INODE_REFERENCE linked_by[N_INODES];
+  for(int i = 0; i < N_INODES; ++i) {
+    INODE *inode = INODE_AT(i);
+    memset(&expected[i], 0, sizeof(USAGE_ENTRY));
+    if(!reachable[i]) {
+      continue;
+    }
+    expected[i].bytes = inode->type == IT_FILE ? inode->size : 0;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+      expected[i].blocks += inode->data[k] != UNALLOCATED_BLOCK;
+    }
+    expected[i].inodes = 1;
+  }
+  add_up_usage(0, expected, seen, linked_by);
+
+  for(int i = 0; i < N_INODES; ++i) {
+    if(!reachable[i]) {
+      continue;
+    }
+    BLOCK_REFERENCE table_block = master->usage_block[i / USAGES_PER_BLOCK];
+    USAGE_ENTRY *usage = &image[table_block].usages.usage[i % USAGES_PER_BLOCK];
+    // A file with several links may be followed up through any of them
+    INODE_REFERENCE parent = i == 0 ? UNALLOCATED_INODE : linked_by[i];
+    int parent_ok = usage->parent == parent;
+    if(INODE_AT(i)->type == IT_FILE && entry_count[i] > 1) {
+      parent_ok = usage->parent < N_INODES && reachable[usage->parent] &&
+        INODE_AT(usage->parent)->type == IT_DIRECTORY;
+    }
+    if(usage->bytes != expected[i].bytes || usage->blocks != expected[i].blocks ||
+       usage->inodes != expected[i].inodes || !parent_ok) {
+      report("Inode %d: usage (%u bytes, %u blocks, %u inodes, parent %d) recorded, (%u, %u, %u, %d) expected\n",
+             i, usage->bytes, usage->blocks, usage->inodes, usage->parent, expected[i].bytes, expected[i].blocks,
+             expected[i].inodes, parent_ok ? usage->parent : parent);
+      usage->bytes = expected[i].bytes;
+      usage->blocks = expected[i].blocks;
+      usage->inodes = expected[i].inodes;
+      if(!parent_ok) {
+        usage->parent = parent;
+      }
+      dirty[table_block] = 1;
+    }
+  }
+}
+
+/**
+ *  Usage: zfsck [-r] [-j threads]
+ *
+ *  @param argc The number of parameters from the command line
+ *  @param argv The array containing the parameters from the command line
+ *  @return 0 if the file system is consistent, 1 if problems were found
+ */
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  int repair = 0;
+  int n_threads = N_INODES >= FSCK_PARALLEL_INODES ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  for(int i = 1; i < argc; ++i) {
+    if(strncmp(argv[i], "-r", 3) == 0) {
+      repair = 1;
+    }else if(strncmp(argv[i], "-j", 3) == 0 && i + 1 < argc) {
+      n_threads = atoi(argv[++i]);
+    }else{
+      fprintf(stderr, "Usage: zfsck [-r] [-j threads]\n");
+      return(-1);
+    }
+  }
+  n_threads = MIN(n_threads, FSCK_MAX_THREADS);
+  if(n_threads < 1) {
+    n_threads = 1;
+  }
+
+  // One sequential pass over the disk.  Blocks that do not match their
+  //  checksums are loaded as they are and reported below, unless ZCHECKSUM
+  //  asks for something else
+  setenv(CHECKSUM_ENVIRONMENT, "log", 0);
+  if(vdisk_disk_open(disk_name) != 0) {
+    return(-1);
+  }
+  if(vdisk_read_blocks(0, N_BLOCKS_IN_DISK, image) != 0) {
+    return(-1);
+  }
+
+  char dirty[N_BLOCKS_IN_DISK];
+  memset(dirty, 0, sizeof(dirty));
+  check_checksums(dirty);
+  walk_tree(n_threads);
+  check_inodes(dirty);
+  check_snapshots(dirty);
+  check_tables(dirty);
+  check_dedup(dirty);
+  check_owners(dirty);
+  check_usage(dirty);
+
+  int n_inodes = 0;
+  int n_blocks = 0;
+  for(int i = 0; i < N_INODES; ++i) {
+    n_inodes += reachable[i];
+  }
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    n_blocks += BIT_IS_SET(image[MASTER_BLOCK_REFERENCE].master.block_allocated_flag, b);
+  }
+
+  if(repair && problems > 0) {
+    // All fixes reach the disk together
+    vdisk_journal_begin();
+    for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      if(dirty[b]) {
+        vdisk_write_block(b, &image[b]);
+      }
+    }
+    vdisk_journal_end();
+  }
+
+  // Blocks that files would take without sharing, against the blocks they take
+  char dedup[64] = "";
+  if(image[MASTER_BLOCK_REFERENCE].master.dedup_block != 0) {
+    int n_file_blocks = 0;
+    for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      n_file_blocks += file_block[b];
+    }
+    snprintf(dedup, sizeof(dedup), ", dedup %.2f (%d file blocks in %d)",
+             n_file_blocks ? (double) file_references / n_file_blocks : 1.0, file_references, n_file_blocks);
+  }
+
+  printf("zfsck: %d/%d inodes, %d/%d blocks%s, %d problem%s%s\n", n_inodes, (int) N_INODES,
+         n_blocks, N_BLOCKS_IN_DISK, dedup, problems, problems == 1 ? "" : "s",
+         repair && problems > 0 ? " repaired" : "");
+
+  vdisk_disk_close();
+  return(problems > 0);
+}
@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+/**
+ *  Content search.
+ *
+ *  The files below the start path are found with one scan of the inode
+ *  table and a walk of the directory blocks.  Their blocks are then read in
+ *  disk order, runs of consecutive blocks with one vdisk_read_blocks() call
+ *  each, and a pool of threads searches the files in memory.  Each file is
+ *  searched as one buffer, so matches that cross a block boundary are found.
+ *
+ *  The search looks for the first and the last byte of the pattern 32 (AVX2)
+ *  or 16 (SSE2) positions at a time, and compares the whole pattern only
+ *  where both match.  Without either, it falls back to memchr().
+ */
+
+// Most threads in the pool
+#define ZGREP_MAX_THREADS 64
+
+// Room for a path: every directory level takes a name and a '/'
+#define ZGREP_PATH_LENGTH (N_INODES * FILE_NAME_SIZE + 2)
+
+// Largest file
+#define ZGREP_FILE_SIZE (BLOCKS_PER_INODE * BLOCK_SIZE)
+
+// One file to search, and what the search found
+typedef struct grep_file_s
+{
+    char path[ZGREP_PATH_LENGTH];
+    INODE_REFERENCE inode_reference;
+    // Lines printed for the file
+    char *output;
+    size_t output_size;
+    // Matching lines
+    int count;
+} GREP_FILE;
+
+// Search kernels: first occurrence of a pattern in a buffer
+typedef const char *(*SEARCH_KERNEL)(const char *haystack, size_t n, const char *needle, size_t m);
+
+// Options
+static const char *pattern;
+static size_t pattern_length;
+static int list_files = 0;
+static int count_only = 0;
+static int line_numbers = 0;
+static SEARCH_KERNEL search;
+
+// Every inode in use
+static INODE inodes[N_INODES];
+static char in_use[N_INODES];
+
+// The files to search, in path order
+static GREP_FILE *files;
+static int n_files = 0;
+
+// Blocks of those files, read from the disk
+static BLOCK *image;
+
+// Next file for the pool to search
+static int next_file = 0;
+
+/**
+ *  First occurrence of a pattern, with memchr() to find candidates
+ *
+ *  @param haystack Buffer to search
+ *  @param n Its length
+ *  @param needle The pattern
+ *  @param m Its length, at least 1
+ *  @return The first occurrence, NULL if there is none
+ */
+static const char *search_scalar(const char *haystack, size_t n, const char *needle, size_t m)
+{
+    const char *end = haystack + n;
+    for (const char *p = haystack; (size_t) (end - p) >= m; ++p) {
+        p = memchr(p, needle[0], end - p - m + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (!memcmp(p + 1, needle + 1, m - 1)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define ZGREP_HAVE_X86 1
+
+/**
+ *  First occurrence of a pattern, 16 positions at a time (SSE2)
+ *
+ *  @param haystack Buffer to search
+ *  @param n Its length
+ *  @param needle The pattern
+ *  @param m Its length, at least 1
+ *  @return The first occurrence, NULL if there is none
+ */
+static const char *search_sse2(const char *haystack, size_t n, const char *needle, size_t m)
+{
+    if (n < m) {
+        return NULL;
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    // Positions i ... i + 15 where the first and the last byte both match
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *) (haystack + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                            _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(haystack + i + bit + 1, needle + 1, m - 1)) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return search_scalar(haystack + i, n - i, needle, m);
+}
+
+/**
+ *  First occurrence of a pattern, 32 positions at a time (AVX2)
+ *
+ *  @param haystack Buffer to search
+ *  @param n Its length
+ *  @param needle The pattern
+ *  @param m Its length, at least 1
+ *  @return The first occurrence, NULL if there is none
+ */
+__attribute__((target("avx2")))
+static const char *search_avx2(const char *haystack, size_t n, const char *needle, size_t m)
+{
+    if (n < m) {
+        return NULL;
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *) (haystack + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *) (haystack + i + m - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                                  _mm256_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(haystack + i + bit + 1, needle + 1, m - 1)) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return search_sse2(haystack + i, n - i, needle, m);
+}
+#endif
+
+/**
+ *  Picks the fastest search kernel that this processor runs
+ */
+static void choose_kernel()
+{
+    search = search_scalar;
+#ifdef ZGREP_HAVE_X86
+    search = __builtin_cpu_supports("avx2") ? search_avx2 : search_sse2;
+#endif
+}
+
+/**
+ *  Searches one file, and keeps its matching lines for printing
+ *
+ *  @param file The file
+ */
+static void grep_file(GREP_FILE *file)
+{
+    INODE *inode = &inodes[file->inode_reference];
+    static __thread char contents[ZGREP_FILE_SIZE];
+    size_t size = MIN(inode->size, ZGREP_FILE_SIZE);
+    for (size_t k = 0; k * BLOCK_SIZE < size; ++k) {
+        memcpy(&contents[k * BLOCK_SIZE], &image[inode->data[k]], MIN(BLOCK_SIZE, size - k * BLOCK_SIZE));
+    }
+
+    FILE *out = open_memstream(&file->output, &file->output_size);
+    const char *end = contents + size;
+    const char *line_start = contents;
+    int line_number = 1;
+    for (const char *p = contents; p < end;) {
+        const char *match = search(p, end - p, pattern, pattern_length);
+        if (match == NULL) {
+            break;
+        }
+        // The line around the match
+        for (; line_start < match; ) {
+            const char *newline = memchr(line_start, '\n', match - line_start);
+            if (newline == NULL) {
+                break;
+            }
+            line_start = newline + 1;
+            ++line_number;
+        }
+        const char *line_end = memchr(match, '\n', end - match);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        ++file->count;
+        if (list_files) {
+            break;
+        }
+        if (!count_only) {
+            fprintf(out, "%s:", file->path);
+            if (line_numbers) {
+                fprintf(out, "%d:", line_number);
+            }
+            fwrite(line_start, 1, line_end - line_start, out);
+            fputc('\n', out);
+        }
+        p = line_end + 1;
+    }
+    fclose(out);
+}
+
+/**
+ *  One thread of the pool: searches files until there are none left
+ *
+ *  @param arg Unused
+ *  @return NULL
+ */
+static void *grep_worker(void *arg)
+{
+    (void) arg;
+    for (;;) {
+        int f = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED);
+        if (f >= n_files) {
+            return NULL;
+        }
+        grep_file(&files[f]);
+    }
+}
+
+/**
+ *  Adds the files below a directory to the list, in name order
+ *
+ *  @param dir The directory
+ *  @param path Its path
+ *  @param depth Directories above it, which bounds the walk
+ */
+static void add_files(INODE_REFERENCE dir, const char *path, int depth)
+{
+    if (inodes[dir].type != IT_DIRECTORY || depth >= N_INODES || inodes[dir].data[0] >= N_BLOCKS_IN_DISK) {
+        return;
+    }
+    BLOCK block;
+    vdisk_read_block(inodes[dir].data[0], &block);
+    qsort(block.directory.entry, DIRECTORY_ENTRIES_PER_BLOCK, sizeof(DIRECTORY_ENTRY), string_compare);
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+        DIRECTORY_ENTRY *entry = &block.directory.entry[i];
+        INODE_REFERENCE child = entry->inode_reference;
+        if (child >= N_INODES || !in_use[child] || !strcmp(entry->name, ".") || !strcmp(entry->name, "..")) {
+            continue;
+        }
+        char child_path[ZGREP_PATH_LENGTH];
+        snprintf(child_path, sizeof(child_path), "%s%s%.*s", path, strcmp(path, "/") ? "/" : "",
+                 (int) FILE_NAME_SIZE, entry->name);
+        if (inodes[child].type == IT_DIRECTORY) {
+            add_files(child, child_path, depth + 1);
+        } else if (inodes[child].type == IT_FILE) {
+            GREP_FILE *file = &files[n_files++];
+            strcpy(file->path, child_path);
+            file->inode_reference = child;
+        }
+    }
+}
+
+/**
+ *  Finds the inode that a path names
+ *
+ *  @param cwd Current working directory
+ *  @param path Path to look up, absolute or relative to cwd
+ *  @return The inode, UNALLOCATED_INODE if there is none
+ */
+static INODE_REFERENCE look_up(const char *cwd, const char *path)
+{
+    char full_path[2 * MAX_PATH_LENGTH + 2];
+    snprintf(full_path, sizeof(full_path), "%s/%s", path[0] == '/' ? "" : cwd, path);
+    INODE_REFERENCE inode_reference = 0;
+    for (char *name = strtok(full_path, "/"); name != NULL; name = strtok(NULL, "/")) {
+        if (inodes[inode_reference].type != IT_DIRECTORY) {
+            return UNALLOCATED_INODE;
+        }
+        BLOCK block;
+        vdisk_read_block(inodes[inode_reference].data[0], &block);
+        INODE_REFERENCE next = UNALLOCATED_INODE;
+        for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+            if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE &&
+                !strncmp(block.directory.entry[i].name, name, FILE_NAME_SIZE - 1)) {
+                next = block.directory.entry[i].inode_reference;
+                break;
+            }
+        }
+        if (next >= N_INODES || !in_use[next]) {
+            return UNALLOCATED_INODE;
+        }
+        inode_reference = next;
+    }
+    return inode_reference;
+}
+
+/**
+ *  Reads the blocks of every file to search, in disk order: each run of
+ *  consecutive blocks takes one vdisk_read_blocks() call
+ *
+ *  @return 0 on success, -1 on error
+ */
+static int load_blocks()
+{
+    static char wanted[N_BLOCKS_IN_DISK];
+    for (int f = 0; f < n_files; ++f) {
+        INODE *inode = &inodes[files[f].inode_reference];
+        for (int k = 0; k < BLOCKS_PER_INODE && (unsigned int) k * BLOCK_SIZE < inode->size; ++k) {
+            if (inode->data[k] <= N_INODE_BLOCKS || inode->data[k] >= N_BLOCKS_IN_DISK) {
+                fprintf(stderr, "zgrep: %s: bad block reference %d\n", files[f].path, inode->data[k]);
+                return -1;
+            }
+            wanted[inode->data[k]] = 1;
+        }
+    }
+    for (int b = 0; b < N_BLOCKS_IN_DISK;) {
+        if (!wanted[b]) {
+            ++b;
+            continue;
+        }
+        int run = 1;
+        while (b + run < N_BLOCKS_IN_DISK && wanted[b + run]) {
+            ++run;
+        }
+        if (vdisk_read_blocks(b, run, &image[b]) != 0) {
+            return -1;
+        }
+        b += run;
+    }
+    return 0;
+}
+
+/**
+ *  Searches the contents of the files below a path for a fixed string.
+ *
+ *  Usage: zgrep [-l] [-c] [-n] [-j threads] pattern [path]
+ *  Prints each matching line as path:line (path:number:line with -n).
+ *  -l prints only the names of the files with a match, -c the number of
+ *  matching lines of every file.  The path defaults to the current working
+ *  directory.  Files are searched by one thread per CPU, or by -j threads
+ *
+ *  @return 0 if a line matched, 1 if none did, 2 on error
+ */
+int main(int argc, char** argv) {
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name);
+
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *path = NULL;
+    int usage = 0;
+    for (int i = 1; i < argc && !usage; ++i) {
+        if (!strcmp(argv[i], "-l")) {
+            list_files = 1;
+        } else if (!strcmp(argv[i], "-c")) {
+            count_only = 1;
+        } else if (!strcmp(argv[i], "-n")) {
+            line_numbers = 1;
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            n_threads = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && pattern == NULL) {
+            pattern = argv[i];
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage || pattern == NULL || pattern[0] == 0) {
+        fprintf(stderr, "Usage: zgrep [-l] [-c] [-n] [-j threads] pattern [path]\n");
+        return(2);
+    }
+    pattern_length = strlen(pattern);
+    n_threads = MIN(n_threads, ZGREP_MAX_THREADS);
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    choose_kernel();
+
+    if (vdisk_disk_open(disk_name) != 0) {
+        return(2);
+    }
+    //Read from a snapshot instead of the live file system
+    char *snapshot_name = getenv("ZSNAP");
+    if (snapshot_name != NULL && oufs_snapshot_select(snapshot_name) != 0) {
+        return(2);
+    }
+
+    // Every inode in use, then the files below the path
+    INODE_SCAN scan;
+    INODE_REFERENCE inode_reference;
+    INODE inode;
+    int result;
+    if (oufs_inode_scan_open(&scan) != 0) {
+        return(2);
+    }
+    while ((result = oufs_inode_scan_next(&scan, &inode_reference, &inode)) == 1) {
+        inodes[inode_reference] = inode;
+        in_use[inode_reference] = 1;
+    }
+    if (result < 0) {
+        return(2);
+    }
+    if (path == NULL) {
+        path = cwd;
+    }
+    INODE_REFERENCE start = look_up(cwd, path);
+    if (start == UNALLOCATED_INODE) {
+        fprintf(stderr, "zgrep: %s not found\n", path);
+        return(2);
+    }
+    files = calloc(N_INODES * DIRECTORY_ENTRIES_PER_BLOCK, sizeof(GREP_FILE));
+    image = malloc(N_BLOCKS_IN_DISK * sizeof(BLOCK));
+    if (inodes[start].type == IT_FILE) {
+        strcpy(files[0].path, path);
+        files[0].inode_reference = start;
+        n_files = 1;
+    } else {
+        add_files(start, path, 0);
+    }
+    if (load_blocks() != 0) {
+        return(2);
+    }
+    vdisk_disk_close();
+
+    // Search
+    pthread_t threads[ZGREP_MAX_THREADS];
+    n_threads = MIN(n_threads, n_files > 0 ? n_files : 1);
+    for (int t = 1; t < n_threads; ++t) {
+        pthread_create(&threads[t], NULL, grep_worker, NULL);
+    }
+    grep_worker(NULL);
+    for (int t = 1; t < n_threads; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Results, in path order
+    int matched = 0;
+    for (int f = 0; f < n_files; ++f) {
+        GREP_FILE *file = &files[f];
+        matched |= file->count > 0;
+        if (list_files) {
+            if (file->count > 0) {
+                printf("%s\n", file->path);
+            }
+        } else if (count_only) {
+            printf("%s:%d\n", file->path, file->count);
+        } else {
+            fwrite(file->output, 1, file->output_size, stdout);
+        }
+        free(file->output);
+    }
+    free(files);
+    free(image);
+    return(matched ? 0 : 1);
+}
@@ -3,12 +3,335 @@
 
 #include "oufs_lib.h"
 
+// Output buffer for -dump, so that a whole disk is written in a few large writes
+#define DUMP_BUFFER_SIZE (1 << 20)
+
+// Maximum number of holders recorded for one block
+#define MAX_OWNERS 8
+
+// Kinds of block owners
+#define OWNER_MASTER "master"
+#define OWNER_INODE_TABLE "inode_table"
+#define OWNER_DIRECTORY "directory"
+#define OWNER_DATA "data"
+#define OWNER_SNAPSHOT_TABLE "snapshot_table"
+#define OWNER_REFCOUNTS "refcounts"
+#define OWNER_DEDUP_INDEX "dedup_index"
+#define OWNER_OWNER_MAP "owner_map"
+#define OWNER_USAGE_TABLE "usage_table"
+#define OWNER_SNAPSHOT_INODES "snapshot_inodes"
+#define OWNER_SNAPSHOT "snapshot"
+
+// One holder of a block
+typedef struct owner_s
+{
+    const char *kind;
+    // Inode (directory, data) or snapshot slot (snapshot_inodes, snapshot); -1 if none
+    int id;
+    // Index into INODE.data[] or SNAPSHOT.inode_block[]; -1 if none
+    int index;
+} OWNER;
+
+// The whole disk, loaded with one read
+static BLOCK image[N_BLOCKS_IN_DISK];
+// Holders of each block
+static OWNER owners[N_BLOCKS_IN_DISK][MAX_OWNERS];
+static int n_owners[N_BLOCKS_IN_DISK];
+
+// Inode i as stored in the loaded image
+#define INODE_AT(i) (&image[(i) / INODES_PER_BLOCK + 1].inodes.inode[(i) % INODES_PER_BLOCK])
+
+// Bit helper for allocation tables
+#define BIT_IS_SET(table, i) (((table)[(i) >> 3] >> ((i) & 0x7)) & 1)
+
+/**
+ *  Records a holder of a block
+ *
+ *  @param block_reference The block
+ *  @param kind One of the OWNER_ kinds
+ *  @param id Inode or snapshot slot, -1 if none
+ *  @param index Index within the holder, -1 if none
+ */
+static void add_owner(BLOCK_REFERENCE block_reference, const char *kind, int id, int index)
+{
+    if (block_reference >= N_BLOCKS_IN_DISK || n_owners[block_reference] == MAX_OWNERS) {
+        return;
+    }
+    OWNER *owner = &owners[block_reference][n_owners[block_reference]++];
+    owner->kind = kind;
+    owner->id = id;
+    owner->index = index;
+}
+
+/**
+ *  Works out the holders of every block from the loaded image
+ */
+static void build_owner_map()
+{
+    MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+    
+    add_owner(MASTER_BLOCK_REFERENCE, OWNER_MASTER, -1, -1);
+    for (int i = 1; i <= N_INODE_BLOCKS; ++i) {
+        add_owner(i, OWNER_INODE_TABLE, -1, i - 1);
+    }
+    for (int i = 0; i < N_INODES; ++i) {
+        if (!BIT_IS_SET(master->inode_allocated_flag, i)) {
+            continue;
+        }
+        INODE *inode = INODE_AT(i);
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            if (inode->data[k] != UNALLOCATED_BLOCK) {
+                add_owner(inode->data[k], inode->type == IT_DIRECTORY ? OWNER_DIRECTORY : OWNER_DATA, i, k);
+            }
+        }
+    }
+    if (master->refcount_block != 0) {
+        add_owner(master->refcount_block, OWNER_REFCOUNTS, -1, -1);
+    }
+    if (master->dedup_block != 0) {
+        add_owner(master->dedup_block, OWNER_DEDUP_INDEX, -1, -1);
+    }
+    for (int m = 0; m < OWNER_MAP_BLOCKS && master->owner_map_block[0] != 0; ++m) {
+        add_owner(master->owner_map_block[m], OWNER_OWNER_MAP, -1, m);
+    }
+    for (int m = 0; m < USAGE_BLOCKS && master->usage_block[0] != 0; ++m) {
+        add_owner(master->usage_block[m], OWNER_USAGE_TABLE, -1, m);
+    }
+    if (master->snapshot_table_block != 0 && master->snapshot_table_block < N_BLOCKS_IN_DISK) {
+        add_owner(master->snapshot_table_block, OWNER_SNAPSHOT_TABLE, -1, -1);
+        SNAPSHOT_BLOCK *table = &image[master->snapshot_table_block].snapshots;
+        for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+            if (table->snapshot[i].name[0] == 0) {
+                continue;
+            }
+            for (int j = 0; j < N_INODE_BLOCKS; ++j) {
+                if (table->snapshot[i].inode_block[j] != UNALLOCATED_BLOCK) {
+                    add_owner(table->snapshot[i].inode_block[j], OWNER_SNAPSHOT_INODES, i, j);
+                }
+            }
+            for (int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+                if (BIT_IS_SET(table->snapshot[i].block_held_flag, b)) {
+                    add_owner(b, OWNER_SNAPSHOT, i, -1);
+                }
+            }
+        }
+    }
+}
+
+/**
+ *  Prints a name as a JSON string
+ *
+ *  @param name Directory entry name (not necessarily terminated)
+ */
+static void print_json_name(const char *name)
+{
+    putchar('"');
+    for (int i = 0; i < FILE_NAME_SIZE && name[i] != 0; ++i) {
+        unsigned char c = name[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < ' ' || c > '~') {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/**
+ *  Prints a name as a CSV field
+ *
+ *  @param name Directory entry name (not necessarily terminated)
+ */
+static void print_csv_name(const char *name)
+{
+    putchar('"');
+    for (int i = 0; i < FILE_NAME_SIZE && name[i] != 0; ++i) {
+        if (name[i] == '"') {
+            putchar('"');
+        }
+        putchar(name[i]);
+    }
+    putchar('"');
+}
+
+/**
+ *  Prints an allocation table as hex digits
+ *
+ *  @param table The table
+ *  @param len Number of bytes
+ */
+static void print_table(unsigned char *table, int len)
+{
+    for (int i = 0; i < len; ++i) {
+        printf("%02x", table[i]);
+    }
+}
+
+/**
+ *  Dumps the whole disk as JSON: geometry, master block, allocated inodes, directory blocks and the owners of every block
+ */
+static void dump_json()
+{
+    MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+    
+    printf("{\n\"geometry\": {\"block_size\": %d, \"blocks\": %d, \"inodes\": %d},\n",
+           BLOCK_SIZE, N_BLOCKS_IN_DISK, (int) N_INODES);
+    printf("\"master\": {\"inode_allocated\": \"");
+    print_table(master->inode_allocated_flag, sizeof(master->inode_allocated_flag));
+    printf("\", \"block_allocated\": \"");
+    print_table(master->block_allocated_flag, sizeof(master->block_allocated_flag));
+    printf("\", \"snapshot_table_block\": %d, \"refcount_block\": %d, \"dedup_block\": %d},\n",
+           master->snapshot_table_block, master->refcount_block, master->dedup_block);
+    
+    printf("\"inodes\": [");
+    int first = 1;
+    for (int i = 0; i < N_INODES; ++i) {
+        if (!BIT_IS_SET(master->inode_allocated_flag, i)) {
+            continue;
+        }
+        INODE *inode = INODE_AT(i);
+        printf("%s\n {\"inode\": %d, \"type\": \"%c\", \"n_references\": %d, \"size\": %u, \"blocks\": [",
+               first ? "" : ",", i, inode->type, inode->n_references, inode->size);
+        int first_block = 1;
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            if (inode->data[k] != UNALLOCATED_BLOCK) {
+                printf("%s%d", first_block ? "" : ", ", inode->data[k]);
+                first_block = 0;
+            }
+        }
+        printf("]}");
+        first = 0;
+    }
+    
+    printf("\n],\n\"directories\": [");
+    first = 1;
+    for (int i = 0; i < N_INODES; ++i) {
+        INODE *inode = INODE_AT(i);
+        if (!BIT_IS_SET(master->inode_allocated_flag, i) || inode->type != IT_DIRECTORY ||
+            inode->data[0] >= N_BLOCKS_IN_DISK) {
+            continue;
+        }
+        DIRECTORY_BLOCK *directory = &image[inode->data[0]].directory;
+        printf("%s\n {\"inode\": %d, \"block\": %d, \"entries\": [", first ? "" : ",", i, inode->data[0]);
+        int first_entry = 1;
+        for (int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+            if (directory->entry[e].inode_reference == UNALLOCATED_INODE) {
+                continue;
+            }
+            printf("%s{\"entry\": %d, \"name\": ", first_entry ? "" : ", ", e);
+            print_json_name(directory->entry[e].name);
+            printf(", \"inode\": %d}", directory->entry[e].inode_reference);
+            first_entry = 0;
+        }
+        printf("]}");
+        first = 0;
+    }
+    
+    printf("\n],\n\"blocks\": [");
+    for (int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+        printf("%s\n {\"block\": %d, \"allocated\": %s, \"owners\": [", b == 0 ? "" : ",", b,
+               BIT_IS_SET(master->block_allocated_flag, b) ? "true" : "false");
+        for (int o = 0; o < n_owners[b]; ++o) {
+            printf("%s{\"kind\": \"%s\", \"id\": %d, \"index\": %d}", o == 0 ? "" : ", ",
+                   owners[b][o].kind, owners[b][o].id, owners[b][o].index);
+        }
+        printf("]}");
+    }
+    printf("\n]\n}\n");
+}
+
+/**
+ *  Dumps the whole disk as CSV.  The first field of every record names its type:
+ *    master,<inode table hex>,<block table hex>,<snapshot table block>,<refcount block>,<dedup block>
+ *    inode,<inode>,<type>,<n_references>,<size>,<blocks separated by spaces>
+ *    entry,<directory inode>,<block>,<entry>,<name>,<inode>
+ *    block,<block>,<allocated>,<owner kind>,<owner id>,<owner index>
+ *  A block with several owners has one block record per owner, a block without owners has one with empty owner fields
+ */
+static void dump_csv()
+{
+    MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+    
+    printf("master,");
+    print_table(master->inode_allocated_flag, sizeof(master->inode_allocated_flag));
+    putchar(',');
+    print_table(master->block_allocated_flag, sizeof(master->block_allocated_flag));
+    printf(",%d,%d,%d\n", master->snapshot_table_block, master->refcount_block, master->dedup_block);
+    
+    for (int i = 0; i < N_INODES; ++i) {
+        if (!BIT_IS_SET(master->inode_allocated_flag, i)) {
+            continue;
+        }
+        INODE *inode = INODE_AT(i);
+        printf("inode,%d,%c,%d,%u,", i, inode->type, inode->n_references, inode->size);
+        int first_block = 1;
+        for (int k = 0; k < BLOCKS_PER_INODE; ++k) {
+            if (inode->data[k] != UNALLOCATED_BLOCK) {
+                printf("%s%d", first_block ? "" : " ", inode->data[k]);
+                first_block = 0;
+            }
+        }
+        putchar('\n');
+    }
+    
+    for (int i = 0; i < N_INODES; ++i) {
+        INODE *inode = INODE_AT(i);
+        if (!BIT_IS_SET(master->inode_allocated_flag, i) || inode->type != IT_DIRECTORY ||
+            inode->data[0] >= N_BLOCKS_IN_DISK) {
+            continue;
+        }
+        DIRECTORY_BLOCK *directory = &image[inode->data[0]].directory;
+        for (int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+            if (directory->entry[e].inode_reference == UNALLOCATED_INODE) {
+                continue;
+            }
+            printf("entry,%d,%d,%d,", i, inode->data[0], e);
+            print_csv_name(directory->entry[e].name);
+            printf(",%d\n", directory->entry[e].inode_reference);
+        }
+    }
+    
+    for (int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+        int allocated = BIT_IS_SET(master->block_allocated_flag, b);
+        if (n_owners[b] == 0) {
+            printf("block,%d,%d,,,\n", b, allocated);
+        }
+        for (int o = 0; o < n_owners[b]; ++o) {
+            printf("block,%d,%d,%s,%d,%d\n", b, allocated, owners[b][o].kind, owners[b][o].id, owners[b][o].index);
+        }
+    }
+}
+
 int main(int argc, char** argv) {
-    if(vdisk_disk_open("vdisk1") != 0) {
+    // Fetch the key environment vars
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name);
+    
+    if(vdisk_disk_open(disk_name) != 0) {
         return(-1);
     }
     
-    if(argc == 2){
+    if((argc == 2 || argc == 3) && strncmp(argv[1], "-dump", 6) == 0) {
+        // Whole disk dump: one sequential read, buffered output
+        const char *format = argc == 3 ? argv[2] : "json";
+        if(strcmp(format, "json") && strcmp(format, "csv")) {
+            fprintf(stderr, "Unknown dump format (%s)\n", format);
+        }else if(vdisk_read_blocks(0, N_BLOCKS_IN_DISK, image) != 0) {
+            fprintf(stderr, "Error reading disk\n");
+        }else{
+            setvbuf(stdout, NULL, _IOFBF, DUMP_BUFFER_SIZE);
+            build_owner_map();
+            if(!strcmp(format, "json")) {
+                dump_json();
+            }else{
+                dump_csv();
+            }
+        }
+        
+    }else if(argc == 2){
         if(strncmp(argv[1], "-master", 8) == 0) {
             // Master record
             BLOCK block;
@@ -74,6 +397,26 @@ int main(int argc, char** argv) {
             }else{
                 fprintf(stderr, "Unknown argument (-inode %s)\n", argv[2]);
             }
+        }else if(strncmp(argv[1], "-owner", 7) == 0) {
+            // Inode that holds a block
+            int index;
+            if(sscanf(argv[2], "%d", &index) == 1){
+                if(index < 0 || index >= N_BLOCKS_IN_DISK) {
+                    fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
+                }else{
+                    INODE_REFERENCE owner;
+                    int data_index;
+                    int scanned;
+                    if(oufs_block_owner(index, &owner, &data_index, &scanned)) {
+                        printf("Block %d: inode %d, data[%d]", index, owner, data_index);
+                    }else{
+                        printf("Block %d: not held by any inode", index);
+                    }
+                    printf(" (%s)\n", scanned ? "inode table scan" : "reverse map");
+                }
+            }else{
+                fprintf(stderr, "Unknown argument (-owner %s)\n", argv[2]);
+            }
         }else if(strncmp(argv[1], "-dblock", 8) == 0) {
             // Inspect directory block
             int index;
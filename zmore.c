@@ -12,6 +12,12 @@ int main(int argc, char** argv) {
     // Open the virtual disk
     vdisk_disk_open(disk_name);
     
+    //Read from a snapshot instead of the live file system
+    char *snapshot_name = getenv("ZSNAP");
+    if (snapshot_name != NULL && oufs_snapshot_select(snapshot_name) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    
     //Opening file for reading
     OUFILE file_specs = *oufs_fopen(cwd, argv[1], "r");
     
@@ -19,22 +25,32 @@ int main(int argc, char** argv) {
     INODE inode;
     oufs_read_inode_by_reference(file_specs.inode_reference, &inode);
     
-    for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-        if (inode.data[i] == UNALLOCATED_INODE) {
-            break;
-        } else {
-            BLOCK_REFERENCE block_reference = inode.data[i];
-            //Get block from block reference in inode
-            BLOCK block;
-            //Read block at reference into block
-            vdisk_read_block(block_reference, &block);
-            
-            for (int j = 0; j < 256; ++j) {
-                if (block.data.data[j] == NULL) {
-                    break;
-                } else {
-                    fprintf(stdout, "%c", block.data.data[j]);
-                }
+    //Read the blocks of the file, a run of consecutive blocks at a time, so that
+    // a striped disk reads each run from all of its members at once
+    BLOCK blocks[BLOCKS_PER_INODE];
+    int n_blocks = 0;
+    while (n_blocks < BLOCKS_PER_INODE && inode.data[n_blocks] != UNALLOCATED_INODE) {
+        ++n_blocks;
+    }
+    for (int i = 0; i < n_blocks; ) {
+        int run = 1;
+        while (i + run < n_blocks && inode.data[i + run] == inode.data[i] + run) {
+            ++run;
+        }
+        //Stop at blocks that cannot be read
+        if (vdisk_read_blocks(inode.data[i], run, &blocks[i]) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        i += run;
+    }
+
+    for (int i = 0; i < n_blocks; ++i) {
+        BLOCK *block = &blocks[i];
+        for (int j = 0; j < 256; ++j) {
+            if (block->data.data[j] == NULL) {
+                break;
+            } else {
+                fprintf(stdout, "%c", block->data.data[j]);
             }
         }
     }
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/**
+ *  Creates, lists and deletes snapshots of the file system. A snapshot can then be read by setting ZSNAP to its name before running zfilez or zmore
+ *
+ *  @param argc The number of parameters from the command line
+ *  @param argv The array containing the parameters from the command line
+ *  @return 0 on success, anything else is error
+ */
+int main(int argc, char** argv) {
+    // Fetch the key environment vars
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name);
+    
+    int ret = 0;
+    if (argc == 2 && strncmp(argv[1], "-list", 6) == 0) {
+        // Open the virtual disk
+        vdisk_disk_open(disk_name);
+        oufs_snapshot_list();
+    } else if (argc == 3 && strncmp(argv[1], "-create", 8) == 0) {
+        vdisk_disk_open(disk_name);
+        ret = oufs_snapshot_create(argv[2]);
+    } else if (argc == 3 && strncmp(argv[1], "-delete", 8) == 0) {
+        vdisk_disk_open(disk_name);
+        ret = oufs_snapshot_delete(argv[2]);
+    } else {
+        // Wrong parameters
+        fprintf(stderr, "Usage: zsnap -create <name> | -delete <name> | -list\n");
+        return(-1);
+    }
+    
+    // Clean up
+    vdisk_disk_close();
+    return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,849 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oufs_lib.h"
+#include "oufs_stats.h"
+
+// Default number of generated file operations
+#define DEFAULT_OPS 1000
+
+// Default scratch image; it is formatted before every run
+#define DEFAULT_IMAGE "vdisk_workload"
+
+// Files are kept within the blocks that oufs_fwrite() handles
+#define FILE_LIMIT (7 * BLOCK_SIZE)
+
+// Longest line written by create and append
+#define LINE_LENGTH 64
+
+// Longest line of a command log
+#define MAX_COMMAND 256
+
+// Largest number of directories in the generated tree
+#define MAX_DIRS N_INODES
+
+// Largest number of file names alive at once
+#define MAX_FILES (N_INODES * 4)
+
+// Replayed commands
+#define W_MKDIR 0
+#define W_RMDIR 1
+#define W_CREATE 2
+#define W_APPEND 3
+#define W_READ 4
+#define W_LINK 5
+#define W_REMOVE 6
+#define N_COMMANDS 7
+
+static const char *command_name[N_COMMANDS] = {"mkdir", "rmdir", "create", "append", "read", "link", "remove"};
+
+// Generated mix, in the order create:append:read:link:remove
+#define N_MIX 5
+static const int mix_command[N_MIX] = {W_CREATE, W_APPEND, W_READ, W_LINK, W_REMOVE};
+
+// Options
+static unsigned long long seed = 1;
+static int n_ops = DEFAULT_OPS;
+static int mix[N_MIX] = {30, 20, 30, 10, 10};
+static int min_size = 0;
+static int max_size = 3 * BLOCK_SIZE;
+static int small_sizes = 0;
+static int max_append = LINE_LENGTH;
+static int fanout = 2;
+static int depth = 3;
+static int json = 0;
+static int keep = 0;
+static char *image = DEFAULT_IMAGE;
+
+/**********************************************************************/
+// Generator model of the file system
+
+typedef struct dir_model_s
+{
+  char path[MAX_PATH_LENGTH];
+  // Entries in the directory block, "." and ".." included
+  int entries;
+} DIR_MODEL;
+
+// A file inode, shared by all of its links
+typedef struct object_model_s
+{
+  int size;
+  int links;
+} OBJECT_MODEL;
+
+// A name of a file
+typedef struct file_model_s
+{
+  int dir;
+  char name[FILE_NAME_SIZE];
+  int object;
+} FILE_MODEL;
+
+static DIR_MODEL dirs[MAX_DIRS];
+static int n_dirs = 0;
+static OBJECT_MODEL objects[MAX_FILES];
+static int n_objects = 0;
+static FILE_MODEL files[MAX_FILES];
+static int n_files = 0;
+static int next_name = 0;
+// Data blocks of all the files
+static int file_blocks = 0;
+// Directory of the last emitted "cd"
+static int current_dir = -1;
+
+/**
+ *  Next number from the generator's own random sequence, so that a seed gives the same
+ *  workload everywhere
+ *
+ *  @return Pseudo random number
+ */
+static unsigned long long next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+/**
+ *  Random number in a range
+ *
+ *  @param low Smallest value
+ *  @param high Largest value
+ *  @return Value in [low, high]
+ */
+static int random_range(int low, int high)
+{
+    if (high <= low) {
+        return low;
+    }
+    return low + (int) (next_random() % (unsigned long long) (high - low + 1));
+}
+
+/**
+ *  Data blocks used by a file of a given size
+ *
+ *  @param size File size in bytes
+ *  @return Number of blocks
+ */
+static int blocks_for(int size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ *  Blocks that are not yet used by the model.  One block is kept in reserve
+ *
+ *  @return Number of free blocks
+ */
+static int free_blocks()
+{
+    return N_BLOCKS_IN_DISK - ROOT_DIRECTORY_BLOCK - n_dirs - file_blocks - 1;
+}
+
+/**
+ *  Inodes that are not yet used by the model
+ *
+ *  @return Number of free inodes
+ */
+static int free_inodes()
+{
+    return N_INODES - n_dirs - n_objects;
+}
+
+/**
+ *  Emits a "cd" if the next command runs in another directory
+ *
+ *  @param log Command log
+ *  @param dir Directory of the next command
+ */
+static void emit_cd(FILE *log, int dir)
+{
+    if (dir != current_dir) {
+        fprintf(log, "cd %s\n", dirs[dir].path);
+        current_dir = dir;
+    }
+}
+
+/**
+ *  Adds the directory tree: fanout subdirectories per directory, depth levels deep.  The
+ *  tree stops growing once it would take half of the inodes
+ *
+ *  @param log Command log
+ */
+static void generate_tree(FILE *log)
+{
+    strcpy(dirs[0].path, "/");
+    dirs[0].entries = 2;
+    n_dirs = 1;
+
+    int level_start = 0;
+    for (int level = 0; level < depth; ++level) {
+        int level_end = n_dirs;
+        for (int parent = level_start; parent < level_end; ++parent) {
+            for (int i = 0; i < fanout; ++i) {
+                if (n_dirs >= N_INODES / 2 || dirs[parent].entries >= DIRECTORY_ENTRIES_PER_BLOCK ||
+                    strlen(dirs[parent].path) + FILE_NAME_SIZE + 1 >= MAX_PATH_LENGTH) {
+                    return;
+                }
+                // The parent is in dirs[] too: format apart, then copy
+                char path[MAX_PATH_LENGTH];
+                int len = snprintf(path, sizeof(path), "%s%sd%d", dirs[parent].path, parent == 0 ? "" : "/", n_dirs);
+                if (len < 0 || len >= (int) sizeof(path)) {
+                    return;
+                }
+                DIR_MODEL *dir = &dirs[n_dirs];
+                strcpy(dir->path, path);
+                dir->entries = 2;
+                ++dirs[parent].entries;
+                emit_cd(log, parent);
+                fprintf(log, "mkdir d%d\n", n_dirs);
+                ++n_dirs;
+            }
+        }
+        level_start = level_end;
+    }
+}
+
+/**
+ *  Picks the size of a new file
+ *
+ *  @return Size in bytes
+ */
+static int random_size()
+{
+    if (small_sizes) {
+        // Most files are small: the cube of a uniform value
+        double u = (next_random() % 1000000) / 1e6;
+        return min_size + (int) ((max_size - min_size) * u * u * u);
+    }
+    return random_range(min_size, max_size);
+}
+
+/**
+ *  Generates a create in a random directory
+ *
+ *  @param log Command log
+ *  @return 0 if done, -1 if the file system is full
+ */
+static int generate_create(FILE *log)
+{
+    int dir = random_range(0, n_dirs - 1);
+    if (dirs[dir].entries >= DIRECTORY_ENTRIES_PER_BLOCK || free_inodes() <= 0 || n_files >= MAX_FILES) {
+        return (-1);
+    }
+    int size = random_size();
+    if (blocks_for(size) > free_blocks()) {
+        size = free_blocks() * BLOCK_SIZE;
+    }
+    if (size < 0) {
+        return (-1);
+    }
+
+    OBJECT_MODEL *object = &objects[n_objects];
+    object->size = size;
+    object->links = 1;
+    FILE_MODEL *file = &files[n_files++];
+    file->dir = dir;
+    sprintf(file->name, "f%d", next_name++);
+    file->object = n_objects++;
+    ++dirs[dir].entries;
+    file_blocks += blocks_for(size);
+
+    emit_cd(log, dir);
+    fprintf(log, "create %s %d\n", file->name, size);
+    return (0);
+}
+
+/**
+ *  Generates an append to a random file
+ *
+ *  @param log Command log
+ *  @return 0 if done, -1 if no file can grow
+ */
+static int generate_append(FILE *log)
+{
+    if (n_files == 0) {
+        return (-1);
+    }
+    FILE_MODEL *file = &files[random_range(0, n_files - 1)];
+    OBJECT_MODEL *object = &objects[file->object];
+    int len = random_range(1, max_append);
+    if (object->size + len > FILE_LIMIT) {
+        len = FILE_LIMIT - object->size;
+    }
+    // Stay within the last block if the disk is full
+    int new_blocks = blocks_for(object->size + len) - blocks_for(object->size);
+    if (new_blocks > free_blocks()) {
+        len = blocks_for(object->size) * BLOCK_SIZE - object->size;
+        new_blocks = 0;
+    }
+    if (len <= 0) {
+        return (-1);
+    }
+    object->size += len;
+    file_blocks += new_blocks;
+
+    emit_cd(log, file->dir);
+    fprintf(log, "append %s %d\n", file->name, len);
+    return (0);
+}
+
+/**
+ *  Generates a read of a random file, with the size it is expected to have
+ *
+ *  @param log Command log
+ *  @return 0 if done, -1 if there are no files
+ */
+static int generate_read(FILE *log)
+{
+    if (n_files == 0) {
+        return (-1);
+    }
+    FILE_MODEL *file = &files[random_range(0, n_files - 1)];
+    emit_cd(log, file->dir);
+    fprintf(log, "read %s %d\n", file->name, objects[file->object].size);
+    return (0);
+}
+
+/**
+ *  Generates a second name for a random file, in the same directory
+ *
+ *  @param log Command log
+ *  @return 0 if done, -1 if no link can be made
+ */
+static int generate_link(FILE *log)
+{
+    if (n_files == 0 || n_files >= MAX_FILES) {
+        return (-1);
+    }
+    FILE_MODEL *source = &files[random_range(0, n_files - 1)];
+    if (dirs[source->dir].entries >= DIRECTORY_ENTRIES_PER_BLOCK) {
+        return (-1);
+    }
+    FILE_MODEL *file = &files[n_files++];
+    file->dir = source->dir;
+    sprintf(file->name, "f%d", next_name++);
+    file->object = source->object;
+    ++objects[file->object].links;
+    ++dirs[file->dir].entries;
+
+    emit_cd(log, file->dir);
+    fprintf(log, "link %s %s\n", source->name, file->name);
+    return (0);
+}
+
+/**
+ *  Generates the removal of a random file name
+ *
+ *  @param log Command log
+ *  @return 0 if done, -1 if there are no files
+ */
+static int generate_remove(FILE *log)
+{
+    if (n_files == 0) {
+        return (-1);
+    }
+    int i = random_range(0, n_files - 1);
+    FILE_MODEL *file = &files[i];
+    emit_cd(log, file->dir);
+    fprintf(log, "remove %s\n", file->name);
+
+    --dirs[file->dir].entries;
+    OBJECT_MODEL *object = &objects[file->object];
+    if (--object->links == 0) {
+        file_blocks -= blocks_for(object->size);
+        // Keep the objects dense: move the last one into the hole
+        int last = --n_objects;
+        if (file->object != last) {
+            objects[file->object] = objects[last];
+            for (int j = 0; j < n_files; ++j) {
+                if (files[j].object == last) {
+                    files[j].object = file->object;
+                }
+            }
+        }
+    }
+    files[i] = files[--n_files];
+    return (0);
+}
+
+/**
+ *  Writes a workload to the command log
+ *
+ *  @param log Command log
+ */
+static void generate(FILE *log)
+{
+    fprintf(log, "# zworkload -seed %llu -ops %d -mix %d:%d:%d:%d:%d -size %d:%d%s -fanout %d -depth %d\n",
+            seed, n_ops, mix[0], mix[1], mix[2], mix[3], mix[4], min_size, max_size,
+            small_sizes ? " -small" : "", fanout, depth);
+    generate_tree(log);
+
+    int total = 0;
+    for (int i = 0; i < N_MIX; ++i) {
+        total += mix[i];
+    }
+    for (int op = 0; op < n_ops; ++op) {
+        int pick = random_range(0, total - 1);
+        int kind = 0;
+        while (pick >= mix[kind]) {
+            pick -= mix[kind++];
+        }
+        // An operation that cannot be done (no files yet, the disk is full) becomes a
+        //  create, or a remove if nothing more can be created
+        int done;
+        switch (mix_command[kind]) {
+            case W_CREATE: done = generate_create(log); break;
+            case W_APPEND: done = generate_append(log); break;
+            case W_READ: done = generate_read(log); break;
+            case W_LINK: done = generate_link(log); break;
+            default: done = generate_remove(log); break;
+        }
+        if (done != 0 && generate_create(log) != 0) {
+            generate_remove(log);
+        }
+    }
+}
+
+/**********************************************************************/
+// Replay
+
+// Latency of each replayed command, by command (microseconds)
+static double *samples[N_COMMANDS];
+static int n_samples[N_COMMANDS];
+static int max_samples[N_COMMANDS];
+// I/O done by the replayed commands, by command
+static VDISK_STATS io_total[N_COMMANDS];
+
+static int n_errors = 0;
+static long long bytes_written = 0;
+static long long bytes_read = 0;
+
+// The command being timed
+static OP_TIMER timer;
+
+/**
+ *  Starts timing one command
+ */
+static void op_start()
+{
+    oufs_timer_start(&timer);
+}
+
+/**
+ *  Stops timing the command started by op_start() and records it
+ *
+ *  @param command W_ command
+ */
+static void op_stop(int command)
+{
+    double us = oufs_timer_stop(&timer, &io_total[command]);
+    if (n_samples[command] == max_samples[command]) {
+        max_samples[command] = max_samples[command] ? 2 * max_samples[command] : 256;
+        samples[command] = realloc(samples[command], max_samples[command] * sizeof(double));
+        if (samples[command] == NULL) {
+            fprintf(stderr, "zworkload: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples[command][n_samples[command]++] = us;
+}
+
+/**
+ *  Opens a file relative to the current directory.  The library tokenizes its arguments
+ *  in place, so it gets copies
+ *
+ *  @param cwd Current directory
+ *  @param name File name
+ *  @param mode "r", "w" or "a"
+ *  @return The file; the caller frees it
+ */
+static OUFILE *open_file(const char *cwd, const char *name, char *mode)
+{
+    char cwd_copy[MAX_PATH_LENGTH];
+    char name_copy[MAX_PATH_LENGTH];
+    strcpy(cwd_copy, cwd);
+    strcpy(name_copy, name);
+    return oufs_fopen(cwd_copy, name_copy, mode);
+}
+
+/**
+ *  Runs one oufs_mkdir() operation relative to the current directory
+ *
+ *  @param cwd Current directory
+ *  @param name Entry name
+ *  @param operation oufs_mkdir() operation code
+ *  @return Result of oufs_mkdir()
+ */
+static int make_entry(const char *cwd, const char *name, int operation)
+{
+    char cwd_copy[MAX_PATH_LENGTH];
+    char name_copy[MAX_PATH_LENGTH];
+    strcpy(cwd_copy, cwd);
+    strcpy(name_copy, name);
+    return oufs_mkdir(cwd_copy, name_copy, operation);
+}
+
+/**
+ *  Checks whether a file exists, outside of any timing
+ *
+ *  @param cwd Current directory
+ *  @param name File name
+ *  @return Inode reference of the file, or UNALLOCATED_INODE
+ */
+static INODE_REFERENCE file_inode(const char *cwd, const char *name)
+{
+    OUFILE *fp = open_file(cwd, name, "r");
+    INODE_REFERENCE inode_reference = fp->inode_reference;
+    free(fp);
+    return inode_reference;
+}
+
+/**
+ *  Writes len bytes of text to an open file, LINE_LENGTH bytes at a time
+ *
+ *  @param fp The file
+ *  @param len Number of bytes
+ */
+static void write_text(OUFILE *fp, int len)
+{
+    // oufs_fwrite() copies text: the buffer must be terminated
+    char line[LINE_LENGTH + 1];
+    while (len > 0) {
+        int n = len < LINE_LENGTH ? len : LINE_LENGTH;
+        memset(line, 'a' + (len % 26), n);
+        line[n - 1] = '\n';
+        line[n] = 0;
+        oufs_fwrite(fp, line, n);
+        len -= n;
+    }
+}
+
+/**
+ *  Reads a whole file the way zmore does
+ *
+ *  @param inode_reference Inode of the file
+ *  @return Number of bytes read
+ */
+static int read_text(INODE_REFERENCE inode_reference)
+{
+    INODE inode;
+    oufs_read_inode_by_reference(inode_reference, &inode);
+    int total = 0;
+    for (int i = 0; i < BLOCKS_PER_INODE && inode.data[i] != UNALLOCATED_BLOCK; ++i) {
+        BLOCK block;
+        vdisk_read_block(inode.data[i], &block);
+        int n = 0;
+        while (n < BLOCK_SIZE && block.data.data[n] != 0) {
+            ++n;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/**
+ *  Reports a command that failed
+ *
+ *  @param line_number Line of the command log
+ *  @param message What went wrong
+ */
+static void command_error(int line_number, const char *message)
+{
+    fprintf(stderr, "zworkload: line %d: %s\n", line_number, message);
+    ++n_errors;
+}
+
+/**
+ *  Replays a command log against the open image
+ *
+ *  @param log Command log
+ */
+static void replay(FILE *log)
+{
+    char cwd[MAX_PATH_LENGTH] = "/";
+    char line[MAX_COMMAND];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), log) != NULL) {
+        ++line_number;
+        char *command = strtok(line, " \t\n");
+        char *arg1 = command ? strtok(NULL, " \t\n") : NULL;
+        char *arg2 = arg1 ? strtok(NULL, " \t\n") : NULL;
+        if (command == NULL || command[0] == '#') {
+            continue;
+        }
+        if (arg1 == NULL || strlen(arg1) >= MAX_PATH_LENGTH) {
+            command_error(line_number, "missing or bad argument");
+            continue;
+        }
+
+        if (!strcmp(command, "cd")) {
+            strcpy(cwd, arg1);
+        } else if (!strcmp(command, "mkdir") || !strcmp(command, "rmdir")) {
+            int is_mkdir = command[0] == 'm';
+            op_start();
+            int ret = make_entry(cwd, arg1, is_mkdir ? 0 : 1);
+            op_stop(is_mkdir ? W_MKDIR : W_RMDIR);
+            if (ret != 0) {
+                command_error(line_number, is_mkdir ? "mkdir failed" : "rmdir failed");
+            }
+        } else if (!strcmp(command, "create")) {
+            int len = arg2 ? atoi(arg2) : 0;
+            // Like zcreate: the whole file is one transaction
+            op_start();
+            oufs_txn_begin();
+            int ret = make_entry(cwd, arg1, 2);
+            if (ret == 0) {
+                OUFILE *fp = open_file(cwd, arg1, "w");
+                write_text(fp, len);
+                free(fp);
+                bytes_written += len;
+            }
+            oufs_txn_commit();
+            op_stop(W_CREATE);
+            if (ret != 0) {
+                command_error(line_number, "create failed");
+            }
+        } else if (!strcmp(command, "append")) {
+            int len = arg2 ? atoi(arg2) : 0;
+            if (file_inode(cwd, arg1) == UNALLOCATED_INODE) {
+                command_error(line_number, "append to a missing file");
+                continue;
+            }
+            op_start();
+            oufs_txn_begin();
+            OUFILE *fp = open_file(cwd, arg1, "a");
+            // The offset is within the last block; a full last block is 256
+            int size = fp->offset;
+            fp->offset = size % BLOCK_SIZE;
+            if (size > 0 && fp->offset == 0) {
+                fp->offset = BLOCK_SIZE;
+            }
+            write_text(fp, len);
+            free(fp);
+            oufs_txn_commit();
+            op_stop(W_APPEND);
+            bytes_written += len;
+        } else if (!strcmp(command, "read")) {
+            if (file_inode(cwd, arg1) == UNALLOCATED_INODE) {
+                command_error(line_number, "read of a missing file");
+                continue;
+            }
+            op_start();
+            OUFILE *fp = open_file(cwd, arg1, "r");
+            int len = read_text(fp->inode_reference);
+            free(fp);
+            op_stop(W_READ);
+            bytes_read += len;
+            if (arg2 != NULL && len != atoi(arg2)) {
+                command_error(line_number, "read returned a different size");
+            }
+        } else if (!strcmp(command, "link")) {
+            if (arg2 == NULL || strlen(arg2) >= FILE_NAME_SIZE) {
+                command_error(line_number, "missing or bad argument");
+                continue;
+            }
+            INODE_REFERENCE inode_reference = file_inode(cwd, arg1);
+            if (inode_reference == UNALLOCATED_INODE || file_inode(cwd, arg2) != UNALLOCATED_INODE) {
+                command_error(line_number, "link source missing or target exists");
+                continue;
+            }
+            char cwd_copy[MAX_PATH_LENGTH];
+            strcpy(cwd_copy, cwd);
+            op_start();
+            int ret = oufs_link(cwd_copy, arg2, inode_reference);
+            op_stop(W_LINK);
+            if (ret != 0) {
+                command_error(line_number, "link failed");
+            }
+        } else if (!strcmp(command, "remove")) {
+            if (file_inode(cwd, arg1) == UNALLOCATED_INODE) {
+                command_error(line_number, "remove of a missing file");
+                continue;
+            }
+            op_start();
+            make_entry(cwd, arg1, 3);
+            op_stop(W_REMOVE);
+        } else {
+            command_error(line_number, "unknown command");
+        }
+    }
+}
+
+/**
+ *  Prints the results of the replay
+ *
+ *  @param wall Wall clock time of the whole replay (microseconds)
+ */
+static void report(double wall)
+{
+    int total_ops = 0;
+    for (int c = 0; c < N_COMMANDS; ++c) {
+        total_ops += n_samples[c];
+    }
+    if (json) {
+        printf("{\"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.0f, \"errors\": %d, \"bytes_written\": %lld, "
+               "\"bytes_read\": %lld, \"commands\": [",
+               total_ops, wall / 1e6, wall > 0 ? total_ops / (wall / 1e6) : 0, n_errors, bytes_written, bytes_read);
+    } else {
+        printf("%d ops in %.3f s (%.0f ops/s), %d errors, %lld bytes written, %lld bytes read\n\n",
+               total_ops, wall / 1e6, wall > 0 ? total_ops / (wall / 1e6) : 0, n_errors, bytes_written, bytes_read);
+        printf("%-8s %8s %12s %10s %10s %8s %8s %8s %8s %8s\n", "command", "ops", "ops/s", "p50_us", "p99_us",
+               "rd/op", "wr/op", "dev_rd", "dev_wr", "sync/op");
+    }
+
+    int n_reported = 0;
+    for (int c = 0; c < N_COMMANDS; ++c) {
+        int n_ops_done = n_samples[c];
+        if (n_ops_done == 0) {
+            continue;
+        }
+        double total = 0;
+        for (int i = 0; i < n_ops_done; ++i) {
+            total += samples[c][i];
+        }
+        qsort(samples[c], n_ops_done, sizeof(double), oufs_compare_samples);
+        double p50 = samples[c][n_ops_done / 2];
+        double p99 = samples[c][(n_ops_done * 99) / 100];
+        double ops_per_sec = total > 0 ? n_ops_done / (total / 1e6) : 0;
+        double n = n_ops_done;
+        VDISK_STATS *io = &io_total[c];
+
+        if (json) {
+            printf("%s\n  {\"name\": \"%s\", \"ops\": %d, \"ops_per_sec\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                   "\"block_reads_per_op\": %.2f, \"block_writes_per_op\": %.2f, \"device_reads_per_op\": %.2f, "
+                   "\"device_writes_per_op\": %.2f, \"syncs_per_op\": %.3f}",
+                   n_reported == 0 ? "" : ",", command_name[c], n_ops_done, ops_per_sec, p50, p99,
+                   io->block_reads / n, io->block_writes / n, io->device_reads / n, io->device_writes / n,
+                   io->device_syncs / n);
+        } else {
+            printf("%-8s %8d %12.0f %10.2f %10.2f %8.2f %8.2f %8.2f %8.2f %8.3f\n",
+                   command_name[c], n_ops_done, ops_per_sec, p50, p99,
+                   io->block_reads / n, io->block_writes / n, io->device_reads / n, io->device_writes / n,
+                   io->device_syncs / n);
+        }
+        ++n_reported;
+    }
+    if (json) {
+        printf("\n]}\n");
+    }
+}
+
+/**
+ *  Reads "a:b" into two numbers
+ *
+ *  @param arg The argument
+ *  @param a First number
+ *  @param b Second number
+ *  @return 0 on success, -1 if the argument is malformed
+ */
+static int parse_pair(const char *arg, int *a, int *b)
+{
+    return sscanf(arg, "%d:%d", a, b) == 2 ? 0 : -1;
+}
+
+/**
+ *  Generates a synthetic workload, or reads a recorded command log, and replays it against
+ *  a freshly formatted image
+ *
+ *  Usage: zworkload [-seed n] [-ops n] [-mix create:append:read:link:remove] [-size min:max]
+ *                   [-small] [-append max] [-fanout n] [-depth n] [-d image] [-json]
+ *                   [-emit logfile | -replay logfile [-keep]]
+ */
+int main(int argc, char** argv) {
+    char *emit_name = NULL;
+    char *replay_name = NULL;
+    int usage = 0;
+    for (int i = 1; i < argc && !usage; ++i) {
+        int has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "-seed") && has_value) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-ops") && has_value) {
+            n_ops = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-mix") && has_value) {
+            usage = sscanf(argv[++i], "%d:%d:%d:%d:%d", &mix[0], &mix[1], &mix[2], &mix[3], &mix[4]) != N_MIX;
+        } else if (!strcmp(argv[i], "-size") && has_value) {
+            usage = parse_pair(argv[++i], &min_size, &max_size) != 0;
+        } else if (!strcmp(argv[i], "-small")) {
+            small_sizes = 1;
+        } else if (!strcmp(argv[i], "-append") && has_value) {
+            max_append = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-fanout") && has_value) {
+            fanout = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-depth") && has_value) {
+            depth = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-d") && has_value) {
+            image = argv[++i];
+        } else if (!strcmp(argv[i], "-json")) {
+            json = 1;
+        } else if (!strcmp(argv[i], "-emit") && has_value) {
+            emit_name = argv[++i];
+        } else if (!strcmp(argv[i], "-replay") && has_value) {
+            replay_name = argv[++i];
+        } else if (!strcmp(argv[i], "-keep")) {
+            keep = 1;
+        } else {
+            usage = 1;
+        }
+    }
+    int mix_total = 0;
+    for (int i = 0; i < N_MIX; ++i) {
+        usage |= mix[i] < 0;
+        mix_total += mix[i];
+    }
+    if (usage || (emit_name && replay_name) || (keep && !replay_name)) {
+        fprintf(stderr, "Usage: zworkload [-seed n] [-ops n] [-mix create:append:read:link:remove] [-size min:max]\n"
+                "                 [-small] [-append max] [-fanout n] [-depth n] [-d image] [-json]\n"
+                "                 [-emit logfile | -replay logfile [-keep]]\n");
+        exit(EXIT_FAILURE);
+    }
+    if (seed == 0 || n_ops < 0 || mix_total <= 0 || min_size < 0 || max_size < min_size || max_size > FILE_LIMIT ||
+        max_append <= 0 || fanout < 0 || depth < 0) {
+        fprintf(stderr, "zworkload: bad option value (seed > 0, sizes within 0 ... %d)\n", FILE_LIMIT);
+        exit(EXIT_FAILURE);
+    }
+
+    // The command log: generated, or recorded earlier
+    FILE *log;
+    if (replay_name != NULL) {
+        log = fopen(replay_name, "r");
+    } else {
+        log = emit_name ? fopen(emit_name, "w") : tmpfile();
+    }
+    if (log == NULL) {
+        fprintf(stderr, "zworkload: cannot open the command log\n");
+        exit(EXIT_FAILURE);
+    }
+    if (replay_name == NULL) {
+        generate(log);
+        if (emit_name != NULL) {
+            fclose(log);
+            return 0;
+        }
+        rewind(log);
+    }
+
+    if (!keep) {
+        unlink(image);
+        if (oufs_format_disk(image) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        vdisk_disk_close();
+    }
+    if (vdisk_disk_open(image) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    double start = oufs_stats_now();
+    replay(log);
+    double wall = oufs_stats_now() - start;
+    fclose(log);
+    vdisk_disk_close();
+
+    report(wall);
+    return n_errors ? EXIT_FAILURE : 0;
+}